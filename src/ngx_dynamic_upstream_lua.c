@@ -5,6 +5,7 @@
 
 
 #include "ngx_dynamic_upstream_lua.h"
+#include "ngx_dynamic_upstream_lua_json.h"
 #include "ngx_dynamic_upstream_module.h"
 
 
@@ -20,6 +21,10 @@ ngx_http_dynamic_upstream_lua_get_upstreams(lua_State *L);
 static int
 ngx_http_dynamic_upstream_lua_get_peers(lua_State *L);
 static int
+ngx_http_dynamic_upstream_lua_get_peer(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_get_tagged_peers(lua_State *L);
+static int
 ngx_http_dynamic_upstream_lua_get_peers_locked(lua_State *L);
 static int
 ngx_http_dynamic_upstream_lua_get_primary_peers(lua_State *L);
@@ -30,6 +35,10 @@ ngx_http_dynamic_upstream_lua_set_peer_down(lua_State *L);
 static int
 ngx_http_dynamic_upstream_lua_set_peer_up(lua_State *L);
 static int
+ngx_http_dynamic_upstream_lua_set_down(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_set_up(lua_State *L);
+static int
 ngx_http_dynamic_upstream_lua_add_primary_peer(lua_State *L);
 static int
 ngx_http_dynamic_upstream_lua_add_backup_peer(lua_State *L);
@@ -39,6 +48,39 @@ static int
 ngx_http_dynamic_upstream_lua_update_peer(lua_State *L);
 static int
 ngx_http_dynamic_upstream_lua_current_upstream(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_current_peer(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_load_json(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_swap_primary_backup(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_stage(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_commit_staged(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_get_changes(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_apply_changes(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_get_peers_json(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_get_all_peers_json(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_get_zone_usage(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_pick_peer(lua_State *L);
+static int
+ngx_http_dynamic_upstream_lua_get_panic(lua_State *L);
+
+static int
+ngx_http_dynamic_upstream_lua_get_queue(lua_State *L);
+
+static int
+ngx_http_dynamic_upstream_lua_create_upstream(lua_State *L);
+
+static int
+ngx_http_dynamic_upstream_lua_delete_upstream(lua_State *L);
 
 
 ngx_int_t
@@ -64,6 +106,9 @@ ngx_http_dynamic_upstream_lua_create_module(lua_State *L)
     lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_get_peers);
     lua_setfield(L, -2, "get_peers");
 
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_get_peer);
+    lua_setfield(L, -2, "get_peer");
+
     lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_get_peers_locked);
     lua_setfield(L, -2, "get_peers_locked");
 
@@ -73,12 +118,25 @@ ngx_http_dynamic_upstream_lua_create_module(lua_State *L)
     lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_get_backup_peers);
     lua_setfield(L, -2, "get_backup_peers");
 
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_get_peers_json);
+    lua_setfield(L, -2, "get_peers_json");
+
+    lua_pushcfunction(L,
+                      ngx_http_dynamic_upstream_lua_get_all_peers_json);
+    lua_setfield(L, -2, "get_all_peers_json");
+
     lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_set_peer_down);
     lua_setfield(L, -2, "set_peer_down");
 
     lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_set_peer_up);
     lua_setfield(L, -2, "set_peer_up");
 
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_set_down);
+    lua_setfield(L, -2, "set_down");
+
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_set_up);
+    lua_setfield(L, -2, "set_up");
+
     lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_add_primary_peer);
     lua_setfield(L, -2, "add_primary_peer");
 
@@ -91,9 +149,48 @@ ngx_http_dynamic_upstream_lua_create_module(lua_State *L)
     lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_update_peer);
     lua_setfield(L, -2, "update_peer");
 
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_swap_primary_backup);
+    lua_setfield(L, -2, "swap_primary_backup");
+
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_stage);
+    lua_setfield(L, -2, "stage");
+
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_commit_staged);
+    lua_setfield(L, -2, "commit_staged");
+
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_get_changes);
+    lua_setfield(L, -2, "get_changes");
+
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_apply_changes);
+    lua_setfield(L, -2, "apply_changes");
+
     lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_current_upstream);
     lua_setfield(L, -2, "current_upstream");
 
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_current_peer);
+    lua_setfield(L, -2, "current_peer");
+
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_load_json);
+    lua_setfield(L, -2, "load_json");
+
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_get_zone_usage);
+    lua_setfield(L, -2, "get_zone_usage");
+
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_pick_peer);
+    lua_setfield(L, -2, "pick_peer");
+
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_get_panic);
+    lua_setfield(L, -2, "get_panic");
+
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_get_queue);
+    lua_setfield(L, -2, "get_queue");
+
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_create_upstream);
+    lua_setfield(L, -2, "create_upstream");
+
+    lua_pushcfunction(L, ngx_http_dynamic_upstream_lua_delete_upstream);
+    lua_setfield(L, -2, "delete_upstream");
+
     return 1;
 }
 
@@ -103,6 +200,8 @@ ngx_http_lua_upstream_get_upstream_main_conf(lua_State *L)
 {
     ngx_http_request_t *r;
 
+    ngx_http_dynamic_upstream_lua_pool_sync();
+
     r = ngx_http_lua_get_request(L);
 
     if (r == NULL) {
@@ -114,6 +213,21 @@ ngx_http_lua_upstream_get_upstream_main_conf(lua_State *L)
 }
 
 
+static ngx_log_t *
+ngx_http_dynamic_upstream_lua_log(lua_State *L)
+{
+    ngx_http_request_t *r;
+
+    r = ngx_http_lua_get_request(L);
+
+    if (r == NULL) {
+        return ngx_cycle->log;
+    }
+
+    return r->connection->log;
+}
+
+
 static ngx_http_upstream_srv_conf_t *
 ngx_dynamic_upstream_get(lua_State *L, ngx_dynamic_upstream_op_t *op)
 {
@@ -142,60 +256,139 @@ static const int BACKUP  = 2;
 static const int LOCK    = 4;
 
 
-static void
-ngx_dynamic_upstream_lua_create_response(ngx_http_upstream_rr_peers_t *primary,
-    lua_State *L, int flags)
+static ngx_flag_t
+ngx_http_dynamic_upstream_lua_filter(ngx_dynamic_upstream_lua_filter_t *filter,
+    ngx_http_upstream_rr_peer_t *peer)
 {
-    ngx_http_upstream_rr_peer_t  *peer;
-    ngx_http_upstream_rr_peers_t *peers, *backup;
-    int                           i = 1;
+    ngx_uint_t  i;
 
-    backup = primary->next;
+    if (filter == NULL) {
+        return 1;
+    }
 
-    if (flags & LOCK) {
-        ngx_http_upstream_rr_peers_rlock(primary);
+    if (filter->down != NGX_CONF_UNSET && (peer->down != 0) != filter->down) {
+        return 0;
+    }
+
+    if (peer->conns < filter->min_conns) {
+        return 0;
+    }
+
+    if (filter->servers == NULL) {
+        return 1;
+    }
+
+    for (i = 0; i < filter->nservers; i++) {
+        if (peer->server.len == filter->servers[i].len
+            && ngx_strncmp(peer->server.data, filter->servers[i].data,
+                           peer->server.len) == 0) {
+            return 1;
+        }
     }
 
+    return 0;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_push_peer(ngx_http_upstream_srv_conf_t *uscf,
+    lua_State *L, ngx_http_upstream_rr_peer_t *peer, ngx_flag_t backup)
+{
+    ngx_uint_t  ewma, inflight, ejections;
+    ngx_flag_t  ejected;
+
     lua_newtable(L);
 
-    for (peers = primary; peers; peers = peers->next) {
-        if ( (flags & PRIMARY && peers == primary)
-              || (flags & BACKUP && peers == backup) ) {
-            for (peer = peers->peer; peer; peer = peer->next, ++i) {
-                lua_newtable(L);
+    lua_pushlstring(L, (char *) peer->server.data, peer->server.len);
+    lua_setfield(L, -2, "server");
+
+    lua_pushlstring(L, (char *) peer->name.data, peer->name.len);
+    lua_setfield(L, -2, "name");
+
+    lua_pushinteger(L, (lua_Integer) peer->weight);
+    lua_setfield(L, -2, "weight");
+
+    lua_pushinteger(L, (lua_Integer) peer->max_conns);
+    lua_setfield(L, -2, "max_conns");
+
+    lua_pushinteger(L, (lua_Integer) peer->conns);
+    lua_setfield(L, -2, "conns");
+
+    lua_pushinteger(L, (lua_Integer) peer->max_fails);
+    lua_setfield(L, -2, "max_fails");
+
+    lua_pushinteger(L, (lua_Integer) peer->fail_timeout);
+    lua_setfield(L, -2, "fail_timeout");
+
+    lua_pushboolean(L, backup);
+    lua_setfield(L, -2, "backup");
 
-                lua_pushlstring(L, (char *) peer->server.data,
-                                            peer->server.len);
-                lua_setfield(L, -2, "server");
+    if (peer->down) {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, "down");
+    }
+
+    if (ngx_http_dynamic_upstream_lua_ewma_stat(uscf, &peer->name, &ewma,
+                                                &inflight) == NGX_OK)
+    {
+        lua_pushinteger(L, (lua_Integer) ewma);
+        lua_setfield(L, -2, "ewma");
+
+        lua_pushinteger(L, (lua_Integer) inflight);
+        lua_setfield(L, -2, "inflight");
+    }
+
+    if (ngx_http_dynamic_upstream_lua_outlier_stat(uscf, &peer->name,
+                                                   &ejected, &ejections)
+        == NGX_OK)
+    {
+        lua_pushboolean(L, ejected);
+        lua_setfield(L, -2, "ejected");
 
-                lua_pushlstring(L, (char *) peer->name.data,
-                                            peer->name.len);
-                lua_setfield(L, -2, "name");
+        lua_pushinteger(L, (lua_Integer) ejections);
+        lua_setfield(L, -2, "ejections");
+    }
+}
+
+
+static void
+ngx_dynamic_upstream_lua_create_response(ngx_http_upstream_srv_conf_t *uscf,
+    lua_State *L, int flags, ngx_dynamic_upstream_lua_filter_t *filter)
+{
+    ngx_http_dynamic_upstream_lua_replica_t  *replica = NULL;
+    ngx_http_upstream_rr_peer_t              *peer;
+    ngx_http_upstream_rr_peers_t             *primary, *peers, *backup;
+    int                                       i = 1;
+
+    if (flags & LOCK) {
+        replica = ngx_http_dynamic_upstream_lua_replica(uscf, 0);
+    }
 
-                lua_pushinteger(L, (lua_Integer) peer->weight);
-                lua_setfield(L, -2, "weight");
+    /* rlock and unlock do nothing on the replica */
 
-                lua_pushinteger(L, (lua_Integer) peer->max_conns);
-                lua_setfield(L, -2, "max_conns");
+    primary = replica != NULL ? &replica->peers[0] : uscf->peer.data;
 
-                lua_pushinteger(L, (lua_Integer) peer->conns);
-                lua_setfield(L, -2, "conns");
+    backup = primary->next;
 
-                lua_pushinteger(L, (lua_Integer) peer->max_fails);
-                lua_setfield(L, -2, "max_fails");
+    if (flags & LOCK) {
+        ngx_http_upstream_rr_peers_rlock(primary);
+    }
 
-                lua_pushinteger(L, (lua_Integer) peer->fail_timeout);
-                lua_setfield(L, -2, "fail_timeout");
+    lua_newtable(L);
 
-                lua_pushboolean(L, peers != primary);
-                lua_setfield(L, -2, "backup");
+    for (peers = primary; peers; peers = peers->next) {
+        if ( (flags & PRIMARY && peers == primary)
+              || (flags & BACKUP && peers == backup) ) {
+            for (peer = peers->peer; peer; peer = peer->next) {
 
-                if (peer->down) {
-                    lua_pushboolean(L, 1);
-                    lua_setfield(L, -2, "down");
+                if (!ngx_http_dynamic_upstream_lua_filter(filter, peer)) {
+                    continue;
                 }
 
-                lua_rawseti(L, -2, i);
+                ngx_dynamic_upstream_lua_push_peer(uscf, L, peer,
+                                                   peers != primary);
+
+                lua_rawseti(L, -2, i++);
             }
         }
     }
@@ -207,8 +400,8 @@ ngx_dynamic_upstream_lua_create_response(ngx_http_upstream_rr_peers_t *primary,
 
 
 static void
-ngx_http_dynamic_upstream_lua_op_defaults(lua_State *L,
-    ngx_dynamic_upstream_op_t *op, int operation)
+ngx_http_dynamic_upstream_lua_op_init(ngx_dynamic_upstream_op_t *op,
+    int operation)
 {
     ngx_memzero(op, sizeof(ngx_dynamic_upstream_op_t));
 
@@ -222,6 +415,14 @@ ngx_http_dynamic_upstream_lua_op_defaults(lua_State *L,
     op->verbose      = 0;
     op->backup       = 0;
     op->op_param     = NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE;
+}
+
+
+static void
+ngx_http_dynamic_upstream_lua_op_defaults(lua_State *L,
+    ngx_dynamic_upstream_op_t *op, int operation)
+{
+    ngx_http_dynamic_upstream_lua_op_init(op, operation);
 
     op->upstream.data = (u_char *) luaL_checklstring(L, 1, &op->upstream.len);
 }
@@ -243,7 +444,6 @@ ngx_http_dynamic_upstream_lua_op(lua_State *L, ngx_dynamic_upstream_op_t *op,
 {
     ngx_int_t                       rc;
     ngx_http_upstream_srv_conf_t   *uscf;
-    ngx_http_upstream_rr_peers_t   *primary;
 
     uscf = ngx_dynamic_upstream_get(L, op);
     if (uscf == NULL) {
@@ -252,8 +452,8 @@ ngx_http_dynamic_upstream_lua_op(lua_State *L, ngx_dynamic_upstream_op_t *op,
 
     if (op->op != NGX_DYNAMIC_UPSTEAM_OP_LIST) {
         if (flags & LOCK) {
-            rc = ngx_dynamic_upstream_op(ngx_http_lua_get_request(L)->
-                connection->log, op, uscf);
+            rc = ngx_http_dynamic_upstream_lua_apply(
+                ngx_http_dynamic_upstream_lua_log(L), op, uscf);
             if (rc != NGX_OK && rc != NGX_AGAIN) {
                 return ngx_http_dynamic_upstream_lua_error(L,
                     op->err);
@@ -267,8 +467,7 @@ ngx_http_dynamic_upstream_lua_op(lua_State *L, ngx_dynamic_upstream_op_t *op,
     lua_pushboolean(L, 1);
 
     if (op->verbose) {
-        primary = uscf->peer.data;
-        ngx_dynamic_upstream_lua_create_response(primary, L, flags);
+        ngx_dynamic_upstream_lua_create_response(uscf, L, flags, NULL);
     } else {
         lua_pushnil(L);
     }
@@ -325,10 +524,190 @@ ngx_http_dynamic_upstream_lua_get_upstreams(lua_State *L)
 }
 
 
+static const char *
+ngx_http_dynamic_upstream_lua_filter_parse(lua_State *L, int index,
+    ngx_dynamic_upstream_lua_filter_t *filter)
+{
+    lua_Number  min_conns;
+
+    ngx_memzero(filter, sizeof(ngx_dynamic_upstream_lua_filter_t));
+
+    filter->down = NGX_CONF_UNSET;
+    filter->backup = NGX_CONF_UNSET;
+
+    lua_getfield(L, index, "down");
+    if (lua_isboolean(L, -1)) {
+        filter->down = lua_toboolean(L, -1);
+    } else if (!lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return "down must be a boolean";
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "backup");
+    if (lua_isboolean(L, -1)) {
+        filter->backup = lua_toboolean(L, -1);
+    } else if (!lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return "backup must be a boolean";
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "min_conns");
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+        min_conns = lua_tonumber(L, -1);
+        filter->min_conns = min_conns > 0 ? (ngx_uint_t) min_conns : 0;
+    } else if (!lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return "min_conns must be a number";
+    }
+    lua_pop(L, 1);
+
+    return NULL;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_filter_flags(
+    ngx_dynamic_upstream_lua_filter_t *filter)
+{
+    /* peer set excluded by the filter is not walked at all */
+
+    if (filter->backup == NGX_CONF_UNSET) {
+        return PRIMARY|BACKUP|LOCK;
+    }
+
+    return (filter->backup ? BACKUP : PRIMARY)|LOCK;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_get_filtered_peers(lua_State *L)
+{
+    ngx_dynamic_upstream_op_t           op;
+    ngx_dynamic_upstream_lua_filter_t   filter;
+    ngx_http_upstream_srv_conf_t       *uscf;
+    const char                         *err;
+
+    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
+                                              NGX_DYNAMIC_UPSTEAM_OP_LIST);
+
+    err = ngx_http_dynamic_upstream_lua_filter_parse(L, 2, &filter);
+    if (err != NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, err);
+    }
+
+    uscf = ngx_dynamic_upstream_get(L, &op);
+    if (uscf == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "upstream not found");
+    }
+
+    lua_pushboolean(L, 1);
+
+    ngx_dynamic_upstream_lua_create_response(uscf, L,
+        ngx_http_dynamic_upstream_lua_filter_flags(&filter), &filter);
+
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_get_peer(lua_State *L)
+{
+    ngx_dynamic_upstream_op_t                 op;
+    ngx_http_upstream_srv_conf_t             *uscf;
+    ngx_http_upstream_rr_peers_t             *primary, *peers;
+    ngx_http_upstream_rr_peer_t              *peer;
+    ngx_http_dynamic_upstream_lua_replica_t  *replica;
+    ngx_int_t                                 rc;
+
+    if (lua_gettop(L) != 2) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "exactly 2 arguments expected");
+    }
+
+    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
+                                              NGX_DYNAMIC_UPSTEAM_OP_LIST);
+
+    op.server.data = (u_char *) luaL_checklstring(L, 2, &op.server.len);
+
+    uscf = ngx_dynamic_upstream_get(L, &op);
+    if (uscf == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "upstream not found");
+    }
+
+    /* the replica indexes servers and names of its version */
+
+    replica = ngx_http_dynamic_upstream_lua_replica(uscf, 1);
+
+    if (replica != NULL) {
+        rc = ngx_http_dynamic_upstream_lua_replica_find(replica, &op.server,
+                                                        &peer);
+
+        if (rc == NGX_DECLINED) {
+            return ngx_http_dynamic_upstream_lua_error(L, "peer not found");
+        }
+
+        if (rc == NGX_OK) {
+            lua_pushboolean(L, 1);
+            ngx_dynamic_upstream_lua_push_peer(uscf, L, peer,
+                peer >= replica->peer + replica->nprimary);
+            lua_pushnil(L);
+
+            return 3;
+        }
+
+        /* no memory for the index, the zone is scanned */
+    }
+
+    primary = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    /* stop at the first peer matched by server or name */
+
+    for (peers = primary; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if ((peer->server.len != op.server.len
+                 || ngx_strncmp(peer->server.data, op.server.data,
+                                op.server.len) != 0)
+                && (peer->name.len != op.server.len
+                    || ngx_strncmp(peer->name.data, op.server.data,
+                                   op.server.len) != 0))
+            {
+                continue;
+            }
+
+            lua_pushboolean(L, 1);
+            ngx_dynamic_upstream_lua_push_peer(uscf, L, peer,
+                                               peers != primary);
+            lua_pushnil(L);
+
+            ngx_http_upstream_rr_peers_unlock(primary);
+
+            return 3;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    return ngx_http_dynamic_upstream_lua_error(L, "peer not found");
+}
+
+
 static int
 ngx_http_dynamic_upstream_lua_get_peers(lua_State *L)
 {
     ngx_dynamic_upstream_op_t op;
+    if (lua_gettop(L) == 1 && lua_istable(L, 1)) {
+        return ngx_http_dynamic_upstream_lua_get_tagged_peers(L);
+    }
+    if (lua_gettop(L) == 2 && lua_istable(L, 2)) {
+        return ngx_http_dynamic_upstream_lua_get_filtered_peers(L);
+    }
     if (lua_gettop(L) != 1) {
         return ngx_http_dynamic_upstream_lua_error(L,
             "exactly one argument expected");
@@ -407,65 +786,246 @@ ngx_http_dynamic_upstream_lua_set_peer_down(lua_State *L)
 }
 
 
-static int
-ngx_http_dynamic_upstream_lua_set_peer_up(lua_State *L)
+static ngx_int_t
+ngx_http_dynamic_upstream_lua_warmup_connections(lua_State *L)
 {
-    ngx_dynamic_upstream_op_t op;
+    ngx_int_t  connections = 0;
 
-    if (lua_gettop(L) != 2) {
-        return ngx_http_dynamic_upstream_lua_error(L,
-            "exactly 2 arguments expected");
+    if (lua_gettop(L) < 3) {
+        return 0;
     }
 
-    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
-                                              NGX_DYNAMIC_UPSTEAM_OP_PARAM);
+    luaL_checktype(L, 3, LUA_TTABLE);
 
-    op.up = 1;
-    op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+    lua_getfield(L, 3, "warmup");
 
-    op.server.data = (u_char *) luaL_checklstring(L, 2, &op.server.len);
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, "connections");
+        connections = (ngx_int_t) lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
 
-    return ngx_http_dynamic_upstream_lua_op(L, &op, LOCK);
+    lua_pop(L, 1);
+
+    return connections > 0 ? connections : 0;
 }
 
 
 static int
-ngx_http_dynamic_upstream_lua_add_peer_impl(lua_State *L, int backup)
+ngx_http_dynamic_upstream_lua_op_warmup(lua_State *L,
+    ngx_dynamic_upstream_op_t *op, ngx_int_t connections)
 {
-    ngx_dynamic_upstream_op_t op;
+    int                            n;
+    ngx_int_t                      rc;
+    ngx_log_t                     *log;
+    ngx_http_upstream_srv_conf_t  *uscf;
 
-    if (lua_gettop(L) != 2) {
+    if (connections == 0) {
+        return ngx_http_dynamic_upstream_lua_op(L, op, LOCK);
+    }
+
+    uscf = ngx_dynamic_upstream_get(L, op);
+    if (uscf == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "upstream not found");
+    }
+
+    if (!ngx_http_dynamic_upstream_lua_warmup_enabled(uscf)) {
         return ngx_http_dynamic_upstream_lua_error(L,
-            "exactly 2 arguments expected");
+            "warmup is not enabled, use dynamic_warmup");
     }
 
-    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
-                                              NGX_DYNAMIC_UPSTEAM_OP_ADD);
+    log = ngx_http_dynamic_upstream_lua_log(L);
 
-    op.server.data = (u_char *) luaL_checklstring(L, 2, &op.server.len);
+    /* the peer takes requests when its connections are opened */
 
-    op.backup = backup;
+    if (op->op == NGX_DYNAMIC_UPSTEAM_OP_PARAM) {
 
-    return ngx_http_dynamic_upstream_lua_op(L, &op, LOCK);
-}
+        rc = ngx_http_dynamic_upstream_lua_warmup_peer(log, uscf,
+                                                       &op->server,
+                                                       connections);
+        if (rc == NGX_DECLINED) {
+            return ngx_http_dynamic_upstream_lua_error(L, "server not found");
+        }
 
+        if (rc == NGX_ERROR) {
+            return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+        }
 
-static int
-ngx_http_dynamic_upstream_lua_add_primary_peer(lua_State *L)
-{
-    return ngx_http_dynamic_upstream_lua_add_peer_impl(L, 0);
-}
+        lua_pushboolean(L, 1);
+        lua_pushnil(L);
+        lua_pushnil(L);
 
+        return 3;
+    }
 
-static int
-ngx_http_dynamic_upstream_lua_add_backup_peer(lua_State *L)
-{
-    return ngx_http_dynamic_upstream_lua_add_peer_impl(L, 1);
-}
+    if (ngx_http_dynamic_upstream_lua_warmup_address(&op->server)) {
+        op->down = 1;
+        op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+    }
 
+    n = ngx_http_dynamic_upstream_lua_op(L, op, LOCK);
 
-static int
-ngx_http_dynamic_upstream_lua_remove_peer(lua_State *L)
+    if (lua_toboolean(L, -n)
+        && ngx_http_dynamic_upstream_lua_warmup_peer(log, uscf, &op->server,
+                                                     connections)
+           == NGX_ERROR)
+    {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "dynamic upstream: %V in %V is left down, no memory "
+                      "for warmup", &op->server, &uscf->host);
+    }
+
+    return n;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_set_peer_up(lua_State *L)
+{
+    ngx_dynamic_upstream_op_t op;
+
+    if (lua_gettop(L) != 2 && lua_gettop(L) != 3) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "2 or 3 arguments expected");
+    }
+
+    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
+                                              NGX_DYNAMIC_UPSTEAM_OP_PARAM);
+
+    op.up = 1;
+    op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+
+    op.server.data = (u_char *) luaL_checklstring(L, 2, &op.server.len);
+
+    return ngx_http_dynamic_upstream_lua_op_warmup(L, &op,
+        ngx_http_dynamic_upstream_lua_warmup_connections(L));
+}
+
+
+static const char *
+ngx_http_dynamic_upstream_lua_tags(lua_State *L, int index,
+    ngx_str_t *tags, ngx_int_t *ntags)
+{
+    ngx_int_t  i, n;
+
+    *ntags = -1;
+
+    if (lua_gettop(L) < index || !lua_istable(L, index)) {
+        return NULL;
+    }
+
+    lua_getfield(L, index, "tags");
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return "tags must be an array of strings";
+    }
+
+    n = (ngx_int_t) lua_objlen(L, -1);
+    if (n > NGX_DYNAMIC_UPSTREAM_LUA_MAX_TAGS) {
+        lua_pop(L, 1);
+        return "too many tags";
+    }
+
+    /* strings stay referenced by the table of the caller */
+
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, -1, i + 1);
+
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            lua_pop(L, 2);
+            return "tags must be an array of strings";
+        }
+
+        tags[i].data = (u_char *) lua_tolstring(L, -1, &tags[i].len);
+
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+
+    if (ngx_dynamic_upstream_lua_shm_pool() == NULL) {
+        return "tags require dynamic_upstream_shm_size";
+    }
+
+    *ntags = n;
+
+    return NULL;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_op_tags(lua_State *L,
+    ngx_dynamic_upstream_op_t *op, int n, ngx_str_t *tags, ngx_int_t ntags)
+{
+    if (ntags < 0 || !lua_toboolean(L, -n)) {
+        return n;
+    }
+
+    if (ngx_dynamic_upstream_lua_tag_set(&op->upstream, 0, &op->server,
+                                         tags, ntags) != NGX_OK) {
+        lua_pop(L, n);
+        return ngx_http_dynamic_upstream_lua_error(L, "no memory for tags");
+    }
+
+    return n;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_add_peer_impl(lua_State *L, int backup)
+{
+    ngx_dynamic_upstream_op_t   op;
+    ngx_str_t                   tags[NGX_DYNAMIC_UPSTREAM_LUA_MAX_TAGS];
+    ngx_int_t                   ntags;
+    const char                 *err;
+    int                         n;
+
+    if (lua_gettop(L) != 2 && lua_gettop(L) != 3) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "2 or 3 arguments expected");
+    }
+
+    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
+                                              NGX_DYNAMIC_UPSTEAM_OP_ADD);
+
+    op.server.data = (u_char *) luaL_checklstring(L, 2, &op.server.len);
+
+    op.backup = backup;
+
+    err = ngx_http_dynamic_upstream_lua_tags(L, 3, tags, &ntags);
+    if (err != NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, err);
+    }
+
+    n = ngx_http_dynamic_upstream_lua_op_warmup(L, &op,
+        ngx_http_dynamic_upstream_lua_warmup_connections(L));
+
+    return ngx_http_dynamic_upstream_lua_op_tags(L, &op, n, tags, ntags);
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_add_primary_peer(lua_State *L)
+{
+    return ngx_http_dynamic_upstream_lua_add_peer_impl(L, 0);
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_add_backup_peer(lua_State *L)
+{
+    return ngx_http_dynamic_upstream_lua_add_peer_impl(L, 1);
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_remove_peer(lua_State *L)
 {
     ngx_dynamic_upstream_op_t op;
 
@@ -529,7 +1089,11 @@ ngx_http_dynamic_upstream_lua_update_peer_parse_params(lua_State *L,
 static int
 ngx_http_dynamic_upstream_lua_update_peer(lua_State *L)
 {
-    ngx_dynamic_upstream_op_t op;
+    ngx_dynamic_upstream_op_t   op;
+    ngx_str_t                   tags[NGX_DYNAMIC_UPSTREAM_LUA_MAX_TAGS];
+    ngx_int_t                   ntags;
+    const char                 *err;
+    int                         n;
 
     if (lua_gettop(L) != 3 || !lua_istable(L, 3)) {
         return ngx_http_dynamic_upstream_lua_error(L,
@@ -541,46 +1105,1728 @@ ngx_http_dynamic_upstream_lua_update_peer(lua_State *L)
 
     op.server.data = (u_char *) luaL_checklstring(L, 2, &op.server.len);
 
+    err = ngx_http_dynamic_upstream_lua_tags(L, 3, tags, &ntags);
+    if (err != NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, err);
+    }
+
     ngx_http_dynamic_upstream_lua_update_peer_parse_params(L, &op);
 
-    return ngx_http_dynamic_upstream_lua_op(L, &op, LOCK);
+    n = ngx_http_dynamic_upstream_lua_op(L, &op, LOCK);
+
+    return ngx_http_dynamic_upstream_lua_op_tags(L, &op, n, tags, ntags);
+}
+
+
+static const char *
+ngx_http_dynamic_upstream_lua_select(lua_State *L, ngx_pool_t *pool,
+    ngx_array_t *tagged)
+{
+    ngx_str_t  tag;
+    ngx_int_t  rc;
+
+    lua_getfield(L, 1, "tag");
+
+    if (lua_type(L, -1) != LUA_TSTRING) {
+        lua_pop(L, 1);
+        return "tag expected";
+    }
+
+    tag.data = (u_char *) lua_tolstring(L, -1, &tag.len);
+
+    rc = ngx_array_init(tagged, pool, 16,
+                        sizeof(ngx_dynamic_upstream_lua_tagged_t));
+    if (rc == NGX_OK) {
+        rc = ngx_dynamic_upstream_lua_tag_select(pool, &tag, 0, tagged);
+    }
+
+    lua_pop(L, 1);
+
+    if (rc == NGX_DECLINED) {
+        return "tags require dynamic_upstream_shm_size";
+    }
+
+    if (rc == NGX_ERROR) {
+        return "no memory";
+    }
+
+    return NULL;
 }
 
 
 static int
-ngx_http_dynamic_upstream_lua_current_upstream(lua_State *L)
+ngx_http_dynamic_upstream_lua_set_tagged(lua_State *L, int down)
+{
+    ngx_pool_t                         *pool;
+    ngx_array_t                         tagged;
+    ngx_dynamic_upstream_lua_tagged_t  *peer;
+    ngx_dynamic_upstream_op_t          *ops;
+    ngx_http_upstream_srv_conf_t       *uscf;
+    ngx_log_t                          *log;
+    ngx_uint_t                          i, j, k, n, count = 0;
+    ngx_int_t                          *rcs;
+    const char                         *err;
+
+    if (lua_gettop(L) != 1 || !lua_istable(L, 1)) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "exactly one argument expected");
+    }
+
+    log = ngx_http_dynamic_upstream_lua_log(L);
+
+    pool = ngx_create_pool(1024, log);
+    if (pool == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+    }
+
+    err = ngx_http_dynamic_upstream_lua_select(L, pool, &tagged);
+    if (err != NULL) {
+        ngx_destroy_pool(pool);
+        return ngx_http_dynamic_upstream_lua_error(L, err);
+    }
+
+    peer = tagged.elts;
+
+    /* peers of one upstream are changed in one write lock cycle */
+
+    for (i = 0; i < tagged.nelts; i = j) {
+
+        for (j = i + 1; j < tagged.nelts; j++) {
+            if (peer[j].upstream.len != peer[i].upstream.len
+                || ngx_strncmp(peer[j].upstream.data, peer[i].upstream.data,
+                               peer[i].upstream.len) != 0)
+            {
+                break;
+            }
+        }
+
+        n = j - i;
+
+        ops = ngx_palloc(pool, n * sizeof(ngx_dynamic_upstream_op_t));
+        rcs = ngx_palloc(pool, n * sizeof(ngx_int_t));
+
+        if (ops == NULL || rcs == NULL) {
+            ngx_destroy_pool(pool);
+            return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+        }
+
+        for (k = 0; k < n; k++) {
+
+            ngx_http_dynamic_upstream_lua_op_init(&ops[k],
+                NGX_DYNAMIC_UPSTEAM_OP_PARAM);
+
+            ops[k].upstream = peer[i + k].upstream;
+            ops[k].server = peer[i + k].server;
+
+            if (down) {
+                ops[k].down = 1;
+                ops[k].op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+            } else {
+                ops[k].up = 1;
+                ops[k].op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+            }
+        }
+
+        uscf = ngx_dynamic_upstream_get(L, &ops[0]);
+        if (uscf == NULL || uscf->shm_zone == NULL) {
+            continue;
+        }
+
+        if (ngx_http_dynamic_upstream_lua_apply_batch(log, pool, uscf, ops,
+                                                      rcs, n, 0)
+            != NGX_OK)
+        {
+            ngx_destroy_pool(pool);
+            return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+        }
+
+        for (k = 0; k < n; k++) {
+            if (rcs[k] == NGX_OK || rcs[k] == NGX_AGAIN) {
+                count++;
+            }
+        }
+    }
+
+    ngx_destroy_pool(pool);
+
+    lua_pushboolean(L, 1);
+    lua_pushinteger(L, (lua_Integer) count);
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_set_down(lua_State *L)
+{
+    return ngx_http_dynamic_upstream_lua_set_tagged(L, 1);
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_set_up(lua_State *L)
+{
+    return ngx_http_dynamic_upstream_lua_set_tagged(L, 0);
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_get_tagged_peers(lua_State *L)
+{
+    ngx_pool_t                         *pool;
+    ngx_array_t                         tagged;
+    ngx_dynamic_upstream_lua_tagged_t  *peer;
+    ngx_dynamic_upstream_lua_filter_t   filter;
+    ngx_dynamic_upstream_op_t           op;
+    ngx_http_upstream_srv_conf_t       *uscf;
+    ngx_uint_t                          i, j, k;
+    const char                         *err;
+
+    pool = ngx_create_pool(1024, ngx_http_dynamic_upstream_lua_log(L));
+    if (pool == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+    }
+
+    err = ngx_http_dynamic_upstream_lua_filter_parse(L, 1, &filter);
+    if (err == NULL) {
+        err = ngx_http_dynamic_upstream_lua_select(L, pool, &tagged);
+    }
+
+    if (err != NULL) {
+        ngx_destroy_pool(pool);
+        return ngx_http_dynamic_upstream_lua_error(L, err);
+    }
+
+    filter.servers = ngx_palloc(pool, (tagged.nelts + 1) * sizeof(ngx_str_t));
+    if (filter.servers == NULL) {
+        ngx_destroy_pool(pool);
+        return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+    }
+
+    peer = tagged.elts;
+
+    lua_pushboolean(L, 1);
+    lua_newtable(L);
+
+    /* peers of the same upstream are adjacent */
+
+    for (i = 0; i < tagged.nelts; i = j) {
+
+        for (j = i + 1; j < tagged.nelts; j++) {
+            if (peer[j].upstream.len != peer[i].upstream.len
+                || ngx_strncmp(peer[j].upstream.data, peer[i].upstream.data,
+                               peer[i].upstream.len) != 0) {
+                break;
+            }
+        }
+
+        ngx_http_dynamic_upstream_lua_op_init(&op,
+            NGX_DYNAMIC_UPSTEAM_OP_LIST);
+
+        op.upstream = peer[i].upstream;
+
+        uscf = ngx_dynamic_upstream_get(L, &op);
+        if (uscf == NULL) {
+            continue;
+        }
+
+        for (k = i; k < j; k++) {
+            filter.servers[k - i] = peer[k].server;
+        }
+
+        filter.nservers = j - i;
+
+        lua_pushlstring(L, (char *) uscf->host.data, uscf->host.len);
+        ngx_dynamic_upstream_lua_create_response(uscf, L,
+            ngx_http_dynamic_upstream_lua_filter_flags(&filter), &filter);
+        lua_rawset(L, -3);
+    }
+
+    ngx_destroy_pool(pool);
+
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static const char *
+ngx_http_dynamic_upstream_lua_current(lua_State *L, ngx_http_upstream_t **u,
+    ngx_http_upstream_srv_conf_t **uscf)
 {
     ngx_http_request_t           *r;
     ngx_http_upstream_t          *us;
     ngx_http_upstream_conf_t     *ucf;
-    ngx_http_upstream_srv_conf_t *uscf;
 
     r = ngx_http_lua_get_request(L);
     if (r == NULL) {
-        return ngx_http_dynamic_upstream_lua_error(L, "no request object");
+        return "no request object";
     }
 
     us = r->upstream;
     if (us == NULL) {
-        return ngx_http_dynamic_upstream_lua_error(L, "no proxying");
+        return "no proxying";
     }
 
-    uscf = us->upstream;
+    *u = us;
+    *uscf = us->upstream;
 
-    if (uscf == NULL) {
+    if (*uscf == NULL) {
         ucf = us->conf;
         if (ucf == NULL) {
-            return ngx_http_dynamic_upstream_lua_error(L,"no upstream");
+            return "no upstream";
         }
-        uscf = ucf->upstream;
-        if (uscf == NULL) {
-            return ngx_http_dynamic_upstream_lua_error(L, "no srv upstream");
+        *uscf = ucf->upstream;
+        if (*uscf == NULL) {
+            return "no srv upstream";
         }
     }
 
+    return NULL;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_current_upstream(lua_State *L)
+{
+    ngx_http_upstream_t          *us;
+    ngx_http_upstream_srv_conf_t *uscf;
+    const char                   *err;
+
+    err = ngx_http_dynamic_upstream_lua_current(L, &us, &uscf);
+    if (err != NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, err);
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushlstring(L, (char *) uscf->host.data, uscf->host.len);
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static void
+ngx_http_dynamic_upstream_lua_push_msec(lua_State *L, const char *name,
+    ngx_msec_t ms)
+{
+    if (ms != (ngx_msec_t) -1) {
+        lua_pushinteger(L, (lua_Integer) ms);
+        lua_setfield(L, -2, name);
+    }
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_current_peer(lua_State *L)
+{
+    ngx_http_upstream_t               *us;
+    ngx_http_upstream_srv_conf_t      *uscf;
+    ngx_http_upstream_state_t         *state;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+    ngx_http_upstream_rr_peers_t      *primary, *peers;
+    ngx_http_upstream_rr_peer_t       *peer, *current;
+    ngx_flag_t                         backup;
+    const char                        *err;
+
+    err = ngx_http_dynamic_upstream_lua_current(L, &us, &uscf);
+    if (err != NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, err);
+    }
+
+    state = us->state;
+    if (state == NULL || state->peer == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "no peer");
+    }
+
     lua_pushboolean(L, 1);
+    lua_newtable(L);
+
     lua_pushlstring(L, (char *) uscf->host.data, uscf->host.len);
+    lua_setfield(L, -2, "upstream");
+
+    lua_pushlstring(L, (char *) state->peer->data, state->peer->len);
+    lua_setfield(L, -2, "name");
+
+    if (state->status != 0) {
+        lua_pushinteger(L, (lua_Integer) state->status);
+        lua_setfield(L, -2, "status");
+    }
+
+    ngx_http_dynamic_upstream_lua_push_msec(L, "connect_time",
+                                            state->connect_time);
+    ngx_http_dynamic_upstream_lua_push_msec(L, "header_time",
+                                            state->header_time);
+    ngx_http_dynamic_upstream_lua_push_msec(L, "response_time",
+                                            state->response_time);
+
+    primary = uscf->peer.data;
+    if (primary == NULL || uscf->shm_zone == NULL) {
+        goto done;
+    }
+
+    rrp = ngx_http_dynamic_upstream_lua_rr_peer_data(us);
+    current = rrp != NULL ? rrp->current : NULL;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    /* the peer is held by the request until it is released */
+
+    if (current != NULL && us->peer.sockaddr != NULL) {
+        backup = rrp->peers != primary;
+        goto found;
+    }
+
+    /*
+     * the released peer may be removed since and its memory given to
+     * another peer, it is looked for without touching it and matched by
+     * name too, by name only for balancers keeping other data
+     */
+
+    for (peers = primary; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if ((current == NULL || peer == current)
+                && peer->name.len == state->peer->len
+                && ngx_strncmp(peer->name.data, state->peer->data,
+                               state->peer->len) == 0)
+            {
+                backup = peers != primary;
+                current = peer;
+
+                goto found;
+            }
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    goto done;
+
+found:
+
+    peer = current;
+
+    lua_pushlstring(L, (char *) peer->server.data, peer->server.len);
+    lua_setfield(L, -2, "server");
+
+    lua_pushinteger(L, (lua_Integer) peer->weight);
+    lua_setfield(L, -2, "weight");
+
+    lua_pushinteger(L, (lua_Integer) peer->max_conns);
+    lua_setfield(L, -2, "max_conns");
+
+    lua_pushinteger(L, (lua_Integer) peer->conns);
+    lua_setfield(L, -2, "conns");
+
+    lua_pushinteger(L, (lua_Integer) peer->max_fails);
+    lua_setfield(L, -2, "max_fails");
+
+    lua_pushinteger(L, (lua_Integer) peer->fail_timeout);
+    lua_setfield(L, -2, "fail_timeout");
+
+    lua_pushboolean(L, backup);
+    lua_setfield(L, -2, "backup");
+
+    lua_pushboolean(L, peer->down != 0);
+    lua_setfield(L, -2, "down");
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+done:
+
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_get_panic(lua_State *L)
+{
+    ngx_dynamic_upstream_op_t         op;
+    ngx_http_upstream_srv_conf_t     *uscf;
+    ngx_dynamic_upstream_lua_panic_t  stat;
+
+    if (lua_gettop(L) != 1) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "exactly one argument expected");
+    }
+
+    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
+        NGX_DYNAMIC_UPSTEAM_OP_LIST);
+
+    uscf = ngx_dynamic_upstream_get(L, &op);
+    if (uscf == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "upstream not found");
+    }
+
+    if (ngx_http_dynamic_upstream_lua_panic_stat(uscf, &stat) != NGX_OK) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "dynamic_panic_threshold is not set");
+    }
+
+    lua_pushboolean(L, 1);
+    lua_newtable(L);
+
+    lua_pushboolean(L, stat.panic);
+    lua_setfield(L, -2, "panic");
+
+    lua_pushinteger(L, (lua_Integer) stat.threshold);
+    lua_setfield(L, -2, "threshold");
+
+    lua_pushinteger(L, (lua_Integer) stat.primaries);
+    lua_setfield(L, -2, "primaries");
+
+    lua_pushinteger(L, (lua_Integer) stat.alive);
+    lua_setfield(L, -2, "alive");
+
+    lua_pushinteger(L, (lua_Integer) stat.transitions);
+    lua_setfield(L, -2, "transitions");
+
+    lua_pushinteger(L, (lua_Integer) stat.selections);
+    lua_setfield(L, -2, "selections");
+
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_get_queue(lua_State *L)
+{
+    ngx_dynamic_upstream_op_t              op;
+    ngx_http_upstream_srv_conf_t          *uscf;
+    ngx_dynamic_upstream_lua_queue_stat_t  stat;
+
+    if (lua_gettop(L) != 1) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "exactly one argument expected");
+    }
+
+    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
+        NGX_DYNAMIC_UPSTEAM_OP_LIST);
+
+    uscf = ngx_dynamic_upstream_get(L, &op);
+    if (uscf == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "upstream not found");
+    }
+
+    if (ngx_http_dynamic_upstream_lua_queue_stat(uscf, &stat) != NGX_OK) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "dynamic_queue is not set");
+    }
+
+    lua_pushboolean(L, 1);
+    lua_newtable(L);
+
+    lua_pushinteger(L, (lua_Integer) stat.size);
+    lua_setfield(L, -2, "size");
+
+    lua_pushinteger(L, (lua_Integer) stat.timeout);
+    lua_setfield(L, -2, "timeout");
+
+    lua_pushinteger(L, (lua_Integer) stat.waiting);
+    lua_setfield(L, -2, "waiting");
+
+    lua_pushinteger(L, (lua_Integer) stat.queued);
+    lua_setfield(L, -2, "queued");
+
+    lua_pushinteger(L, (lua_Integer) stat.dequeued);
+    lua_setfield(L, -2, "dequeued");
+
+    lua_pushinteger(L, (lua_Integer) stat.rejected);
+    lua_setfield(L, -2, "rejected");
+
+    lua_pushinteger(L, (lua_Integer) stat.timedout);
+    lua_setfield(L, -2, "timedout");
+
+    lua_pushinteger(L, (lua_Integer) stat.wait_time);
+    lua_setfield(L, -2, "wait_time");
+
+    lua_pushinteger(L, (lua_Integer) stat.wait_max);
+    lua_setfield(L, -2, "wait_max");
+
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_create_upstream(lua_State *L)
+{
+    ngx_str_t    name, balancer, slice;
+    size_t       size;
+    ssize_t      n;
+    const char  *err;
+
+    if ((lua_gettop(L) != 1 && lua_gettop(L) != 2) || !lua_isstring(L, 1)) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "one or two arguments expected");
+    }
+
+    name.data = (u_char *) lua_tolstring(L, 1, &name.len);
+    if (name.len == 0) {
+        return ngx_http_dynamic_upstream_lua_error(L, "empty upstream name");
+    }
+
+    ngx_str_null(&balancer);
+    size = 0;
+
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "zone_slice");
+        if (lua_type(L, -1) == LUA_TNUMBER) {
+            n = (ssize_t) lua_tointeger(L, -1);
+            if (n <= 0) {
+                return ngx_http_dynamic_upstream_lua_error(L,
+                    "invalid zone_slice");
+            }
+            size = (size_t) n;
+        } else if (lua_isstring(L, -1)) {
+            slice.data = (u_char *) lua_tolstring(L, -1, &slice.len);
+            n = ngx_parse_size(&slice);
+            if (n == NGX_ERROR || n == 0) {
+                return ngx_http_dynamic_upstream_lua_error(L,
+                    "invalid zone_slice");
+            }
+            size = (size_t) n;
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "balancer");
+        if (lua_isstring(L, -1)) {
+            balancer.data = (u_char *) lua_tolstring(L, -1, &balancer.len);
+        }
+        lua_pop(L, 1);
+    }
+
+    err = NULL;
+
+    if (ngx_http_dynamic_upstream_lua_pool_create(
+            ngx_http_dynamic_upstream_lua_log(L), &name, size, &balancer,
+            &err) != NGX_OK)
+    {
+        return ngx_http_dynamic_upstream_lua_error(L, err);
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_delete_upstream(lua_State *L)
+{
+    ngx_str_t    name;
+    const char  *err;
+
+    if (lua_gettop(L) != 1 || !lua_isstring(L, 1)) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "exactly one argument expected");
+    }
+
+    name.data = (u_char *) lua_tolstring(L, 1, &name.len);
+
+    err = NULL;
+
+    if (ngx_http_dynamic_upstream_lua_pool_delete(
+            ngx_http_dynamic_upstream_lua_log(L), &name, &err) != NGX_OK)
+    {
+        return ngx_http_dynamic_upstream_lua_error(L, err);
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static ngx_flag_t
+ngx_http_dynamic_upstream_lua_peer_usable(ngx_http_upstream_rr_peer_t *peer,
+    time_t now, ngx_flag_t panic)
+{
+    /* in panic mode the load is spread regardless of down flags */
+
+    if (peer->down && !panic) {
+        return 0;
+    }
+
+    if (peer->max_fails
+        && peer->fails >= peer->max_fails
+        && now - peer->checked <= peer->fail_timeout)
+    {
+        return 0;
+    }
+
+    if (peer->max_conns && peer->conns >= peer->max_conns) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+static ngx_http_upstream_rr_peer_t *
+ngx_http_dynamic_upstream_lua_pick(ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t policy, ngx_str_t *key, ngx_flag_t panic)
+{
+    time_t                        now;
+    uint32_t                      hash, base, score, best_score = 0;
+    ngx_uint_t                    i, j, n, a, b;
+    ngx_http_upstream_rr_peer_t  *peer, *best = NULL, *first = NULL;
+
+    now = ngx_time();
+
+    switch (policy) {
+
+        case NGX_DYNAMIC_UPSTREAM_LUA_PICK_LEAST_CONN:
+
+            for (peer = peers->peer; peer; peer = peer->next) {
+                if (!ngx_http_dynamic_upstream_lua_peer_usable(peer, now,
+                                                               panic))
+                {
+                    continue;
+                }
+
+                if (best == NULL
+                    || peer->conns * best->weight < best->conns * peer->weight)
+                {
+                    best = peer;
+                }
+            }
+
+            return best;
+
+        case NGX_DYNAMIC_UPSTREAM_LUA_PICK_HASH:
+
+            /*
+             * the nearest point clockwise of the key among usable peers,
+             * the same peer as found on the ring of the replica
+             */
+
+            hash = ngx_crc32_long(key->data, key->len);
+
+            for (peer = peers->peer; peer; peer = peer->next) {
+                if (!ngx_http_dynamic_upstream_lua_peer_usable(peer, now,
+                                                               panic))
+                {
+                    continue;
+                }
+
+                base = ngx_dynamic_upstream_lua_ring_base(&peer->name);
+                n = peer->weight * NGX_DYNAMIC_UPSTREAM_LUA_RING_POINTS;
+
+                for (j = 0; j < n; j++) {
+                    score = ngx_dynamic_upstream_lua_ring_point(base, j)
+                            - hash;
+
+                    if (best == NULL || score < best_score) {
+                        best = peer;
+                        best_score = score;
+                    }
+                }
+            }
+
+            return best;
+
+        default:
+            break;
+    }
+
+    /* power of two choices */
+
+    n = 0;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        if (ngx_http_dynamic_upstream_lua_peer_usable(peer, now, panic)) {
+            n++;
+        }
+    }
+
+    if (n == 0) {
+        return NULL;
+    }
+
+    a = ngx_random() % n;
+    b = n > 1 ? (a + 1 + ngx_random() % (n - 1)) % n : a;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next) {
+        if (!ngx_http_dynamic_upstream_lua_peer_usable(peer, now, panic)) {
+            continue;
+        }
+
+        if (i == a) {
+            first = peer;
+        }
+
+        if (i == b) {
+            best = peer;
+        }
+
+        i++;
+    }
+
+    if (first->conns * best->weight < best->conns * first->weight) {
+        best = first;
+    }
+
+    return best;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_pick_error(lua_State *L, const char *error)
+{
+    lua_pushboolean(L, 0);
+    lua_pushnil(L);
+    lua_pushnil(L);
+    lua_pushstring(L, error);
+    return 4;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_pick_peer(lua_State *L)
+{
+    ngx_dynamic_upstream_op_t                 op;
+    ngx_http_upstream_srv_conf_t             *uscf;
+    ngx_http_dynamic_upstream_lua_replica_t  *replica;
+    ngx_dynamic_upstream_lua_ring_t         *ring;
+    ngx_http_upstream_rr_peers_t             *primary, *sets[2];
+    ngx_http_upstream_rr_peer_t              *peer = NULL;
+    ngx_str_t                                 key, policy;
+    ngx_uint_t                                pick, k, lo, hi;
+    ngx_int_t                                 i;
+    ngx_flag_t                                backup, panic;
+    u_char                                    addr[NGX_SOCKADDR_STRLEN];
+    size_t                                    len = 0;
+    in_port_t                                 port = 0;
+
+    if (lua_gettop(L) != 1 && lua_gettop(L) != 2) {
+        return ngx_http_dynamic_upstream_lua_pick_error(L,
+            "one or two arguments expected");
+    }
+
+    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
+        NGX_DYNAMIC_UPSTEAM_OP_LIST);
+
+    ngx_str_null(&key);
+    pick = NGX_DYNAMIC_UPSTREAM_LUA_PICK_P2C;
+
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "policy");
+        if (lua_isstring(L, -1)) {
+            policy.data = (u_char *) lua_tolstring(L, -1, &policy.len);
+
+            if (policy.len == 10
+                && ngx_strncmp(policy.data, "least_conn", 10) == 0) {
+                pick = NGX_DYNAMIC_UPSTREAM_LUA_PICK_LEAST_CONN;
+            } else if (policy.len == 4
+                       && ngx_strncmp(policy.data, "hash", 4) == 0) {
+                pick = NGX_DYNAMIC_UPSTREAM_LUA_PICK_HASH;
+            } else if (policy.len != 3
+                       || ngx_strncmp(policy.data, "p2c", 3) != 0) {
+                return ngx_http_dynamic_upstream_lua_pick_error(L,
+                    "unknown policy");
+            }
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "key");
+        if (lua_isstring(L, -1)) {
+            key.data = (u_char *) lua_tolstring(L, -1, &key.len);
+        }
+        lua_pop(L, 1);
+    }
+
+    if (pick == NGX_DYNAMIC_UPSTREAM_LUA_PICK_HASH && key.data == NULL) {
+        return ngx_http_dynamic_upstream_lua_pick_error(L,
+            "key is required for hash policy");
+    }
+
+    uscf = ngx_dynamic_upstream_get(L, &op);
+    if (uscf == NULL) {
+        return ngx_http_dynamic_upstream_lua_pick_error(L,
+            "upstream not found");
+    }
+
+    backup = ngx_http_dynamic_upstream_lua_backup_first(uscf,
+                 key.data != NULL ? &key : NULL);
+    panic = ngx_http_dynamic_upstream_lua_panic(uscf);
+
+    /* the replica is read without the lock, rlock does nothing on it */
+
+    replica = ngx_http_dynamic_upstream_lua_replica(uscf, 1);
+
+    primary = replica != NULL ? &replica->peers[0] : uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    /*
+     * backup peers are used only if all primary peers are unavailable
+     * or the share of alive primary peers is below dynamic_backup_threshold
+     */
+
+    if (replica != NULL) {
+
+        /* the selection fields are scanned as an array, not as a list */
+
+        for (k = 0, i = NGX_DECLINED; k < 2 && i == NGX_DECLINED; k++) {
+
+            if ((k == 0) != (backup != 0)) {
+                lo = 0;
+                hi = replica->nprimary;
+                ring = &replica->ring[0];
+            } else {
+                lo = replica->nprimary;
+                hi = replica->n;
+                ring = &replica->ring[1];
+            }
+
+            i = ngx_dynamic_upstream_lua_hot_pick(replica->hot + lo,
+                                                  replica->name + lo,
+                                                  hi - lo, ring, pick, &key,
+                                                  panic);
+            if (i != NGX_DECLINED) {
+                peer = &replica->peer[lo + i];
+            }
+        }
+
+    } else {
+
+        sets[0] = backup ? primary->next : primary;
+        sets[1] = backup ? primary : primary->next;
+
+        for (k = 0; k < 2 && sets[k] != NULL && peer == NULL; k++) {
+            peer = ngx_http_dynamic_upstream_lua_pick(sets[k], pick, &key,
+                                                    panic);
+        }
+    }
+
+    if (peer != NULL) {
+        len = ngx_min(peer->name.len, NGX_SOCKADDR_STRLEN);
+        ngx_memcpy(addr, peer->name.data, len);
+
+        if (peer->sockaddr->sa_family != AF_UNIX) {
+            port = ngx_inet_get_port(peer->sockaddr);
+
+            while (len > 0) {
+                if (addr[--len] == ':') {
+                    break;
+                }
+            }
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    if (peer == NULL) {
+        return ngx_http_dynamic_upstream_lua_pick_error(L, "no live peers");
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushlstring(L, (char *) addr, len);
+
+    if (port != 0) {
+        lua_pushinteger(L, (lua_Integer) port);
+    } else {
+        lua_pushnil(L);
+    }
+
+    lua_pushnil(L);
+
+    return 4;
+}
+
+
+typedef struct {
+    ngx_str_t                      upstream;
+    ngx_http_upstream_srv_conf_t  *uscf;
+    ngx_array_t                    ops;
+} ngx_http_dynamic_upstream_lua_load_t;
+
+
+static void
+ngx_http_dynamic_upstream_lua_report_error(lua_State *L, ngx_str_t *server,
+    const char *error, int i)
+{
+    lua_newtable(L);
+
+    if (server != NULL) {
+        lua_pushlstring(L, (char *) server->data, server->len);
+        lua_setfield(L, -2, "server");
+    }
+
+    lua_pushstring(L, error);
+    lua_setfield(L, -2, "error");
+
+    lua_rawseti(L, -2, i);
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_lua_load_parse(lua_State *L,
+    ngx_dynamic_upstream_lua_json_t *js, ngx_array_t *loads)
+{
+    ngx_dynamic_upstream_op_t              op, *peer;
+    ngx_http_dynamic_upstream_lua_load_t  *load;
+    ngx_int_t                              rc;
+
+    /* every peer is parsed and checked before the first change */
+
+    rc = ngx_dynamic_upstream_lua_json_begin(js, '{');
+
+    while (rc == NGX_OK) {
+
+        load = ngx_array_push(loads);
+        if (load == NULL) {
+            js->err = "no memory";
+            return NGX_ERROR;
+        }
+
+        if (ngx_dynamic_upstream_lua_json_key(js, &load->upstream)
+                != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_array_init(&load->ops, js->pool, 8,
+                           sizeof(ngx_dynamic_upstream_op_t)) != NGX_OK) {
+            js->err = "no memory";
+            return NGX_ERROR;
+        }
+
+        ngx_http_dynamic_upstream_lua_op_init(&op,
+            NGX_DYNAMIC_UPSTEAM_OP_LIST);
+        op.upstream = load->upstream;
+
+        load->uscf = ngx_dynamic_upstream_get(L, &op);
+
+        if (load->uscf == NULL || load->uscf->shm_zone == NULL) {
+            if (ngx_dynamic_upstream_lua_json_skip(js) != NGX_OK) {
+                return NGX_ERROR;
+            }
+            goto next;
+        }
+
+        rc = ngx_dynamic_upstream_lua_json_begin(js, '[');
+
+        while (rc == NGX_OK) {
+
+            peer = ngx_array_push(&load->ops);
+            if (peer == NULL) {
+                js->err = "no memory";
+                return NGX_ERROR;
+            }
+
+            ngx_http_dynamic_upstream_lua_op_init(peer,
+                NGX_DYNAMIC_UPSTEAM_OP_ADD);
+            peer->upstream = load->upstream;
+
+            if (ngx_dynamic_upstream_lua_json_peer(js, peer) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            rc = ngx_dynamic_upstream_lua_json_next(js, ']');
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+next:
+
+        rc = ngx_dynamic_upstream_lua_json_next(js, '}');
+    }
+
+    return rc == NGX_ERROR ? NGX_ERROR : NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_lua_load_upstream(lua_State *L, ngx_pool_t *pool,
+    ngx_http_dynamic_upstream_lua_load_t *load)
+{
+    ngx_dynamic_upstream_op_t  *ops;
+    ngx_int_t                  *rcs;
+    ngx_uint_t                  i, added = 0, updated = 0;
+    int                         errors = 0;
+
+    ops = load->ops.elts;
+    rcs = NULL;
+
+    if (load->uscf != NULL && load->uscf->shm_zone != NULL) {
+
+        rcs = ngx_palloc(pool, load->ops.nelts * sizeof(ngx_int_t));
+        if (rcs == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_dynamic_upstream_lua_apply_batch(
+                ngx_http_dynamic_upstream_lua_log(L), pool, load->uscf, ops,
+                rcs, load->ops.nelts, 1) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    lua_pushlstring(L, (char *) load->upstream.data, load->upstream.len);
+    lua_newtable(L);
+    lua_newtable(L);
+
+    if (rcs == NULL) {
+
+        ngx_http_dynamic_upstream_lua_report_error(L, NULL,
+            load->uscf == NULL ? "upstream not found" : "no zone",
+            ++errors);
+
+        goto done;
+    }
+
+    for (i = 0; i < load->ops.nelts; i++) {
+
+        if (rcs[i] == NGX_OK || rcs[i] == NGX_AGAIN) {
+            if (ops[i].op == NGX_DYNAMIC_UPSTEAM_OP_ADD) {
+                added++;
+            } else {
+                updated++;
+            }
+        } else {
+            ngx_http_dynamic_upstream_lua_report_error(L, &ops[i].server,
+                ops[i].err != NULL ? ops[i].err : "failed", ++errors);
+        }
+    }
+
+done:
+
+    lua_setfield(L, -2, "errors");
+
+    lua_pushinteger(L, (lua_Integer) added);
+    lua_setfield(L, -2, "added");
+
+    lua_pushinteger(L, (lua_Integer) updated);
+    lua_setfield(L, -2, "updated");
+
+    lua_rawset(L, -3);
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_get_zone_usage(lua_State *L)
+{
+    ngx_dynamic_upstream_op_t              op;
+    ngx_http_upstream_srv_conf_t          *uscf;
+    ngx_http_upstream_rr_peers_t          *primary, *peers;
+    ngx_dynamic_upstream_lua_zone_usage_t  usage;
+    ngx_uint_t                             n = 0;
+
+    if (lua_gettop(L) != 1) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "exactly one argument expected");
+    }
+
+    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
+        NGX_DYNAMIC_UPSTEAM_OP_LIST);
+
+    uscf = ngx_dynamic_upstream_get(L, &op);
+    if (uscf == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "upstream not found");
+    }
+
+    if (uscf->shm_zone == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "no zone");
+    }
+
+    ngx_dynamic_upstream_lua_zone_usage(uscf->shm_zone, &usage);
+
+    primary = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    for (peers = primary; peers; peers = peers->next) {
+        n += peers->number;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    lua_pushboolean(L, 1);
+    lua_newtable(L);
+
+    lua_pushinteger(L, (lua_Integer) usage.size);
+    lua_setfield(L, -2, "size");
+
+    lua_pushinteger(L, (lua_Integer) usage.used);
+    lua_setfield(L, -2, "used");
+
+    lua_pushinteger(L, (lua_Integer) usage.pages);
+    lua_setfield(L, -2, "pages");
+
+    lua_pushinteger(L, (lua_Integer) usage.free_pages);
+    lua_setfield(L, -2, "free_pages");
+
+    lua_pushinteger(L, (lua_Integer) n);
+    lua_setfield(L, -2, "peers");
+
+    lua_pushinteger(L, (lua_Integer) (n != 0 ? usage.used / n : 0));
+    lua_setfield(L, -2, "bytes_per_peer");
+
+    lua_pushinteger(L, (lua_Integer) (usage.slab_size != 0
+        ? 100 - usage.slab_used * 100 / usage.slab_size : 0));
+    lua_setfield(L, -2, "fragmentation");
+
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_lua_check_zone(ngx_pool_t *pool,
+    ngx_array_t *loads, u_char *err, size_t len)
+{
+    ngx_dynamic_upstream_op_t             *ops;
+    ngx_http_dynamic_upstream_lua_load_t  *load;
+    ngx_dynamic_upstream_lua_zone_usage_t  usage;
+    ngx_dynamic_upstream_lua_names_t       names;
+    ngx_uint_t                             i, j;
+    size_t                                 need, avail;
+
+    /* estimate memory for new peers before anything is applied */
+
+    load = loads->elts;
+
+    for (i = 0; i < loads->nelts; i++) {
+
+        if (load[i].uscf == NULL || load[i].uscf->shm_zone == NULL) {
+            continue;
+        }
+
+        ngx_dynamic_upstream_lua_names_init(&names, pool);
+
+        if (ngx_http_dynamic_upstream_lua_names(load[i].uscf, &names)
+                != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        need = 0;
+        ops = load[i].ops.elts;
+
+        for (j = 0; j < load[i].ops.nelts; j++) {
+
+            /* a server listed twice is added once */
+
+            if (ngx_dynamic_upstream_lua_names_find(&names, &ops[j].server)
+                    != NULL)
+            {
+                continue;
+            }
+
+            need += ngx_dynamic_upstream_lua_peer_size(
+                sizeof(ngx_http_upstream_rr_peer_t), &ops[j].server);
+
+            if (ngx_dynamic_upstream_lua_names_add(&names, &ops[j].server, 0)
+                    == NULL)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        ngx_dynamic_upstream_lua_zone_usage(load[i].uscf->shm_zone, &usage);
+
+        avail = usage.free_pages * ngx_pagesize;
+
+        if (need > avail) {
+            ngx_snprintf(err, len, "zone of upstream \"%V\" is too small: "
+                         "%uz bytes required, %uz free%Z",
+                         &load[i].upstream, need, avail);
+            return NGX_DECLINED;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_dynamic_upstream_lua_json_flags(lua_State *L, int index)
+{
+    ngx_uint_t  flags;
+
+    flags = NGX_DYNAMIC_UPSTREAM_LUA_PRIMARY
+            |NGX_DYNAMIC_UPSTREAM_LUA_BACKUP
+            |NGX_DYNAMIC_UPSTREAM_LUA_JSON;
+
+    if (!lua_istable(L, index)) {
+        return flags;
+    }
+
+    lua_getfield(L, index, "primary");
+    if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+        flags &= ~NGX_DYNAMIC_UPSTREAM_LUA_PRIMARY;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "backup");
+    if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+        flags &= ~NGX_DYNAMIC_UPSTREAM_LUA_BACKUP;
+    }
+    lua_pop(L, 1);
+
+    return flags;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_get_peers_json(lua_State *L)
+{
+    ngx_dynamic_upstream_op_t      op;
+    ngx_http_upstream_srv_conf_t  *uscf;
+    ngx_pool_t                    *pool;
+    ngx_buf_t                     *b;
+    ngx_uint_t                     flags;
+
+    if (lua_gettop(L) != 1 && lua_gettop(L) != 2) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "one or two arguments expected");
+    }
+
+    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
+        NGX_DYNAMIC_UPSTEAM_OP_LIST);
+
+    flags = ngx_http_dynamic_upstream_lua_json_flags(L, 2);
+
+    uscf = ngx_dynamic_upstream_get(L, &op);
+    if (uscf == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "upstream not found");
+    }
+
+    if (uscf->shm_zone == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "no zone");
+    }
+
+    pool = ngx_create_pool(ngx_pagesize, ngx_http_dynamic_upstream_lua_log(L));
+    if (pool == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+    }
+
+    b = ngx_http_dynamic_upstream_lua_peers_buf(pool, uscf->peer.data, flags);
+    if (b == NULL) {
+        ngx_destroy_pool(pool);
+        return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+    }
+
+    lua_pushboolean(L, 1);
+
+    /* without trailing LF */
+    lua_pushlstring(L, (char *) b->pos, b->last - b->pos - 1);
+
+    lua_pushnil(L);
+
+    ngx_destroy_pool(pool);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_get_all_peers_json(lua_State *L)
+{
+    ngx_uint_t                      i, flags;
+    ngx_http_upstream_srv_conf_t  **uscfp, *uscf;
+    ngx_http_upstream_main_conf_t  *umcf;
+    ngx_pool_t                     *pool;
+    ngx_buf_t                      *b;
+    u_char                         *name;
+    size_t                          len;
+    ngx_flag_t                      first = 1;
+    luaL_Buffer                     json;
+
+    if (lua_gettop(L) > 1) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "one optional argument expected");
+    }
+
+    flags = ngx_http_dynamic_upstream_lua_json_flags(L, 1);
+
+    umcf = ngx_http_lua_upstream_get_upstream_main_conf(L);
+    if (umcf == NULL) {
+        lua_pushboolean(L, 1);
+        lua_pushliteral(L, "{}");
+        lua_pushnil(L);
+        return 3;
+    }
+
+    pool = ngx_create_pool(ngx_pagesize, ngx_http_dynamic_upstream_lua_log(L));
+    if (pool == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    lua_pushboolean(L, 1);
+
+    luaL_buffinit(L, &json);
+    luaL_addchar(&json, '{');
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->srv_conf == NULL || uscf->shm_zone == NULL) {
+            continue;
+        }
+
+        len = ngx_escape_json(NULL, uscf->host.data, uscf->host.len);
+
+        name = ngx_pnalloc(pool, uscf->host.len + len);
+        b = ngx_http_dynamic_upstream_lua_peers_buf(pool, uscf->peer.data,
+                                                    flags);
+
+        if (name == NULL || b == NULL) {
+            luaL_pushresult(&json);
+            ngx_destroy_pool(pool);
+            lua_pop(L, 2);
+            return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+        }
+
+        len = (u_char *) ngx_escape_json(name, uscf->host.data, uscf->host.len)
+              - name;
+
+        if (!first) {
+            luaL_addchar(&json, ',');
+        }
+
+        luaL_addchar(&json, '"');
+        luaL_addlstring(&json, (char *) name, len);
+        luaL_addlstring(&json, "\":", 2);
+        luaL_addlstring(&json, (char *) b->pos, b->last - b->pos - 1);
+
+        first = 0;
+
+        ngx_reset_pool(pool);
+    }
+
+    luaL_addchar(&json, '}');
+    luaL_pushresult(&json);
+
+    ngx_destroy_pool(pool);
+
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_swap_primary_backup(lua_State *L)
+{
+    ngx_dynamic_upstream_op_t      op;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (lua_gettop(L) != 1) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "exactly one argument expected");
+    }
+
+    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
+                                              NGX_DYNAMIC_UPSTEAM_OP_LIST);
+
+    uscf = ngx_dynamic_upstream_get(L, &op);
+    if (uscf == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "upstream not found");
+    }
+
+    if (ngx_http_dynamic_upstream_lua_swap(
+            ngx_http_dynamic_upstream_lua_log(L), uscf) != NGX_OK) {
+        return ngx_http_dynamic_upstream_lua_error(L, "no backup peers");
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_stage(lua_State *L)
+{
+    ngx_dynamic_upstream_op_t  op;
+    ngx_str_t                  upstream;
+    ngx_int_t                  rc;
+    int                        i, n;
+
+    if (lua_gettop(L) != 2 || !lua_istable(L, 2)) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "exactly 2 arguments expected");
+    }
+
+    ngx_http_dynamic_upstream_lua_op_defaults(L, &op,
+        NGX_DYNAMIC_UPSTEAM_OP_LIST);
+
+    upstream = op.upstream;
+
+    if (ngx_dynamic_upstream_get(L, &op) == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "upstream not found");
+    }
+
+    n = lua_objlen(L, 2);
+
+    for (i = 1; i <= n; i++) {
+
+        ngx_http_dynamic_upstream_lua_op_init(&op,
+            NGX_DYNAMIC_UPSTEAM_OP_PARAM);
+        op.upstream = upstream;
+
+        lua_rawgeti(L, 2, i);
+
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            return ngx_http_dynamic_upstream_lua_error(L,
+                "table of peers expected");
+        }
+
+        lua_getfield(L, -1, "server");
+
+        if (!lua_isstring(L, -1)) {
+            lua_pop(L, 2);
+            return ngx_http_dynamic_upstream_lua_error(L,
+                "peer without server");
+        }
+
+        op.server.data = (u_char *) lua_tolstring(L, -1, &op.server.len);
+
+        lua_pop(L, 1);
+
+        ngx_http_dynamic_upstream_lua_update_peer_parse_params(L, &op);
+
+        lua_pop(L, 1);
+
+        rc = ngx_dynamic_upstream_lua_stage(&upstream, 0, &op);
+
+        if (rc == NGX_DECLINED) {
+            return ngx_http_dynamic_upstream_lua_error(L,
+                "staging is disabled, use dynamic_upstream_stage_interval");
+        }
+
+        if (rc == NGX_ERROR) {
+            return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+        }
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_commit_staged(lua_State *L)
+{
+    if (lua_gettop(L) != 0) {
+        return ngx_http_dynamic_upstream_lua_error(L, "no argument expected");
+    }
+
+    ngx_dynamic_upstream_lua_stage_commit(
+        ngx_http_dynamic_upstream_lua_log(L));
+
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_get_changes(lua_State *L)
+{
+    ngx_pool_t  *pool;
+    ngx_buf_t   *b;
+    lua_Integer  since;
+    const char  *err;
+
+    if (lua_gettop(L) != 1) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "exactly one argument expected");
+    }
+
+    since = luaL_checkinteger(L, 1);
+
+    pool = ngx_create_pool(ngx_pagesize,
+                           ngx_http_dynamic_upstream_lua_log(L));
+    if (pool == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+    }
+
+    b = ngx_dynamic_upstream_lua_journal_export(pool,
+                                                since > 0 ? since : 0, &err);
+    if (b == NULL) {
+        ngx_destroy_pool(pool);
+        return ngx_http_dynamic_upstream_lua_error(L, err);
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushlstring(L, (char *) b->pos, b->last - b->pos);
+    lua_pushnil(L);
+
+    ngx_destroy_pool(pool);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_apply_changes(lua_State *L)
+{
+    ngx_str_t    blob;
+    ngx_pool_t  *pool;
+    ngx_uint_t   applied;
+    const char  *err;
+
+    if (lua_gettop(L) != 1) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "exactly one argument expected");
+    }
+
+    blob.data = (u_char *) luaL_checklstring(L, 1, &blob.len);
+
+    pool = ngx_create_pool(1024, ngx_http_dynamic_upstream_lua_log(L));
+    if (pool == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+    }
+
+    if (ngx_dynamic_upstream_lua_journal_import(
+            ngx_http_dynamic_upstream_lua_log(L), pool, &blob, &applied,
+            &err) != NGX_OK) {
+        ngx_destroy_pool(pool);
+
+        lua_pushboolean(L, 0);
+        lua_pushnil(L);
+        lua_pushfstring(L, "json: %s", err);
+
+        return 3;
+    }
+
+    ngx_destroy_pool(pool);
+
+    lua_pushboolean(L, 1);
+    lua_pushinteger(L, (lua_Integer) applied);
+    lua_pushnil(L);
+
+    return 3;
+}
+
+
+static int
+ngx_http_dynamic_upstream_lua_load_json(lua_State *L)
+{
+    ngx_dynamic_upstream_lua_json_t        js;
+    ngx_http_dynamic_upstream_lua_load_t  *load;
+    ngx_array_t                            loads;
+    ngx_str_t                              json;
+    ngx_pool_t                            *pool;
+    ngx_uint_t                             i;
+    ngx_int_t                              rc;
+    int                                    check_zone;
+    u_char                                 err[NGX_MAX_ERROR_STR];
+
+    if (lua_gettop(L) != 1 && lua_gettop(L) != 2) {
+        return ngx_http_dynamic_upstream_lua_error(L,
+            "one or two arguments expected");
+    }
+
+    json.data = (u_char *) luaL_checklstring(L, 1, &json.len);
+
+    check_zone = 0;
+
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "check_zone");
+        check_zone = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
+    pool = ngx_create_pool(1024, ngx_http_dynamic_upstream_lua_log(L));
+    if (pool == NULL) {
+        return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+    }
+
+    if (ngx_array_init(&loads, pool, 4,
+                       sizeof(ngx_http_dynamic_upstream_lua_load_t))
+            != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+    }
+
+    ngx_dynamic_upstream_lua_json_init(&js, json.data, json.len, pool);
+
+    if (ngx_dynamic_upstream_lua_json_validate(&js) != NGX_OK) {
+        goto error;
+    }
+
+    if (ngx_http_dynamic_upstream_lua_load_parse(L, &js, &loads) != NGX_OK) {
+        goto error;
+    }
+
+    if (check_zone) {
+
+        rc = ngx_http_dynamic_upstream_lua_check_zone(pool, &loads, err,
+                                                      sizeof(err));
+
+        if (rc == NGX_ERROR) {
+            goto nomem;
+        }
+
+        if (rc == NGX_DECLINED) {
+            ngx_destroy_pool(pool);
+            return ngx_http_dynamic_upstream_lua_error(L, (char *) err);
+        }
+    }
+
+    lua_pushboolean(L, 1);
+    lua_newtable(L);
+
+    load = loads.elts;
+
+    for (i = 0; i < loads.nelts; i++) {
+        if (ngx_http_dynamic_upstream_lua_load_upstream(L, pool, &load[i])
+                != NGX_OK) {
+            lua_pop(L, 2);
+            goto nomem;
+        }
+    }
+
+    ngx_destroy_pool(pool);
+
+    lua_pushnil(L);
+
+    return 3;
+
+nomem:
+
+    ngx_destroy_pool(pool);
+
+    return ngx_http_dynamic_upstream_lua_error(L, "no memory");
+
+error:
+
+    ngx_destroy_pool(pool);
+
+    lua_pushboolean(L, 0);
     lua_pushnil(L);
+    lua_pushfstring(L, "json: %s at offset %d", js.err,
+                    (int) (js.pos - js.start));
 
     return 3;
 }
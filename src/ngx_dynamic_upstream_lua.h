@@ -3,10 +3,930 @@
 
 
 #include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_PRIMARY  1
+#define NGX_DYNAMIC_UPSTREAM_LUA_BACKUP   2
+#define NGX_DYNAMIC_UPSTREAM_LUA_JSON     8
+#define NGX_DYNAMIC_UPSTREAM_LUA_STREAM   16
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_PICK_P2C         0
+#define NGX_DYNAMIC_UPSTREAM_LUA_PICK_LEAST_CONN  1
+#define NGX_DYNAMIC_UPSTREAM_LUA_PICK_HASH        2
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_MAX_TAGS  16
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_ADD     1
+#define NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_REMOVE  2
+#define NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_PARAM   3
+#define NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_SWAP    4
+#define NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_TAGS    5
+
+
+/* backup peers join when less than threshold percent of primaries are up */
+
+#define ngx_dynamic_upstream_lua_backup_needed(threshold, alive, total)       \
+    ((threshold) ? (alive) * 100 < (threshold) * (total) : (alive) == 0)
+
+
+/* failed peers are out like down peers until fail_timeout passes */
+
+#define ngx_dynamic_upstream_lua_peer_alive(peer, now)                        \
+    (!(peer)->down                                                            \
+     && !((peer)->max_fails && (peer)->fails >= (peer)->max_fails             \
+          && (now) - (peer)->checked <= (peer)->fail_timeout))
+
+
+#define NGX_DYNAMIC_UPSTEAM_OP_PARAM_FIELDS                                   \
+    (NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT                                      \
+     |NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS                                  \
+     |NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS                                  \
+     |NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT                               \
+     |NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP                                         \
+     |NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN)
+
+
+typedef struct ngx_dynamic_upstream_lua_chash_server_s
+    ngx_dynamic_upstream_lua_chash_server_t;
+
+struct ngx_dynamic_upstream_lua_chash_server_s {
+    ngx_dynamic_upstream_lua_chash_server_t  *next;
+    ngx_str_t                                 server;
+    ngx_uint_t                                weight;
+};
+
+
+typedef struct {
+    uint32_t                                  hash;
+    ngx_dynamic_upstream_lua_chash_server_t  *server;
+} ngx_dynamic_upstream_lua_chash_point_t;
+
+
+typedef struct {
+    ngx_atomic_t                              lock;
+    ngx_flag_t                                built;
+    ngx_uint_t                                generation;
+    ngx_uint_t                                number;
+    ngx_uint_t                                nalloc;
+    ngx_dynamic_upstream_lua_chash_point_t   *points;
+    ngx_dynamic_upstream_lua_chash_server_t  *servers;
+} ngx_dynamic_upstream_lua_chash_t;
+
+
+typedef struct ngx_dynamic_upstream_lua_ewma_peer_s
+    ngx_dynamic_upstream_lua_ewma_peer_t;
+
+struct ngx_dynamic_upstream_lua_ewma_peer_s {
+    ngx_str_node_t                         sn;
+    ngx_dynamic_upstream_lua_ewma_peer_t  *next;
+    ngx_uint_t                             version;
+    ngx_atomic_t                           ewma;
+    ngx_atomic_t                           inflight;
+    ngx_flag_t                             removed;
+    size_t                                 len;
+    u_char                                 name[NGX_SOCKADDR_STRLEN];
+};
+
+
+/* statistics are atomic, the lock protects the index */
+
+typedef struct {
+    ngx_atomic_t                           lock;
+    ngx_rbtree_t                           rbtree;
+    ngx_rbtree_node_t                      sentinel;
+    ngx_dynamic_upstream_lua_ewma_peer_t  *peers;
+    ngx_dynamic_upstream_lua_ewma_peer_t  *free;
+} ngx_dynamic_upstream_lua_ewma_t;
+
+
+typedef struct ngx_dynamic_upstream_lua_outlier_peer_s
+    ngx_dynamic_upstream_lua_outlier_peer_t;
+
+struct ngx_dynamic_upstream_lua_outlier_peer_s {
+    ngx_str_node_t                            sn;
+    ngx_dynamic_upstream_lua_outlier_peer_t  *next;
+    ngx_atomic_t                              requests;
+    ngx_atomic_t                              errors;
+    ngx_atomic_t                              consecutive;
+    ngx_atomic_t                              window;
+    ngx_msec_t                                ejected_until;
+    ngx_uint_t                                ejections;
+    ngx_uint_t                                total;
+    ngx_flag_t                                ejected;
+    ngx_flag_t                                ejecting;
+    size_t                                    len;
+    u_char                                    name[NGX_SOCKADDR_STRLEN];
+};
+
+
+/* counters are atomic, the lock protects the index and the ejections */
+
+typedef struct {
+    ngx_atomic_t                              lock;
+    ngx_uint_t                                generation;
+    ngx_uint_t                                nejected;
+    ngx_rbtree_t                              rbtree;
+    ngx_rbtree_node_t                         sentinel;
+    ngx_dynamic_upstream_lua_outlier_peer_t  *peers;
+    ngx_dynamic_upstream_lua_outlier_peer_t  *free;
+} ngx_dynamic_upstream_lua_outlier_t;
+
+
+/* staged changes of a peer, keyed by server */
+
+typedef struct {
+    ngx_str_node_t  sn;
+    ngx_uint_t      op_param;
+    ngx_int_t       weight;
+    ngx_int_t       max_fails;
+    ngx_int_t       max_conns;
+    time_t          fail_timeout;
+} ngx_dynamic_upstream_lua_stage_t;
+
+
+typedef struct ngx_dynamic_upstream_lua_tag_peer_s
+    ngx_dynamic_upstream_lua_tag_peer_t;
+
+/* equal tags of several peers are adjacent in the index */
+
+typedef struct {
+    ngx_str_node_t                        sn;
+    ngx_dynamic_upstream_lua_tag_peer_t  *peer;
+} ngx_dynamic_upstream_lua_tag_t;
+
+struct ngx_dynamic_upstream_lua_tag_peer_s {
+    ngx_str_node_t                   sn;
+    ngx_uint_t                       ntags;
+    ngx_dynamic_upstream_lua_tag_t  *tags;
+};
+
+
+typedef struct {
+    ngx_uint_t         generation;
+    ngx_rbtree_t       rbtree;
+    ngx_rbtree_node_t  sentinel;
+    ngx_rbtree_t       peers;
+    ngx_rbtree_node_t  peers_sentinel;
+} ngx_dynamic_upstream_lua_tags_t;
+
+
+typedef struct {
+    ngx_str_t  upstream;
+    ngx_str_t  server;
+} ngx_dynamic_upstream_lua_tagged_t;
+
+
+typedef struct ngx_dynamic_upstream_lua_change_s
+    ngx_dynamic_upstream_lua_change_t;
+
+struct ngx_dynamic_upstream_lua_change_s {
+    ngx_dynamic_upstream_lua_change_t  *next;
+    ngx_uint_t                          seq;
+    ngx_uint_t                          type;
+    ngx_uint_t                          flags;
+    ngx_uint_t                          op_param;
+    ngx_flag_t                          backup;
+    ngx_int_t                           weight;
+    ngx_int_t                           max_fails;
+    ngx_int_t                           max_conns;
+    time_t                              fail_timeout;
+    ngx_str_t                           upstream;
+    ngx_str_t                           server;
+    ngx_str_t                          *tags;
+    ngx_uint_t                          ntags;
+};
+
+
+typedef struct {
+    ngx_dynamic_upstream_lua_change_t  *head;
+    ngx_dynamic_upstream_lua_change_t  *tail;
+    ngx_uint_t                          n;
+    ngx_uint_t                          seq;
+    ngx_uint_t                          generation;
+} ngx_dynamic_upstream_lua_journal_t;
+
+
+typedef struct {
+    ngx_str_t   *servers;
+    ngx_uint_t   nservers;
+    ngx_int_t    down;
+    ngx_int_t    backup;
+    ngx_uint_t   min_conns;
+} ngx_dynamic_upstream_lua_filter_t;
+
+
+/* requests a process holds in the queue, returned when the process exits */
+
+typedef struct {
+    ngx_atomic_t  waiting;
+    ngx_atomic_t  pending;
+    ngx_pid_t     pid;
+} ngx_dynamic_upstream_lua_queue_slot_t;
+
+
+typedef struct {
+    ngx_atomic_t                            waiting;
+    ngx_atomic_t                            pending;
+    ngx_atomic_t                            queued;
+    ngx_atomic_t                            dequeued;
+    ngx_atomic_t                            rejected;
+    ngx_atomic_t                            timedout;
+    ngx_atomic_t                            wait_time;
+    ngx_atomic_t                            wait_max;
+    ngx_dynamic_upstream_lua_queue_slot_t  *slots;
+} ngx_dynamic_upstream_lua_queue_counters_t;
+
+
+typedef struct {
+    ngx_rbtree_node_t                          node;
+    ngx_str_t                                  name;
+    ngx_uint_t                                 flags;
+    ngx_atomic_t                               version;
+    ngx_atomic_t                               writers;
+    ngx_atomic_t                               primaries;
+    ngx_atomic_t                               alive;
+    ngx_atomic_t                               backups;
+    ngx_atomic_t                               counted;
+    ngx_atomic_t                               counted_generation;
+    ngx_atomic_t                               panic;
+    ngx_atomic_t                               panics;
+    ngx_atomic_t                               panic_selections;
+    ngx_dynamic_upstream_lua_chash_t           chash;
+    ngx_dynamic_upstream_lua_ewma_t            ewma;
+    ngx_dynamic_upstream_lua_outlier_t         outlier;
+    ngx_dynamic_upstream_lua_queue_counters_t  queue;
+    ngx_rbtree_t                               staged;
+    ngx_rbtree_node_t                          staged_sentinel;
+    ngx_dynamic_upstream_lua_tags_t            tags;
+} ngx_dynamic_upstream_lua_state_t;
+
+
+typedef struct {
+    ngx_uint_t  primaries;
+    ngx_uint_t  alive;
+    ngx_uint_t  backups;
+} ngx_dynamic_upstream_lua_alive_t;
+
+
+typedef struct {
+    ngx_uint_t  threshold;
+    ngx_uint_t  primaries;
+    ngx_uint_t  alive;
+    ngx_flag_t  panic;
+    ngx_uint_t  transitions;
+    ngx_uint_t  selections;
+} ngx_dynamic_upstream_lua_panic_t;
+
+
+typedef struct {
+    ngx_uint_t  size;
+    ngx_msec_t  timeout;
+    ngx_uint_t  waiting;
+    ngx_uint_t  queued;
+    ngx_uint_t  dequeued;
+    ngx_uint_t  rejected;
+    ngx_uint_t  timedout;
+    ngx_msec_t  wait_time;
+    ngx_msec_t  wait_max;
+} ngx_dynamic_upstream_lua_queue_stat_t;
+
+
+/* requests of the worker waiting for a free peer of the upstream */
+
+typedef struct {
+    ngx_uint_t                                  size;
+    ngx_msec_t                                  timeout;
+    ngx_queue_t                                 waiters;
+    ngx_uint_t                                  nwaiters;
+    ngx_queue_t                                 busy;
+    ngx_http_upstream_srv_conf_t               *uscf;
+    ngx_stream_upstream_srv_conf_t             *suscf;
+    ngx_dynamic_upstream_lua_queue_counters_t  *counters;
+    ngx_dynamic_upstream_lua_queue_slot_t      *slot;
+    ngx_dynamic_upstream_lua_queue_counters_t   local;
+    ngx_dynamic_upstream_lua_queue_slot_t       local_slot;
+    ngx_dynamic_upstream_lua_state_t           *state;
+    ngx_atomic_uint_t                           version;
+    ngx_msec_t                                  counted;
+    ngx_uint_t                                  free;
+    ngx_flag_t                                  cached;
+} ngx_dynamic_upstream_lua_queue_t;
+
+
+typedef struct ngx_dynamic_upstream_lua_waiter_s
+    ngx_dynamic_upstream_lua_waiter_t;
+
+typedef void (*ngx_dynamic_upstream_lua_resume_pt)(
+    ngx_dynamic_upstream_lua_waiter_t *w);
+
+struct ngx_dynamic_upstream_lua_waiter_s {
+    ngx_queue_t                          queue;
+    ngx_event_t                          event;
+    ngx_dynamic_upstream_lua_queue_t    *q;
+    ngx_msec_t                           start;
+    ngx_int_t                            status;
+    ngx_flag_t                           pending;
+    void                                *data;
+    ngx_dynamic_upstream_lua_resume_pt   resume;
+};
+
+
+typedef struct {
+    ngx_rbtree_t                        rbtree;
+    ngx_rbtree_node_t                   sentinel;
+    ngx_uint_t                          generation;
+    ngx_dynamic_upstream_lua_journal_t  journal;
+} ngx_dynamic_upstream_lua_shm_t;
+
+
+/* peer names of an upstream, looked up in O(log n) instead of a scan */
+
+typedef struct ngx_dynamic_upstream_lua_name_s
+    ngx_dynamic_upstream_lua_name_t;
+
+struct ngx_dynamic_upstream_lua_name_s {
+    ngx_str_node_t                    sn;
+    ngx_dynamic_upstream_lua_name_t  *next;
+    void                             *peer;
+    void                             *peers;
+};
+
+
+typedef struct {
+    ngx_rbtree_t                      rbtree;
+    ngx_rbtree_node_t                 sentinel;
+    ngx_pool_t                       *pool;
+} ngx_dynamic_upstream_lua_names_t;
+
+
+typedef struct {
+    size_t      size;
+    size_t      used;
+    ngx_uint_t  pages;
+    ngx_uint_t  free_pages;
+    size_t      slab_size;
+    size_t      slab_used;
+} ngx_dynamic_upstream_lua_zone_usage_t;
+
+
+typedef struct {
+    ngx_shm_zone_t  *shm_zone;
+    size_t           shm_size;
+    ngx_msec_t       stage_interval;
+    ngx_uint_t       journal_size;
+    ngx_flag_t       read_replicas;
+    ngx_shm_zone_t  *pool_zone;
+    ngx_uint_t       pool_upstreams;
+} ngx_http_dynamic_upstream_lua_main_conf_t;
+
+
+/* points of the peers for the hash policy of pick_peer, sorted by hash */
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_RING_POINTS  40
+
+
+typedef struct {
+    uint32_t  hash;
+    uint32_t  index;
+} ngx_dynamic_upstream_lua_ring_point_t;
+
+
+typedef struct {
+    ngx_flag_t                              built;
+    ngx_uint_t                              number;
+    ngx_dynamic_upstream_lua_ring_point_t  *points;
+} ngx_dynamic_upstream_lua_ring_t;
+
+
+/* selection fields of a peer, kept in one array per upstream */
+
+typedef struct {
+    time_t      checked;
+    uint32_t    weight;
+    uint32_t    conns;
+    uint32_t    max_conns;
+    uint32_t    fails;
+    uint32_t    max_fails;
+    uint32_t    fail_timeout;
+    uint32_t    down;
+} ngx_dynamic_upstream_lua_hot_t;
+
+
+typedef struct {
+    ngx_dynamic_upstream_lua_state_t   *state;
+    ngx_atomic_uint_t                   version;
+    ngx_msec_t                          refreshed;
+    time_t                              validated;
+    ngx_uint_t                          number;
+    ngx_uint_t                          n;
+    ngx_uint_t                          nprimary;
+    ngx_dynamic_upstream_lua_hot_t     *hot;
+    ngx_str_t                          *name;
+    ngx_dynamic_upstream_lua_ring_t     ring[2];
+    ngx_pool_t                         *pool;
+    ngx_dynamic_upstream_lua_names_t    names;
+    ngx_http_upstream_rr_peers_t        peers[2];
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peer_t       **source;
+} ngx_http_dynamic_upstream_lua_replica_t;
+
+
+typedef struct {
+    ngx_dynamic_upstream_lua_state_t   *state;
+    ngx_atomic_uint_t                   version;
+    ngx_msec_t                          refreshed;
+    time_t                              validated;
+    ngx_uint_t                          number;
+    ngx_uint_t                          n;
+    ngx_uint_t                          nprimary;
+    ngx_dynamic_upstream_lua_hot_t     *hot;
+    ngx_str_t                          *name;
+    ngx_dynamic_upstream_lua_ring_t     ring[2];
+    ngx_pool_t                         *pool;
+    ngx_dynamic_upstream_lua_names_t    names;
+    ngx_stream_upstream_rr_peers_t      peers[2];
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_rr_peer_t     **source;
+} ngx_stream_dynamic_upstream_lua_replica_t;
+
+
+typedef struct {
+    ngx_uint_t  consecutive;
+    ngx_uint_t  error_rate;
+    ngx_uint_t  min_requests;
+    ngx_uint_t  max_ejected;
+    ngx_msec_t  interval;
+    ngx_msec_t  ejection_time;
+    ngx_msec_t  max_ejection_time;
+} ngx_http_dynamic_upstream_lua_outlier_conf_t;
+
+
+typedef struct {
+    ngx_http_complex_value_t                      *chash_key;
+    ngx_uint_t                                     ewma_decay;
+    ngx_dynamic_upstream_lua_state_t              *state;
+    ngx_http_upstream_init_peer_pt                 original_init_peer;
+    ngx_flag_t                                     disconnect_backup;
+    ngx_flag_t                                     disconnect_down;
+    ngx_flag_t                                     disconnect_exiting;
+    ngx_msec_t                                     warmup_timeout;
+    ngx_uint_t                                     backup_threshold;
+    ngx_uint_t                                     panic_threshold;
+    ngx_str_t                                      file;
+    ngx_dynamic_upstream_lua_queue_t              *queue;
+    ngx_http_dynamic_upstream_lua_outlier_conf_t  *outlier;
+    ngx_http_dynamic_upstream_lua_replica_t       *replica;
+} ngx_http_dynamic_upstream_lua_srv_conf_t;
+
+
+typedef struct {
+    ngx_http_complex_value_t      *queue_upstream;
+    ngx_http_upstream_srv_conf_t  *queue_uscf;
+} ngx_http_dynamic_upstream_lua_loc_conf_t;
+
+
+typedef struct {
+    ngx_flag_t                                  disconnect_backup;
+    ngx_flag_t                                  disconnect_down;
+    ngx_flag_t                                  disconnect_on_exiting;
+    ngx_uint_t                                  backup_threshold;
+    ngx_uint_t                                  panic_threshold;
+    ngx_str_t                                   file;
+    ngx_dynamic_upstream_lua_queue_t           *queue;
+    ngx_stream_complex_value_t                 *queue_upstream;
+    ngx_stream_upstream_srv_conf_t             *queue_uscf;
+    ngx_dynamic_upstream_lua_state_t           *state;
+    ngx_stream_dynamic_upstream_lua_replica_t  *replica;
+} ngx_stream_dynamic_upstream_lua_srv_conf_t;
 
 
 ngx_int_t
 ngx_http_dynamic_upstream_lua_init(ngx_conf_t *cf);
 
 
+char *
+ngx_dynamic_upstream_lua_api(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_shm_add(ngx_conf_t *cf);
+
+char *
+ngx_dynamic_upstream_lua_shm_size(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+ngx_slab_pool_t *
+ngx_dynamic_upstream_lua_shm_pool(void);
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_dynamic_upstream_lua_state(ngx_str_t *name, ngx_uint_t flags);
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_dynamic_upstream_lua_state_find(ngx_str_t *name, ngx_uint_t flags);
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_dynamic_upstream_lua_state_detach(ngx_str_t *name, ngx_uint_t flags);
+
+void
+ngx_dynamic_upstream_lua_state_free(ngx_dynamic_upstream_lua_state_t *state);
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_http_dynamic_upstream_lua_srv_state(ngx_http_upstream_srv_conf_t *uscf);
+
+void
+ngx_dynamic_upstream_lua_zone_usage(ngx_shm_zone_t *zone,
+    ngx_dynamic_upstream_lua_zone_usage_t *usage);
+
+size_t
+ngx_dynamic_upstream_lua_peer_size(size_t peer_size, ngx_str_t *server);
+
+
+char *
+ngx_dynamic_upstream_lua_stage_interval(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_stage(ngx_str_t *upstream, ngx_uint_t flags,
+    ngx_dynamic_upstream_op_t *op);
+
+void
+ngx_dynamic_upstream_lua_stage_commit(ngx_log_t *log);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_stage_init_process(ngx_cycle_t *cycle);
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_tag_set(ngx_str_t *upstream, ngx_uint_t flags,
+    ngx_str_t *server, ngx_str_t *tags, ngx_uint_t n);
+
+void
+ngx_dynamic_upstream_lua_tag_remove(ngx_str_t *upstream, ngx_uint_t flags,
+    ngx_str_t *server);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_tag_select(ngx_pool_t *pool, ngx_str_t *tag,
+    ngx_uint_t flags, ngx_array_t *tagged);
+
+
+char *
+ngx_dynamic_upstream_lua_journal(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+void
+ngx_dynamic_upstream_lua_journal_op(ngx_str_t *upstream, ngx_uint_t flags,
+    ngx_dynamic_upstream_op_t *op);
+
+void
+ngx_dynamic_upstream_lua_journal_swap(ngx_str_t *upstream, ngx_uint_t flags);
+
+void
+ngx_dynamic_upstream_lua_journal_tags(ngx_str_t *upstream, ngx_uint_t flags,
+    ngx_str_t *server, ngx_str_t *tags, ngx_uint_t n);
+
+ngx_buf_t *
+ngx_dynamic_upstream_lua_journal_export(ngx_pool_t *pool, ngx_uint_t since,
+    const char **err);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_journal_import(ngx_log_t *log, ngx_pool_t *pool,
+    ngx_str_t *blob, ngx_uint_t *applied, const char **err);
+
+
+char *
+ngx_dynamic_upstream_lua_read_replicas(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+void
+ngx_dynamic_upstream_lua_replica_bump(ngx_str_t *upstream, ngx_uint_t flags);
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_dynamic_upstream_lua_replica_write(ngx_str_t *upstream, ngx_uint_t flags);
+
+void
+ngx_dynamic_upstream_lua_replica_written(
+    ngx_dynamic_upstream_lua_state_t *state);
+
+ngx_http_dynamic_upstream_lua_replica_t *
+ngx_http_dynamic_upstream_lua_replica(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_flag_t lookup);
+
+void
+ngx_http_dynamic_upstream_lua_replica_free(
+    ngx_http_dynamic_upstream_lua_replica_t *replica);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_replica_find(
+    ngx_http_dynamic_upstream_lua_replica_t *replica, ngx_str_t *server,
+    ngx_http_upstream_rr_peer_t **peer);
+
+ngx_stream_dynamic_upstream_lua_replica_t *
+ngx_stream_dynamic_upstream_lua_replica(ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_flag_t lookup);
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_replica_find(
+    ngx_stream_dynamic_upstream_lua_replica_t *replica, ngx_str_t *server,
+    ngx_stream_upstream_rr_peer_t **peer);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_hot_pick(ngx_dynamic_upstream_lua_hot_t *hot,
+    ngx_str_t *name, ngx_uint_t n, ngx_dynamic_upstream_lua_ring_t *ring,
+    ngx_uint_t policy, ngx_str_t *key, ngx_flag_t panic);
+
+uint32_t
+ngx_dynamic_upstream_lua_ring_base(ngx_str_t *name);
+
+uint32_t
+ngx_dynamic_upstream_lua_ring_point(uint32_t base, ngx_uint_t j);
+
+
+char *
+ngx_dynamic_upstream_lua_threshold(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+ngx_http_dynamic_upstream_lua_srv_conf_t *
+ngx_http_dynamic_upstream_lua_alive_conf(ngx_http_upstream_srv_conf_t *uscf);
+
+ngx_stream_dynamic_upstream_lua_srv_conf_t *
+ngx_stream_dynamic_upstream_lua_alive_conf(
+    ngx_stream_upstream_srv_conf_t *uscf);
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_http_dynamic_upstream_lua_alive(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_http_dynamic_upstream_lua_srv_conf_t *ucscf, ngx_flag_t fresh,
+    ngx_dynamic_upstream_lua_alive_t *a);
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_stream_dynamic_upstream_lua_alive(ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_stream_dynamic_upstream_lua_srv_conf_t *ucscf, ngx_flag_t fresh,
+    ngx_dynamic_upstream_lua_alive_t *a);
+
+void
+ngx_http_dynamic_upstream_lua_alive_count(ngx_http_upstream_srv_conf_t *uscf);
+
+void
+ngx_stream_dynamic_upstream_lua_alive_count(
+    ngx_stream_upstream_srv_conf_t *uscf);
+
+ngx_flag_t
+ngx_http_dynamic_upstream_lua_backup_first(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_str_t *key);
+
+ngx_flag_t
+ngx_stream_dynamic_upstream_lua_backup_first(
+    ngx_stream_upstream_srv_conf_t *uscf, ngx_str_t *key);
+
+void
+ngx_dynamic_upstream_lua_panic_update(ngx_dynamic_upstream_lua_state_t *state,
+    ngx_dynamic_upstream_lua_alive_t *a, ngx_uint_t threshold);
+
+ngx_flag_t
+ngx_http_dynamic_upstream_lua_panic(ngx_http_upstream_srv_conf_t *uscf);
+
+ngx_flag_t
+ngx_stream_dynamic_upstream_lua_panic(ngx_stream_upstream_srv_conf_t *uscf);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_panic_stat(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_panic_t *stat);
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_panic_stat(
+    ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_panic_t *stat);
+
+
+char *
+ngx_dynamic_upstream_lua_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_file_init_process(ngx_cycle_t *cycle);
+
+
+char *
+ngx_dynamic_upstream_lua_queue(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_queue_enter(ngx_dynamic_upstream_lua_queue_t *q,
+    ngx_dynamic_upstream_lua_waiter_t *w, ngx_log_t *log);
+
+void
+ngx_dynamic_upstream_lua_queue_cleanup(void *data);
+
+void
+ngx_dynamic_upstream_lua_queue_started(ngx_dynamic_upstream_lua_waiter_t *w);
+
+void
+ngx_http_dynamic_upstream_lua_queue_started(ngx_http_request_t *r);
+
+void
+ngx_http_dynamic_upstream_lua_queue_notify(ngx_http_upstream_srv_conf_t *uscf);
+
+void
+ngx_stream_dynamic_upstream_lua_queue_notify(
+    ngx_stream_upstream_srv_conf_t *uscf);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_queue_stat(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_queue_stat_t *stat);
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_queue_stat(
+    ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_queue_stat_t *stat);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_queue_init(ngx_conf_t *cf);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_queue_init_process(ngx_cycle_t *cycle);
+
+
+char *
+ngx_dynamic_upstream_lua_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_pool_create(ngx_log_t *log, ngx_str_t *name,
+    size_t size, ngx_str_t *balancer, const char **err);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_pool_delete(ngx_log_t *log, ngx_str_t *name,
+    const char **err);
+
+void
+ngx_http_dynamic_upstream_lua_pool_sync(void);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_pool_init(ngx_conf_t *cf);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_pool_init_process(ngx_cycle_t *cycle);
+
+char *
+ngx_http_dynamic_upstream_lua_disconnect(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_disconnect_init(ngx_conf_t *cf);
+
+void
+ngx_http_dynamic_upstream_lua_disconnect_check(ngx_log_t *log);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_disconnect_init_process(ngx_cycle_t *cycle);
+
+ngx_http_upstream_rr_peer_data_t *
+ngx_http_dynamic_upstream_lua_rr_peer_data(ngx_http_upstream_t *u);
+
+
+char *
+ngx_http_dynamic_upstream_lua_warmup(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+ngx_flag_t
+ngx_http_dynamic_upstream_lua_warmup_enabled(
+    ngx_http_upstream_srv_conf_t *uscf);
+
+void
+ngx_http_dynamic_upstream_lua_warmup_check(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *uscf);
+
+ngx_flag_t
+ngx_http_dynamic_upstream_lua_warmup_address(ngx_str_t *server);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_warmup_peer(ngx_log_t *log,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_str_t *server,
+    ngx_uint_t connections);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_warmup_get(ngx_peer_connection_t *pc,
+    ngx_http_upstream_srv_conf_t *uscf);
+
+void
+ngx_http_dynamic_upstream_lua_warmup_exit_process(ngx_cycle_t *cycle);
+
+
+char *
+ngx_http_dynamic_upstream_lua_outlier(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+void
+ngx_http_dynamic_upstream_lua_outlier_observe(ngx_log_t *log,
+    ngx_http_upstream_srv_conf_t *uscf, u_char *name, size_t len,
+    ngx_flag_t failed);
+
+void
+ngx_http_dynamic_upstream_lua_outlier_check(ngx_log_t *log);
+
+void
+ngx_http_dynamic_upstream_lua_outlier_update(
+    ngx_http_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_op_t *op);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_outlier_stat(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_str_t *name, ngx_flag_t *ejected, ngx_uint_t *ejections);
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_apply(ngx_log_t *log,
+    ngx_dynamic_upstream_op_t *op, ngx_http_upstream_srv_conf_t *uscf);
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_apply(ngx_log_t *log,
+    ngx_dynamic_upstream_op_t *op, ngx_stream_upstream_srv_conf_t *uscf);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_apply_batch(ngx_log_t *log, ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_op_t *ops,
+    ngx_int_t *rcs, ngx_uint_t n, ngx_flag_t upsert);
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_apply_batch(ngx_log_t *log, ngx_pool_t *pool,
+    ngx_stream_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_op_t *ops,
+    ngx_int_t *rcs, ngx_uint_t n, ngx_flag_t upsert);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_swap(ngx_log_t *log,
+    ngx_http_upstream_srv_conf_t *uscf);
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_swap(ngx_log_t *log,
+    ngx_stream_upstream_srv_conf_t *uscf);
+
+
+void
+ngx_dynamic_upstream_lua_names_init(ngx_dynamic_upstream_lua_names_t *names,
+    ngx_pool_t *pool);
+
+ngx_dynamic_upstream_lua_name_t *
+ngx_dynamic_upstream_lua_names_add(ngx_dynamic_upstream_lua_names_t *names,
+    ngx_str_t *name, ngx_flag_t copy);
+
+ngx_dynamic_upstream_lua_name_t *
+ngx_dynamic_upstream_lua_names_find(ngx_dynamic_upstream_lua_names_t *names,
+    ngx_str_t *name);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_names(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_names_t *names);
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_names(ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_names_t *names);
+
+ngx_http_upstream_srv_conf_t *
+ngx_http_dynamic_upstream_lua_upstream(ngx_str_t *name);
+
+ngx_stream_upstream_srv_conf_t *
+ngx_stream_dynamic_upstream_lua_upstream(ngx_str_t *name);
+
+
+char *
+ngx_http_dynamic_upstream_lua_chash(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+void
+ngx_http_dynamic_upstream_lua_chash_update(
+    ngx_http_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_op_t *op);
+
+void
+ngx_http_dynamic_upstream_lua_chash_reset(ngx_http_upstream_srv_conf_t *uscf);
+
+
+char *
+ngx_http_dynamic_upstream_lua_ewma(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+void
+ngx_http_dynamic_upstream_lua_ewma_update(
+    ngx_http_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_op_t *op);
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_ewma_stat(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_str_t *name, ngx_uint_t *ewma, ngx_uint_t *inflight);
+
+ngx_flag_t
+ngx_http_dynamic_upstream_lua_ewma_balancer(ngx_event_free_peer_pt free);
+
+
+ngx_buf_t *
+ngx_http_dynamic_upstream_lua_peers_buf(ngx_pool_t *pool,
+    ngx_http_upstream_rr_peers_t *primary, ngx_uint_t flags);
+
+ngx_buf_t *
+ngx_stream_dynamic_upstream_lua_peers_buf(ngx_pool_t *pool,
+    ngx_stream_upstream_rr_peers_t *primary, ngx_uint_t flags);
+
+
 #endif
\ No newline at end of file
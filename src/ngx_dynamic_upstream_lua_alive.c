@@ -0,0 +1,372 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+extern ngx_module_t ngx_stream_dynamic_upstream_lua_module;
+
+
+char *
+ngx_dynamic_upstream_lua_threshold(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_uint_t  *np;
+    ngx_str_t   *value;
+    ngx_int_t    n, rc;
+
+    np = (ngx_uint_t *) ((char *) conf + cmd->offset);
+
+    if (*np) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (value[1].len < 2 || value[1].data[value[1].len - 1] != '%') {
+        return "invalid value, percent expected";
+    }
+
+    n = ngx_atoi(value[1].data, value[1].len - 1);
+    if (n <= 0 || n > 100) {
+        return "invalid value, 1% .. 100% expected";
+    }
+
+    *np = n;
+
+    /* counters of alive peers are kept in the module zone */
+
+    rc = ngx_dynamic_upstream_lua_shm_add(cf);
+
+    if (rc == NGX_DECLINED) {
+        return "requires the http block before the stream block";
+    }
+
+    if (rc != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_alive_store(ngx_dynamic_upstream_lua_state_t *state,
+    ngx_dynamic_upstream_lua_alive_t *a, ngx_uint_t panic_threshold)
+{
+    ngx_dynamic_upstream_lua_shm_t  *sh;
+
+    sh = ngx_dynamic_upstream_lua_shm_pool()->data;
+
+    state->alive = a->alive;
+    state->backups = a->backups;
+    state->primaries = a->primaries;
+    state->counted = ngx_time();
+    state->counted_generation = sh->generation;
+
+    ngx_dynamic_upstream_lua_panic_update(state, a, panic_threshold);
+}
+
+
+static ngx_flag_t
+ngx_dynamic_upstream_lua_alive_load(ngx_dynamic_upstream_lua_state_t *state,
+    ngx_dynamic_upstream_lua_alive_t *a)
+{
+    ngx_dynamic_upstream_lua_shm_t  *sh;
+
+    if (state == NULL || state->primaries == 0) {
+        return 0;
+    }
+
+    sh = ngx_dynamic_upstream_lua_shm_pool()->data;
+
+    /*
+     * peers are configured again on reload, failed peers come back after
+     * fail_timeout and health checks mark peers bypassing the module,
+     * so counts live for one second, failures recount them at once
+     */
+
+    if (state->counted_generation != sh->generation
+        || (time_t) state->counted != ngx_time())
+    {
+        return 0;
+    }
+
+    a->primaries = state->primaries;
+    a->alive = state->alive;
+    a->backups = state->backups;
+
+    return 1;
+}
+
+
+static ngx_flag_t
+ngx_dynamic_upstream_lua_backup_join(ngx_uint_t threshold,
+    ngx_dynamic_upstream_lua_alive_t *a, ngx_str_t *key)
+{
+    uint32_t  hash;
+
+    if (a->backups == 0
+        || !ngx_dynamic_upstream_lua_backup_needed(threshold, a->alive,
+                                                   a->primaries))
+    {
+        return 0;
+    }
+
+    /* alive primary and backup peers share the load evenly */
+
+    if (key != NULL) {
+        hash = ngx_crc32_short(key->data, key->len);
+    } else {
+        hash = (uint32_t) ngx_random();
+    }
+
+    return hash % (a->alive + a->backups) >= a->alive;
+}
+
+
+static void
+ngx_http_dynamic_upstream_lua_alive_scan(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_alive_t *a)
+{
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *primary;
+    time_t                         now;
+
+    primary = uscf->peer.data;
+
+    now = ngx_time();
+
+    a->alive = 0;
+    a->backups = 0;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    a->primaries = primary->number;
+
+    for (peer = primary->peer; peer; peer = peer->next) {
+        a->alive += ngx_dynamic_upstream_lua_peer_alive(peer, now);
+    }
+
+    if (primary->next != NULL) {
+        for (peer = primary->next->peer; peer; peer = peer->next) {
+            a->backups += ngx_dynamic_upstream_lua_peer_alive(peer, now);
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+}
+
+
+/* counted by changes and failures, and once per second by selections */
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_http_dynamic_upstream_lua_alive(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_http_dynamic_upstream_lua_srv_conf_t *ucscf, ngx_flag_t fresh,
+    ngx_dynamic_upstream_lua_alive_t *a)
+{
+    ngx_dynamic_upstream_lua_state_t  *state;
+
+    state = ngx_http_dynamic_upstream_lua_srv_state(uscf);
+
+    if (fresh || !ngx_dynamic_upstream_lua_alive_load(state, a)) {
+        ngx_http_dynamic_upstream_lua_alive_scan(uscf, a);
+
+        if (state != NULL) {
+            ngx_dynamic_upstream_lua_alive_store(state, a,
+                                                 ucscf->panic_threshold);
+        }
+    }
+
+    return state;
+}
+
+
+ngx_http_dynamic_upstream_lua_srv_conf_t *
+ngx_http_dynamic_upstream_lua_alive_conf(ngx_http_upstream_srv_conf_t *uscf)
+{
+    if (uscf->srv_conf == NULL) {
+        return NULL;
+    }
+
+    return ngx_http_conf_upstream_srv_conf(uscf,
+               ngx_http_dynamic_upstream_lua_module);
+}
+
+
+void
+ngx_http_dynamic_upstream_lua_alive_count(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_dynamic_upstream_lua_state_t          *state;
+    ngx_dynamic_upstream_lua_alive_t           a;
+
+    ucscf = ngx_http_dynamic_upstream_lua_alive_conf(uscf);
+
+    if (ucscf == NULL
+        || (!ucscf->backup_threshold && !ucscf->panic_threshold))
+    {
+        return;
+    }
+
+    state = ngx_http_dynamic_upstream_lua_srv_state(uscf);
+    if (state == NULL) {
+        return;
+    }
+
+    ngx_http_dynamic_upstream_lua_alive_scan(uscf, &a);
+    ngx_dynamic_upstream_lua_alive_store(state, &a, ucscf->panic_threshold);
+}
+
+
+ngx_flag_t
+ngx_http_dynamic_upstream_lua_backup_first(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_str_t *key)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_dynamic_upstream_lua_alive_t           a;
+
+    ucscf = ngx_http_dynamic_upstream_lua_alive_conf(uscf);
+
+    if (ucscf == NULL || !ucscf->backup_threshold) {
+        return 0;
+    }
+
+    (void) ngx_http_dynamic_upstream_lua_alive(uscf, ucscf, 0, &a);
+
+    return ngx_dynamic_upstream_lua_backup_join(ucscf->backup_threshold, &a,
+                                                key);
+}
+
+
+static void
+ngx_stream_dynamic_upstream_lua_alive_scan(
+    ngx_stream_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_lua_alive_t *a)
+{
+    ngx_stream_upstream_rr_peer_t   *peer;
+    ngx_stream_upstream_rr_peers_t  *primary;
+    time_t                           now;
+
+    primary = uscf->peer.data;
+
+    now = ngx_time();
+
+    a->alive = 0;
+    a->backups = 0;
+
+    ngx_stream_upstream_rr_peers_rlock(primary);
+
+    a->primaries = primary->number;
+
+    for (peer = primary->peer; peer; peer = peer->next) {
+        a->alive += ngx_dynamic_upstream_lua_peer_alive(peer, now);
+    }
+
+    if (primary->next != NULL) {
+        for (peer = primary->next->peer; peer; peer = peer->next) {
+            a->backups += ngx_dynamic_upstream_lua_peer_alive(peer, now);
+        }
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(primary);
+}
+
+
+static ngx_dynamic_upstream_lua_state_t *
+ngx_stream_dynamic_upstream_lua_alive_state(
+    ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_stream_dynamic_upstream_lua_srv_conf_t *ucscf)
+{
+    if (ucscf->state == NULL) {
+        ucscf->state = ngx_dynamic_upstream_lua_state(&uscf->host,
+                           NGX_DYNAMIC_UPSTREAM_LUA_STREAM);
+    }
+
+    return ucscf->state;
+}
+
+
+/* without the module zone peers are counted on every selection */
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_stream_dynamic_upstream_lua_alive(ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_stream_dynamic_upstream_lua_srv_conf_t *ucscf, ngx_flag_t fresh,
+    ngx_dynamic_upstream_lua_alive_t *a)
+{
+    ngx_dynamic_upstream_lua_state_t  *state;
+
+    state = ngx_stream_dynamic_upstream_lua_alive_state(uscf, ucscf);
+
+    if (fresh || !ngx_dynamic_upstream_lua_alive_load(state, a)) {
+        ngx_stream_dynamic_upstream_lua_alive_scan(uscf, a);
+
+        if (state != NULL) {
+            ngx_dynamic_upstream_lua_alive_store(state, a,
+                                                 ucscf->panic_threshold);
+        }
+    }
+
+    return state;
+}
+
+
+ngx_stream_dynamic_upstream_lua_srv_conf_t *
+ngx_stream_dynamic_upstream_lua_alive_conf(
+    ngx_stream_upstream_srv_conf_t *uscf)
+{
+    if (uscf->srv_conf == NULL) {
+        return NULL;
+    }
+
+    return ngx_stream_conf_upstream_srv_conf(uscf,
+               ngx_stream_dynamic_upstream_lua_module);
+}
+
+
+void
+ngx_stream_dynamic_upstream_lua_alive_count(
+    ngx_stream_upstream_srv_conf_t *uscf)
+{
+    ngx_stream_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_dynamic_upstream_lua_state_t            *state;
+    ngx_dynamic_upstream_lua_alive_t             a;
+
+    ucscf = ngx_stream_dynamic_upstream_lua_alive_conf(uscf);
+
+    if (ucscf == NULL
+        || (!ucscf->backup_threshold && !ucscf->panic_threshold))
+    {
+        return;
+    }
+
+    state = ngx_stream_dynamic_upstream_lua_alive_state(uscf, ucscf);
+    if (state == NULL) {
+        return;
+    }
+
+    ngx_stream_dynamic_upstream_lua_alive_scan(uscf, &a);
+    ngx_dynamic_upstream_lua_alive_store(state, &a, ucscf->panic_threshold);
+}
+
+
+ngx_flag_t
+ngx_stream_dynamic_upstream_lua_backup_first(
+    ngx_stream_upstream_srv_conf_t *uscf, ngx_str_t *key)
+{
+    ngx_stream_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_dynamic_upstream_lua_alive_t             a;
+
+    ucscf = ngx_stream_dynamic_upstream_lua_alive_conf(uscf);
+
+    if (ucscf == NULL || !ucscf->backup_threshold) {
+        return 0;
+    }
+
+    (void) ngx_stream_dynamic_upstream_lua_alive(uscf, ucscf, 0, &a);
+
+    return ngx_dynamic_upstream_lua_backup_join(ucscf->backup_threshold, &a,
+                                                key);
+}
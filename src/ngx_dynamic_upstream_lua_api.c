@@ -0,0 +1,628 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+#include "ngx_dynamic_upstream_module.h"
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_PEER_LEN                                     \
+    (sizeof("{\"server\":\"\",\"name\":\"\",\"weight\":,\"max_conns\":,"     \
+            "\"conns\":,\"max_fails\":,\"fail_timeout\":,"                    \
+            "\"backup\":false,\"down\":false},\n") - 1                        \
+     + 5 * NGX_INT_T_LEN + NGX_TIME_T_LEN)
+
+
+#define ngx_dynamic_upstream_lua_peers_kind(peers, primary)                   \
+    ((peers) == (primary) ? NGX_DYNAMIC_UPSTREAM_LUA_PRIMARY                  \
+                          : NGX_DYNAMIC_UPSTREAM_LUA_BACKUP)
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_api_handler(ngx_http_request_t *r);
+
+
+char *
+ngx_dynamic_upstream_lua_api(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_dynamic_upstream_lua_api_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static size_t
+ngx_dynamic_upstream_lua_peer_len(ngx_str_t *server, ngx_str_t *name,
+    ngx_uint_t flags)
+{
+    size_t  len;
+
+    len = NGX_DYNAMIC_UPSTREAM_LUA_PEER_LEN + server->len + name->len;
+
+    if (flags & NGX_DYNAMIC_UPSTREAM_LUA_JSON) {
+        len += ngx_escape_json(NULL, server->data, server->len);
+        len += ngx_escape_json(NULL, name->data, name->len);
+    }
+
+    return len;
+}
+
+
+static u_char *
+ngx_dynamic_upstream_lua_peer_write(u_char *p, ngx_str_t *server,
+    ngx_str_t *name, ngx_int_t weight, ngx_uint_t max_conns, ngx_uint_t conns,
+    ngx_uint_t max_fails, time_t fail_timeout, ngx_flag_t backup,
+    ngx_flag_t down, ngx_uint_t flags)
+{
+    if (!(flags & NGX_DYNAMIC_UPSTREAM_LUA_JSON)) {
+        return ngx_sprintf(p, "server %V backup=%i weight=%i max_conns=%ui "
+                              "conns=%ui max_fails=%ui fail_timeout=%T "
+                              "status=%s\n",
+                           name, backup, weight, max_conns, conns, max_fails,
+                           fail_timeout, down ? "down" : "up");
+    }
+
+    p = ngx_cpymem(p, "{\"server\":\"", sizeof("{\"server\":\"") - 1);
+    p = (u_char *) ngx_escape_json(p, server->data, server->len);
+    p = ngx_cpymem(p, "\",\"name\":\"", sizeof("\",\"name\":\"") - 1);
+    p = (u_char *) ngx_escape_json(p, name->data, name->len);
+
+    return ngx_sprintf(p, "\",\"weight\":%i,\"max_conns\":%ui,\"conns\":%ui,"
+                          "\"max_fails\":%ui,\"fail_timeout\":%T,"
+                          "\"backup\":%s,\"down\":%s}",
+                       weight, max_conns, conns, max_fails, fail_timeout,
+                       backup ? "true" : "false", down ? "true" : "false");
+}
+
+
+ngx_buf_t *
+ngx_http_dynamic_upstream_lua_peers_buf(ngx_pool_t *pool,
+    ngx_http_upstream_rr_peers_t *primary, ngx_uint_t flags)
+{
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+    ngx_buf_t                     *b;
+    size_t                         size = sizeof("[]\n");
+    ngx_flag_t                     first = 1;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    for (peers = primary; peers; peers = peers->next) {
+        if (!(flags & ngx_dynamic_upstream_lua_peers_kind(peers, primary))) {
+            continue;
+        }
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+            size += ngx_dynamic_upstream_lua_peer_len(&peer->server,
+                                                      &peer->name, flags);
+        }
+    }
+
+    b = ngx_create_temp_buf(pool, size);
+    if (b == NULL) {
+        ngx_http_upstream_rr_peers_unlock(primary);
+        return NULL;
+    }
+
+    if (flags & NGX_DYNAMIC_UPSTREAM_LUA_JSON) {
+        *b->last++ = '[';
+    }
+
+    for (peers = primary; peers; peers = peers->next) {
+        if (!(flags & ngx_dynamic_upstream_lua_peers_kind(peers, primary))) {
+            continue;
+        }
+
+        for (peer = peers->peer; peer; peer = peer->next, first = 0) {
+
+            if (!first && (flags & NGX_DYNAMIC_UPSTREAM_LUA_JSON)) {
+                *b->last++ = ',';
+            }
+
+            b->last = ngx_dynamic_upstream_lua_peer_write(b->last,
+                &peer->server, &peer->name, peer->weight, peer->max_conns,
+                peer->conns, peer->max_fails, peer->fail_timeout,
+                peers != primary, peer->down, flags);
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    if (flags & NGX_DYNAMIC_UPSTREAM_LUA_JSON) {
+        *b->last++ = ']';
+        *b->last++ = LF;
+    }
+
+    return b;
+}
+
+
+ngx_buf_t *
+ngx_stream_dynamic_upstream_lua_peers_buf(ngx_pool_t *pool,
+    ngx_stream_upstream_rr_peers_t *primary, ngx_uint_t flags)
+{
+    ngx_stream_upstream_rr_peer_t   *peer;
+    ngx_stream_upstream_rr_peers_t  *peers;
+    ngx_buf_t                       *b;
+    size_t                           size = sizeof("[]\n");
+    ngx_flag_t                       first = 1;
+
+    ngx_stream_upstream_rr_peers_rlock(primary);
+
+    for (peers = primary; peers; peers = peers->next) {
+        if (!(flags & ngx_dynamic_upstream_lua_peers_kind(peers, primary))) {
+            continue;
+        }
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+            size += ngx_dynamic_upstream_lua_peer_len(&peer->server,
+                                                      &peer->name, flags);
+        }
+    }
+
+    b = ngx_create_temp_buf(pool, size);
+    if (b == NULL) {
+        ngx_stream_upstream_rr_peers_unlock(primary);
+        return NULL;
+    }
+
+    if (flags & NGX_DYNAMIC_UPSTREAM_LUA_JSON) {
+        *b->last++ = '[';
+    }
+
+    for (peers = primary; peers; peers = peers->next) {
+        if (!(flags & ngx_dynamic_upstream_lua_peers_kind(peers, primary))) {
+            continue;
+        }
+
+        for (peer = peers->peer; peer; peer = peer->next, first = 0) {
+
+            if (!first && (flags & NGX_DYNAMIC_UPSTREAM_LUA_JSON)) {
+                *b->last++ = ',';
+            }
+
+            b->last = ngx_dynamic_upstream_lua_peer_write(b->last,
+                &peer->server, &peer->name, peer->weight, peer->max_conns,
+                peer->conns, peer->max_fails, peer->fail_timeout,
+                peers != primary, peer->down, flags);
+        }
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(primary);
+
+    if (flags & NGX_DYNAMIC_UPSTREAM_LUA_JSON) {
+        *b->last++ = ']';
+        *b->last++ = LF;
+    }
+
+    return b;
+}
+
+
+static ngx_buf_t *
+ngx_dynamic_upstream_lua_api_upstreams(ngx_http_request_t *r,
+    ngx_uint_t flags)
+{
+    ngx_uint_t                        i, j, n;
+    ngx_str_t                        *names;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf = NULL;
+    ngx_stream_upstream_srv_conf_t  **suscfp;
+    ngx_stream_upstream_main_conf_t  *sumcf = NULL;
+    ngx_buf_t                        *b;
+    size_t                            size = sizeof("[]\n");
+
+    if (flags & NGX_DYNAMIC_UPSTREAM_LUA_STREAM) {
+        sumcf = ngx_stream_cycle_get_module_main_conf(ngx_cycle,
+                    ngx_stream_upstream_module);
+        n = sumcf != NULL ? sumcf->upstreams.nelts : 0;
+    } else {
+        umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+        n = umcf->upstreams.nelts;
+    }
+
+    names = ngx_palloc(r->pool, (n + 1) * sizeof(ngx_str_t));
+    if (names == NULL) {
+        return NULL;
+    }
+
+    for (i = 0, j = 0; i < n; i++) {
+        if (flags & NGX_DYNAMIC_UPSTREAM_LUA_STREAM) {
+            suscfp = sumcf->upstreams.elts;
+            if (suscfp[i]->srv_conf == NULL) {
+                continue;
+            }
+            names[j] = suscfp[i]->host;
+        } else {
+            uscfp = umcf->upstreams.elts;
+            if (uscfp[i]->srv_conf == NULL) {
+                continue;
+            }
+            names[j] = uscfp[i]->host;
+        }
+
+        size += names[j].len + sizeof("\"\",") - 1;
+
+        if (flags & NGX_DYNAMIC_UPSTREAM_LUA_JSON) {
+            size += ngx_escape_json(NULL, names[j].data, names[j].len);
+        }
+
+        j++;
+    }
+
+    n = j;
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    if (!(flags & NGX_DYNAMIC_UPSTREAM_LUA_JSON)) {
+        for (i = 0; i < n; i++) {
+            b->last = ngx_sprintf(b->last, "%V\n", &names[i]);
+        }
+        return b;
+    }
+
+    *b->last++ = '[';
+
+    for (i = 0; i < n; i++) {
+        if (i != 0) {
+            *b->last++ = ',';
+        }
+        *b->last++ = '"';
+        b->last = (u_char *) ngx_escape_json(b->last, names[i].data,
+                                             names[i].len);
+        *b->last++ = '"';
+    }
+
+    *b->last++ = ']';
+    *b->last++ = LF;
+
+    return b;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_api_arg(ngx_http_request_t *r, const char *name,
+    ngx_str_t *value)
+{
+    ngx_str_t   arg;
+    u_char     *dst, *src;
+
+    if (ngx_http_arg(r, (u_char *) name, ngx_strlen(name), &arg) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    value->data = ngx_pnalloc(r->pool, arg.len);
+    if (value->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    dst = value->data;
+    src = arg.data;
+
+    ngx_unescape_uri(&dst, &src, arg.len, NGX_UNESCAPE_URI);
+
+    value->len = dst - value->data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_api_int_arg(ngx_http_request_t *r,
+    ngx_dynamic_upstream_op_t *op, const char *name, ngx_int_t *n,
+    ngx_int_t param)
+{
+    ngx_str_t  value;
+    ngx_int_t  rc;
+
+    rc = ngx_dynamic_upstream_lua_api_arg(r, name, &value);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    *n = ngx_atoi(value.data, value.len);
+    if (*n == NGX_ERROR) {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        op->err = "invalid numeric argument";
+        return NGX_ERROR;
+    }
+
+    op->op_param |= param;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_api_parse(ngx_http_request_t *r,
+    ngx_dynamic_upstream_op_t *op, ngx_uint_t *flags)
+{
+    ngx_str_t  value;
+    ngx_int_t  n, rc;
+
+    ngx_memzero(op, sizeof(ngx_dynamic_upstream_op_t));
+
+    op->op           = NGX_DYNAMIC_UPSTEAM_OP_LIST;
+    op->status       = NGX_HTTP_OK;
+    op->weight       = 1;
+    op->max_fails    = 1;
+    op->fail_timeout = 10;
+    op->op_param     = NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE;
+
+    if (ngx_dynamic_upstream_lua_api_arg(r, "format", &value) == NGX_OK
+        && value.len == 4 && ngx_strncmp(value.data, "json", 4) == 0) {
+        *flags |= NGX_DYNAMIC_UPSTREAM_LUA_JSON;
+    }
+
+    if (ngx_dynamic_upstream_lua_api_arg(r, "stream", &value) == NGX_OK
+        && value.len == 1 && value.data[0] == '1') {
+        *flags |= NGX_DYNAMIC_UPSTREAM_LUA_STREAM;
+        op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM;
+    }
+
+    if (ngx_dynamic_upstream_lua_api_arg(r, "upstream", &op->upstream)
+            == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_dynamic_upstream_lua_api_arg(r, "peer", &op->server)
+            == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_dynamic_upstream_lua_api_arg(r, "backup", &value) == NGX_OK
+        && value.len == 1 && value.data[0] == '1') {
+        op->backup = 1;
+    }
+
+    if (ngx_dynamic_upstream_lua_api_int_arg(r, op, "weight", &op->weight,
+            NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT) == NGX_ERROR
+        || ngx_dynamic_upstream_lua_api_int_arg(r, op, "max_fails",
+            &op->max_fails, NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS)
+               == NGX_ERROR
+        || ngx_dynamic_upstream_lua_api_int_arg(r, op, "max_conns",
+            &op->max_conns, NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS)
+               == NGX_ERROR
+        || ngx_dynamic_upstream_lua_api_int_arg(r, op, "fail_timeout",
+            &op->fail_timeout, NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT)
+               == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_dynamic_upstream_lua_api_int_arg(r, op, "down", &n, 0);
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_OK) {
+        if (n) {
+            op->down = 1;
+            op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+        } else {
+            op->up = 1;
+            op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+        }
+    }
+
+    if (ngx_dynamic_upstream_lua_api_arg(r, "op", &value) != NGX_OK
+        || (value.len == 4 && ngx_strncmp(value.data, "list", 4) == 0)) {
+        return NGX_OK;
+    }
+
+    if (value.len == 3 && ngx_strncmp(value.data, "add", 3) == 0) {
+        op->op = NGX_DYNAMIC_UPSTEAM_OP_ADD;
+    } else if (value.len == 6 && ngx_strncmp(value.data, "remove", 6) == 0) {
+        op->op = NGX_DYNAMIC_UPSTEAM_OP_REMOVE;
+    } else if (value.len == 6 && ngx_strncmp(value.data, "update", 6) == 0) {
+        op->op = NGX_DYNAMIC_UPSTEAM_OP_PARAM;
+    } else if (value.len == 2 && ngx_strncmp(value.data, "up", 2) == 0) {
+        op->op = NGX_DYNAMIC_UPSTEAM_OP_PARAM;
+        op->up = 1;
+        op->down = 0;
+        op->op_param &= ~NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+        op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+    } else if (value.len == 4 && ngx_strncmp(value.data, "down", 4) == 0) {
+        op->op = NGX_DYNAMIC_UPSTEAM_OP_PARAM;
+        op->down = 1;
+        op->up = 0;
+        op->op_param &= ~NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+        op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+    } else {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        op->err = "unknown operation";
+        return NGX_ERROR;
+    }
+
+    if (op->upstream.len == 0 || op->server.len == 0) {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        op->err = "upstream and peer arguments required";
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_api_send(ngx_http_request_t *r, ngx_buf_t *b,
+    ngx_uint_t status, ngx_uint_t flags)
+{
+    ngx_int_t    rc;
+    ngx_chain_t  out;
+
+    r->headers_out.status = status;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    if (flags & NGX_DYNAMIC_UPSTREAM_LUA_JSON) {
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+    } else {
+        ngx_str_set(&r->headers_out.content_type, "text/plain");
+    }
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_api_error(ngx_http_request_t *r,
+    ngx_dynamic_upstream_op_t *op, ngx_uint_t flags)
+{
+    ngx_buf_t   *b;
+    ngx_str_t    err;
+    ngx_uint_t   status;
+
+    err.data = (u_char *) (op->err != NULL ? op->err : "failed");
+    err.len = ngx_strlen(err.data);
+
+    status = op->status != NGX_HTTP_OK ? (ngx_uint_t) op->status
+                                       : NGX_HTTP_BAD_REQUEST;
+
+    b = ngx_create_temp_buf(r->pool, sizeof("{\"error\":\"\"}\n")
+                            + err.len + ngx_escape_json(NULL, err.data,
+                                                        err.len));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (flags & NGX_DYNAMIC_UPSTREAM_LUA_JSON) {
+        b->last = ngx_cpymem(b->last, "{\"error\":\"",
+                             sizeof("{\"error\":\"") - 1);
+        b->last = (u_char *) ngx_escape_json(b->last, err.data, err.len);
+        b->last = ngx_cpymem(b->last, "\"}\n", 3);
+    } else {
+        b->last = ngx_sprintf(b->last, "%V\n", &err);
+    }
+
+    return ngx_dynamic_upstream_lua_api_send(r, b, status, flags);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_api_handler(ngx_http_request_t *r)
+{
+    ngx_dynamic_upstream_op_t         op;
+    ngx_uint_t                        flags;
+    ngx_int_t                         rc;
+    ngx_buf_t                        *b;
+    ngx_uint_t                        i, n;
+    ngx_http_upstream_srv_conf_t    **uscfp, *uscf = NULL;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_stream_upstream_srv_conf_t  **suscfp, *suscf = NULL;
+    ngx_stream_upstream_main_conf_t  *sumcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    flags = NGX_DYNAMIC_UPSTREAM_LUA_PRIMARY|NGX_DYNAMIC_UPSTREAM_LUA_BACKUP;
+
+    if (ngx_dynamic_upstream_lua_api_parse(r, &op, &flags) != NGX_OK) {
+        if (op.err == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        return ngx_dynamic_upstream_lua_api_error(r, &op, flags);
+    }
+
+    if (op.upstream.len == 0) {
+        b = ngx_dynamic_upstream_lua_api_upstreams(r, flags);
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        return ngx_dynamic_upstream_lua_api_send(r, b, NGX_HTTP_OK, flags);
+    }
+
+    if (flags & NGX_DYNAMIC_UPSTREAM_LUA_STREAM) {
+
+        sumcf = ngx_stream_cycle_get_module_main_conf(ngx_cycle,
+                    ngx_stream_upstream_module);
+        n = sumcf != NULL ? sumcf->upstreams.nelts : 0;
+        suscfp = n != 0 ? sumcf->upstreams.elts : NULL;
+
+        for (i = 0; i < n; i++) {
+            if (suscfp[i]->srv_conf != NULL
+                && suscfp[i]->host.len == op.upstream.len
+                && ngx_strncmp(suscfp[i]->host.data, op.upstream.data,
+                               op.upstream.len) == 0) {
+                suscf = suscfp[i];
+                break;
+            }
+        }
+
+    } else {
+
+        umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+        uscfp = umcf->upstreams.elts;
+
+        for (i = 0; i < umcf->upstreams.nelts; i++) {
+            if (uscfp[i]->srv_conf != NULL
+                && uscfp[i]->host.len == op.upstream.len
+                && ngx_strncmp(uscfp[i]->host.data, op.upstream.data,
+                               op.upstream.len) == 0) {
+                uscf = uscfp[i];
+                break;
+            }
+        }
+    }
+
+    if ((uscf == NULL || uscf->shm_zone == NULL)
+        && (suscf == NULL || suscf->shm_zone == NULL)) {
+        op.status = NGX_HTTP_NOT_FOUND;
+        op.err = "upstream not found";
+        return ngx_dynamic_upstream_lua_api_error(r, &op, flags);
+    }
+
+    if (op.op != NGX_DYNAMIC_UPSTEAM_OP_LIST) {
+
+        if (suscf != NULL) {
+            rc = ngx_stream_dynamic_upstream_lua_apply(r->connection->log,
+                                                       &op, suscf);
+        } else {
+            rc = ngx_http_dynamic_upstream_lua_apply(r->connection->log,
+                                                     &op, uscf);
+        }
+
+        if (rc != NGX_OK && rc != NGX_AGAIN) {
+            return ngx_dynamic_upstream_lua_api_error(r, &op, flags);
+        }
+    }
+
+    if (suscf != NULL) {
+        b = ngx_stream_dynamic_upstream_lua_peers_buf(r->pool,
+                                                      suscf->peer.data, flags);
+    } else {
+        b = ngx_http_dynamic_upstream_lua_peers_buf(r->pool, uscf->peer.data,
+                                                    flags);
+    }
+
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return ngx_dynamic_upstream_lua_api_send(r, b, NGX_HTTP_OK, flags);
+}
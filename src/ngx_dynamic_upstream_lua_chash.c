@@ -0,0 +1,888 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_CHASH_POINTS  160
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t   rrp;
+    ngx_dynamic_upstream_lua_chash_t  *chash;
+    ngx_uint_t                         number;
+    ngx_uint_t                         hash;
+    uint32_t                           key;
+    ngx_flag_t                         found;
+    ngx_uint_t                         tries;
+    ngx_event_get_peer_pt              get_rr_peer;
+} ngx_http_dynamic_upstream_chash_peer_data_t;
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_chash_init(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t
+ngx_http_dynamic_upstream_chash_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t
+ngx_http_dynamic_upstream_chash_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+
+
+char *
+ngx_http_dynamic_upstream_lua_chash(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf = conf;
+
+    ngx_str_t                         *value;
+    ngx_http_upstream_srv_conf_t      *uscf;
+    ngx_http_compile_complex_value_t   ccv;
+
+    value = cf->args->elts;
+
+    ucscf->chash_key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (ucscf->chash_key == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = ucscf->chash_key;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN;
+
+    uscf->peer.init_upstream = ngx_http_dynamic_upstream_chash_init;
+
+    if (ngx_dynamic_upstream_lua_shm_add(cf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_chash_init(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_dynamic_upstream_chash_init_peer;
+
+    return NGX_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_dynamic_upstream_lua_chash_cmp_points(const void *one, const void *two)
+{
+    ngx_dynamic_upstream_lua_chash_point_t *first =
+        (ngx_dynamic_upstream_lua_chash_point_t *) one;
+    ngx_dynamic_upstream_lua_chash_point_t *second =
+        (ngx_dynamic_upstream_lua_chash_point_t *) two;
+
+    if (first->hash < second->hash) {
+        return -1;
+    }
+
+    return first->hash > second->hash;
+}
+
+
+static ngx_dynamic_upstream_lua_chash_point_t *
+ngx_dynamic_upstream_lua_chash_server_points(
+    ngx_dynamic_upstream_lua_chash_server_t *server,
+    ngx_dynamic_upstream_lua_chash_point_t *point)
+{
+    u_char      *host, *port, c;
+    size_t       host_len, port_len, size;
+    uint32_t     hash, base_hash;
+    ngx_uint_t   j, npoints;
+
+    union {
+        uint32_t  value;
+        u_char    byte[4];
+    } prev_hash;
+
+    /* the same points as ngx_http_upstream_hash_module produces */
+
+    size = server->server.len;
+
+    if (size >= 5
+        && ngx_strncasecmp(server->server.data, (u_char *) "unix:", 5) == 0) {
+        host = server->server.data + 5;
+        host_len = size - 5;
+        port = NULL;
+        port_len = 0;
+        goto done;
+    }
+
+    for (j = 0; j < size; j++) {
+        c = server->server.data[size - j - 1];
+
+        if (c == ':') {
+            host = server->server.data;
+            host_len = size - j - 1;
+            port = server->server.data + size - j;
+            port_len = j;
+            goto done;
+        }
+
+        if (c < '0' || c > '9') {
+            break;
+        }
+    }
+
+    host = server->server.data;
+    host_len = size;
+    port = NULL;
+    port_len = 0;
+
+done:
+
+    ngx_crc32_init(base_hash);
+    ngx_crc32_update(&base_hash, host, host_len);
+    ngx_crc32_update(&base_hash, (u_char *) "", 1);
+    ngx_crc32_update(&base_hash, port, port_len);
+
+    prev_hash.value = 0;
+    npoints = server->weight * NGX_DYNAMIC_UPSTREAM_LUA_CHASH_POINTS;
+
+    for (j = 0; j < npoints; j++) {
+        hash = base_hash;
+
+        ngx_crc32_update(&hash, prev_hash.byte, 4);
+        ngx_crc32_final(hash);
+
+        point->hash = hash;
+        point->server = server;
+        point++;
+
+#if (NGX_HAVE_LITTLE_ENDIAN)
+        prev_hash.value = hash;
+#else
+        prev_hash.byte[0] = (u_char) (hash & 0xff);
+        prev_hash.byte[1] = (u_char) ((hash >> 8) & 0xff);
+        prev_hash.byte[2] = (u_char) ((hash >> 16) & 0xff);
+        prev_hash.byte[3] = (u_char) ((hash >> 24) & 0xff);
+#endif
+    }
+
+    return point;
+}
+
+
+static ngx_dynamic_upstream_lua_chash_server_t *
+ngx_dynamic_upstream_lua_chash_server(ngx_dynamic_upstream_lua_chash_t *chash,
+    ngx_str_t *name)
+{
+    ngx_dynamic_upstream_lua_chash_server_t  *server;
+
+    for (server = chash->servers; server; server = server->next) {
+        if (server->server.len == name->len
+            && ngx_strncmp(server->server.data, name->data, name->len) == 0) {
+            return server;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_dynamic_upstream_lua_chash_server_t *
+ngx_dynamic_upstream_lua_chash_server_alloc(ngx_slab_pool_t *shpool,
+    ngx_dynamic_upstream_lua_chash_t *chash, ngx_str_t *name,
+    ngx_uint_t weight)
+{
+    ngx_dynamic_upstream_lua_chash_server_t  *server;
+
+    server = ngx_slab_alloc_locked(shpool,
+        sizeof(ngx_dynamic_upstream_lua_chash_server_t) + name->len);
+    if (server == NULL) {
+        return NULL;
+    }
+
+    server->server.data = (u_char *) (server + 1);
+    server->server.len = name->len;
+    ngx_memcpy(server->server.data, name->data, name->len);
+
+    server->weight = weight != 0 ? weight : 1;
+
+    server->next = chash->servers;
+    chash->servers = server;
+
+    return server;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_chash_free_locked(ngx_slab_pool_t *shpool,
+    ngx_dynamic_upstream_lua_chash_t *chash)
+{
+    ngx_dynamic_upstream_lua_chash_server_t  *server, *next;
+
+    for (server = chash->servers; server; server = next) {
+        next = server->next;
+        ngx_slab_free_locked(shpool, server);
+    }
+
+    if (chash->points != NULL) {
+        ngx_slab_free_locked(shpool, chash->points);
+    }
+
+    chash->servers = NULL;
+    chash->points = NULL;
+    chash->number = 0;
+    chash->nalloc = 0;
+    chash->built = 0;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_chash_build_locked(ngx_slab_pool_t *shpool,
+    ngx_dynamic_upstream_lua_chash_t *chash,
+    ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_http_upstream_rr_peer_t              *peer;
+    ngx_dynamic_upstream_lua_chash_server_t  *server;
+    ngx_dynamic_upstream_lua_chash_point_t   *point;
+    ngx_uint_t                                number = 0;
+
+    ngx_dynamic_upstream_lua_chash_free_locked(shpool, chash);
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (ngx_dynamic_upstream_lua_chash_server(chash, &peer->server)) {
+            continue;
+        }
+
+        server = ngx_dynamic_upstream_lua_chash_server_alloc(shpool, chash,
+            &peer->server, peer->weight);
+        if (server == NULL) {
+            goto nomem;
+        }
+
+        number += server->weight * NGX_DYNAMIC_UPSTREAM_LUA_CHASH_POINTS;
+    }
+
+    if (number == 0) {
+        chash->built = 1;
+        return NGX_OK;
+    }
+
+    chash->points = ngx_slab_alloc_locked(shpool,
+        number * sizeof(ngx_dynamic_upstream_lua_chash_point_t));
+    if (chash->points == NULL) {
+        goto nomem;
+    }
+
+    point = chash->points;
+
+    for (server = chash->servers; server; server = server->next) {
+        point = ngx_dynamic_upstream_lua_chash_server_points(server, point);
+    }
+
+    chash->number = number;
+    chash->nalloc = number;
+
+    ngx_qsort(chash->points, number,
+              sizeof(ngx_dynamic_upstream_lua_chash_point_t),
+              ngx_dynamic_upstream_lua_chash_cmp_points);
+
+    chash->built = 1;
+
+    return NGX_OK;
+
+nomem:
+
+    ngx_dynamic_upstream_lua_chash_free_locked(shpool, chash);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_chash_add_locked(ngx_slab_pool_t *shpool,
+    ngx_dynamic_upstream_lua_chash_t *chash, ngx_str_t *name,
+    ngx_uint_t weight)
+{
+    ngx_dynamic_upstream_lua_chash_server_t  *server;
+    ngx_dynamic_upstream_lua_chash_point_t   *points, *added, *p, *q, *d;
+    ngx_uint_t                                n, nalloc;
+
+    if (ngx_dynamic_upstream_lua_chash_server(chash, name)) {
+        return NGX_OK;
+    }
+
+    server = ngx_dynamic_upstream_lua_chash_server_alloc(shpool, chash, name,
+                                                         weight);
+    if (server == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = server->weight * NGX_DYNAMIC_UPSTREAM_LUA_CHASH_POINTS;
+
+    added = ngx_alloc(n * sizeof(ngx_dynamic_upstream_lua_chash_point_t),
+                      ngx_cycle->log);
+    if (added == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_dynamic_upstream_lua_chash_server_points(server, added);
+
+    ngx_qsort(added, n, sizeof(ngx_dynamic_upstream_lua_chash_point_t),
+              ngx_dynamic_upstream_lua_chash_cmp_points);
+
+    if (chash->number + n > chash->nalloc) {
+
+        /* grow geometrically to avoid reallocation on each add */
+
+        nalloc = ngx_max(chash->nalloc * 2, chash->number + n);
+
+        points = ngx_slab_alloc_locked(shpool,
+            nalloc * sizeof(ngx_dynamic_upstream_lua_chash_point_t));
+        if (points == NULL) {
+            ngx_free(added);
+            return NGX_ERROR;
+        }
+
+        if (chash->points != NULL) {
+            ngx_memcpy(points, chash->points, chash->number
+                       * sizeof(ngx_dynamic_upstream_lua_chash_point_t));
+            ngx_slab_free_locked(shpool, chash->points);
+        }
+
+        chash->points = points;
+        chash->nalloc = nalloc;
+    }
+
+    /* merge new points from the tail, nothing else is rehashed */
+
+    p = chash->points + chash->number;
+    q = added + n;
+    d = p + n;
+
+    while (q > added) {
+
+        if (p > chash->points && (p - 1)->hash > (q - 1)->hash) {
+            *--d = *--p;
+        } else {
+            *--d = *--q;
+        }
+    }
+
+    ngx_free(added);
+
+    chash->number += n;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_chash_remove_locked(ngx_slab_pool_t *shpool,
+    ngx_dynamic_upstream_lua_chash_t *chash, ngx_str_t *name)
+{
+    ngx_dynamic_upstream_lua_chash_server_t  *server, **prev;
+    ngx_uint_t                                i, n;
+
+    server = ngx_dynamic_upstream_lua_chash_server(chash, name);
+    if (server == NULL) {
+        return NGX_DECLINED;
+    }
+
+    for (i = 0, n = 0; i < chash->number; i++) {
+        if (chash->points[i].server != server) {
+            chash->points[n++] = chash->points[i];
+        }
+    }
+
+    chash->number = n;
+
+    for (prev = &chash->servers; *prev != server; prev = &(*prev)->next) {
+        /* void */
+    }
+
+    *prev = server->next;
+
+    ngx_slab_free_locked(shpool, server);
+
+    return NGX_OK;
+}
+
+
+static ngx_dynamic_upstream_lua_chash_t *
+ngx_http_dynamic_upstream_chash_get(ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_dynamic_upstream_lua_state_t  *state;
+
+    state = ngx_http_dynamic_upstream_lua_srv_state(us);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    return &state->chash;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_chash_ready(ngx_dynamic_upstream_lua_chash_t *chash,
+    ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_slab_pool_t                 *shpool;
+    ngx_dynamic_upstream_lua_shm_t  *sh;
+    ngx_int_t                        rc = NGX_OK;
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+    sh = shpool->data;
+
+    if (chash->built && chash->generation == sh->generation) {
+        return NGX_OK;
+    }
+
+    ngx_rwlock_wlock(&chash->lock);
+
+    if (!chash->built || chash->generation != sh->generation) {
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        rc = ngx_dynamic_upstream_lua_chash_build_locked(shpool, chash, peers);
+        chash->generation = sh->generation;
+
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        if (rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "dynamic consistent hash: no memory for points, "
+                          "increase dynamic_upstream_shm_size");
+        }
+    }
+
+    ngx_rwlock_unlock(&chash->lock);
+
+    return rc;
+}
+
+
+/*
+ * the server is not on the ring: a backup peer leaves the ring as is,
+ * a primary peer addressed by its name changes the ring
+ */
+
+static ngx_flag_t
+ngx_http_dynamic_upstream_chash_stale(ngx_dynamic_upstream_lua_chash_t *chash,
+    ngx_http_upstream_rr_peers_t *primary, ngx_dynamic_upstream_op_t *op)
+{
+    ngx_http_upstream_rr_peer_t              *peer;
+    ngx_dynamic_upstream_lua_chash_server_t  *server;
+
+    if (op->op != NGX_DYNAMIC_UPSTEAM_OP_REMOVE) {
+
+        for (peer = primary->peer; peer; peer = peer->next) {
+            if (peer->name.len == op->server.len
+                && ngx_strncmp(peer->name.data, op->server.data,
+                               op->server.len) == 0)
+            {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    /* the removed peer may be the last one of its server */
+
+    for (server = chash->servers; server; server = server->next) {
+
+        for (peer = primary->peer; peer; peer = peer->next) {
+            if (peer->server.len == server->server.len
+                && ngx_strncmp(peer->server.data, server->server.data,
+                               server->server.len) == 0)
+            {
+                break;
+            }
+        }
+
+        if (peer == NULL) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+void
+ngx_http_dynamic_upstream_lua_chash_update(
+    ngx_http_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_op_t *op)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_dynamic_upstream_lua_chash_t          *chash;
+    ngx_http_upstream_rr_peers_t              *primary;
+    ngx_slab_pool_t                           *shpool;
+    ngx_int_t                                  rc = NGX_OK;
+
+    if (uscf->srv_conf == NULL) {
+        return;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(uscf,
+                ngx_http_dynamic_upstream_lua_module);
+    if (ucscf->chash_key == NULL) {
+        return;
+    }
+
+    chash = ngx_http_dynamic_upstream_chash_get(uscf);
+    if (chash == NULL) {
+        return;
+    }
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+
+    primary = uscf->peer.data;
+
+    /* the peers lock is taken before the ring lock as in the balancer */
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+    ngx_rwlock_wlock(&chash->lock);
+
+    if (!chash->built) {
+        /* will be built on the next balancing with this change */
+        goto done;
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    switch (op->op) {
+
+        case NGX_DYNAMIC_UPSTEAM_OP_ADD:
+            if (!op->backup) {
+                rc = ngx_dynamic_upstream_lua_chash_add_locked(shpool, chash,
+                    &op->server, op->weight);
+            }
+            break;
+
+        case NGX_DYNAMIC_UPSTEAM_OP_REMOVE:
+            rc = ngx_dynamic_upstream_lua_chash_remove_locked(shpool, chash,
+                &op->server);
+            break;
+
+        case NGX_DYNAMIC_UPSTEAM_OP_PARAM:
+            if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT) {
+                rc = ngx_dynamic_upstream_lua_chash_remove_locked(shpool,
+                    chash, &op->server);
+                if (rc == NGX_OK) {
+                    rc = ngx_dynamic_upstream_lua_chash_add_locked(shpool,
+                        chash, &op->server, op->weight);
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    if (rc == NGX_DECLINED
+        && !ngx_http_dynamic_upstream_chash_stale(chash, primary, op))
+    {
+        rc = NGX_OK;
+    }
+
+    if (rc != NGX_OK) {
+        /*
+         * peer is addressed by name or memory is exhausted:
+         * fall back to the full rebuild
+         */
+        ngx_dynamic_upstream_lua_chash_free_locked(shpool, chash);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+done:
+
+    ngx_rwlock_unlock(&chash->lock);
+    ngx_http_upstream_rr_peers_unlock(primary);
+}
+
+
+void
+ngx_http_dynamic_upstream_lua_chash_reset(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_dynamic_upstream_lua_chash_t          *chash;
+    ngx_slab_pool_t                           *shpool;
+
+    if (uscf->srv_conf == NULL) {
+        return;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(uscf,
+                ngx_http_dynamic_upstream_lua_module);
+    if (ucscf->chash_key == NULL) {
+        return;
+    }
+
+    chash = ngx_http_dynamic_upstream_chash_get(uscf);
+    if (chash == NULL) {
+        return;
+    }
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+
+    ngx_rwlock_wlock(&chash->lock);
+    ngx_shmtx_lock(&shpool->mutex);
+
+    /* will be built on the next balancing */
+
+    ngx_dynamic_upstream_lua_chash_free_locked(shpool, chash);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_rwlock_unlock(&chash->lock);
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_chash_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_str_t                                     key;
+    ngx_http_dynamic_upstream_lua_srv_conf_t     *ucscf;
+    ngx_http_dynamic_upstream_chash_peer_data_t  *hp;
+
+    ucscf = ngx_http_conf_upstream_srv_conf(us,
+                ngx_http_dynamic_upstream_lua_module);
+
+    if (ngx_http_complex_value(r, ucscf->chash_key, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hp = ngx_palloc(r->pool,
+                    sizeof(ngx_http_dynamic_upstream_chash_peer_data_t));
+    if (hp == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &hp->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_dynamic_upstream_chash_get_peer;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "dynamic consistent hash key:\"%V\"", &key);
+
+    hp->key = ngx_crc32_long(key.data, key.len);
+    hp->number = hp->rrp.peers->number;
+    hp->found = 0;
+    hp->tries = 0;
+    hp->get_rr_peer = ngx_http_upstream_get_round_robin_peer;
+    hp->chash = ngx_http_dynamic_upstream_chash_get(us);
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_dynamic_upstream_chash_find(ngx_dynamic_upstream_lua_chash_t *chash,
+    uint32_t hash)
+{
+    ngx_uint_t                               i, j, k;
+    ngx_dynamic_upstream_lua_chash_point_t  *point;
+
+    /* find best match */
+
+    point = chash->points;
+
+    i = 0;
+    j = chash->number;
+
+    while (i < j) {
+        k = (i + j) / 2;
+
+        if (hash > point[k].hash) {
+            i = k + 1;
+
+        } else if (hash < point[k].hash) {
+            j = k;
+
+        } else {
+            return k;
+        }
+    }
+
+    return i;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_chash_get_peer(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_http_dynamic_upstream_chash_peer_data_t  *hp = data;
+
+    time_t                                   now;
+    intptr_t                                 m;
+    ngx_str_t                               *server;
+    ngx_int_t                                total;
+    ngx_uint_t                               i, n, best_i;
+    ngx_http_upstream_rr_peer_t             *peer, *best;
+    ngx_dynamic_upstream_lua_chash_t        *chash;
+    ngx_dynamic_upstream_lua_chash_point_t  *point;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get dynamic consistent hash peer, try: %ui", pc->tries);
+
+    chash = hp->chash;
+
+    ngx_http_upstream_rr_peers_wlock(hp->rrp.peers);
+
+    if (chash == NULL || hp->tries > 20 || hp->rrp.peers->single
+        || ngx_http_dynamic_upstream_chash_ready(chash, hp->rrp.peers)
+               != NGX_OK) {
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    ngx_rwlock_rlock(&chash->lock);
+
+    if (chash->number == 0) {
+        ngx_rwlock_unlock(&chash->lock);
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    if (!hp->found) {
+        hp->hash = ngx_http_dynamic_upstream_chash_find(chash, hp->key);
+        hp->found = 1;
+    }
+
+    now = ngx_time();
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    for ( ;; ) {
+        point = &chash->points[hp->hash % chash->number];
+        server = &point->server->server;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "dynamic consistent hash peer:%uD, server:\"%V\"",
+                       point->hash, server);
+
+        best = NULL;
+        best_i = 0;
+        total = 0;
+
+        for (peer = hp->rrp.peers->peer, i = 0;
+             peer && i < hp->number;
+             peer = peer->next, i++)
+        {
+            if (peer->server.len != server->len
+                || ngx_strncmp(peer->server.data, server->data, server->len)
+                   != 0)
+            {
+                continue;
+            }
+
+            n = i / (8 * sizeof(uintptr_t));
+            m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+            if (hp->rrp.tried[n] & m) {
+                continue;
+            }
+
+            if (peer->down) {
+                continue;
+            }
+
+            if (peer->max_fails
+                && peer->fails >= peer->max_fails
+                && now - peer->checked <= peer->fail_timeout)
+            {
+                continue;
+            }
+
+            if (peer->max_conns && peer->conns >= peer->max_conns) {
+                continue;
+            }
+
+            peer->current_weight += peer->effective_weight;
+            total += peer->effective_weight;
+
+            if (peer->effective_weight < peer->weight) {
+                peer->effective_weight++;
+            }
+
+            if (best == NULL || peer->current_weight > best->current_weight) {
+                best = peer;
+                best_i = i;
+            }
+        }
+
+        if (best) {
+            best->current_weight -= total;
+            break;
+        }
+
+        hp->hash++;
+        hp->tries++;
+
+        if (hp->tries > 20) {
+            ngx_rwlock_unlock(&chash->lock);
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+            return hp->get_rr_peer(pc, &hp->rrp);
+        }
+    }
+
+    ngx_rwlock_unlock(&chash->lock);
+
+    hp->rrp.current = best;
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    best->conns++;
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+
+    n = best_i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << best_i % (8 * sizeof(uintptr_t));
+
+    hp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
@@ -0,0 +1,839 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_DISCONNECT_INTERVAL  1000
+
+
+typedef struct {
+    void                            *data;
+    ngx_http_upstream_srv_conf_t    *uscf;
+    ngx_http_request_t              *request;
+    ngx_queue_t                      queue;
+    ngx_flag_t                       upgraded;
+    ngx_flag_t                       started;
+    ngx_flag_t                       backup;
+    ngx_event_get_peer_pt            get;
+    ngx_event_free_peer_pt           free;
+#if (NGX_HTTP_SSL)
+    ngx_event_set_peer_session_pt    set_session;
+    ngx_event_save_peer_session_pt   save_session;
+#endif
+    size_t                           len;
+    u_char                           name[NGX_SOCKADDR_STRLEN];
+} ngx_http_dynamic_upstream_disconnect_peer_data_t;
+
+
+/* keepalive connection cached by the worker */
+
+typedef struct {
+    ngx_queue_t                      queue;
+    ngx_connection_t                *connection;
+    ngx_atomic_uint_t                number;
+    ngx_event_handler_pt             handler;
+    ngx_http_upstream_srv_conf_t    *uscf;
+    size_t                           len;
+    u_char                           name[NGX_SOCKADDR_STRLEN];
+} ngx_http_dynamic_upstream_disconnect_idle_t;
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_disconnect_filter(ngx_http_request_t *r);
+static ngx_int_t
+ngx_http_dynamic_upstream_disconnect_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t
+ngx_http_dynamic_upstream_disconnect_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void
+ngx_http_dynamic_upstream_disconnect_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+#if (NGX_HTTP_SSL)
+static ngx_int_t
+ngx_http_dynamic_upstream_disconnect_set_session(ngx_peer_connection_t *pc,
+    void *data);
+static void
+ngx_http_dynamic_upstream_disconnect_save_session(ngx_peer_connection_t *pc,
+    void *data);
+#endif
+
+
+static ngx_event_t   ngx_http_dynamic_upstream_disconnect_event;
+static ngx_queue_t   ngx_http_dynamic_upstream_disconnect_idle;
+static ngx_queue_t   ngx_http_dynamic_upstream_disconnect_free;
+static ngx_queue_t   ngx_http_dynamic_upstream_disconnect_upgraded;
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+
+/* tracked idle connections indexed by the connection number in the cycle */
+static ngx_http_dynamic_upstream_disconnect_idle_t
+                   **ngx_http_dynamic_upstream_disconnect_index;
+
+
+char *
+ngx_http_dynamic_upstream_lua_disconnect(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_flag_t  *fp;
+
+    fp = (ngx_flag_t *) ((char *) conf + cmd->offset);
+
+    if (*fp) {
+        return "is duplicate";
+    }
+
+    *fp = 1;
+
+    return NGX_CONF_OK;
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_disconnect_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                                 i;
+    ngx_http_upstream_srv_conf_t             **uscfp;
+    ngx_http_upstream_main_conf_t             *umcf;
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    /* peers are initialized already, wrap the balancer of the upstream */
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL
+            || uscfp[i]->shm_zone == NULL
+            || uscfp[i]->peer.init == NULL) {
+            continue;
+        }
+
+        ucscf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                    ngx_http_dynamic_upstream_lua_module);
+
+        if (!ucscf->disconnect_down
+            && !ucscf->disconnect_backup
+            && !ucscf->disconnect_exiting
+            && !ucscf->warmup_timeout
+            && !ucscf->backup_threshold
+            && !ucscf->panic_threshold
+            && ucscf->outlier == NULL
+            && ucscf->queue == NULL) {
+            continue;
+        }
+
+        if (ucscf->warmup_timeout) {
+            ngx_http_dynamic_upstream_lua_warmup_check(cf, uscfp[i]);
+        }
+
+        ucscf->original_init_peer = uscfp[i]->peer.init;
+        uscfp[i]->peer.init = ngx_http_dynamic_upstream_disconnect_init_peer;
+    }
+
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_dynamic_upstream_disconnect_filter;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_disconnect_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t          *ucscf;
+    ngx_http_dynamic_upstream_disconnect_peer_data_t  *dp;
+
+    ucscf = ngx_http_conf_upstream_srv_conf(us,
+                ngx_http_dynamic_upstream_lua_module);
+
+    if (ucscf->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* the request woken from the queue takes its peer now */
+
+    ngx_http_dynamic_upstream_lua_queue_started(r);
+
+    dp = ngx_palloc(r->pool,
+                    sizeof(ngx_http_dynamic_upstream_disconnect_peer_data_t));
+    if (dp == NULL) {
+        return NGX_ERROR;
+    }
+
+    dp->data = r->upstream->peer.data;
+    dp->uscf = us;
+    dp->request = r;
+    dp->upgraded = 0;
+    dp->started = 0;
+    dp->backup = 0;
+    dp->get = r->upstream->peer.get;
+    dp->free = r->upstream->peer.free;
+    dp->len = 0;
+
+    r->upstream->peer.data = dp;
+    r->upstream->peer.get = ngx_http_dynamic_upstream_disconnect_get_peer;
+    r->upstream->peer.free = ngx_http_dynamic_upstream_disconnect_free_peer;
+
+#if (NGX_HTTP_SSL)
+    dp->set_session = r->upstream->peer.set_session;
+    dp->save_session = r->upstream->peer.save_session;
+    r->upstream->peer.set_session =
+        ngx_http_dynamic_upstream_disconnect_set_session;
+    r->upstream->peer.save_session =
+        ngx_http_dynamic_upstream_disconnect_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_dynamic_upstream_disconnect_cleanup(void *data)
+{
+    ngx_http_dynamic_upstream_disconnect_peer_data_t  *dp = data;
+
+    if (dp->upgraded) {
+        ngx_queue_remove(&dp->queue);
+        dp->upgraded = 0;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_disconnect_filter(ngx_http_request_t *r)
+{
+    ngx_http_upstream_t                               *u;
+    ngx_pool_cleanup_t                                *cln;
+    ngx_http_dynamic_upstream_disconnect_peer_data_t  *dp;
+
+    u = r->upstream;
+
+    /* upgraded connections are checked by the timer until closed */
+
+    if (u == NULL
+        || !u->upgrade
+        || u->peer.free != ngx_http_dynamic_upstream_disconnect_free_peer
+        || ngx_http_dynamic_upstream_disconnect_event.handler == NULL)
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
+    dp = u->peer.data;
+
+    if (!dp->upgraded) {
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_dynamic_upstream_disconnect_cleanup;
+        cln->data = dp;
+
+        ngx_queue_insert_tail(&ngx_http_dynamic_upstream_disconnect_upgraded,
+                              &dp->queue);
+        dp->upgraded = 1;
+    }
+
+    return ngx_http_next_header_filter(r);
+}
+
+
+static void
+ngx_http_dynamic_upstream_disconnect_switch(
+    ngx_http_dynamic_upstream_disconnect_peer_data_t *dp,
+    ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_http_upstream_rr_peer_data_t  *rrp = dp->data;
+
+    ngx_uint_t  i, n;
+
+    /* the same as the round robin balancer does for backup peers */
+
+    rrp->peers = peers;
+
+    n = (peers->number + (8 * sizeof(uintptr_t) - 1))
+        / (8 * sizeof(uintptr_t));
+
+    for (i = 0; i < n; i++) {
+        rrp->tried[i] = 0;
+    }
+}
+
+
+static ngx_flag_t
+ngx_http_dynamic_upstream_disconnect_backup(
+    ngx_http_dynamic_upstream_disconnect_peer_data_t *dp)
+{
+    ngx_http_upstream_rr_peer_data_t  *rrp = dp->data;
+    ngx_http_upstream_rr_peers_t      *primary;
+
+    primary = dp->uscf->peer.data;
+
+    /* the next try after backup peers goes to primary peers */
+
+    if (dp->backup) {
+        dp->backup = 0;
+        ngx_http_dynamic_upstream_disconnect_switch(dp, primary);
+        return 1;
+    }
+
+    if (dp->started) {
+        return 0;
+    }
+
+    dp->started = 1;
+
+    if (rrp->peers != primary
+        || primary->next == NULL
+        || !ngx_http_dynamic_upstream_lua_backup_first(dp->uscf, NULL))
+    {
+        return 0;
+    }
+
+    dp->backup = 1;
+    ngx_http_dynamic_upstream_disconnect_switch(dp, primary->next);
+
+    return 1;
+}
+
+
+static ngx_flag_t
+ngx_http_dynamic_upstream_disconnect_usable(
+    ngx_http_upstream_rr_peer_data_t *rrp, ngx_http_upstream_rr_peer_t *peer,
+    ngx_uint_t i, time_t now)
+{
+    uintptr_t   m;
+    ngx_uint_t  n;
+
+    n = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    if (rrp->tried[n] & m) {
+        return 0;
+    }
+
+    /* the down flag is ignored in panic mode */
+
+    if (peer->max_fails
+        && peer->fails >= peer->max_fails
+        && now - peer->checked <= peer->fail_timeout)
+    {
+        return 0;
+    }
+
+    if (peer->max_conns && peer->conns >= peer->max_conns) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_disconnect_panic(ngx_peer_connection_t *pc,
+    ngx_http_dynamic_upstream_disconnect_peer_data_t *dp)
+{
+    ngx_http_upstream_rr_peer_data_t  *rrp = dp->data;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_t       *peer, *best = NULL, *first = NULL;
+    ngx_uint_t                         i, k, n, a, b, ibest = 0, ifirst = 0;
+    time_t                             now;
+
+    peers = rrp->peers;
+
+    if (peers != dp->uscf->peer.data
+        || !ngx_http_dynamic_upstream_lua_panic(dp->uscf))
+    {
+        return NGX_DECLINED;
+    }
+
+    now = ngx_time();
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    /* power of two choices over all primary peers not tried yet */
+
+    n = 0;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        n += ngx_http_dynamic_upstream_disconnect_usable(rrp, peer, i, now);
+    }
+
+    if (n == 0) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return NGX_DECLINED;
+    }
+
+    a = ngx_random() % n;
+    b = n > 1 ? (a + 1 + ngx_random() % (n - 1)) % n : a;
+
+    for (peer = peers->peer, i = 0, k = 0; peer; peer = peer->next, i++) {
+        if (!ngx_http_dynamic_upstream_disconnect_usable(rrp, peer, i, now)) {
+            continue;
+        }
+
+        if (k == a) {
+            first = peer;
+            ifirst = i;
+        }
+
+        if (k == b) {
+            best = peer;
+            ibest = i;
+        }
+
+        k++;
+    }
+
+    if (first->conns * best->weight < best->conns * first->weight) {
+        best = first;
+        ibest = ifirst;
+    }
+
+    /* the same bookkeeping as the round robin balancer */
+
+    rrp->current = best;
+
+    rrp->tried[ibest / (8 * sizeof(uintptr_t))]
+        |= (uintptr_t) 1 << ibest % (8 * sizeof(uintptr_t));
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    best->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_disconnect_get_peer(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_http_dynamic_upstream_disconnect_peer_data_t  *dp = data;
+
+    ngx_int_t   rc = NGX_DECLINED;
+    ngx_flag_t  backup = 0;
+
+    /*
+     * dynamic_panic_threshold and dynamic_backup_threshold are applied
+     * to the round robin balancer
+     */
+
+    if (dp->get == ngx_http_upstream_get_round_robin_peer) {
+        rc = ngx_http_dynamic_upstream_disconnect_panic(pc, dp);
+
+        if (rc == NGX_DECLINED) {
+            backup = ngx_http_dynamic_upstream_disconnect_backup(dp);
+        }
+    }
+
+    if (rc == NGX_DECLINED) {
+        rc = dp->get(pc, dp->data);
+
+        if (rc == NGX_BUSY && backup && dp->backup) {
+            (void) ngx_http_dynamic_upstream_disconnect_backup(dp);
+            rc = dp->get(pc, dp->data);
+        }
+    }
+
+    /* the peer may be removed before the connection is freed */
+
+    if (pc->name != NULL && pc->name->len <= NGX_SOCKADDR_STRLEN) {
+        dp->len = pc->name->len;
+        ngx_memcpy(dp->name, pc->name->data, dp->len);
+    }
+
+    /* nothing cached, try a connection opened by warmup */
+
+    if (rc == NGX_OK
+        && ngx_http_dynamic_upstream_lua_warmup_get(pc, dp->uscf) == NGX_OK)
+    {
+        rc = NGX_DONE;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_disconnect_track(
+    ngx_http_dynamic_upstream_disconnect_peer_data_t *dp, ngx_connection_t *c)
+{
+    ngx_queue_t                                  *q;
+    ngx_uint_t                                    n;
+    ngx_http_dynamic_upstream_disconnect_idle_t  *idle;
+
+    if (ngx_http_dynamic_upstream_disconnect_index == NULL) {
+
+        ngx_http_dynamic_upstream_disconnect_index = ngx_pcalloc(
+            ngx_cycle->pool, ngx_cycle->connection_n * sizeof(void *));
+        if (ngx_http_dynamic_upstream_disconnect_index == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    n = c - ngx_cycle->connections;
+
+    idle = ngx_http_dynamic_upstream_disconnect_index[n];
+
+    if (idle == NULL) {
+
+        if (!ngx_queue_empty(&ngx_http_dynamic_upstream_disconnect_free)) {
+
+            q = ngx_queue_head(&ngx_http_dynamic_upstream_disconnect_free);
+            ngx_queue_remove(q);
+
+            idle = ngx_queue_data(q,
+                ngx_http_dynamic_upstream_disconnect_idle_t, queue);
+
+        } else {
+
+            idle = ngx_palloc(ngx_cycle->pool,
+                       sizeof(ngx_http_dynamic_upstream_disconnect_idle_t));
+            if (idle == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        ngx_queue_insert_tail(&ngx_http_dynamic_upstream_disconnect_idle,
+                              &idle->queue);
+
+        ngx_http_dynamic_upstream_disconnect_index[n] = idle;
+    }
+
+    idle->connection = c;
+    idle->number = c->number;
+    idle->handler = c->read->handler;
+    idle->uscf = dp->uscf;
+    idle->len = dp->len;
+    ngx_memcpy(idle->name, dp->name, dp->len);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_dynamic_upstream_disconnect_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state)
+{
+    ngx_http_dynamic_upstream_disconnect_peer_data_t  *dp = data;
+
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
+
+    c = pc->connection;
+    u = dp->request->upstream;
+
+    /* the status of the current try, the headers are reset on next try */
+
+    if (dp->len != 0) {
+        ngx_http_dynamic_upstream_lua_outlier_observe(pc->log, dp->uscf,
+            dp->name, dp->len, (state & NGX_PEER_FAILED)
+                || u->headers_in.status_n >= NGX_HTTP_INTERNAL_SERVER_ERROR);
+    }
+
+    dp->free(pc, dp->data, state);
+
+    /* the failure may take the peer out of the alive peers */
+
+    if (state & NGX_PEER_FAILED) {
+        ngx_http_dynamic_upstream_lua_alive_count(dp->uscf);
+    }
+
+    ngx_http_dynamic_upstream_lua_queue_notify(dp->uscf);
+
+    /* the connection is kept in the keepalive cache */
+
+    if (c != NULL && pc->connection == NULL && c->idle && dp->len != 0
+        && ngx_http_dynamic_upstream_disconnect_event.handler != NULL)
+    {
+        (void) ngx_http_dynamic_upstream_disconnect_track(dp, c);
+    }
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_dynamic_upstream_disconnect_set_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_http_dynamic_upstream_disconnect_peer_data_t  *dp = data;
+
+    return dp->set_session(pc, dp->data);
+}
+
+
+static void
+ngx_http_dynamic_upstream_disconnect_save_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_http_dynamic_upstream_disconnect_peer_data_t  *dp = data;
+
+    dp->save_session(pc, dp->data);
+}
+
+#endif
+
+
+static const char *
+ngx_http_dynamic_upstream_disconnect_peer(ngx_http_upstream_srv_conf_t *uscf,
+    u_char *name, size_t len)
+{
+    ngx_http_upstream_rr_peer_t               *peer;
+    ngx_http_upstream_rr_peers_t              *primary, *peers;
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_uint_t                                 alive, total;
+    time_t                                     now;
+
+    ucscf = ngx_http_conf_upstream_srv_conf(uscf,
+                ngx_http_dynamic_upstream_lua_module);
+
+    primary = uscf->peer.data;
+
+    now = ngx_time();
+    alive = 0;
+    total = 0;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    for (peers = primary; peers; peers = peers->next) {
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (peers == primary) {
+                alive += ngx_dynamic_upstream_lua_peer_alive(peer, now);
+                total++;
+            }
+
+            if (peer->name.len != len
+                || ngx_strncmp(peer->name.data, name, len) != 0) {
+                continue;
+            }
+
+            ngx_http_upstream_rr_peers_unlock(primary);
+
+            if (peer->down) {
+                return ucscf->disconnect_down
+                       ? "disconnect_if_market_down" : NULL;
+            }
+
+            if (peers == primary) {
+                return NULL;
+            }
+
+            /* backup peers are still needed below the threshold */
+
+            return ucscf->disconnect_backup
+                   && !ngx_dynamic_upstream_lua_backup_needed(
+                           ucscf->backup_threshold, alive, total)
+                   ? "disconnect_backup_if_primary_up" : NULL;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    /* removed peer */
+
+    return ucscf->disconnect_down ? "disconnect_if_market_down" : NULL;
+}
+
+
+void
+ngx_http_dynamic_upstream_lua_disconnect_check(ngx_log_t *log)
+{
+    ngx_queue_t                                  *q, *next;
+    ngx_connection_t                             *c;
+    ngx_http_dynamic_upstream_disconnect_idle_t  *idle;
+
+    if (ngx_http_dynamic_upstream_disconnect_index == NULL
+        || ngx_exiting || ngx_quit || ngx_terminate)
+    {
+        return;
+    }
+
+    for (q = ngx_queue_head(&ngx_http_dynamic_upstream_disconnect_idle);
+         q != ngx_queue_sentinel(&ngx_http_dynamic_upstream_disconnect_idle);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        idle = ngx_queue_data(q, ngx_http_dynamic_upstream_disconnect_idle_t,
+                              queue);
+
+        c = idle->connection;
+
+        if (c->fd != (ngx_socket_t) -1
+            && c->number == idle->number
+            && c->idle
+            && c->read->handler == idle->handler)
+        {
+            if (ngx_http_dynamic_upstream_disconnect_peer(idle->uscf,
+                    idle->name, idle->len) == NULL) {
+                continue;
+            }
+
+            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "dynamic upstream: close keepalive connection "
+                           "*%uA peer=%*s", c->number, idle->len, idle->name);
+
+            /* the keepalive cache releases its slot on close */
+
+            c->close = 1;
+            c->read->handler(c->read);
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(&ngx_http_dynamic_upstream_disconnect_free, q);
+
+        ngx_http_dynamic_upstream_disconnect_index[c - ngx_cycle->connections]
+            = NULL;
+    }
+}
+
+
+static void
+ngx_http_dynamic_upstream_disconnect_upgraded(ngx_log_t *log)
+{
+    ngx_queue_t                                       *upgraded, *q, *next;
+    ngx_connection_t                                  *c;
+    ngx_http_request_t                                *r;
+    ngx_http_dynamic_upstream_lua_srv_conf_t          *ucscf;
+    ngx_http_dynamic_upstream_disconnect_peer_data_t  *dp;
+    const char                                        *reason;
+
+    upgraded = &ngx_http_dynamic_upstream_disconnect_upgraded;
+
+    for (q = ngx_queue_head(upgraded);
+         q != ngx_queue_sentinel(upgraded);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        dp = ngx_queue_data(q,
+                 ngx_http_dynamic_upstream_disconnect_peer_data_t, queue);
+
+        ucscf = ngx_http_conf_upstream_srv_conf(dp->uscf,
+                    ngx_http_dynamic_upstream_lua_module);
+
+        if (ucscf->disconnect_exiting
+            && (ngx_exiting || ngx_quit || ngx_terminate)) {
+            reason = "disconnect_on_exiting";
+
+        } else if (dp->len != 0) {
+            reason = ngx_http_dynamic_upstream_disconnect_peer(dp->uscf,
+                         dp->name, dp->len);
+
+        } else {
+            reason = NULL;
+        }
+
+        if (reason == NULL) {
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_WARN, log, 0, "[%s] peer=%*s upstream=%V",
+                      reason, dp->len, dp->name, &dp->uscf->host);
+
+        ngx_queue_remove(q);
+        dp->upgraded = 0;
+
+        r = dp->request;
+        c = r->connection;
+
+        ngx_http_finalize_request(r, NGX_ERROR);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+
+static void
+ngx_http_dynamic_upstream_disconnect_handler(ngx_event_t *ev)
+{
+    ngx_http_dynamic_upstream_lua_outlier_check(ev->log);
+
+    ngx_http_dynamic_upstream_lua_disconnect_check(ev->log);
+
+    /* upgraded connections are checked while the worker is exiting too */
+
+    ngx_http_dynamic_upstream_disconnect_upgraded(ev->log);
+
+    ngx_add_timer(ev, NGX_DYNAMIC_UPSTREAM_LUA_DISCONNECT_INTERVAL);
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_disconnect_init_process(ngx_cycle_t *cycle)
+{
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    ngx_queue_init(&ngx_http_dynamic_upstream_disconnect_idle);
+    ngx_queue_init(&ngx_http_dynamic_upstream_disconnect_free);
+    ngx_queue_init(&ngx_http_dynamic_upstream_disconnect_upgraded);
+
+    ngx_http_dynamic_upstream_disconnect_event.handler =
+        ngx_http_dynamic_upstream_disconnect_handler;
+    ngx_http_dynamic_upstream_disconnect_event.log = cycle->log;
+    ngx_http_dynamic_upstream_disconnect_event.data = cycle;
+    ngx_http_dynamic_upstream_disconnect_event.cancelable = 1;
+
+    ngx_add_timer(&ngx_http_dynamic_upstream_disconnect_event,
+                  NGX_DYNAMIC_UPSTREAM_LUA_DISCONNECT_INTERVAL);
+
+    return NGX_OK;
+}
+
+
+ngx_http_upstream_rr_peer_data_t *
+ngx_http_dynamic_upstream_lua_rr_peer_data(ngx_http_upstream_t *u)
+{
+    void                                              *data;
+    ngx_event_free_peer_pt                             free;
+    ngx_http_dynamic_upstream_disconnect_peer_data_t  *dp;
+
+    data = u->peer.data;
+    free = u->peer.free;
+
+    if (free == ngx_http_dynamic_upstream_disconnect_free_peer) {
+        dp = data;
+        data = dp->data;
+        free = dp->free;
+    }
+
+    /* the round robin data is first in the data of these balancers */
+
+    if (free == ngx_http_upstream_free_round_robin_peer
+        || ngx_http_dynamic_upstream_lua_ewma_balancer(free))
+    {
+        return data;
+    }
+
+    return NULL;
+}
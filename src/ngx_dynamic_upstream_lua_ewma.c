@@ -0,0 +1,581 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+
+
+/* response time is kept in 1/1024 of millisecond */
+#define NGX_DYNAMIC_UPSTREAM_LUA_EWMA_SCALE  1024
+#define NGX_DYNAMIC_UPSTREAM_LUA_EWMA_DECAY  10
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t       rrp;
+    ngx_dynamic_upstream_lua_ewma_t       *ewma;
+    ngx_dynamic_upstream_lua_ewma_peer_t  *stat;
+    ngx_uint_t                             version;
+    ngx_uint_t                             decay;
+    ngx_uint_t                             number;
+    ngx_msec_t                             start;
+} ngx_http_dynamic_upstream_ewma_peer_data_t;
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_ewma_init(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t
+ngx_http_dynamic_upstream_ewma_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t
+ngx_http_dynamic_upstream_ewma_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void
+ngx_http_dynamic_upstream_ewma_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+
+char *
+ngx_http_dynamic_upstream_lua_ewma(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf = conf;
+
+    ngx_str_t                     *value;
+    ngx_int_t                      decay;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    value = cf->args->elts;
+
+    decay = NGX_DYNAMIC_UPSTREAM_LUA_EWMA_DECAY;
+
+    if (cf->args->nelts == 2) {
+        decay = ngx_atoi(value[1].data, value[1].len);
+        if (decay == NGX_ERROR || decay == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid decay \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ucscf->ewma_decay = decay;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    uscf->peer.init_upstream = ngx_http_dynamic_upstream_ewma_init;
+
+    if (ngx_dynamic_upstream_lua_shm_add(cf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_ewma_init(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_dynamic_upstream_ewma_init_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_dynamic_upstream_lua_ewma_t *
+ngx_http_dynamic_upstream_ewma_get(ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_dynamic_upstream_lua_state_t          *state;
+    ngx_dynamic_upstream_lua_ewma_t           *ewma;
+
+    if (us->srv_conf == NULL) {
+        return NULL;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(us,
+                ngx_http_dynamic_upstream_lua_module);
+    if (ucscf->ewma_decay == 0) {
+        return NULL;
+    }
+
+    state = ngx_http_dynamic_upstream_lua_srv_state(us);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    ewma = &state->ewma;
+
+    if (ewma->rbtree.root == NULL) {
+        ngx_rwlock_wlock(&ewma->lock);
+
+        if (ewma->rbtree.root == NULL) {
+            ngx_rbtree_init(&ewma->rbtree, &ewma->sentinel,
+                            ngx_str_rbtree_insert_value);
+        }
+
+        ngx_rwlock_unlock(&ewma->lock);
+    }
+
+    return ewma;
+}
+
+
+static ngx_dynamic_upstream_lua_ewma_peer_t *
+ngx_dynamic_upstream_lua_ewma_find(ngx_dynamic_upstream_lua_ewma_t *ewma,
+    ngx_str_t *name)
+{
+    return (ngx_dynamic_upstream_lua_ewma_peer_t *)
+        ngx_str_rbtree_lookup(&ewma->rbtree, name,
+                              ngx_crc32_short(name->data, name->len));
+}
+
+
+static ngx_dynamic_upstream_lua_ewma_peer_t *
+ngx_dynamic_upstream_lua_ewma_alloc(ngx_dynamic_upstream_lua_ewma_t *ewma,
+    ngx_str_t *name)
+{
+    ngx_uint_t                             version;
+    ngx_slab_pool_t                       *shpool;
+    ngx_dynamic_upstream_lua_ewma_peer_t  *stat;
+
+    if (name->len > NGX_SOCKADDR_STRLEN) {
+        return NULL;
+    }
+
+    /* reuse the entry of the removed peer */
+
+    stat = ewma->free;
+
+    if (stat != NULL) {
+        ewma->free = stat->next;
+        version = stat->version;
+        ngx_memzero(stat, sizeof(ngx_dynamic_upstream_lua_ewma_peer_t));
+        stat->version = version;
+
+    } else {
+        shpool = ngx_dynamic_upstream_lua_shm_pool();
+
+        stat = ngx_slab_calloc(shpool,
+                               sizeof(ngx_dynamic_upstream_lua_ewma_peer_t));
+        if (stat == NULL) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "dynamic ewma: no memory for peer statistics, "
+                          "increase dynamic_upstream_shm_size");
+            return NULL;
+        }
+    }
+
+    stat->len = name->len;
+    ngx_memcpy(stat->name, name->data, name->len);
+
+    stat->sn.str.data = stat->name;
+    stat->sn.str.len = name->len;
+    stat->sn.node.key = ngx_crc32_short(name->data, name->len);
+
+    ngx_rbtree_insert(&ewma->rbtree, &stat->sn.node);
+
+    stat->next = ewma->peers;
+    ewma->peers = stat;
+
+    return stat;
+}
+
+
+void
+ngx_http_dynamic_upstream_lua_ewma_update(
+    ngx_http_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_op_t *op)
+{
+    ngx_dynamic_upstream_lua_ewma_t       *ewma;
+    ngx_dynamic_upstream_lua_ewma_peer_t  *stat, **prev;
+    ngx_http_upstream_rr_peers_t          *primary, *peers;
+    ngx_http_upstream_rr_peer_t           *peer;
+
+    if (op->op != NGX_DYNAMIC_UPSTEAM_OP_REMOVE) {
+        return;
+    }
+
+    ewma = ngx_http_dynamic_upstream_ewma_get(uscf);
+    if (ewma == NULL) {
+        return;
+    }
+
+    primary = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+    ngx_rwlock_wlock(&ewma->lock);
+
+    /* statistics not found among the peers are released for reuse */
+
+    for (stat = ewma->peers; stat; stat = stat->next) {
+        stat->removed = 1;
+    }
+
+    for (peers = primary; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+            stat = ngx_dynamic_upstream_lua_ewma_find(ewma, &peer->name);
+            if (stat != NULL) {
+                stat->removed = 0;
+            }
+        }
+    }
+
+    prev = &ewma->peers;
+
+    while (*prev) {
+        stat = *prev;
+
+        if (!stat->removed) {
+            prev = &stat->next;
+            continue;
+        }
+
+        *prev = stat->next;
+
+        ngx_rbtree_delete(&ewma->rbtree, &stat->sn.node);
+
+        stat->version++;
+        stat->next = ewma->free;
+        ewma->free = stat;
+    }
+
+    ngx_rwlock_unlock(&ewma->lock);
+    ngx_http_upstream_rr_peers_unlock(primary);
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_ewma_stat(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_str_t *name, ngx_uint_t *ewma, ngx_uint_t *inflight)
+{
+    ngx_dynamic_upstream_lua_ewma_t       *e;
+    ngx_dynamic_upstream_lua_ewma_peer_t  *stat;
+
+    e = ngx_http_dynamic_upstream_ewma_get(uscf);
+    if (e == NULL) {
+        return NGX_DECLINED;
+    }
+
+    *ewma = 0;
+    *inflight = 0;
+
+    ngx_rwlock_rlock(&e->lock);
+
+    stat = ngx_dynamic_upstream_lua_ewma_find(e, name);
+    if (stat != NULL) {
+        *ewma = stat->ewma / NGX_DYNAMIC_UPSTREAM_LUA_EWMA_SCALE;
+        *inflight = stat->inflight;
+    }
+
+    ngx_rwlock_unlock(&e->lock);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_ewma_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t    *ucscf;
+    ngx_http_dynamic_upstream_ewma_peer_data_t  *ep;
+
+    ucscf = ngx_http_conf_upstream_srv_conf(us,
+                ngx_http_dynamic_upstream_lua_module);
+
+    ep = ngx_palloc(r->pool,
+                    sizeof(ngx_http_dynamic_upstream_ewma_peer_data_t));
+    if (ep == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &ep->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_dynamic_upstream_ewma_get_peer;
+    r->upstream->peer.free = ngx_http_dynamic_upstream_ewma_free_peer;
+
+    ep->ewma = ngx_http_dynamic_upstream_ewma_get(us);
+    ep->stat = NULL;
+    ep->version = 0;
+    ep->decay = ucscf->ewma_decay;
+    ep->number = ep->rrp.peers->number;
+
+    if (ep->rrp.peers->next != NULL
+        && ep->rrp.peers->next->number > ep->number) {
+        ep->number = ep->rrp.peers->next->number;
+    }
+    ep->start = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_flag_t
+ngx_http_dynamic_upstream_ewma_usable(
+    ngx_http_dynamic_upstream_ewma_peer_data_t *ep,
+    ngx_http_upstream_rr_peer_t *peer, ngx_uint_t i, time_t now)
+{
+    uintptr_t   m;
+    ngx_uint_t  n;
+
+    if (i >= ep->number) {
+        return 0;
+    }
+
+    n = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    if (ep->rrp.tried[n] & m) {
+        return 0;
+    }
+
+    if (peer->down) {
+        return 0;
+    }
+
+    if (peer->max_fails
+        && peer->fails >= peer->max_fails
+        && now - peer->checked <= peer->fail_timeout)
+    {
+        return 0;
+    }
+
+    if (peer->max_conns && peer->conns >= peer->max_conns) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+static uint64_t
+ngx_http_dynamic_upstream_ewma_score(ngx_dynamic_upstream_lua_ewma_peer_t *s)
+{
+    if (s == NULL) {
+        return 1;
+    }
+
+    return ((uint64_t) s->ewma + 1) * (s->inflight + 1);
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_ewma_get_peer(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_http_dynamic_upstream_ewma_peer_data_t  *ep = data;
+
+    time_t                                 now;
+    uintptr_t                              m;
+    uint64_t                               s1, s2;
+    ngx_uint_t                             i, n, a, b, first_i, best_i;
+    ngx_http_upstream_rr_peers_t          *peers;
+    ngx_http_upstream_rr_peer_t           *peer, *first, *best;
+    ngx_dynamic_upstream_lua_ewma_peer_t  *first_stat, *best_stat;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get dynamic ewma peer, try: %ui", pc->tries);
+
+    ep->stat = NULL;
+
+    peers = ep->rrp.peers;
+
+    if (ep->ewma == NULL || peers->single) {
+        return ngx_http_upstream_get_round_robin_peer(pc, &ep->rrp);
+    }
+
+    now = ngx_time();
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    n = 0;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        if (ngx_http_dynamic_upstream_ewma_usable(ep, peer, i, now)) {
+            n++;
+        }
+    }
+
+    if (n == 0) {
+        /* round robin switches to the backup peers or fails */
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, &ep->rrp);
+    }
+
+    /* power of two choices */
+
+    a = ngx_random() % n;
+    b = n > 1 ? (a + 1 + ngx_random() % (n - 1)) % n : a;
+
+    first = NULL;
+    best = NULL;
+    first_i = 0;
+    best_i = 0;
+
+    for (peer = peers->peer, i = 0, n = 0; peer; peer = peer->next, i++) {
+        if (!ngx_http_dynamic_upstream_ewma_usable(ep, peer, i, now)) {
+            continue;
+        }
+
+        if (n == a) {
+            first = peer;
+            first_i = i;
+        }
+
+        if (n == b) {
+            best = peer;
+            best_i = i;
+        }
+
+        n++;
+    }
+
+    /* scores are read in parallel, the index is locked only to add */
+
+    ngx_rwlock_rlock(&ep->ewma->lock);
+
+    first_stat = ngx_dynamic_upstream_lua_ewma_find(ep->ewma, &first->name);
+    best_stat = ngx_dynamic_upstream_lua_ewma_find(ep->ewma, &best->name);
+
+    s1 = ngx_http_dynamic_upstream_ewma_score(first_stat) * best->weight;
+    s2 = ngx_http_dynamic_upstream_ewma_score(best_stat) * first->weight;
+
+    if (s1 < s2) {
+        best = first;
+        best_i = first_i;
+        best_stat = first_stat;
+    }
+
+    if (best_stat == NULL) {
+        ngx_rwlock_unlock(&ep->ewma->lock);
+        ngx_rwlock_wlock(&ep->ewma->lock);
+
+        best_stat = ngx_dynamic_upstream_lua_ewma_find(ep->ewma, &best->name);
+        if (best_stat == NULL) {
+            best_stat = ngx_dynamic_upstream_lua_ewma_alloc(ep->ewma,
+                                                            &best->name);
+        }
+    }
+
+    if (best_stat != NULL) {
+        (void) ngx_atomic_fetch_add(&best_stat->inflight, 1);
+        ep->stat = best_stat;
+        ep->version = best_stat->version;
+    }
+
+    ngx_rwlock_unlock(&ep->ewma->lock);
+
+    ep->rrp.current = best;
+    ep->start = ngx_current_msec;
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    best->conns++;
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    n = best_i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << best_i % (8 * sizeof(uintptr_t));
+
+    ep->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_dynamic_upstream_ewma_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state)
+{
+    ngx_http_dynamic_upstream_ewma_peer_data_t  *ep = data;
+
+    ngx_dynamic_upstream_lua_ewma_peer_t  *stat;
+    ngx_atomic_uint_t                      sample, old, avg;
+
+    stat = ep->stat;
+
+    if (stat != NULL) {
+
+        sample = (ngx_current_msec - ep->start)
+                 * NGX_DYNAMIC_UPSTREAM_LUA_EWMA_SCALE;
+
+        /* entries are released only under the write lock */
+
+        ngx_rwlock_rlock(&ep->ewma->lock);
+
+        /* the entry is reused by another peer */
+
+        if (stat->version == ep->version) {
+
+            (void) ngx_atomic_fetch_add(&stat->inflight, -1);
+
+            do {
+                old = stat->ewma;
+                avg = sample;
+
+                /* failed attempt is accounted as twice the average */
+
+                if (state & NGX_PEER_FAILED) {
+                    avg = ngx_max(avg, old * 2);
+                }
+
+                if (old == 0) {
+                    /* void */
+
+                } else if (avg > old) {
+                    avg = old + (avg - old) / ep->decay;
+
+                } else {
+                    avg = old - (old - avg) / ep->decay;
+                }
+
+            } while (!ngx_atomic_cmp_set(&stat->ewma, old, avg));
+        }
+
+        ngx_rwlock_unlock(&ep->ewma->lock);
+
+        ep->stat = NULL;
+    }
+
+    ngx_http_upstream_free_round_robin_peer(pc, &ep->rrp, state);
+}
+
+
+ngx_flag_t
+ngx_http_dynamic_upstream_lua_ewma_balancer(ngx_event_free_peer_pt free)
+{
+    return free == ngx_http_dynamic_upstream_ewma_free_peer;
+}
@@ -0,0 +1,956 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+#if (NGX_LINUX)
+#include <sys/inotify.h>
+#endif
+
+
+#include "ngx_dynamic_upstream_lua.h"
+#include "ngx_dynamic_upstream_lua_json.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+extern ngx_module_t ngx_stream_dynamic_upstream_lua_module;
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_FILE_DELAY     10
+#define NGX_DYNAMIC_UPSTREAM_LUA_FILE_INTERVAL  1000
+
+
+typedef struct {
+    ngx_str_t                        path;
+    ngx_str_t                        dir;
+    ngx_str_t                        name;
+    ngx_http_upstream_srv_conf_t    *uscf;
+    ngx_stream_upstream_srv_conf_t  *suscf;
+    time_t                           mtime;
+    int                              wd;
+    unsigned                         dirty:1;
+} ngx_dynamic_upstream_lua_file_t;
+
+
+/* servers of the file and of the changes are indexed by name */
+
+typedef struct {
+    ngx_array_t                       ops;
+    ngx_array_t                       changes;
+    ngx_dynamic_upstream_lua_names_t  servers;
+    ngx_dynamic_upstream_lua_names_t  changed;
+    ngx_flag_t                       *seen;
+    ngx_uint_t                        added;
+    ngx_uint_t                        updated;
+    ngx_uint_t                        removed;
+} ngx_dynamic_upstream_lua_file_diff_t;
+
+
+static ngx_array_t  *ngx_dynamic_upstream_lua_files;
+static ngx_event_t   ngx_dynamic_upstream_lua_file_event;
+
+
+char *
+ngx_dynamic_upstream_lua_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t  *path, *value;
+
+    path = (ngx_str_t *) ((char *) conf + cmd->offset);
+
+    if (path->data != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    *path = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, path, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (path->data[path->len - 1] == '/') {
+        return "invalid value, file expected";
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_file_read(ngx_pool_t *pool, ngx_log_t *log,
+    ngx_dynamic_upstream_lua_file_t *f, ngx_str_t *content)
+{
+    ngx_file_t       file;
+    ngx_file_info_t  fi;
+    ssize_t          n;
+    size_t           size;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = f->path;
+    file.log = log;
+
+    file.fd = ngx_open_file(f->path.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &f->path);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &f->path);
+        goto failed;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    content->data = ngx_pnalloc(pool, size + 1);
+    if (content->data == NULL) {
+        goto failed;
+    }
+
+    n = ngx_read_file(&file, content->data, size, 0);
+    if (n == NGX_ERROR) {
+        goto failed;
+    }
+
+    content->len = n;
+
+    f->mtime = ngx_file_mtime(&fi);
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &f->path);
+    }
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &f->path);
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_file_parse(ngx_pool_t *pool,
+    ngx_dynamic_upstream_lua_file_t *f, ngx_str_t *content,
+    ngx_dynamic_upstream_lua_file_diff_t *diff, const char **err)
+{
+    ngx_dynamic_upstream_lua_json_t   js;
+    ngx_dynamic_upstream_op_t        *op;
+    ngx_dynamic_upstream_lua_name_t  *name;
+    ngx_int_t                         rc;
+
+    ngx_dynamic_upstream_lua_json_init(&js, content->data, content->len,
+                                       pool);
+
+    if (ngx_dynamic_upstream_lua_json_validate(&js) != NGX_OK) {
+        *err = js.err;
+        return NGX_ERROR;
+    }
+
+    rc = ngx_dynamic_upstream_lua_json_begin(&js, '[');
+
+    while (rc == NGX_OK) {
+
+        op = ngx_array_push(&diff->ops);
+        if (op == NULL) {
+            *err = "no memory";
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(op, sizeof(ngx_dynamic_upstream_op_t));
+
+        op->op = NGX_DYNAMIC_UPSTEAM_OP_ADD;
+        op->status = NGX_HTTP_OK;
+        op->weight = 1;
+        op->max_fails = 1;
+        op->fail_timeout = 10;
+        op->op_param = NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE;
+
+        if (f->suscf != NULL) {
+            op->upstream = f->suscf->host;
+            op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM;
+        } else {
+            op->upstream = f->uscf->host;
+        }
+
+        if (ngx_dynamic_upstream_lua_json_peer(&js, op) != NGX_OK) {
+            *err = js.err;
+            return NGX_ERROR;
+        }
+
+        if (op->server.len == 0) {
+            *err = "peer without server";
+            return NGX_ERROR;
+        }
+
+        /* the first entry of a server wins */
+
+        if (ngx_dynamic_upstream_lua_names_find(&diff->servers, &op->server)
+            != NULL)
+        {
+            diff->ops.nelts--;
+
+        } else {
+            name = ngx_dynamic_upstream_lua_names_add(&diff->servers,
+                                                      &op->server, 0);
+            if (name == NULL) {
+                *err = "no memory";
+                return NGX_ERROR;
+            }
+
+            name->peer = (void *) (uintptr_t) (diff->ops.nelts - 1);
+        }
+
+        rc = ngx_dynamic_upstream_lua_json_next(&js, ']');
+    }
+
+    if (rc == NGX_ERROR) {
+        *err = js.err;
+        return NGX_ERROR;
+    }
+
+    diff->seen = ngx_pcalloc(pool, (diff->ops.nelts + 1)
+                                   * sizeof(ngx_flag_t));
+    if (diff->seen == NULL) {
+        *err = "no memory";
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_dynamic_upstream_op_t *
+ngx_dynamic_upstream_lua_file_match(ngx_dynamic_upstream_lua_file_diff_t *diff,
+    ngx_str_t *server, ngx_str_t *name)
+{
+    ngx_uint_t                        i;
+    ngx_dynamic_upstream_op_t        *op;
+    ngx_dynamic_upstream_lua_name_t  *n;
+
+    n = NULL;
+
+    if (server->len != 0) {
+        n = ngx_dynamic_upstream_lua_names_find(&diff->servers, server);
+    }
+
+    if (n == NULL) {
+        n = ngx_dynamic_upstream_lua_names_find(&diff->servers, name);
+        if (n == NULL) {
+            return NULL;
+        }
+    }
+
+    i = (ngx_uint_t) (uintptr_t) n->peer;
+    op = diff->ops.elts;
+
+    diff->seen[i] = 1;
+
+    return &op[i];
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_file_change(ngx_pool_t *pool,
+    ngx_dynamic_upstream_lua_file_diff_t *diff, ngx_dynamic_upstream_op_t *op,
+    ngx_int_t operation, ngx_str_t *server)
+{
+    ngx_dynamic_upstream_op_t        *change;
+    ngx_dynamic_upstream_lua_name_t  *n;
+
+    /* peers resolved from one server name are changed once */
+
+    for (n = ngx_dynamic_upstream_lua_names_find(&diff->changed, server);
+         n;
+         n = n->next)
+    {
+        if ((ngx_int_t) (uintptr_t) n->peer == operation) {
+            return NGX_OK;
+        }
+    }
+
+    change = ngx_array_push(&diff->changes);
+    if (change == NULL) {
+        return NGX_ERROR;
+    }
+
+    *change = *op;
+    change->op = operation;
+
+    /* the peer may be freed once the lock is released */
+
+    change->server.data = ngx_pstrdup(pool, server);
+    if (change->server.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    change->server.len = server->len;
+
+    n = ngx_dynamic_upstream_lua_names_add(&diff->changed, &change->server,
+                                           0);
+    if (n == NULL) {
+        return NGX_ERROR;
+    }
+
+    n->peer = (void *) (uintptr_t) operation;
+
+    return NGX_OK;
+}
+
+
+static ngx_flag_t
+ngx_dynamic_upstream_lua_file_changed(ngx_dynamic_upstream_op_t *op,
+    ngx_int_t weight, ngx_int_t max_fails, ngx_uint_t max_conns,
+    time_t fail_timeout, ngx_uint_t down)
+{
+    /* fields missing in the file keep their current values */
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT)
+        && op->weight != weight)
+    {
+        return 1;
+    }
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS)
+        && op->max_fails != max_fails)
+    {
+        return 1;
+    }
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS)
+        && (ngx_uint_t) op->max_conns != max_conns)
+    {
+        return 1;
+    }
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT)
+        && op->fail_timeout != fail_timeout)
+    {
+        return 1;
+    }
+
+    return (op->down && !down) || (op->up && down);
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_lua_file_diff(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_file_diff_t *diff)
+{
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *primary, *peers;
+    ngx_dynamic_upstream_op_t     *op, del;
+    ngx_str_t                     *server;
+    ngx_int_t                      rc = NGX_OK;
+
+    ngx_memzero(&del, sizeof(ngx_dynamic_upstream_op_t));
+
+    del.status = NGX_HTTP_OK;
+    del.upstream = uscf->host;
+
+    primary = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    for (peers = primary; peers && rc == NGX_OK; peers = peers->next) {
+        for (peer = peers->peer; peer && rc == NGX_OK; peer = peer->next) {
+
+            server = peer->server.len ? &peer->server : &peer->name;
+
+            op = ngx_dynamic_upstream_lua_file_match(diff, &peer->server,
+                                                     &peer->name);
+
+            if (op == NULL) {
+                rc = ngx_dynamic_upstream_lua_file_change(pool, diff,
+                         &del, NGX_DYNAMIC_UPSTEAM_OP_REMOVE, server);
+                continue;
+            }
+
+            if ((ngx_uint_t) op->backup != (peers != primary)) {
+
+                /* moved between primary and backup */
+
+                rc = ngx_dynamic_upstream_lua_file_change(pool, diff,
+                         &del, NGX_DYNAMIC_UPSTEAM_OP_REMOVE, server);
+
+                if (rc == NGX_OK) {
+                    rc = ngx_dynamic_upstream_lua_file_change(pool, diff,
+                             op, NGX_DYNAMIC_UPSTEAM_OP_ADD, &op->server);
+                }
+
+                continue;
+            }
+
+            if (ngx_dynamic_upstream_lua_file_changed(op, peer->weight,
+                    peer->max_fails, peer->max_conns, peer->fail_timeout,
+                    peer->down))
+            {
+                rc = ngx_dynamic_upstream_lua_file_change(pool, diff, op,
+                         NGX_DYNAMIC_UPSTEAM_OP_PARAM, &op->server);
+            }
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_stream_dynamic_upstream_lua_file_diff(ngx_pool_t *pool,
+    ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_file_diff_t *diff)
+{
+    ngx_stream_upstream_rr_peer_t   *peer;
+    ngx_stream_upstream_rr_peers_t  *primary, *peers;
+    ngx_dynamic_upstream_op_t       *op, del;
+    ngx_str_t                       *server;
+    ngx_int_t                        rc = NGX_OK;
+
+    ngx_memzero(&del, sizeof(ngx_dynamic_upstream_op_t));
+
+    del.status = NGX_HTTP_OK;
+    del.upstream = uscf->host;
+    del.op_param = NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM;
+
+    primary = uscf->peer.data;
+
+    ngx_stream_upstream_rr_peers_rlock(primary);
+
+    for (peers = primary; peers && rc == NGX_OK; peers = peers->next) {
+        for (peer = peers->peer; peer && rc == NGX_OK; peer = peer->next) {
+
+            server = peer->server.len ? &peer->server : &peer->name;
+
+            op = ngx_dynamic_upstream_lua_file_match(diff, &peer->server,
+                                                     &peer->name);
+
+            if (op == NULL) {
+                rc = ngx_dynamic_upstream_lua_file_change(pool, diff,
+                         &del, NGX_DYNAMIC_UPSTEAM_OP_REMOVE, server);
+                continue;
+            }
+
+            if ((ngx_uint_t) op->backup != (peers != primary)) {
+
+                /* moved between primary and backup */
+
+                rc = ngx_dynamic_upstream_lua_file_change(pool, diff,
+                         &del, NGX_DYNAMIC_UPSTEAM_OP_REMOVE, server);
+
+                if (rc == NGX_OK) {
+                    rc = ngx_dynamic_upstream_lua_file_change(pool, diff,
+                             op, NGX_DYNAMIC_UPSTEAM_OP_ADD, &op->server);
+                }
+
+                continue;
+            }
+
+            if (ngx_dynamic_upstream_lua_file_changed(op, peer->weight,
+                    peer->max_fails, peer->max_conns, peer->fail_timeout,
+                    peer->down))
+            {
+                rc = ngx_dynamic_upstream_lua_file_change(pool, diff, op,
+                         NGX_DYNAMIC_UPSTEAM_OP_PARAM, &op->server);
+            }
+        }
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(primary);
+
+    return rc;
+}
+
+
+/*
+ * Parameters are changed in one write lock cycle of the batch, so no
+ * request sees a part of the file.  New servers go first, the upstream
+ * is never left empty by the removes following them.
+ */
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_file_apply(ngx_log_t *log, ngx_pool_t *pool,
+    ngx_dynamic_upstream_lua_file_t *f,
+    ngx_dynamic_upstream_lua_file_diff_t *diff)
+{
+    ngx_dynamic_upstream_op_t  *op, *ops;
+    ngx_int_t                  *rcs, rc;
+    ngx_uint_t                  i, n;
+
+    ops = ngx_palloc(pool, (diff->ops.nelts + diff->changes.nelts)
+                           * sizeof(ngx_dynamic_upstream_op_t));
+    rcs = ngx_palloc(pool, (diff->ops.nelts + diff->changes.nelts)
+                           * sizeof(ngx_int_t));
+
+    if (ops == NULL || rcs == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = 0;
+    op = diff->ops.elts;
+
+    for (i = 0; i < diff->ops.nelts; i++) {
+        if (!diff->seen[i]) {
+            ops[n++] = op[i];
+        }
+    }
+
+    op = diff->changes.elts;
+
+    for (i = 0; i < diff->changes.nelts; i++) {
+        ops[n++] = op[i];
+    }
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    if (f->uscf != NULL) {
+        rc = ngx_http_dynamic_upstream_lua_apply_batch(log, pool, f->uscf,
+                                                       ops, rcs, n, 0);
+    } else {
+        rc = ngx_stream_dynamic_upstream_lua_apply_batch(log, pool, f->suscf,
+                                                         ops, rcs, n, 0);
+    }
+
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+
+        if (rcs[i] != NGX_OK && rcs[i] != NGX_AGAIN) {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "dynamic upstream: update of %V in %V from \"%V\" "
+                          "failed: %s", &ops[i].server, &ops[i].upstream,
+                          &f->path,
+                          ops[i].err != NULL ? ops[i].err : "unknown error");
+            continue;
+        }
+
+        switch (ops[i].op) {
+            case NGX_DYNAMIC_UPSTEAM_OP_ADD:
+                diff->added++;
+                break;
+
+            case NGX_DYNAMIC_UPSTEAM_OP_REMOVE:
+                diff->removed++;
+                break;
+
+            default:
+                diff->updated++;
+                break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_file_load(ngx_log_t *log,
+    ngx_dynamic_upstream_lua_file_t *f)
+{
+    ngx_dynamic_upstream_lua_file_diff_t   diff;
+    ngx_pool_t                            *pool;
+    ngx_str_t                              content;
+    ngx_int_t                              rc;
+    const char                            *err;
+
+    f->dirty = 0;
+
+    pool = ngx_create_pool(ngx_pagesize, log);
+    if (pool == NULL) {
+        return;
+    }
+
+    ngx_memzero(&diff, sizeof(ngx_dynamic_upstream_lua_file_diff_t));
+
+    ngx_dynamic_upstream_lua_names_init(&diff.servers, pool);
+    ngx_dynamic_upstream_lua_names_init(&diff.changed, pool);
+
+    if (ngx_array_init(&diff.ops, pool, 16,
+                       sizeof(ngx_dynamic_upstream_op_t)) != NGX_OK
+        || ngx_array_init(&diff.changes, pool, 16,
+                          sizeof(ngx_dynamic_upstream_op_t)) != NGX_OK)
+    {
+        goto done;
+    }
+
+    if (ngx_dynamic_upstream_lua_file_read(pool, log, f, &content)
+            != NGX_OK) {
+        goto done;
+    }
+
+    /* a broken file keeps the current peers */
+
+    if (ngx_dynamic_upstream_lua_file_parse(pool, f, &content, &diff, &err)
+            != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "dynamic upstream: invalid peers in \"%V\": %s",
+                      &f->path, err);
+        goto done;
+    }
+
+    if (f->uscf != NULL) {
+        rc = ngx_http_dynamic_upstream_lua_file_diff(pool, f->uscf, &diff);
+    } else {
+        rc = ngx_stream_dynamic_upstream_lua_file_diff(pool, f->suscf, &diff);
+    }
+
+    if (rc != NGX_OK) {
+        goto done;
+    }
+
+    if (ngx_dynamic_upstream_lua_file_apply(log, pool, f, &diff) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "dynamic upstream: no memory to apply \"%V\"",
+                      &f->path);
+        goto done;
+    }
+
+    if (diff.added || diff.updated || diff.removed) {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "dynamic upstream: %V loaded from \"%V\", "
+                      "%ui added, %ui updated, %ui removed",
+                      f->uscf != NULL ? &f->uscf->host : &f->suscf->host,
+                      &f->path, diff.added, diff.updated, diff.removed);
+    }
+
+done:
+
+    ngx_destroy_pool(pool);
+}
+
+
+static void
+ngx_dynamic_upstream_lua_file_handler(ngx_event_t *ev)
+{
+    ngx_dynamic_upstream_lua_file_t  *f;
+    ngx_file_info_t                   fi;
+    ngx_uint_t                        i;
+
+    if (ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    f = ngx_dynamic_upstream_lua_files->elts;
+
+    for (i = 0; i < ngx_dynamic_upstream_lua_files->nelts; i++) {
+
+        /* without inotify files are polled by mtime */
+
+        if (f[i].wd == -1
+            && ngx_file_info(f[i].path.data, &fi) != NGX_FILE_ERROR
+            && ngx_file_mtime(&fi) != f[i].mtime)
+        {
+            f[i].dirty = 1;
+        }
+
+        if (f[i].dirty) {
+            ngx_dynamic_upstream_lua_file_load(ev->log, &f[i]);
+        }
+    }
+
+    for (i = 0; i < ngx_dynamic_upstream_lua_files->nelts; i++) {
+        if (f[i].wd == -1) {
+            ngx_add_timer(ev, NGX_DYNAMIC_UPSTREAM_LUA_FILE_INTERVAL);
+            break;
+        }
+    }
+}
+
+
+#if (NGX_LINUX)
+
+static void
+ngx_dynamic_upstream_lua_file_notify(ngx_event_t *rev)
+{
+    ngx_connection_t                 *c;
+    ngx_dynamic_upstream_lua_file_t  *f;
+    struct inotify_event             *event;
+    u_char                           *p;
+    ssize_t                           n;
+    size_t                            len;
+    ngx_uint_t                        i;
+
+    union {
+        struct inotify_event          event;
+        u_char                        data[4096];
+    } buf;
+
+    c = rev->data;
+    f = ngx_dynamic_upstream_lua_files->elts;
+
+    /* events are edge triggered, read them all */
+
+    for ( ;; ) {
+
+        n = read(c->fd, buf.data, sizeof(buf));
+
+        if (n == -1) {
+            if (ngx_errno != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ERR, rev->log, ngx_errno,
+                              "dynamic upstream: inotify read() failed");
+            }
+
+            break;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        for (p = buf.data; p < buf.data + n;
+             p += sizeof(struct inotify_event) + len)
+        {
+
+            event = (struct inotify_event *) p;
+            len = event->len;
+
+            if (len == 0) {
+                continue;
+            }
+
+            for (i = 0; i < ngx_dynamic_upstream_lua_files->nelts; i++) {
+                if (f[i].wd == event->wd
+                    && ngx_strcmp(f[i].name.data, event->name) == 0)
+                {
+                    f[i].dirty = 1;
+                }
+            }
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        return;
+    }
+
+    /* writers often replace a file in a few steps, let them finish */
+
+    if (!ngx_dynamic_upstream_lua_file_event.timer_set) {
+        ngx_add_timer(&ngx_dynamic_upstream_lua_file_event,
+                      NGX_DYNAMIC_UPSTREAM_LUA_FILE_DELAY);
+    }
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_file_watch(ngx_cycle_t *cycle)
+{
+    ngx_connection_t                 *c;
+    ngx_dynamic_upstream_lua_file_t  *f;
+    ngx_uint_t                        i;
+    int                               fd;
+
+    fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (fd == -1) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, ngx_errno,
+                      "dynamic upstream: inotify_init1() failed, "
+                      "polling files");
+        return NGX_DECLINED;
+    }
+
+    f = ngx_dynamic_upstream_lua_files->elts;
+
+    for (i = 0; i < ngx_dynamic_upstream_lua_files->nelts; i++) {
+
+        /* the directory is watched to see files replaced by rename() */
+
+        f[i].wd = inotify_add_watch(fd, (char *) f[i].dir.data,
+                                    IN_CLOSE_WRITE|IN_MOVED_TO);
+        if (f[i].wd == -1) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, ngx_errno,
+                          "dynamic upstream: inotify_add_watch(\"%V\") "
+                          "failed, polling \"%V\"", &f[i].dir, &f[i].path);
+        }
+    }
+
+    c = ngx_get_connection(fd, cycle->log);
+    if (c == NULL) {
+        (void) close(fd);
+        return NGX_ERROR;
+    }
+
+    c->read->handler = ngx_dynamic_upstream_lua_file_notify;
+    c->read->log = cycle->log;
+    c->log = cycle->log;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_file_add(ngx_cycle_t *cycle, ngx_str_t *path,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_stream_upstream_srv_conf_t *suscf)
+{
+    ngx_dynamic_upstream_lua_file_t  *f;
+    u_char                           *p;
+
+    f = ngx_array_push(ngx_dynamic_upstream_lua_files);
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(f, sizeof(ngx_dynamic_upstream_lua_file_t));
+
+    f->path = *path;
+    f->uscf = uscf;
+    f->suscf = suscf;
+    f->wd = -1;
+    f->dirty = 1;
+
+    for (p = path->data + path->len; p > path->data; p--) {
+        if (p[-1] == '/') {
+            break;
+        }
+    }
+
+    f->name.data = p;
+    f->name.len = path->data + path->len - p;
+
+    f->dir.len = p > path->data + 1 ? p - path->data - 1 : 1;
+    f->dir.data = ngx_pnalloc(cycle->pool, f->dir.len + 1);
+    if (f->dir.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_cpystrn(f->dir.data, path->data, f->dir.len + 1);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_file_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_upstream_main_conf_t                *umcf;
+    ngx_stream_upstream_main_conf_t              *sumcf;
+    ngx_http_upstream_srv_conf_t                **uscfp;
+    ngx_stream_upstream_srv_conf_t              **suscfp;
+    ngx_http_dynamic_upstream_lua_srv_conf_t     *ucscf;
+    ngx_stream_dynamic_upstream_lua_srv_conf_t   *sucscf;
+    ngx_uint_t                                    i;
+
+    /* one process watches files, the others see peers in the zones */
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    ngx_dynamic_upstream_lua_files = ngx_array_create(cycle->pool, 4,
+        sizeof(ngx_dynamic_upstream_lua_file_t));
+    if (ngx_dynamic_upstream_lua_files == NULL) {
+        return NGX_ERROR;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_upstream_module);
+    if (umcf != NULL) {
+
+        uscfp = umcf->upstreams.elts;
+
+        for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+            if (uscfp[i]->srv_conf == NULL) {
+                continue;
+            }
+
+            ucscf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                        ngx_http_dynamic_upstream_lua_module);
+            if (ucscf == NULL || ucscf->file.len == 0) {
+                continue;
+            }
+
+            if (uscfp[i]->shm_zone == NULL) {
+                ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                              "dynamic upstream: \"%V\" is not loaded, "
+                              "upstream %V has no zone",
+                              &ucscf->file, &uscfp[i]->host);
+                continue;
+            }
+
+            if (ngx_dynamic_upstream_lua_file_add(cycle, &ucscf->file,
+                                                  uscfp[i], NULL)
+                    != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    sumcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                  ngx_stream_upstream_module);
+    if (sumcf != NULL) {
+
+        suscfp = sumcf->upstreams.elts;
+
+        for (i = 0; i < sumcf->upstreams.nelts; i++) {
+
+            if (suscfp[i]->srv_conf == NULL) {
+                continue;
+            }
+
+            sucscf = ngx_stream_conf_upstream_srv_conf(suscfp[i],
+                         ngx_stream_dynamic_upstream_lua_module);
+            if (sucscf == NULL || sucscf->file.len == 0) {
+                continue;
+            }
+
+            if (suscfp[i]->shm_zone == NULL) {
+                ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                              "dynamic upstream: \"%V\" is not loaded, "
+                              "upstream %V has no zone",
+                              &sucscf->file, &suscfp[i]->host);
+                continue;
+            }
+
+            if (ngx_dynamic_upstream_lua_file_add(cycle, &sucscf->file,
+                                                  NULL, suscfp[i])
+                    != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (ngx_dynamic_upstream_lua_files->nelts == 0) {
+        return NGX_OK;
+    }
+
+#if (NGX_LINUX)
+    if (ngx_dynamic_upstream_lua_file_watch(cycle) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+#endif
+
+    ngx_dynamic_upstream_lua_file_event.handler =
+        ngx_dynamic_upstream_lua_file_handler;
+    ngx_dynamic_upstream_lua_file_event.log = cycle->log;
+    ngx_dynamic_upstream_lua_file_event.data = cycle;
+    ngx_dynamic_upstream_lua_file_event.cancelable = 1;
+
+    /* files are loaded once the worker runs its event loop */
+
+    ngx_add_timer(&ngx_dynamic_upstream_lua_file_event, 0);
+
+    return NGX_OK;
+}
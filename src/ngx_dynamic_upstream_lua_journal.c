@@ -0,0 +1,765 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+#include "ngx_dynamic_upstream_lua_json.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+
+
+static ngx_str_t ngx_dynamic_upstream_lua_change_names[] = {
+    ngx_null_string,
+    ngx_string("add"),
+    ngx_string("remove"),
+    ngx_string("param"),
+    ngx_string("swap"),
+    ngx_string("tags")
+};
+
+
+char *
+ngx_dynamic_upstream_lua_journal(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf = conf;
+
+    ngx_str_t  *value;
+    ngx_int_t   n;
+
+    if (mcf->journal_size != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        return "invalid value";
+    }
+
+    mcf->journal_size = n;
+
+    if (ngx_dynamic_upstream_lua_shm_add(cf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_uint_t
+ngx_dynamic_upstream_lua_journal_size(void)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf;
+
+    mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+              ngx_http_dynamic_upstream_lua_module);
+    if (mcf == NULL || mcf->shm_zone == NULL) {
+        return 0;
+    }
+
+    return mcf->journal_size;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_journal_evict_locked(ngx_slab_pool_t *shpool,
+    ngx_dynamic_upstream_lua_journal_t *journal)
+{
+    ngx_dynamic_upstream_lua_change_t  *change;
+
+    change = journal->head;
+
+    journal->head = change->next;
+    if (journal->head == NULL) {
+        journal->tail = NULL;
+    }
+
+    journal->n--;
+
+    ngx_slab_free_locked(shpool, change);
+}
+
+
+static ngx_dynamic_upstream_lua_journal_t *
+ngx_dynamic_upstream_lua_journal_locked(ngx_slab_pool_t *shpool)
+{
+    ngx_dynamic_upstream_lua_shm_t      *sh;
+    ngx_dynamic_upstream_lua_journal_t  *journal;
+
+    sh = shpool->data;
+    journal = &sh->journal;
+
+    if (journal->generation == sh->generation) {
+        return journal;
+    }
+
+    /* peers are configured again on reload, old changes do not apply */
+
+    while (journal->head != NULL) {
+        ngx_dynamic_upstream_lua_journal_evict_locked(shpool, journal);
+    }
+
+    journal->seq = 0;
+    journal->generation = sh->generation;
+
+    return journal;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_journal_add(ngx_dynamic_upstream_lua_change_t *src)
+{
+    ngx_slab_pool_t                     *shpool;
+    ngx_dynamic_upstream_lua_journal_t  *journal;
+    ngx_dynamic_upstream_lua_change_t   *change;
+    ngx_uint_t                           limit, i;
+    size_t                               size;
+    u_char                              *p;
+
+    limit = ngx_dynamic_upstream_lua_journal_size();
+    if (limit == 0) {
+        return;
+    }
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+
+    size = sizeof(ngx_dynamic_upstream_lua_change_t) + src->upstream.len
+           + src->server.len + src->ntags * sizeof(ngx_str_t);
+
+    for (i = 0; i < src->ntags; i++) {
+        size += src->tags[i].len;
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    journal = ngx_dynamic_upstream_lua_journal_locked(shpool);
+
+    journal->seq++;
+
+    while (journal->n >= limit) {
+        ngx_dynamic_upstream_lua_journal_evict_locked(shpool, journal);
+    }
+
+    /* the oldest changes give way, readers behind them resync */
+
+    for ( ;; ) {
+
+        change = ngx_slab_alloc_locked(shpool, size);
+        if (change != NULL) {
+            break;
+        }
+
+        if (journal->head == NULL) {
+            ngx_shmtx_unlock(&shpool->mutex);
+            return;
+        }
+
+        ngx_dynamic_upstream_lua_journal_evict_locked(shpool, journal);
+    }
+
+    *change = *src;
+
+    change->next = NULL;
+    change->seq = journal->seq;
+
+    change->tags = (ngx_str_t *) (change + 1);
+    p = (u_char *) (change->tags + src->ntags);
+
+    change->upstream.data = p;
+    p = ngx_cpymem(p, src->upstream.data, src->upstream.len);
+
+    change->server.data = p;
+    p = ngx_cpymem(p, src->server.data, src->server.len);
+
+    for (i = 0; i < src->ntags; i++) {
+        change->tags[i].data = p;
+        change->tags[i].len = src->tags[i].len;
+        p = ngx_cpymem(p, src->tags[i].data, src->tags[i].len);
+    }
+
+    if (journal->tail != NULL) {
+        journal->tail->next = change;
+    } else {
+        journal->head = change;
+    }
+
+    journal->tail = change;
+    journal->n++;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+void
+ngx_dynamic_upstream_lua_journal_op(ngx_str_t *upstream, ngx_uint_t flags,
+    ngx_dynamic_upstream_op_t *op)
+{
+    ngx_dynamic_upstream_lua_change_t  change;
+
+    ngx_memzero(&change, sizeof(ngx_dynamic_upstream_lua_change_t));
+
+    switch (op->op) {
+        case NGX_DYNAMIC_UPSTEAM_OP_ADD:
+            change.type = NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_ADD;
+            break;
+
+        case NGX_DYNAMIC_UPSTEAM_OP_REMOVE:
+            change.type = NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_REMOVE;
+            break;
+
+        case NGX_DYNAMIC_UPSTEAM_OP_PARAM:
+            change.type = NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_PARAM;
+            break;
+
+        default:
+            return;
+    }
+
+    change.flags = flags & NGX_DYNAMIC_UPSTREAM_LUA_STREAM;
+    change.op_param = op->op_param;
+    change.backup = op->backup;
+    change.weight = op->weight;
+    change.max_fails = op->max_fails;
+    change.max_conns = op->max_conns;
+    change.fail_timeout = op->fail_timeout;
+    change.upstream = *upstream;
+    change.server = op->server;
+
+    ngx_dynamic_upstream_lua_journal_add(&change);
+}
+
+
+void
+ngx_dynamic_upstream_lua_journal_swap(ngx_str_t *upstream, ngx_uint_t flags)
+{
+    ngx_dynamic_upstream_lua_change_t  change;
+
+    ngx_memzero(&change, sizeof(ngx_dynamic_upstream_lua_change_t));
+
+    change.type = NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_SWAP;
+    change.flags = flags & NGX_DYNAMIC_UPSTREAM_LUA_STREAM;
+    change.upstream = *upstream;
+
+    ngx_dynamic_upstream_lua_journal_add(&change);
+}
+
+
+void
+ngx_dynamic_upstream_lua_journal_tags(ngx_str_t *upstream, ngx_uint_t flags,
+    ngx_str_t *server, ngx_str_t *tags, ngx_uint_t n)
+{
+    ngx_dynamic_upstream_lua_change_t  change;
+
+    ngx_memzero(&change, sizeof(ngx_dynamic_upstream_lua_change_t));
+
+    change.type = NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_TAGS;
+    change.flags = flags & NGX_DYNAMIC_UPSTREAM_LUA_STREAM;
+    change.upstream = *upstream;
+    change.server = *server;
+    change.tags = tags;
+    change.ntags = n;
+
+    ngx_dynamic_upstream_lua_journal_add(&change);
+}
+
+
+static u_char *
+ngx_dynamic_upstream_lua_journal_string(u_char *p, ngx_str_t *s)
+{
+    *p++ = '"';
+    p = (u_char *) ngx_escape_json(p, s->data, s->len);
+    *p++ = '"';
+
+    return p;
+}
+
+
+static size_t
+ngx_dynamic_upstream_lua_journal_change_size(
+    ngx_dynamic_upstream_lua_change_t *change)
+{
+    size_t      size;
+    ngx_uint_t  i;
+
+    /* [seq,"type",stream,"upstream","server",...] */
+
+    size = sizeof("[,\"\",,\"\",\"\"],") - 1 + 2 * NGX_INT_T_LEN
+           + ngx_dynamic_upstream_lua_change_names[change->type].len
+           + change->upstream.len
+           + ngx_escape_json(NULL, change->upstream.data,
+                             change->upstream.len)
+           + change->server.len
+           + ngx_escape_json(NULL, change->server.data, change->server.len);
+
+    switch (change->type) {
+        case NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_SWAP:
+            break;
+
+        case NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_TAGS:
+            size += sizeof(",[]") - 1;
+
+            for (i = 0; i < change->ntags; i++) {
+                size += sizeof("\"\",") - 1 + change->tags[i].len
+                        + ngx_escape_json(NULL, change->tags[i].data,
+                                          change->tags[i].len);
+            }
+
+            break;
+
+        default:
+            size += sizeof(",,,,,,") - 1 + 6 * NGX_INT_T_LEN;
+            break;
+    }
+
+    return size;
+}
+
+
+static u_char *
+ngx_dynamic_upstream_lua_journal_change(u_char *p,
+    ngx_dynamic_upstream_lua_change_t *change)
+{
+    ngx_uint_t  i;
+
+    p = ngx_sprintf(p, "[%ui,\"%V\",%ui,", change->seq,
+                    &ngx_dynamic_upstream_lua_change_names[change->type],
+                    (ngx_uint_t) (change->flags != 0));
+
+    p = ngx_dynamic_upstream_lua_journal_string(p, &change->upstream);
+    *p++ = ',';
+    p = ngx_dynamic_upstream_lua_journal_string(p, &change->server);
+
+    switch (change->type) {
+        case NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_SWAP:
+            break;
+
+        case NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_TAGS:
+            p = ngx_cpymem(p, ",[", 2);
+
+            for (i = 0; i < change->ntags; i++) {
+                if (i != 0) {
+                    *p++ = ',';
+                }
+
+                p = ngx_dynamic_upstream_lua_journal_string(p,
+                                                            &change->tags[i]);
+            }
+
+            *p++ = ']';
+            break;
+
+        default:
+            p = ngx_sprintf(p, ",%ui,%ui,%i,%i,%i,%T", change->op_param,
+                            (ngx_uint_t) (change->backup != 0),
+                            change->weight, change->max_fails,
+                            change->max_conns, change->fail_timeout);
+            break;
+    }
+
+    *p++ = ']';
+
+    return p;
+}
+
+
+ngx_buf_t *
+ngx_dynamic_upstream_lua_journal_export(ngx_pool_t *pool, ngx_uint_t since,
+    const char **err)
+{
+    ngx_slab_pool_t                     *shpool;
+    ngx_dynamic_upstream_lua_journal_t  *journal;
+    ngx_dynamic_upstream_lua_change_t   *change;
+    ngx_buf_t                           *b;
+    size_t                               size;
+
+    if (ngx_dynamic_upstream_lua_journal_size() == 0) {
+        *err = "journal is disabled, use dynamic_upstream_journal";
+        return NULL;
+    }
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    journal = ngx_dynamic_upstream_lua_journal_locked(shpool);
+
+    /* evicted changes can not be replayed, the reader has to resync */
+
+    if (since < journal->seq
+        && (journal->head == NULL || journal->head->seq > since + 1))
+    {
+        ngx_shmtx_unlock(&shpool->mutex);
+        *err = "changes are lost";
+        return NULL;
+    }
+
+    size = sizeof("{\"last\":,\"changes\":[]}") - 1 + NGX_INT_T_LEN;
+
+    for (change = journal->head; change; change = change->next) {
+        if (change->seq > since) {
+            size += ngx_dynamic_upstream_lua_journal_change_size(change);
+        }
+    }
+
+    b = ngx_create_temp_buf(pool, size);
+    if (b == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        *err = "no memory";
+        return NULL;
+    }
+
+    b->last = ngx_sprintf(b->last, "{\"last\":%ui,\"changes\":[",
+                          journal->seq);
+
+    for (change = journal->head; change; change = change->next) {
+
+        if (change->seq <= since) {
+            continue;
+        }
+
+        if (b->last[-1] != '[') {
+            *b->last++ = ',';
+        }
+
+        b->last = ngx_dynamic_upstream_lua_journal_change(b->last, change);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    b->last = ngx_cpymem(b->last, "]}", 2);
+
+    return b;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_journal_field(ngx_dynamic_upstream_lua_json_t *js)
+{
+    ngx_int_t  rc;
+
+    rc = ngx_dynamic_upstream_lua_json_next(js, ']');
+
+    if (rc == NGX_DONE) {
+        js->err = "change is truncated";
+        return NGX_ERROR;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_journal_parse(ngx_dynamic_upstream_lua_json_t *js,
+    ngx_dynamic_upstream_lua_change_t *change)
+{
+    ngx_str_t   type;
+    ngx_int_t   n, rc;
+    ngx_uint_t  i;
+    ngx_flag_t  f;
+
+    ngx_memzero(change, sizeof(ngx_dynamic_upstream_lua_change_t));
+
+    if (ngx_dynamic_upstream_lua_json_begin(js, '[') != NGX_OK
+        || ngx_dynamic_upstream_lua_json_number(js, &n) != NGX_OK
+        || ngx_dynamic_upstream_lua_journal_field(js) != NGX_OK
+        || ngx_dynamic_upstream_lua_json_string(js, &type) != NGX_OK
+        || ngx_dynamic_upstream_lua_journal_field(js) != NGX_OK
+        || ngx_dynamic_upstream_lua_json_boolean(js, &f) != NGX_OK
+        || ngx_dynamic_upstream_lua_journal_field(js) != NGX_OK
+        || ngx_dynamic_upstream_lua_json_string(js, &change->upstream)
+               != NGX_OK
+        || ngx_dynamic_upstream_lua_journal_field(js) != NGX_OK
+        || ngx_dynamic_upstream_lua_json_string(js, &change->server)
+               != NGX_OK)
+    {
+        if (js->err == NULL) {
+            js->err = "change expected";
+        }
+
+        return NGX_ERROR;
+    }
+
+    change->seq = n;
+    change->flags = f ? NGX_DYNAMIC_UPSTREAM_LUA_STREAM : 0;
+
+    for (i = NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_ADD;
+         i <= NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_TAGS;
+         i++)
+    {
+        if (type.len == ngx_dynamic_upstream_lua_change_names[i].len
+            && ngx_strncmp(type.data,
+                           ngx_dynamic_upstream_lua_change_names[i].data,
+                           type.len) == 0)
+        {
+            change->type = i;
+            break;
+        }
+    }
+
+    switch (change->type) {
+        case 0:
+            js->err = "unknown change";
+            return NGX_ERROR;
+
+        case NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_SWAP:
+            break;
+
+        case NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_TAGS:
+            change->tags = ngx_palloc(js->pool,
+                NGX_DYNAMIC_UPSTREAM_LUA_MAX_TAGS * sizeof(ngx_str_t));
+            if (change->tags == NULL) {
+                js->err = "no memory";
+                return NGX_ERROR;
+            }
+
+            if (ngx_dynamic_upstream_lua_journal_field(js) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            rc = ngx_dynamic_upstream_lua_json_begin(js, '[');
+
+            while (rc == NGX_OK) {
+
+                if (change->ntags == NGX_DYNAMIC_UPSTREAM_LUA_MAX_TAGS) {
+                    js->err = "too many tags";
+                    return NGX_ERROR;
+                }
+
+                if (ngx_dynamic_upstream_lua_json_string(js,
+                        &change->tags[change->ntags]) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                change->ntags++;
+
+                rc = ngx_dynamic_upstream_lua_json_next(js, ']');
+            }
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            break;
+
+        default:
+            if (ngx_dynamic_upstream_lua_journal_field(js) != NGX_OK
+                || ngx_dynamic_upstream_lua_json_number(js, &n) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            change->op_param = n;
+
+            if (ngx_dynamic_upstream_lua_journal_field(js) != NGX_OK
+                || ngx_dynamic_upstream_lua_json_boolean(js, &change->backup)
+                       != NGX_OK
+                || ngx_dynamic_upstream_lua_journal_field(js) != NGX_OK
+                || ngx_dynamic_upstream_lua_json_number(js, &change->weight)
+                       != NGX_OK
+                || ngx_dynamic_upstream_lua_journal_field(js) != NGX_OK
+                || ngx_dynamic_upstream_lua_json_number(js,
+                       &change->max_fails) != NGX_OK
+                || ngx_dynamic_upstream_lua_journal_field(js) != NGX_OK
+                || ngx_dynamic_upstream_lua_json_number(js,
+                       &change->max_conns) != NGX_OK
+                || ngx_dynamic_upstream_lua_journal_field(js) != NGX_OK
+                || ngx_dynamic_upstream_lua_json_number(js, &n) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            change->fail_timeout = n;
+
+            break;
+    }
+
+    if (ngx_dynamic_upstream_lua_json_next(js, ']') != NGX_DONE) {
+        js->err = "']' expected";
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_journal_change_op(
+    ngx_dynamic_upstream_lua_change_t *change, ngx_dynamic_upstream_op_t *op)
+{
+    ngx_memzero(op, sizeof(ngx_dynamic_upstream_op_t));
+
+    switch (change->type) {
+        case NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_ADD:
+            op->op = NGX_DYNAMIC_UPSTEAM_OP_ADD;
+            break;
+
+        case NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_REMOVE:
+            op->op = NGX_DYNAMIC_UPSTEAM_OP_REMOVE;
+            break;
+
+        default:
+            op->op = NGX_DYNAMIC_UPSTEAM_OP_PARAM;
+            break;
+    }
+
+    op->status = NGX_HTTP_OK;
+    op->upstream = change->upstream;
+    op->server = change->server;
+    op->op_param = change->op_param;
+    op->backup = change->backup;
+    op->weight = change->weight;
+    op->max_fails = change->max_fails;
+    op->max_conns = change->max_conns;
+    op->fail_timeout = change->fail_timeout;
+
+    op->up = (change->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP) != 0;
+    op->down = (change->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) != 0;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_journal_replay(ngx_log_t *log,
+    ngx_dynamic_upstream_lua_change_t *change)
+{
+    ngx_dynamic_upstream_op_t        op;
+    ngx_http_upstream_srv_conf_t    *uscf;
+    ngx_stream_upstream_srv_conf_t  *suscf;
+
+    uscf = NULL;
+    suscf = NULL;
+
+    if (change->flags & NGX_DYNAMIC_UPSTREAM_LUA_STREAM) {
+        suscf = ngx_stream_dynamic_upstream_lua_upstream(&change->upstream);
+    } else {
+        uscf = ngx_http_dynamic_upstream_lua_upstream(&change->upstream);
+    }
+
+    if (uscf == NULL && suscf == NULL) {
+        return NGX_DECLINED;
+    }
+
+    switch (change->type) {
+        case NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_SWAP:
+            return uscf != NULL
+                   ? ngx_http_dynamic_upstream_lua_swap(log, uscf)
+                   : ngx_stream_dynamic_upstream_lua_swap(log, suscf);
+
+        case NGX_DYNAMIC_UPSTREAM_LUA_CHANGE_TAGS:
+            return ngx_dynamic_upstream_lua_tag_set(&change->upstream,
+                                                    change->flags,
+                                                    &change->server,
+                                                    change->tags,
+                                                    change->ntags);
+
+        default:
+            break;
+    }
+
+    ngx_dynamic_upstream_lua_journal_change_op(change, &op);
+
+    return uscf != NULL
+           ? ngx_http_dynamic_upstream_lua_apply(log, &op, uscf)
+           : ngx_stream_dynamic_upstream_lua_apply(log, &op, suscf);
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_journal_import(ngx_log_t *log, ngx_pool_t *pool,
+    ngx_str_t *blob, ngx_uint_t *applied, const char **err)
+{
+    ngx_dynamic_upstream_lua_json_t     js;
+    ngx_dynamic_upstream_lua_change_t  *change;
+    ngx_array_t                         changes;
+    ngx_str_t                           key;
+    ngx_int_t                           rc;
+    ngx_uint_t                          i;
+
+    *applied = 0;
+
+    if (ngx_array_init(&changes, pool, 16,
+                       sizeof(ngx_dynamic_upstream_lua_change_t))
+        != NGX_OK)
+    {
+        *err = "no memory";
+        return NGX_ERROR;
+    }
+
+    ngx_dynamic_upstream_lua_json_init(&js, blob->data, blob->len, pool);
+
+    if (ngx_dynamic_upstream_lua_json_validate(&js) != NGX_OK) {
+        goto error;
+    }
+
+    rc = ngx_dynamic_upstream_lua_json_begin(&js, '{');
+
+    while (rc == NGX_OK) {
+
+        if (ngx_dynamic_upstream_lua_json_key(&js, &key) != NGX_OK) {
+            goto error;
+        }
+
+        if (key.len != 7 || ngx_strncmp(key.data, "changes", 7) != 0) {
+
+            if (ngx_dynamic_upstream_lua_json_skip(&js) != NGX_OK) {
+                goto error;
+            }
+
+            rc = ngx_dynamic_upstream_lua_json_next(&js, '}');
+            continue;
+        }
+
+        rc = ngx_dynamic_upstream_lua_json_begin(&js, '[');
+
+        while (rc == NGX_OK) {
+
+            change = ngx_array_push(&changes);
+            if (change == NULL) {
+                js.err = "no memory";
+                goto error;
+            }
+
+            if (ngx_dynamic_upstream_lua_journal_parse(&js, change)
+                    != NGX_OK) {
+                goto error;
+            }
+
+            rc = ngx_dynamic_upstream_lua_json_next(&js, ']');
+        }
+
+        if (rc == NGX_ERROR) {
+            goto error;
+        }
+
+        rc = ngx_dynamic_upstream_lua_json_next(&js, '}');
+    }
+
+    if (rc == NGX_ERROR) {
+        goto error;
+    }
+
+    /* a malformed document is rejected before any change is applied */
+
+    change = changes.elts;
+
+    for (i = 0; i < changes.nelts; i++) {
+
+        /* replay is idempotent enough, failed changes are skipped */
+
+        if (ngx_dynamic_upstream_lua_journal_replay(log, &change[i])
+                == NGX_OK) {
+            (*applied)++;
+        }
+    }
+
+    return NGX_OK;
+
+error:
+
+    *err = js.err;
+
+    return NGX_ERROR;
+}
@@ -0,0 +1,637 @@
+#include <ngx_core.h>
+
+
+#include "ngx_dynamic_upstream_lua_json.h"
+
+
+#define ngx_json_error(js, msg)  ((js)->err = (msg), NGX_ERROR)
+
+
+void
+ngx_dynamic_upstream_lua_json_init(ngx_dynamic_upstream_lua_json_t *js,
+    u_char *data, size_t len, ngx_pool_t *pool)
+{
+    js->start = data;
+    js->pos = data;
+    js->last = data + len;
+    js->pool = pool;
+    js->err = NULL;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_json_ws(ngx_dynamic_upstream_lua_json_t *js)
+{
+    while (js->pos < js->last) {
+        switch (*js->pos) {
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+                js->pos++;
+                break;
+
+            default:
+                return;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_json_literal(ngx_dynamic_upstream_lua_json_t *js,
+    const char *lit, size_t len)
+{
+    if ((size_t) (js->last - js->pos) < len
+        || ngx_strncmp(js->pos, lit, len) != 0) {
+        return ngx_json_error(js, "unexpected token");
+    }
+
+    js->pos += len;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_begin(ngx_dynamic_upstream_lua_json_t *js,
+    u_char open)
+{
+    ngx_dynamic_upstream_lua_json_ws(js);
+
+    if (js->pos == js->last || *js->pos != open) {
+        return ngx_json_error(js, open == '{' ? "object expected"
+                                              : "array expected");
+    }
+
+    js->pos++;
+
+    ngx_dynamic_upstream_lua_json_ws(js);
+
+    if (js->pos < js->last && *js->pos == (open == '{' ? '}' : ']')) {
+        js->pos++;
+        return NGX_DONE;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_next(ngx_dynamic_upstream_lua_json_t *js,
+    u_char close)
+{
+    ngx_dynamic_upstream_lua_json_ws(js);
+
+    if (js->pos == js->last) {
+        return ngx_json_error(js, "unexpected end of document");
+    }
+
+    if (*js->pos == ',') {
+        js->pos++;
+        return NGX_OK;
+    }
+
+    if (*js->pos == close) {
+        js->pos++;
+        return NGX_DONE;
+    }
+
+    return ngx_json_error(js, close == '}' ? "',' or '}' expected"
+                                           : "',' or ']' expected");
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_json_hex(u_char *p)
+{
+    ngx_int_t  n;
+
+    n = ngx_hextoi(p, 4);
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return n;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_string(ngx_dynamic_upstream_lua_json_t *js,
+    ngx_str_t *s)
+{
+    u_char     *p, *dst;
+    ngx_int_t   ch, lo;
+    ngx_flag_t  escaped = 0;
+
+    ngx_dynamic_upstream_lua_json_ws(js);
+
+    if (js->pos == js->last || *js->pos != '"') {
+        return ngx_json_error(js, "string expected");
+    }
+
+    for (p = ++js->pos; p < js->last && *p != '"'; p++) {
+        if (*p == '\\') {
+            escaped = 1;
+            if (++p == js->last) {
+                break;
+            }
+        } else if (*p < 0x20) {
+            return ngx_json_error(js, "control character in string");
+        }
+    }
+
+    if (p == js->last) {
+        return ngx_json_error(js, "unterminated string");
+    }
+
+    if (!escaped) {
+        s->data = js->pos;
+        s->len = p - js->pos;
+        js->pos = p + 1;
+        return NGX_OK;
+    }
+
+    if (js->pool == NULL) {
+        /* validation only */
+        js->pos = p + 1;
+        ngx_str_null(s);
+        return NGX_OK;
+    }
+
+    /* utf-8 of \uXXXX never takes more bytes than its escape */
+
+    s->data = ngx_pnalloc(js->pool, p - js->pos);
+    if (s->data == NULL) {
+        return ngx_json_error(js, "no memory");
+    }
+
+    for (dst = s->data; js->pos < p; js->pos++) {
+
+        if (*js->pos != '\\') {
+            *dst++ = *js->pos;
+            continue;
+        }
+
+        switch (*++js->pos) {
+            case '"':
+            case '\\':
+            case '/':
+                *dst++ = *js->pos;
+                break;
+
+            case 'b':
+                *dst++ = '\b';
+                break;
+
+            case 'f':
+                *dst++ = '\f';
+                break;
+
+            case 'n':
+                *dst++ = '\n';
+                break;
+
+            case 'r':
+                *dst++ = '\r';
+                break;
+
+            case 't':
+                *dst++ = '\t';
+                break;
+
+            case 'u':
+                if (p - js->pos < 5
+                    || (ch = ngx_dynamic_upstream_lua_json_hex(js->pos + 1))
+                           == NGX_ERROR) {
+                    return ngx_json_error(js, "invalid unicode escape");
+                }
+
+                js->pos += 4;
+
+                /* a pair of surrogates is one code point */
+
+                if (ch >= 0xdc00 && ch <= 0xdfff) {
+                    return ngx_json_error(js, "invalid unicode escape");
+                }
+
+                if (ch >= 0xd800 && ch <= 0xdbff) {
+
+                    if (p - js->pos < 7
+                        || js->pos[1] != '\\' || js->pos[2] != 'u'
+                        || (lo = ngx_dynamic_upstream_lua_json_hex(js->pos + 3))
+                           == NGX_ERROR
+                        || lo < 0xdc00 || lo > 0xdfff)
+                    {
+                        return ngx_json_error(js, "invalid unicode escape");
+                    }
+
+                    js->pos += 6;
+
+                    ch = 0x10000 + ((ch - 0xd800) << 10) + (lo - 0xdc00);
+                }
+
+                if (ch < 0x80) {
+                    *dst++ = (u_char) ch;
+                } else if (ch < 0x800) {
+                    *dst++ = (u_char) (0xc0 | (ch >> 6));
+                    *dst++ = (u_char) (0x80 | (ch & 0x3f));
+                } else if (ch < 0x10000) {
+                    *dst++ = (u_char) (0xe0 | (ch >> 12));
+                    *dst++ = (u_char) (0x80 | ((ch >> 6) & 0x3f));
+                    *dst++ = (u_char) (0x80 | (ch & 0x3f));
+                } else {
+                    *dst++ = (u_char) (0xf0 | (ch >> 18));
+                    *dst++ = (u_char) (0x80 | ((ch >> 12) & 0x3f));
+                    *dst++ = (u_char) (0x80 | ((ch >> 6) & 0x3f));
+                    *dst++ = (u_char) (0x80 | (ch & 0x3f));
+                }
+
+                break;
+
+            default:
+                return ngx_json_error(js, "invalid escape");
+        }
+    }
+
+    s->len = dst - s->data;
+    js->pos = p + 1;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_key(ngx_dynamic_upstream_lua_json_t *js,
+    ngx_str_t *key)
+{
+    if (ngx_dynamic_upstream_lua_json_string(js, key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_dynamic_upstream_lua_json_ws(js);
+
+    if (js->pos == js->last || *js->pos != ':') {
+        return ngx_json_error(js, "':' expected");
+    }
+
+    js->pos++;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_number(ngx_dynamic_upstream_lua_json_t *js,
+    ngx_int_t *n)
+{
+    ngx_flag_t  negative = 0;
+    u_char     *start;
+
+    ngx_dynamic_upstream_lua_json_ws(js);
+
+    if (js->pos < js->last && *js->pos == '-') {
+        negative = 1;
+        js->pos++;
+    }
+
+    *n = 0;
+
+    for (start = js->pos;
+         js->pos < js->last && *js->pos >= '0' && *js->pos <= '9';
+         js->pos++) {
+
+        if (*n > (NGX_MAX_INT_T_VALUE - 9) / 10) {
+            return ngx_json_error(js, "number is too big");
+        }
+
+        *n = *n * 10 + (*js->pos - '0');
+    }
+
+    if (js->pos == start) {
+        return ngx_json_error(js, "number expected");
+    }
+
+    if (*start == '0' && js->pos - start > 1) {
+        return ngx_json_error(js, "invalid number");
+    }
+
+    /* fraction and exponent are accepted and truncated */
+
+    if (js->pos < js->last && *js->pos == '.') {
+
+        for (start = ++js->pos;
+             js->pos < js->last && *js->pos >= '0' && *js->pos <= '9';
+             js->pos++) { /* void */ }
+
+        if (js->pos == start) {
+            return ngx_json_error(js, "invalid number");
+        }
+    }
+
+    if (js->pos < js->last && (*js->pos == 'e' || *js->pos == 'E')) {
+
+        js->pos++;
+
+        if (js->pos < js->last && (*js->pos == '+' || *js->pos == '-')) {
+            js->pos++;
+        }
+
+        for (start = js->pos;
+             js->pos < js->last && *js->pos >= '0' && *js->pos <= '9';
+             js->pos++) { /* void */ }
+
+        if (js->pos == start) {
+            return ngx_json_error(js, "invalid number");
+        }
+    }
+
+    if (js->pos < js->last) {
+        switch (*js->pos) {
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+            case ',':
+            case '}':
+            case ']':
+                break;
+
+            default:
+                return ngx_json_error(js, "invalid number");
+        }
+    }
+
+    if (negative) {
+        *n = -*n;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_boolean(ngx_dynamic_upstream_lua_json_t *js,
+    ngx_flag_t *f)
+{
+    ngx_int_t  n;
+
+    ngx_dynamic_upstream_lua_json_ws(js);
+
+    if (js->pos == js->last) {
+        return ngx_json_error(js, "boolean expected");
+    }
+
+    switch (*js->pos) {
+        case 't':
+            *f = 1;
+            return ngx_dynamic_upstream_lua_json_literal(js, "true", 4);
+
+        case 'f':
+            *f = 0;
+            return ngx_dynamic_upstream_lua_json_literal(js, "false", 5);
+
+        default:
+            break;
+    }
+
+    if (ngx_dynamic_upstream_lua_json_number(js, &n) != NGX_OK) {
+        return ngx_json_error(js, "boolean expected");
+    }
+
+    *f = n != 0;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_skip(ngx_dynamic_upstream_lua_json_t *js)
+{
+    ngx_str_t   s;
+    ngx_int_t   n, rc;
+    u_char      close;
+
+    ngx_dynamic_upstream_lua_json_ws(js);
+
+    if (js->pos == js->last) {
+        return ngx_json_error(js, "unexpected end of document");
+    }
+
+    switch (*js->pos) {
+        case '"':
+            return ngx_dynamic_upstream_lua_json_string(js, &s);
+
+        case 't':
+            return ngx_dynamic_upstream_lua_json_literal(js, "true", 4);
+
+        case 'f':
+            return ngx_dynamic_upstream_lua_json_literal(js, "false", 5);
+
+        case 'n':
+            return ngx_dynamic_upstream_lua_json_literal(js, "null", 4);
+
+        case '{':
+        case '[':
+            close = *js->pos == '{' ? '}' : ']';
+
+            rc = ngx_dynamic_upstream_lua_json_begin(js, *js->pos);
+
+            while (rc == NGX_OK) {
+
+                if (close == '}'
+                    && ngx_dynamic_upstream_lua_json_key(js, &s) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                if (ngx_dynamic_upstream_lua_json_skip(js) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                rc = ngx_dynamic_upstream_lua_json_next(js, close);
+            }
+
+            return rc == NGX_DONE ? NGX_OK : NGX_ERROR;
+
+        default:
+            break;
+    }
+
+    return ngx_dynamic_upstream_lua_json_number(js, &n);
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_validate(ngx_dynamic_upstream_lua_json_t *js)
+{
+    ngx_pool_t  *pool = js->pool;
+    ngx_int_t    rc;
+
+    js->pool = NULL;
+
+    rc = ngx_dynamic_upstream_lua_json_skip(js);
+
+    if (rc == NGX_OK) {
+        ngx_dynamic_upstream_lua_json_ws(js);
+        if (js->pos != js->last) {
+            rc = ngx_json_error(js, "trailing garbage");
+        }
+    }
+
+    if (rc == NGX_OK) {
+        js->pos = js->start;
+    }
+
+    js->pool = pool;
+
+    return rc;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_peer(ngx_dynamic_upstream_lua_json_t *js,
+    ngx_dynamic_upstream_op_t *op)
+{
+    ngx_str_t   key;
+    ngx_int_t   rc, n;
+    ngx_flag_t  f;
+    ngx_url_t   u;
+
+    rc = ngx_dynamic_upstream_lua_json_begin(js, '{');
+
+    while (rc == NGX_OK) {
+
+        if (ngx_dynamic_upstream_lua_json_key(js, &key) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (key.len == 6 && ngx_strncmp(key.data, "server", 6) == 0) {
+
+            if (ngx_dynamic_upstream_lua_json_string(js, &op->server)
+                    != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+        } else if (key.len == 6 && ngx_strncmp(key.data, "weight", 6) == 0) {
+
+            if (ngx_dynamic_upstream_lua_json_number(js, &n) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            op->weight = n;
+            op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT;
+
+        } else if (key.len == 9
+                   && ngx_strncmp(key.data, "max_fails", 9) == 0) {
+
+            if (ngx_dynamic_upstream_lua_json_number(js, &n) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            op->max_fails = n;
+            op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS;
+
+        } else if (key.len == 9
+                   && ngx_strncmp(key.data, "max_conns", 9) == 0) {
+
+            if (ngx_dynamic_upstream_lua_json_number(js, &n) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            op->max_conns = n;
+            op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS;
+
+        } else if (key.len == 12
+                   && ngx_strncmp(key.data, "fail_timeout", 12) == 0) {
+
+            if (ngx_dynamic_upstream_lua_json_number(js, &n) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            op->fail_timeout = n;
+            op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT;
+
+        } else if (key.len == 6 && ngx_strncmp(key.data, "backup", 6) == 0) {
+
+            if (ngx_dynamic_upstream_lua_json_boolean(js, &f) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            op->backup = f;
+
+        } else if (key.len == 4 && ngx_strncmp(key.data, "down", 4) == 0) {
+
+            if (ngx_dynamic_upstream_lua_json_boolean(js, &f) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (f) {
+                op->down = 1;
+                op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+            } else {
+                op->up = 1;
+                op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+            }
+
+        } else if (ngx_dynamic_upstream_lua_json_skip(js) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        rc = ngx_dynamic_upstream_lua_json_next(js, '}');
+    }
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (op->server.len == 0) {
+        return ngx_json_error(js, "peer without server");
+    }
+
+    /* whole document is checked before the first change */
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT)
+        && (op->weight <= 0 || op->weight > NGX_MAX_INT32_VALUE))
+    {
+        return ngx_json_error(js, "invalid weight");
+    }
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS)
+        && op->max_fails < 0)
+    {
+        return ngx_json_error(js, "invalid max_fails");
+    }
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS)
+        && op->max_conns < 0)
+    {
+        return ngx_json_error(js, "invalid max_conns");
+    }
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT)
+        && op->fail_timeout < 0)
+    {
+        return ngx_json_error(js, "invalid fail_timeout");
+    }
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = op->server;
+    u.no_resolve = 1;
+
+    /* stream servers have no default port */
+
+    if (!(op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM)) {
+        u.default_port = 80;
+    }
+
+    if (ngx_parse_url(js->pool, &u) != NGX_OK) {
+        return ngx_json_error(js, "invalid server");
+    }
+
+    if (u.no_port && u.default_port == 0) {
+        return ngx_json_error(js, "no port in server");
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,59 @@
+#ifndef _ngx_dynamic_upstream_lua_json_h_
+#define _ngx_dynamic_upstream_lua_json_h_
+
+
+#include <ngx_core.h>
+
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+typedef struct {
+    u_char      *start;
+    u_char      *pos;
+    u_char      *last;
+    ngx_pool_t  *pool;
+    const char  *err;
+} ngx_dynamic_upstream_lua_json_t;
+
+
+void
+ngx_dynamic_upstream_lua_json_init(ngx_dynamic_upstream_lua_json_t *js,
+    u_char *data, size_t len, ngx_pool_t *pool);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_validate(ngx_dynamic_upstream_lua_json_t *js);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_begin(ngx_dynamic_upstream_lua_json_t *js,
+    u_char open);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_next(ngx_dynamic_upstream_lua_json_t *js,
+    u_char close);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_key(ngx_dynamic_upstream_lua_json_t *js,
+    ngx_str_t *key);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_string(ngx_dynamic_upstream_lua_json_t *js,
+    ngx_str_t *s);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_number(ngx_dynamic_upstream_lua_json_t *js,
+    ngx_int_t *n);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_boolean(ngx_dynamic_upstream_lua_json_t *js,
+    ngx_flag_t *f);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_skip(ngx_dynamic_upstream_lua_json_t *js);
+
+ngx_int_t
+ngx_dynamic_upstream_lua_json_peer(ngx_dynamic_upstream_lua_json_t *js,
+    ngx_dynamic_upstream_op_t *op);
+
+
+#endif
@@ -13,30 +13,187 @@ ngx_module_t ngx_http_dynamic_upstream_lua_module;
 static ngx_int_t
 ngx_http_dynamic_upstream_lua_post_conf(ngx_conf_t *cf);
 
+static ngx_int_t
+ngx_http_dynamic_upstream_lua_init_process(ngx_cycle_t *cycle);
+
+static void
+ngx_http_dynamic_upstream_lua_exit_process(ngx_cycle_t *cycle);
+
+static void *
+ngx_http_dynamic_upstream_lua_create_main_conf(ngx_conf_t *cf);
+
+static char *
+ngx_http_dynamic_upstream_lua_init_main_conf(ngx_conf_t *cf, void *conf);
+
+static void *
+ngx_http_dynamic_upstream_lua_create_srv_conf(ngx_conf_t *cf);
+
+static void *
+ngx_http_dynamic_upstream_lua_create_loc_conf(ngx_conf_t *cf);
+
+static char *
+ngx_http_dynamic_upstream_lua_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+
+
+static ngx_command_t ngx_http_dynamic_upstream_lua_commands[] = {
+
+    { ngx_string("dynamic_upstream_api"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_dynamic_upstream_lua_api,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_upstream_shm_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_dynamic_upstream_lua_shm_size,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_dynamic_upstream_lua_main_conf_t, shm_size),
+      NULL },
+
+    { ngx_string("dynamic_upstream_stage_interval"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_dynamic_upstream_lua_stage_interval,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_upstream_journal"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_dynamic_upstream_lua_journal,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_upstream_read_replicas"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_dynamic_upstream_lua_read_replicas,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_dynamic_upstream_lua_main_conf_t, read_replicas),
+      NULL },
+
+    { ngx_string("dynamic_upstream_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_dynamic_upstream_lua_pool,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_consistent_hash"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_http_dynamic_upstream_lua_chash,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_ewma"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_dynamic_upstream_lua_ewma,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_warmup"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_dynamic_upstream_lua_warmup,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_outlier_detection"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_dynamic_upstream_lua_outlier,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_backup_threshold"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_dynamic_upstream_lua_threshold,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_dynamic_upstream_lua_srv_conf_t, backup_threshold),
+      NULL },
+
+    { ngx_string("dynamic_panic_threshold"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_dynamic_upstream_lua_threshold,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_dynamic_upstream_lua_srv_conf_t, panic_threshold),
+      NULL },
+
+    { ngx_string("dynamic_upstream_file"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_dynamic_upstream_lua_file,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_dynamic_upstream_lua_srv_conf_t, file),
+      NULL },
+
+    { ngx_string("dynamic_queue"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_dynamic_upstream_lua_queue,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_dynamic_upstream_lua_srv_conf_t, queue),
+      NULL },
+
+    { ngx_string("dynamic_queue_upstream"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_dynamic_upstream_lua_loc_conf_t, queue_upstream),
+      NULL },
+
+    { ngx_string("disconnect_backup_if_primary_up"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS,
+      ngx_http_dynamic_upstream_lua_disconnect,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_dynamic_upstream_lua_srv_conf_t, disconnect_backup),
+      NULL },
+
+    { ngx_string("disconnect_if_market_down"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS,
+      ngx_http_dynamic_upstream_lua_disconnect,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_dynamic_upstream_lua_srv_conf_t, disconnect_down),
+      NULL },
+
+    { ngx_string("disconnect_on_exiting"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS,
+      ngx_http_dynamic_upstream_lua_disconnect,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_dynamic_upstream_lua_srv_conf_t, disconnect_exiting),
+      NULL },
+
+    ngx_null_command
+
+};
+
 
 static ngx_http_module_t ngx_http_dynamic_upstream_lua_ctx = {
-    NULL,                                          /* preconfiguration  */
-    ngx_http_dynamic_upstream_lua_post_conf,       /* postconfiguration */
-    NULL,                                          /* create main       */
-    NULL,                                          /* init main         */
-    NULL,                                          /* create server     */
-    NULL,                                          /* merge server      */
-    NULL,                                          /* create location   */
-    NULL                                           /* merge location    */
+    NULL,                                           /* preconfiguration  */
+    ngx_http_dynamic_upstream_lua_post_conf,        /* postconfiguration */
+    ngx_http_dynamic_upstream_lua_create_main_conf, /* create main       */
+    ngx_http_dynamic_upstream_lua_init_main_conf,   /* init main         */
+    ngx_http_dynamic_upstream_lua_create_srv_conf,  /* create server     */
+    NULL,                                           /* merge server      */
+    ngx_http_dynamic_upstream_lua_create_loc_conf,  /* create location   */
+    ngx_http_dynamic_upstream_lua_merge_loc_conf    /* merge location    */
 };
 
 
 ngx_module_t ngx_http_dynamic_upstream_lua_module = {
     NGX_MODULE_V1,
     &ngx_http_dynamic_upstream_lua_ctx,        /* module context    */
-    NULL,                                      /* module directives */
+    ngx_http_dynamic_upstream_lua_commands,    /* module directives */
     NGX_HTTP_MODULE,                           /* module type       */
     NULL,                                      /* init master       */
     NULL,                                      /* init module       */
-    NULL,                                      /* init process      */
+    ngx_http_dynamic_upstream_lua_init_process,
+                                               /* init process      */
     NULL,                                      /* init thread       */
     NULL,                                      /* exit thread       */
-    NULL,                                      /* exit process      */
+    ngx_http_dynamic_upstream_lua_exit_process,
+                                               /* exit process      */
     NULL,                                      /* exit master       */
     NGX_MODULE_V1_PADDING
 };
@@ -56,5 +213,130 @@ ngx_http_dynamic_upstream_lua_post_conf(ngx_conf_t *cf)
         return NGX_ERROR;
     }
 
+    if (ngx_http_dynamic_upstream_lua_disconnect_init(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_dynamic_upstream_lua_queue_init(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_dynamic_upstream_lua_pool_init(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     return NGX_OK;
 }
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_lua_init_process(ngx_cycle_t *cycle)
+{
+    if (ngx_dynamic_upstream_lua_stage_init_process(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_dynamic_upstream_lua_file_init_process(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_dynamic_upstream_lua_pool_init_process(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_dynamic_upstream_lua_queue_init_process(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_dynamic_upstream_lua_disconnect_init_process(cycle);
+}
+
+
+static void
+ngx_http_dynamic_upstream_lua_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_dynamic_upstream_lua_warmup_exit_process(cycle);
+}
+
+
+static void *
+ngx_http_dynamic_upstream_lua_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf;
+
+    mcf = ngx_pcalloc(cf->pool,
+                      sizeof(ngx_http_dynamic_upstream_lua_main_conf_t));
+    if (mcf == NULL) {
+        return NULL;
+    }
+
+    mcf->shm_size = NGX_CONF_UNSET_SIZE;
+    mcf->stage_interval = NGX_CONF_UNSET_MSEC;
+    mcf->journal_size = NGX_CONF_UNSET_UINT;
+    mcf->read_replicas = NGX_CONF_UNSET;
+
+    return mcf;
+}
+
+
+static char *
+ngx_http_dynamic_upstream_lua_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf = conf;
+
+    ngx_conf_init_size_value(mcf->shm_size, 1024 * 1024);
+    ngx_conf_init_msec_value(mcf->stage_interval, 0);
+    ngx_conf_init_uint_value(mcf->journal_size, 0);
+    ngx_conf_init_value(mcf->read_replicas, 0);
+
+    if (mcf->shm_zone != NULL) {
+        mcf->shm_zone->shm.size = mcf->shm_size;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_dynamic_upstream_lua_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+
+    ucscf = ngx_pcalloc(cf->pool,
+                        sizeof(ngx_http_dynamic_upstream_lua_srv_conf_t));
+    if (ucscf == NULL) {
+        return NULL;
+    }
+
+    return ucscf;
+}
+
+
+static void *
+ngx_http_dynamic_upstream_lua_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_dynamic_upstream_lua_loc_conf_t  *lcf;
+
+    lcf = ngx_pcalloc(cf->pool,
+                      sizeof(ngx_http_dynamic_upstream_lua_loc_conf_t));
+    if (lcf == NULL) {
+        return NULL;
+    }
+
+    return lcf;
+}
+
+
+static char *
+ngx_http_dynamic_upstream_lua_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_http_dynamic_upstream_lua_loc_conf_t  *prev = parent;
+    ngx_http_dynamic_upstream_lua_loc_conf_t  *conf = child;
+
+    if (conf->queue_upstream == NULL) {
+        conf->queue_upstream = prev->queue_upstream;
+    }
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,845 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+static void
+ngx_http_dynamic_upstream_lua_applied(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_op_t *op)
+{
+    ngx_http_dynamic_upstream_lua_chash_update(uscf, op);
+    ngx_http_dynamic_upstream_lua_ewma_update(uscf, op);
+    ngx_http_dynamic_upstream_lua_outlier_update(uscf, op);
+
+    if (op->op == NGX_DYNAMIC_UPSTEAM_OP_REMOVE) {
+        ngx_dynamic_upstream_lua_tag_remove(&uscf->host, 0, &op->server);
+    }
+
+    ngx_dynamic_upstream_lua_journal_op(&uscf->host, 0, op);
+}
+
+
+static void
+ngx_http_dynamic_upstream_lua_changed(ngx_log_t *log,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_flag_t disconnect)
+{
+    /* other workers close their connections by the timer */
+
+    if (disconnect) {
+        ngx_http_dynamic_upstream_lua_disconnect_check(log);
+    }
+
+    ngx_dynamic_upstream_lua_replica_bump(&uscf->host, 0);
+    ngx_http_dynamic_upstream_lua_alive_count(uscf);
+    ngx_http_dynamic_upstream_lua_queue_notify(uscf);
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_apply(ngx_log_t *log,
+    ngx_dynamic_upstream_op_t *op, ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_int_t                          rc;
+    ngx_dynamic_upstream_lua_state_t  *state;
+
+    state = ngx_dynamic_upstream_lua_replica_write(&uscf->host, 0);
+
+    rc = ngx_dynamic_upstream_op(log, op, uscf);
+
+    ngx_dynamic_upstream_lua_replica_written(state);
+
+    if (rc == NGX_OK) {
+        ngx_http_dynamic_upstream_lua_applied(uscf, op);
+        ngx_http_dynamic_upstream_lua_changed(log, uscf,
+            op->op == NGX_DYNAMIC_UPSTEAM_OP_REMOVE
+            || op->op == NGX_DYNAMIC_UPSTEAM_OP_PARAM);
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_dynamic_upstream_lua_set_params(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer, ngx_dynamic_upstream_op_t *op)
+{
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT) {
+        peers->total_weight += op->weight - peer->weight;
+        peers->weighted = peers->total_weight != peers->number;
+        peer->weight = op->weight;
+        peer->effective_weight = op->weight;
+        peer->current_weight = 0;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS) {
+        peer->max_fails = op->max_fails;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS) {
+        peer->max_conns = op->max_conns;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT) {
+        peer->fail_timeout = op->fail_timeout;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) {
+        peer->down = 1;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP) {
+        peer->down = 0;
+        peer->fails = 0;
+    }
+}
+
+
+/*
+ * Parameters of existing peers are changed in one write lock cycle.
+ * Peers are allocated and freed by ngx_dynamic_upstream which takes the
+ * lock itself, so adds and removes follow in order after the unlock.
+ * With upsert an add of an existing server updates its parameters.
+ */
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_apply_batch(ngx_log_t *log, ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_op_t *ops,
+    ngx_int_t *rcs, ngx_uint_t n, ngx_flag_t upsert)
+{
+    ngx_uint_t                        i;
+    ngx_int_t                         rc = NGX_OK;
+    ngx_flag_t                        changed = 0, disconnect = 0;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *primary, *backup, *peers;
+    ngx_dynamic_upstream_op_t        *op;
+    ngx_dynamic_upstream_lua_name_t  *name;
+    ngx_dynamic_upstream_lua_names_t  names;
+    ngx_dynamic_upstream_lua_state_t *state;
+
+    ngx_dynamic_upstream_lua_names_init(&names, pool);
+
+    primary = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_wlock(primary);
+
+    /* the balancer locks backup peers separately */
+
+    backup = primary->next;
+
+    if (backup != NULL) {
+        ngx_http_upstream_rr_peers_wlock(backup);
+    }
+
+    for (peers = primary; peers && rc == NGX_OK; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            name = ngx_dynamic_upstream_lua_names_add(&names, &peer->name, 0);
+            if (name == NULL) {
+                rc = NGX_ERROR;
+                break;
+            }
+
+            name->peer = peer;
+            name->peers = peers;
+
+            if (peer->server.len == 0
+                || (peer->server.len == peer->name.len
+                    && ngx_strncmp(peer->server.data, peer->name.data,
+                                   peer->name.len) == 0))
+            {
+                continue;
+            }
+
+            name = ngx_dynamic_upstream_lua_names_add(&names, &peer->server,
+                                                      0);
+            if (name == NULL) {
+                rc = NGX_ERROR;
+                break;
+            }
+
+            name->peer = peer;
+            name->peers = peers;
+        }
+    }
+
+    for (i = 0; i < n && rc == NGX_OK; i++) {
+
+        op = &ops[i];
+        rcs[i] = NGX_DECLINED;
+
+        name = ngx_dynamic_upstream_lua_names_find(&names, &op->server);
+
+        if (op->op == NGX_DYNAMIC_UPSTEAM_OP_REMOVE) {
+            if (name != NULL) {
+                ngx_rbtree_delete(&names.rbtree, &name->sn.node);
+            }
+            continue;
+        }
+
+        if (op->op == NGX_DYNAMIC_UPSTEAM_OP_ADD) {
+
+            if (name == NULL) {
+                /* later changes of the server follow its add */
+
+                if (ngx_dynamic_upstream_lua_names_add(&names, &op->server, 0)
+                        == NULL)
+                {
+                    rc = NGX_ERROR;
+                }
+
+                continue;
+            }
+
+            if (!upsert) {
+                continue;
+            }
+
+            if (!(op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FIELDS)) {
+                op->op = NGX_DYNAMIC_UPSTEAM_OP_LIST;
+                rcs[i] = NGX_OK;
+                continue;
+            }
+
+            op->op = NGX_DYNAMIC_UPSTEAM_OP_PARAM;
+        }
+
+        if (op->op != NGX_DYNAMIC_UPSTEAM_OP_PARAM) {
+            continue;
+        }
+
+        if (name == NULL) {
+            op->status = NGX_HTTP_BAD_REQUEST;
+            op->err = "server not found";
+            rcs[i] = NGX_ERROR;
+            continue;
+        }
+
+        if (name->peer == NULL) {
+            continue;
+        }
+
+        for ( /* void */ ; name; name = name->next) {
+            ngx_http_dynamic_upstream_lua_set_params(name->peers, name->peer,
+                                                     op);
+        }
+
+        rcs[i] = NGX_OK;
+    }
+
+    if (backup != NULL) {
+        ngx_http_upstream_rr_peers_unlock(backup);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    state = ngx_dynamic_upstream_lua_replica_write(&uscf->host, 0);
+
+    for (i = 0; i < n; i++) {
+        if (rcs[i] == NGX_DECLINED) {
+            rcs[i] = ngx_dynamic_upstream_op(log, &ops[i], uscf);
+        }
+    }
+
+    ngx_dynamic_upstream_lua_replica_written(state);
+
+    for (i = 0; i < n; i++) {
+
+        op = &ops[i];
+
+        if (rcs[i] != NGX_OK || op->op == NGX_DYNAMIC_UPSTEAM_OP_LIST) {
+            continue;
+        }
+
+        ngx_http_dynamic_upstream_lua_applied(uscf, op);
+
+        changed = 1;
+
+        if (op->op != NGX_DYNAMIC_UPSTEAM_OP_ADD) {
+            disconnect = 1;
+        }
+    }
+
+    if (changed) {
+        ngx_http_dynamic_upstream_lua_changed(log, uscf, disconnect);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_dynamic_upstream_lua_applied(ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_op_t *op)
+{
+    if (op->op == NGX_DYNAMIC_UPSTEAM_OP_REMOVE) {
+        ngx_dynamic_upstream_lua_tag_remove(&uscf->host,
+                                            NGX_DYNAMIC_UPSTREAM_LUA_STREAM,
+                                            &op->server);
+    }
+
+    ngx_dynamic_upstream_lua_journal_op(&uscf->host,
+                                        NGX_DYNAMIC_UPSTREAM_LUA_STREAM,
+                                        op);
+}
+
+
+static void
+ngx_stream_dynamic_upstream_lua_changed(ngx_stream_upstream_srv_conf_t *uscf)
+{
+    ngx_dynamic_upstream_lua_replica_bump(&uscf->host,
+                                          NGX_DYNAMIC_UPSTREAM_LUA_STREAM);
+    ngx_stream_dynamic_upstream_lua_alive_count(uscf);
+    ngx_stream_dynamic_upstream_lua_queue_notify(uscf);
+}
+
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_apply(ngx_log_t *log,
+    ngx_dynamic_upstream_op_t *op, ngx_stream_upstream_srv_conf_t *uscf)
+{
+    ngx_int_t                          rc;
+    ngx_dynamic_upstream_lua_state_t  *state;
+
+    state = ngx_dynamic_upstream_lua_replica_write(&uscf->host,
+                                               NGX_DYNAMIC_UPSTREAM_LUA_STREAM);
+
+    rc = ngx_dynamic_upstream_stream_op(log, op, uscf);
+
+    ngx_dynamic_upstream_lua_replica_written(state);
+
+    if (rc == NGX_OK) {
+        ngx_stream_dynamic_upstream_lua_applied(uscf, op);
+        ngx_stream_dynamic_upstream_lua_changed(uscf);
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_stream_dynamic_upstream_lua_set_params(
+    ngx_stream_upstream_rr_peers_t *peers, ngx_stream_upstream_rr_peer_t *peer,
+    ngx_dynamic_upstream_op_t *op)
+{
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT) {
+        peers->total_weight += op->weight - peer->weight;
+        peers->weighted = peers->total_weight != peers->number;
+        peer->weight = op->weight;
+        peer->effective_weight = op->weight;
+        peer->current_weight = 0;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS) {
+        peer->max_fails = op->max_fails;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS) {
+        peer->max_conns = op->max_conns;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT) {
+        peer->fail_timeout = op->fail_timeout;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) {
+        peer->down = 1;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP) {
+        peer->down = 0;
+        peer->fails = 0;
+    }
+}
+
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_apply_batch(ngx_log_t *log, ngx_pool_t *pool,
+    ngx_stream_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_op_t *ops,
+    ngx_int_t *rcs, ngx_uint_t n, ngx_flag_t upsert)
+{
+    ngx_uint_t                        i;
+    ngx_int_t                         rc = NGX_OK;
+    ngx_flag_t                        changed = 0;
+    ngx_stream_upstream_rr_peer_t    *peer;
+    ngx_stream_upstream_rr_peers_t   *primary, *backup, *peers;
+    ngx_dynamic_upstream_op_t        *op;
+    ngx_dynamic_upstream_lua_name_t  *name;
+    ngx_dynamic_upstream_lua_names_t  names;
+    ngx_dynamic_upstream_lua_state_t *state;
+
+    ngx_dynamic_upstream_lua_names_init(&names, pool);
+
+    primary = uscf->peer.data;
+
+    ngx_stream_upstream_rr_peers_wlock(primary);
+
+    backup = primary->next;
+
+    if (backup != NULL) {
+        ngx_stream_upstream_rr_peers_wlock(backup);
+    }
+
+    for (peers = primary; peers && rc == NGX_OK; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            name = ngx_dynamic_upstream_lua_names_add(&names, &peer->name, 0);
+            if (name == NULL) {
+                rc = NGX_ERROR;
+                break;
+            }
+
+            name->peer = peer;
+            name->peers = peers;
+
+            if (peer->server.len == 0
+                || (peer->server.len == peer->name.len
+                    && ngx_strncmp(peer->server.data, peer->name.data,
+                                   peer->name.len) == 0))
+            {
+                continue;
+            }
+
+            name = ngx_dynamic_upstream_lua_names_add(&names, &peer->server,
+                                                      0);
+            if (name == NULL) {
+                rc = NGX_ERROR;
+                break;
+            }
+
+            name->peer = peer;
+            name->peers = peers;
+        }
+    }
+
+    for (i = 0; i < n && rc == NGX_OK; i++) {
+
+        op = &ops[i];
+        rcs[i] = NGX_DECLINED;
+
+        name = ngx_dynamic_upstream_lua_names_find(&names, &op->server);
+
+        if (op->op == NGX_DYNAMIC_UPSTEAM_OP_REMOVE) {
+            if (name != NULL) {
+                ngx_rbtree_delete(&names.rbtree, &name->sn.node);
+            }
+            continue;
+        }
+
+        if (op->op == NGX_DYNAMIC_UPSTEAM_OP_ADD) {
+
+            if (name == NULL) {
+                if (ngx_dynamic_upstream_lua_names_add(&names, &op->server, 0)
+                        == NULL)
+                {
+                    rc = NGX_ERROR;
+                }
+
+                continue;
+            }
+
+            if (!upsert) {
+                continue;
+            }
+
+            if (!(op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FIELDS)) {
+                op->op = NGX_DYNAMIC_UPSTEAM_OP_LIST;
+                rcs[i] = NGX_OK;
+                continue;
+            }
+
+            op->op = NGX_DYNAMIC_UPSTEAM_OP_PARAM;
+        }
+
+        if (op->op != NGX_DYNAMIC_UPSTEAM_OP_PARAM) {
+            continue;
+        }
+
+        if (name == NULL) {
+            op->status = NGX_HTTP_BAD_REQUEST;
+            op->err = "server not found";
+            rcs[i] = NGX_ERROR;
+            continue;
+        }
+
+        if (name->peer == NULL) {
+            continue;
+        }
+
+        for ( /* void */ ; name; name = name->next) {
+            ngx_stream_dynamic_upstream_lua_set_params(name->peers, name->peer,
+                                                       op);
+        }
+
+        rcs[i] = NGX_OK;
+    }
+
+    if (backup != NULL) {
+        ngx_stream_upstream_rr_peers_unlock(backup);
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(primary);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    state = ngx_dynamic_upstream_lua_replica_write(&uscf->host,
+                                               NGX_DYNAMIC_UPSTREAM_LUA_STREAM);
+
+    for (i = 0; i < n; i++) {
+        if (rcs[i] == NGX_DECLINED) {
+            rcs[i] = ngx_dynamic_upstream_stream_op(log, &ops[i], uscf);
+        }
+    }
+
+    ngx_dynamic_upstream_lua_replica_written(state);
+
+    for (i = 0; i < n; i++) {
+
+        op = &ops[i];
+
+        if (rcs[i] != NGX_OK || op->op == NGX_DYNAMIC_UPSTEAM_OP_LIST) {
+            continue;
+        }
+
+        ngx_stream_dynamic_upstream_lua_applied(uscf, op);
+
+        changed = 1;
+    }
+
+    if (changed) {
+        ngx_stream_dynamic_upstream_lua_changed(uscf);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_swap(ngx_log_t *log,
+    ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *primary, *backup;
+    ngx_uint_t                     number, total_weight;
+    unsigned                       weighted;
+
+    primary = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_wlock(primary);
+
+    backup = primary->next;
+
+    if (backup == NULL || backup->number == 0) {
+        ngx_http_upstream_rr_peers_unlock(primary);
+        return NGX_DECLINED;
+    }
+
+    /* the balancer locks backup peers separately */
+
+    ngx_http_upstream_rr_peers_wlock(backup);
+
+    peer = primary->peer;
+    primary->peer = backup->peer;
+    backup->peer = peer;
+
+    number = primary->number;
+    primary->number = backup->number;
+    backup->number = number;
+
+    total_weight = primary->total_weight;
+    primary->total_weight = backup->total_weight;
+    backup->total_weight = total_weight;
+
+    weighted = primary->weighted;
+    primary->weighted = backup->weighted;
+    backup->weighted = weighted;
+
+    primary->single = primary->number == 1;
+    backup->single = 0;
+
+    ngx_http_upstream_rr_peers_unlock(backup);
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "dynamic upstream: primary and backup peers of %V swapped",
+                  &uscf->host);
+
+    ngx_http_dynamic_upstream_lua_chash_reset(uscf);
+    ngx_http_dynamic_upstream_lua_disconnect_check(log);
+
+    ngx_dynamic_upstream_lua_journal_swap(&uscf->host, 0);
+    ngx_dynamic_upstream_lua_replica_bump(&uscf->host, 0);
+    ngx_http_dynamic_upstream_lua_alive_count(uscf);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_swap(ngx_log_t *log,
+    ngx_stream_upstream_srv_conf_t *uscf)
+{
+    ngx_stream_upstream_rr_peer_t   *peer;
+    ngx_stream_upstream_rr_peers_t  *primary, *backup;
+    ngx_uint_t                       number, total_weight;
+    unsigned                         weighted;
+
+    primary = uscf->peer.data;
+
+    ngx_stream_upstream_rr_peers_wlock(primary);
+
+    backup = primary->next;
+
+    if (backup == NULL || backup->number == 0) {
+        ngx_stream_upstream_rr_peers_unlock(primary);
+        return NGX_DECLINED;
+    }
+
+    /* the balancer locks backup peers separately */
+
+    ngx_stream_upstream_rr_peers_wlock(backup);
+
+    peer = primary->peer;
+    primary->peer = backup->peer;
+    backup->peer = peer;
+
+    number = primary->number;
+    primary->number = backup->number;
+    backup->number = number;
+
+    total_weight = primary->total_weight;
+    primary->total_weight = backup->total_weight;
+    backup->total_weight = total_weight;
+
+    weighted = primary->weighted;
+    primary->weighted = backup->weighted;
+    backup->weighted = weighted;
+
+    primary->single = primary->number == 1;
+    backup->single = 0;
+
+    ngx_stream_upstream_rr_peers_unlock(backup);
+    ngx_stream_upstream_rr_peers_unlock(primary);
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "dynamic upstream: primary and backup peers of %V swapped",
+                  &uscf->host);
+
+    ngx_dynamic_upstream_lua_journal_swap(&uscf->host,
+                                          NGX_DYNAMIC_UPSTREAM_LUA_STREAM);
+    ngx_dynamic_upstream_lua_replica_bump(&uscf->host,
+                                          NGX_DYNAMIC_UPSTREAM_LUA_STREAM);
+    ngx_stream_dynamic_upstream_lua_alive_count(uscf);
+
+    return NGX_OK;
+}
+
+
+ngx_http_upstream_srv_conf_t *
+ngx_http_dynamic_upstream_lua_upstream(ngx_str_t *name)
+{
+    ngx_uint_t                      i;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    ngx_http_dynamic_upstream_lua_pool_sync();
+
+    umcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return NULL;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->shm_zone != NULL
+            && uscfp[i]->host.len == name->len
+            && ngx_strncmp(uscfp[i]->host.data, name->data, name->len) == 0)
+        {
+            return uscfp[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+ngx_stream_upstream_srv_conf_t *
+ngx_stream_dynamic_upstream_lua_upstream(ngx_str_t *name)
+{
+    ngx_uint_t                        i;
+    ngx_stream_upstream_srv_conf_t  **uscfp;
+    ngx_stream_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_stream_cycle_get_module_main_conf(ngx_cycle,
+                                                 ngx_stream_upstream_module);
+    if (umcf == NULL) {
+        return NULL;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->shm_zone != NULL
+            && uscfp[i]->host.len == name->len
+            && ngx_strncmp(uscfp[i]->host.data, name->data, name->len) == 0)
+        {
+            return uscfp[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+void
+ngx_dynamic_upstream_lua_names_init(ngx_dynamic_upstream_lua_names_t *names,
+    ngx_pool_t *pool)
+{
+    ngx_rbtree_init(&names->rbtree, &names->sentinel,
+                    ngx_str_rbtree_insert_value);
+    names->pool = pool;
+}
+
+
+ngx_dynamic_upstream_lua_name_t *
+ngx_dynamic_upstream_lua_names_add(ngx_dynamic_upstream_lua_names_t *names,
+    ngx_str_t *name, ngx_flag_t copy)
+{
+    ngx_dynamic_upstream_lua_name_t  *n, *head;
+
+    n = ngx_pcalloc(names->pool, sizeof(ngx_dynamic_upstream_lua_name_t));
+    if (n == NULL) {
+        return NULL;
+    }
+
+    n->sn.str = *name;
+
+    if (copy) {
+        n->sn.str.data = ngx_pstrdup(names->pool, name);
+        if (n->sn.str.data == NULL) {
+            return NULL;
+        }
+    }
+
+    /* several peers of one server are chained to the first one */
+
+    head = ngx_dynamic_upstream_lua_names_find(names, name);
+
+    if (head != NULL) {
+        n->next = head->next;
+        head->next = n;
+        return n;
+    }
+
+    n->sn.node.key = ngx_crc32_short(name->data, name->len);
+
+    ngx_rbtree_insert(&names->rbtree, &n->sn.node);
+
+    return n;
+}
+
+
+ngx_dynamic_upstream_lua_name_t *
+ngx_dynamic_upstream_lua_names_find(ngx_dynamic_upstream_lua_names_t *names,
+    ngx_str_t *name)
+{
+    return (ngx_dynamic_upstream_lua_name_t *)
+        ngx_str_rbtree_lookup(&names->rbtree, name,
+                              ngx_crc32_short(name->data, name->len));
+}
+
+
+/* names are copied, the snapshot outlives the lock */
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_names(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_names_t *names)
+{
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *primary, *peers;
+    ngx_int_t                      rc = NGX_OK;
+
+    primary = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    for (peers = primary; peers && rc == NGX_OK; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (ngx_dynamic_upstream_lua_names_find(names, &peer->name)
+                    == NULL
+                && ngx_dynamic_upstream_lua_names_add(names, &peer->name, 1)
+                    == NULL)
+            {
+                rc = NGX_ERROR;
+                break;
+            }
+
+            if (peer->server.len != 0
+                && ngx_dynamic_upstream_lua_names_find(names, &peer->server)
+                    == NULL
+                && ngx_dynamic_upstream_lua_names_add(names, &peer->server, 1)
+                    == NULL)
+            {
+                rc = NGX_ERROR;
+                break;
+            }
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    return rc;
+}
+
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_names(ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_names_t *names)
+{
+    ngx_stream_upstream_rr_peer_t   *peer;
+    ngx_stream_upstream_rr_peers_t  *primary, *peers;
+    ngx_int_t                        rc = NGX_OK;
+
+    primary = uscf->peer.data;
+
+    ngx_stream_upstream_rr_peers_rlock(primary);
+
+    for (peers = primary; peers && rc == NGX_OK; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (ngx_dynamic_upstream_lua_names_find(names, &peer->name)
+                    == NULL
+                && ngx_dynamic_upstream_lua_names_add(names, &peer->name, 1)
+                    == NULL)
+            {
+                rc = NGX_ERROR;
+                break;
+            }
+
+            if (peer->server.len != 0
+                && ngx_dynamic_upstream_lua_names_find(names, &peer->server)
+                    == NULL
+                && ngx_dynamic_upstream_lua_names_add(names, &peer->server, 1)
+                    == NULL)
+            {
+                rc = NGX_ERROR;
+                break;
+            }
+        }
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(primary);
+
+    return rc;
+}
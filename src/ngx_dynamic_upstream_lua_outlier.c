@@ -0,0 +1,747 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_OUTLIER_CONSECUTIVE    5
+#define NGX_DYNAMIC_UPSTREAM_LUA_OUTLIER_MIN_REQUESTS   20
+#define NGX_DYNAMIC_UPSTREAM_LUA_OUTLIER_INTERVAL       10000
+#define NGX_DYNAMIC_UPSTREAM_LUA_OUTLIER_EJECTION       30000
+#define NGX_DYNAMIC_UPSTREAM_LUA_OUTLIER_MAX_EJECTION   300000
+#define NGX_DYNAMIC_UPSTREAM_LUA_OUTLIER_MAX_EJECTED    50
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_outlier_number(ngx_str_t *value, ngx_uint_t *n,
+    ngx_uint_t max)
+{
+    ngx_int_t  rc;
+    size_t     len;
+
+    len = value->len;
+
+    if (len > 0 && value->data[len - 1] == '%') {
+        len--;
+    }
+
+    rc = ngx_atoi(value->data, len);
+    if (rc == NGX_ERROR || (max != 0 && (ngx_uint_t) rc > max)) {
+        return NGX_ERROR;
+    }
+
+    *n = rc;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_outlier_time(ngx_str_t *value, ngx_msec_t *t)
+{
+    *t = ngx_parse_time(value, 0);
+
+    if (*t == (ngx_msec_t) NGX_ERROR || *t == 0) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+char *
+ngx_http_dynamic_upstream_lua_outlier(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf = conf;
+
+    ngx_str_t                                     *value, s;
+    ngx_uint_t                                     i;
+    ngx_int_t                                      rc;
+    ngx_http_dynamic_upstream_lua_outlier_conf_t  *oc;
+
+    if (ucscf->outlier != NULL) {
+        return "is duplicate";
+    }
+
+    oc = ngx_pcalloc(cf->pool,
+                     sizeof(ngx_http_dynamic_upstream_lua_outlier_conf_t));
+    if (oc == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    oc->consecutive = NGX_DYNAMIC_UPSTREAM_LUA_OUTLIER_CONSECUTIVE;
+    oc->min_requests = NGX_DYNAMIC_UPSTREAM_LUA_OUTLIER_MIN_REQUESTS;
+    oc->interval = NGX_DYNAMIC_UPSTREAM_LUA_OUTLIER_INTERVAL;
+    oc->ejection_time = NGX_DYNAMIC_UPSTREAM_LUA_OUTLIER_EJECTION;
+    oc->max_ejection_time = NGX_DYNAMIC_UPSTREAM_LUA_OUTLIER_MAX_EJECTION;
+    oc->max_ejected = NGX_DYNAMIC_UPSTREAM_LUA_OUTLIER_MAX_EJECTED;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "consecutive=", 12) == 0) {
+            s.data = value[i].data + 12;
+            s.len = value[i].len - 12;
+            rc = ngx_http_dynamic_upstream_outlier_number(&s,
+                     &oc->consecutive, 0);
+
+        } else if (ngx_strncmp(value[i].data, "error_rate=", 11) == 0) {
+            s.data = value[i].data + 11;
+            s.len = value[i].len - 11;
+            rc = ngx_http_dynamic_upstream_outlier_number(&s,
+                     &oc->error_rate, 100);
+
+        } else if (ngx_strncmp(value[i].data, "min_requests=", 13) == 0) {
+            s.data = value[i].data + 13;
+            s.len = value[i].len - 13;
+            rc = ngx_http_dynamic_upstream_outlier_number(&s,
+                     &oc->min_requests, 0);
+
+        } else if (ngx_strncmp(value[i].data, "max_ejected=", 12) == 0) {
+            s.data = value[i].data + 12;
+            s.len = value[i].len - 12;
+            rc = ngx_http_dynamic_upstream_outlier_number(&s,
+                     &oc->max_ejected, 100);
+
+        } else if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.data = value[i].data + 9;
+            s.len = value[i].len - 9;
+            rc = ngx_http_dynamic_upstream_outlier_time(&s, &oc->interval);
+
+        } else if (ngx_strncmp(value[i].data, "ejection_time=", 14) == 0) {
+            s.data = value[i].data + 14;
+            s.len = value[i].len - 14;
+            rc = ngx_http_dynamic_upstream_outlier_time(&s,
+                     &oc->ejection_time);
+
+        } else if (ngx_strncmp(value[i].data, "max_ejection_time=", 18)
+                   == 0)
+        {
+            s.data = value[i].data + 18;
+            s.len = value[i].len - 18;
+            rc = ngx_http_dynamic_upstream_outlier_time(&s,
+                     &oc->max_ejection_time);
+
+        } else {
+            rc = NGX_ERROR;
+        }
+
+        if (rc != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (oc->consecutive == 0 && oc->error_rate == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "consecutive or error_rate must be set");
+        return NGX_CONF_ERROR;
+    }
+
+    if (oc->max_ejection_time < oc->ejection_time) {
+        oc->max_ejection_time = oc->ejection_time;
+    }
+
+    ucscf->outlier = oc;
+
+    if (ngx_dynamic_upstream_lua_shm_add(cf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void
+ngx_http_dynamic_upstream_outlier_ready(ngx_dynamic_upstream_lua_outlier_t *o)
+{
+    ngx_dynamic_upstream_lua_shm_t           *sh;
+    ngx_dynamic_upstream_lua_outlier_peer_t  *stat;
+
+    sh = ngx_dynamic_upstream_lua_shm_pool()->data;
+
+    if (o->rbtree.root != NULL && o->generation == sh->generation) {
+        return;
+    }
+
+    ngx_rwlock_wlock(&o->lock);
+
+    if (o->rbtree.root == NULL) {
+        ngx_rbtree_init(&o->rbtree, &o->sentinel,
+                        ngx_str_rbtree_insert_value);
+    }
+
+    if (o->generation != sh->generation) {
+
+        /* peers of the zone are configured again on reload */
+
+        o->nejected = 0;
+
+        for (stat = o->peers; stat; stat = stat->next) {
+            stat->ejected = 0;
+
+            if (stat->ejecting) {
+                o->nejected++;
+            }
+        }
+
+        o->generation = sh->generation;
+    }
+
+    ngx_rwlock_unlock(&o->lock);
+}
+
+
+static ngx_dynamic_upstream_lua_outlier_t *
+ngx_http_dynamic_upstream_outlier_get(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_http_dynamic_upstream_lua_outlier_conf_t **oc)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_dynamic_upstream_lua_state_t          *state;
+
+    if (uscf->srv_conf == NULL || uscf->shm_zone == NULL) {
+        return NULL;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(uscf,
+                ngx_http_dynamic_upstream_lua_module);
+    if (ucscf->outlier == NULL) {
+        return NULL;
+    }
+
+    state = ngx_http_dynamic_upstream_lua_srv_state(uscf);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    if (oc != NULL) {
+        *oc = ucscf->outlier;
+    }
+
+    ngx_http_dynamic_upstream_outlier_ready(&state->outlier);
+
+    return &state->outlier;
+}
+
+
+static ngx_dynamic_upstream_lua_outlier_peer_t *
+ngx_http_dynamic_upstream_outlier_find(ngx_dynamic_upstream_lua_outlier_t *o,
+    u_char *name, size_t len)
+{
+    ngx_str_t  s;
+
+    s.data = name;
+    s.len = len;
+
+    return (ngx_dynamic_upstream_lua_outlier_peer_t *)
+        ngx_str_rbtree_lookup(&o->rbtree, &s, ngx_crc32_short(name, len));
+}
+
+
+static ngx_dynamic_upstream_lua_outlier_peer_t *
+ngx_http_dynamic_upstream_outlier_alloc(ngx_dynamic_upstream_lua_outlier_t *o,
+    u_char *name, size_t len)
+{
+    ngx_slab_pool_t                          *shpool;
+    ngx_dynamic_upstream_lua_outlier_peer_t  *stat;
+
+    /* reuse the entry of the removed peer */
+
+    stat = o->free;
+
+    if (stat != NULL) {
+        o->free = stat->next;
+        ngx_memzero(stat, sizeof(ngx_dynamic_upstream_lua_outlier_peer_t));
+
+    } else {
+        shpool = ngx_dynamic_upstream_lua_shm_pool();
+
+        stat = ngx_slab_calloc(shpool,
+                   sizeof(ngx_dynamic_upstream_lua_outlier_peer_t));
+        if (stat == NULL) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "dynamic outlier: no memory for peer statistics, "
+                          "increase dynamic_upstream_shm_size");
+            return NULL;
+        }
+    }
+
+    stat->window = ngx_current_msec;
+    stat->len = len;
+    ngx_memcpy(stat->name, name, len);
+
+    stat->sn.str.data = stat->name;
+    stat->sn.str.len = len;
+    stat->sn.node.key = ngx_crc32_short(name, len);
+
+    ngx_rbtree_insert(&o->rbtree, &stat->sn.node);
+
+    stat->next = o->peers;
+    o->peers = stat;
+
+    return stat;
+}
+
+
+static ngx_http_upstream_rr_peer_t *
+ngx_http_dynamic_upstream_outlier_peer(ngx_http_upstream_rr_peers_t *primary,
+    u_char *name, size_t len, ngx_uint_t *total, ngx_flag_t *backup)
+{
+    ngx_http_upstream_rr_peers_t  *peers;
+    ngx_http_upstream_rr_peer_t   *peer, *found = NULL;
+
+    *total = 0;
+
+    for (peers = primary; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            (*total)++;
+
+            if (found == NULL
+                && peer->name.len == len
+                && ngx_memcmp(peer->name.data, name, len) == 0) {
+                found = peer;
+                *backup = peers != primary;
+            }
+        }
+    }
+
+    return found;
+}
+
+
+/* ejections change the peer the same way as the methods of the module */
+
+static ngx_int_t
+ngx_http_dynamic_upstream_outlier_apply(ngx_log_t *log,
+    ngx_http_upstream_srv_conf_t *uscf, u_char *name, size_t len,
+    ngx_flag_t backup, ngx_flag_t down)
+{
+    ngx_dynamic_upstream_op_t  op;
+
+    ngx_memzero(&op, sizeof(ngx_dynamic_upstream_op_t));
+
+    op.op = NGX_DYNAMIC_UPSTEAM_OP_PARAM;
+    op.status = NGX_HTTP_OK;
+    op.upstream = uscf->host;
+    op.server.data = name;
+    op.server.len = len;
+    op.backup = backup;
+
+    if (down) {
+        op.down = 1;
+        op.op_param = NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+
+    } else {
+        op.up = 1;
+        op.op_param = NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+    }
+
+    return ngx_http_dynamic_upstream_lua_apply(log, &op, uscf);
+}
+
+
+static void
+ngx_http_dynamic_upstream_outlier_eject(ngx_log_t *log,
+    ngx_http_upstream_srv_conf_t *uscf,
+    ngx_http_dynamic_upstream_lua_outlier_conf_t *oc,
+    ngx_dynamic_upstream_lua_outlier_t *o, u_char *name, size_t len)
+{
+    ngx_http_upstream_rr_peers_t             *primary;
+    ngx_http_upstream_rr_peer_t              *peer;
+    ngx_dynamic_upstream_lua_outlier_peer_t  *stat;
+    ngx_uint_t                                total, limit, shift;
+    ngx_msec_t                                t;
+    ngx_flag_t                                backup = 0, down;
+    ngx_int_t                                 rc;
+
+    primary = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    peer = ngx_http_dynamic_upstream_outlier_peer(primary, name, len, &total,
+                                                  &backup);
+
+    /* peers marked down by hand are left alone */
+
+    down = peer == NULL || peer->down;
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    if (down) {
+        return;
+    }
+
+    limit = total * oc->max_ejected / 100;
+    if (limit == 0 && oc->max_ejected != 0 && total > 1) {
+        limit = 1;
+    }
+
+    /* the ejection is reserved, the peers are changed out of the lock */
+
+    ngx_rwlock_wlock(&o->lock);
+
+    stat = ngx_http_dynamic_upstream_outlier_find(o, name, len);
+
+    if (stat == NULL || stat->ejected || stat->ejecting
+        || o->nejected >= limit)
+    {
+        ngx_rwlock_unlock(&o->lock);
+        return;
+    }
+
+    stat->ejecting = 1;
+    o->nejected++;
+
+    ngx_rwlock_unlock(&o->lock);
+
+    rc = ngx_http_dynamic_upstream_outlier_apply(log, uscf, name, len,
+                                                 backup, 1);
+
+    ngx_rwlock_wlock(&o->lock);
+
+    /* the peer may be removed meanwhile, its entry is released then */
+
+    stat = ngx_http_dynamic_upstream_outlier_find(o, name, len);
+    if (stat == NULL || !stat->ejecting) {
+        goto done;
+    }
+
+    stat->ejecting = 0;
+
+    if (rc != NGX_OK) {
+        o->nejected--;
+        goto done;
+    }
+
+    /* exponential backoff, the multiplier decays while the peer is fine */
+
+    shift = ngx_min(stat->ejections, 16);
+
+    t = oc->ejection_time << shift;
+    if (t > oc->max_ejection_time || (t >> shift) != oc->ejection_time) {
+        t = oc->max_ejection_time;
+    }
+
+    stat->ejected = 1;
+    stat->ejected_until = ngx_current_msec + t;
+    stat->ejections++;
+    stat->total++;
+
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "dynamic outlier: peer %*s of %V ejected for %Mms, "
+                  "requests=%ui errors=%ui consecutive=%ui",
+                  len, name, &uscf->host, t, stat->requests, stat->errors,
+                  stat->consecutive);
+
+done:
+
+    ngx_rwlock_unlock(&o->lock);
+}
+
+
+void
+ngx_http_dynamic_upstream_lua_outlier_observe(ngx_log_t *log,
+    ngx_http_upstream_srv_conf_t *uscf, u_char *name, size_t len,
+    ngx_flag_t failed)
+{
+    ngx_http_dynamic_upstream_lua_outlier_conf_t  *oc;
+    ngx_dynamic_upstream_lua_outlier_t            *o;
+    ngx_dynamic_upstream_lua_outlier_peer_t       *stat;
+    ngx_atomic_uint_t                              window, requests, errors;
+    ngx_atomic_uint_t                              consecutive;
+    ngx_flag_t                                     eject = 0;
+
+    o = ngx_http_dynamic_upstream_outlier_get(uscf, &oc);
+    if (o == NULL || len == 0) {
+        return;
+    }
+
+    /* requests of all workers count in parallel under the read lock */
+
+    ngx_rwlock_rlock(&o->lock);
+
+    stat = ngx_http_dynamic_upstream_outlier_find(o, name, len);
+
+    if (stat == NULL) {
+        ngx_rwlock_unlock(&o->lock);
+        ngx_rwlock_wlock(&o->lock);
+
+        stat = ngx_http_dynamic_upstream_outlier_find(o, name, len);
+        if (stat == NULL) {
+            stat = ngx_http_dynamic_upstream_outlier_alloc(o, name, len);
+            if (stat == NULL) {
+                goto done;
+            }
+        }
+    }
+
+    if (stat->ejected || stat->ejecting) {
+        goto done;
+    }
+
+    window = stat->window;
+
+    if (ngx_current_msec - window >= oc->interval
+        && ngx_atomic_cmp_set(&stat->window, window, ngx_current_msec))
+    {
+        /* one worker starts the next interval */
+
+        if (stat->ejections > 0 && stat->errors == 0) {
+            stat->ejections--;
+        }
+
+        stat->requests = 0;
+        stat->errors = 0;
+    }
+
+    requests = ngx_atomic_fetch_add(&stat->requests, 1) + 1;
+
+    if (failed) {
+        errors = ngx_atomic_fetch_add(&stat->errors, 1) + 1;
+        consecutive = ngx_atomic_fetch_add(&stat->consecutive, 1) + 1;
+
+    } else {
+        errors = stat->errors;
+        consecutive = 0;
+        stat->consecutive = 0;
+    }
+
+    if (oc->consecutive != 0 && consecutive >= oc->consecutive) {
+        eject = 1;
+    }
+
+    if (oc->error_rate != 0
+        && requests >= oc->min_requests
+        && errors * 100 >= oc->error_rate * requests)
+    {
+        eject = 1;
+    }
+
+done:
+
+    ngx_rwlock_unlock(&o->lock);
+
+    /* the peers lock is taken before the statistics lock */
+
+    if (eject) {
+        ngx_http_dynamic_upstream_outlier_eject(log, uscf, oc, o, name, len);
+    }
+}
+
+
+static void
+ngx_http_dynamic_upstream_outlier_reinstate(ngx_log_t *log,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_lua_outlier_t *o)
+{
+    ngx_http_upstream_rr_peers_t             *primary;
+    ngx_http_upstream_rr_peer_t              *peer;
+    ngx_dynamic_upstream_lua_outlier_peer_t  *stat;
+    ngx_uint_t                                total;
+    ngx_flag_t                                backup = 0;
+    ngx_msec_t                                now;
+    size_t                                    len;
+    u_char                                    name[NGX_SOCKADDR_STRLEN];
+
+    primary = uscf->peer.data;
+
+    /* one peer at a time, the peers are changed out of the lock */
+
+    for ( ;; ) {
+
+        ngx_rwlock_wlock(&o->lock);
+
+        now = ngx_current_msec;
+
+        for (stat = o->peers; stat; stat = stat->next) {
+            if (stat->ejected
+                && (ngx_msec_int_t) (now - stat->ejected_until) >= 0)
+            {
+                break;
+            }
+        }
+
+        if (stat == NULL) {
+            ngx_rwlock_unlock(&o->lock);
+            return;
+        }
+
+        stat->ejected = 0;
+        stat->window = ngx_current_msec;
+        stat->requests = 0;
+        stat->errors = 0;
+        stat->consecutive = 0;
+        o->nejected--;
+
+        len = stat->len;
+        ngx_memcpy(name, stat->name, len);
+
+        ngx_rwlock_unlock(&o->lock);
+
+        ngx_http_upstream_rr_peers_rlock(primary);
+
+        peer = ngx_http_dynamic_upstream_outlier_peer(primary, name, len,
+                                                      &total, &backup);
+
+        ngx_http_upstream_rr_peers_unlock(primary);
+
+        if (peer != NULL) {
+            (void) ngx_http_dynamic_upstream_outlier_apply(log, uscf, name,
+                                                           len, backup, 0);
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "dynamic outlier: peer %*s of %V reinstated",
+                      len, name, &uscf->host);
+    }
+}
+
+
+void
+ngx_http_dynamic_upstream_lua_outlier_check(ngx_log_t *log)
+{
+    ngx_uint_t                           i;
+    ngx_http_upstream_srv_conf_t       **uscfp;
+    ngx_http_upstream_main_conf_t       *umcf;
+    ngx_dynamic_upstream_lua_outlier_t  *o;
+
+    umcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        o = ngx_http_dynamic_upstream_outlier_get(uscfp[i], NULL);
+
+        /* the peers are locked only if something is ejected */
+
+        if (o != NULL && o->nejected != 0) {
+            ngx_http_dynamic_upstream_outlier_reinstate(log, uscfp[i], o);
+        }
+    }
+}
+
+
+void
+ngx_http_dynamic_upstream_lua_outlier_update(
+    ngx_http_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_op_t *op)
+{
+    ngx_http_upstream_rr_peers_t             *primary, *peers;
+    ngx_http_upstream_rr_peer_t              *peer;
+    ngx_dynamic_upstream_lua_outlier_t       *o;
+    ngx_dynamic_upstream_lua_outlier_peer_t  *stat, **sp;
+    ngx_uint_t                                total;
+    ngx_flag_t                                backup;
+
+    if (op->op != NGX_DYNAMIC_UPSTEAM_OP_REMOVE
+        && !(op->op_param & (NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP
+                             |NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN)))
+    {
+        return;
+    }
+
+    o = ngx_http_dynamic_upstream_outlier_get(uscf, NULL);
+    if (o == NULL) {
+        return;
+    }
+
+    primary = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+    ngx_rwlock_wlock(&o->lock);
+
+    if (op->op == NGX_DYNAMIC_UPSTEAM_OP_REMOVE) {
+
+        /* release statistics of the removed peers for reuse */
+
+        for (sp = &o->peers; *sp; /* void */) {
+
+            stat = *sp;
+
+            if (ngx_http_dynamic_upstream_outlier_peer(primary, stat->name,
+                    stat->len, &total, &backup) != NULL)
+            {
+                sp = &stat->next;
+                continue;
+            }
+
+            if (stat->ejected || stat->ejecting) {
+                o->nejected--;
+            }
+
+            ngx_rbtree_delete(&o->rbtree, &stat->sn.node);
+
+            *sp = stat->next;
+            stat->next = o->free;
+            o->free = stat;
+        }
+
+        goto done;
+    }
+
+    /* the peer state set by hand ends the ejection */
+
+    for (peers = primary; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (peer->server.len != op->server.len
+                || ngx_strncmp(peer->server.data, op->server.data,
+                               op->server.len) != 0)
+            {
+                continue;
+            }
+
+            stat = ngx_http_dynamic_upstream_outlier_find(o, peer->name.data,
+                                                          peer->name.len);
+            if (stat != NULL && stat->ejected) {
+                stat->ejected = 0;
+                o->nejected--;
+            }
+        }
+    }
+
+done:
+
+    ngx_rwlock_unlock(&o->lock);
+    ngx_http_upstream_rr_peers_unlock(primary);
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_outlier_stat(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_str_t *name, ngx_flag_t *ejected, ngx_uint_t *ejections)
+{
+    ngx_dynamic_upstream_lua_outlier_t       *o;
+    ngx_dynamic_upstream_lua_outlier_peer_t  *stat;
+
+    o = ngx_http_dynamic_upstream_outlier_get(uscf, NULL);
+    if (o == NULL) {
+        return NGX_DECLINED;
+    }
+
+    *ejected = 0;
+    *ejections = 0;
+
+    ngx_rwlock_rlock(&o->lock);
+
+    stat = ngx_http_dynamic_upstream_outlier_find(o, name->data, name->len);
+    if (stat != NULL) {
+        *ejected = stat->ejected;
+        *ejections = stat->total;
+    }
+
+    ngx_rwlock_unlock(&o->lock);
+
+    return NGX_OK;
+}
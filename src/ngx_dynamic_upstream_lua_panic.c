@@ -0,0 +1,166 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+#define ngx_dynamic_upstream_lua_panic_needed(threshold, a)                   \
+    ((threshold) && (a)->alive * 100 < (threshold) * (a)->primaries)
+
+
+void
+ngx_dynamic_upstream_lua_panic_update(ngx_dynamic_upstream_lua_state_t *state,
+    ngx_dynamic_upstream_lua_alive_t *a, ngx_uint_t threshold)
+{
+    ngx_atomic_uint_t  panic;
+
+    panic = ngx_dynamic_upstream_lua_panic_needed(threshold, a);
+
+    /* the worker changing the state counts the transition */
+
+    if (!ngx_atomic_cmp_set(&state->panic, !panic, panic)) {
+        return;
+    }
+
+    if (panic) {
+        (void) ngx_atomic_fetch_add(&state->panics, 1);
+    }
+
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "dynamic upstream: %V %s panic mode, %ui of %ui primary "
+                  "peers are up", &state->name, panic ? "enters" : "leaves",
+                  a->alive, a->primaries);
+}
+
+
+static ngx_flag_t
+ngx_dynamic_upstream_lua_panic_enter(ngx_dynamic_upstream_lua_state_t *state,
+    ngx_dynamic_upstream_lua_alive_t *a, ngx_uint_t threshold)
+{
+    if (state == NULL) {
+        return ngx_dynamic_upstream_lua_panic_needed(threshold, a);
+    }
+
+    if (!state->panic) {
+        return 0;
+    }
+
+    (void) ngx_atomic_fetch_add(&state->panic_selections, 1);
+
+    return 1;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_panic_fill(ngx_dynamic_upstream_lua_state_t *state,
+    ngx_dynamic_upstream_lua_alive_t *a, ngx_uint_t threshold,
+    ngx_dynamic_upstream_lua_panic_t *stat)
+{
+    stat->threshold = threshold;
+    stat->primaries = a->primaries;
+    stat->alive = a->alive;
+
+    if (state == NULL) {
+        stat->panic = ngx_dynamic_upstream_lua_panic_needed(threshold, a);
+        stat->transitions = 0;
+        stat->selections = 0;
+        return;
+    }
+
+    stat->panic = state->panic;
+    stat->transitions = state->panics;
+    stat->selections = state->panic_selections;
+}
+
+
+ngx_flag_t
+ngx_http_dynamic_upstream_lua_panic(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_dynamic_upstream_lua_state_t          *state;
+    ngx_dynamic_upstream_lua_alive_t           a;
+
+    ucscf = ngx_http_dynamic_upstream_lua_alive_conf(uscf);
+
+    if (ucscf == NULL || !ucscf->panic_threshold) {
+        return 0;
+    }
+
+    state = ngx_http_dynamic_upstream_lua_alive(uscf, ucscf, 0, &a);
+
+    return ngx_dynamic_upstream_lua_panic_enter(state, &a,
+                                                ucscf->panic_threshold);
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_panic_stat(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_panic_t *stat)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_dynamic_upstream_lua_state_t          *state;
+    ngx_dynamic_upstream_lua_alive_t           a;
+
+    ucscf = ngx_http_dynamic_upstream_lua_alive_conf(uscf);
+
+    if (ucscf == NULL || !ucscf->panic_threshold) {
+        return NGX_DECLINED;
+    }
+
+    /* reported counts are not older than the call */
+
+    state = ngx_http_dynamic_upstream_lua_alive(uscf, ucscf, 1, &a);
+
+    ngx_dynamic_upstream_lua_panic_fill(state, &a, ucscf->panic_threshold,
+                                        stat);
+
+    return NGX_OK;
+}
+
+
+ngx_flag_t
+ngx_stream_dynamic_upstream_lua_panic(ngx_stream_upstream_srv_conf_t *uscf)
+{
+    ngx_stream_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_dynamic_upstream_lua_state_t            *state;
+    ngx_dynamic_upstream_lua_alive_t             a;
+
+    ucscf = ngx_stream_dynamic_upstream_lua_alive_conf(uscf);
+
+    if (ucscf == NULL || !ucscf->panic_threshold) {
+        return 0;
+    }
+
+    state = ngx_stream_dynamic_upstream_lua_alive(uscf, ucscf, 0, &a);
+
+    return ngx_dynamic_upstream_lua_panic_enter(state, &a,
+                                                ucscf->panic_threshold);
+}
+
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_panic_stat(
+    ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_panic_t *stat)
+{
+    ngx_stream_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_dynamic_upstream_lua_state_t            *state;
+    ngx_dynamic_upstream_lua_alive_t             a;
+
+    ucscf = ngx_stream_dynamic_upstream_lua_alive_conf(uscf);
+
+    if (ucscf == NULL || !ucscf->panic_threshold) {
+        return NGX_DECLINED;
+    }
+
+    /* reported counts are not older than the call */
+
+    state = ngx_stream_dynamic_upstream_lua_alive(uscf, ucscf, 1, &a);
+
+    ngx_dynamic_upstream_lua_panic_fill(state, &a, ucscf->panic_threshold,
+                                        stat);
+
+    return NGX_OK;
+}
@@ -0,0 +1,1138 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_POOL_UPSTREAMS  64
+#define NGX_DYNAMIC_UPSTREAM_LUA_POOL_SLICE      (128 * 1024)
+#define NGX_DYNAMIC_UPSTREAM_LUA_POOL_INTERVAL   1000
+#define NGX_DYNAMIC_UPSTREAM_LUA_POOL_GRACE      10
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_POOL_FREE       0
+#define NGX_DYNAMIC_UPSTREAM_LUA_POOL_LIVE       1
+#define NGX_DYNAMIC_UPSTREAM_LUA_POOL_DELETED    2
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_POOL_ROUND_ROBIN  0
+#define NGX_DYNAMIC_UPSTREAM_LUA_POOL_LEAST_CONN   1
+
+
+/* set in refs of the slot whose peers may not be used */
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_POOL_DEAD                                    \
+    ((ngx_atomic_uint_t) 1 << (sizeof(ngx_atomic_uint_t) * 8 - 1))
+
+
+typedef struct {
+    ngx_atomic_t                       refs;
+    ngx_atomic_t                       generation;
+    ngx_uint_t                         state;
+    ngx_uint_t                         balancer;
+    time_t                             deleted;
+    ngx_str_t                          name;
+    u_char                            *slice;
+    size_t                             size;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_dynamic_upstream_lua_state_t  *detached;
+} ngx_dynamic_upstream_lua_pool_slot_t;
+
+
+/* refs of the slots held by requests of one process */
+
+typedef struct {
+    ngx_pid_t     pid;
+    ngx_atomic_t  refs[1];
+} ngx_dynamic_upstream_lua_pool_proc_t;
+
+
+/* slots are never freed, only the slices with the peers are */
+
+typedef struct {
+    ngx_atomic_t                            version;
+    ngx_uint_t                              nslots;
+    ngx_dynamic_upstream_lua_pool_slot_t   *slots;
+    ngx_dynamic_upstream_lua_pool_proc_t  **procs;
+} ngx_dynamic_upstream_lua_pool_t;
+
+
+/* the upstream as seen by the worker, linked into umcf->upstreams */
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t              uscf;
+    ngx_http_dynamic_upstream_lua_srv_conf_t  ucscf;
+    ngx_shm_zone_t                            zone;
+    ngx_dynamic_upstream_lua_pool_slot_t     *slot;
+    ngx_uint_t                                index;
+    ngx_atomic_uint_t                         generation;
+    ngx_uint_t                                balancer;
+    ngx_uint_t                                refs;
+    ngx_flag_t                                linked;
+    void                                    **srv_conf;
+} ngx_dynamic_upstream_lua_pool_local_t;
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_pool_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+
+
+static ngx_str_t pool_name = ngx_string("ngx_dynamic_upstream_lua_pool");
+
+
+static ngx_atomic_uint_t  ngx_dynamic_upstream_lua_pool_version;
+static ngx_event_t        ngx_dynamic_upstream_lua_pool_event;
+
+static ngx_dynamic_upstream_lua_pool_proc_t
+    *ngx_dynamic_upstream_lua_pool_self;
+
+static ngx_dynamic_upstream_lua_pool_local_t
+    **ngx_dynamic_upstream_lua_pool_locals;
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_pool_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf = shm_zone->data;
+
+    ngx_slab_pool_t                  *shpool;
+    ngx_dynamic_upstream_lua_pool_t  *pool;
+    ngx_uint_t                        i;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (data != NULL || shm_zone->shm.exists) {
+        /* upstreams created at runtime survive reloads */
+        return NGX_OK;
+    }
+
+    pool = ngx_slab_calloc(shpool, sizeof(ngx_dynamic_upstream_lua_pool_t)
+        + mcf->pool_upstreams * sizeof(ngx_dynamic_upstream_lua_pool_slot_t));
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    pool->nslots = mcf->pool_upstreams;
+    pool->slots = (ngx_dynamic_upstream_lua_pool_slot_t *) (pool + 1);
+
+    /* the refs of a process are allocated by its first request */
+
+    pool->procs = ngx_slab_calloc(shpool, NGX_MAX_PROCESSES
+                      * sizeof(ngx_dynamic_upstream_lua_pool_proc_t *));
+    if (pool->procs == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < pool->nslots; i++) {
+        pool->slots[i].refs = NGX_DYNAMIC_UPSTREAM_LUA_POOL_DEAD;
+    }
+
+    shpool->data = pool;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool,
+        sizeof(" in dynamic upstream pool \"\"") + shm_zone->shm.name.len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in dynamic upstream pool \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+char *
+ngx_dynamic_upstream_lua_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf = conf;
+
+    ngx_str_t   *value;
+    ssize_t      size;
+    ngx_int_t    n;
+    ngx_uint_t   i;
+
+    if (mcf->pool_zone != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[1]);
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        return "invalid size";
+    }
+
+    n = NGX_DYNAMIC_UPSTREAM_LUA_POOL_UPSTREAMS;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "upstreams=", 10) == 0) {
+
+            n = ngx_atoi(value[i].data + 10, value[i].len - 10);
+            if (n == NGX_ERROR || n == 0) {
+                return "invalid upstreams";
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->pool_upstreams = n;
+
+    mcf->pool_zone = ngx_shared_memory_add(cf, &pool_name, size,
+                         &ngx_http_dynamic_upstream_lua_module);
+    if (mcf->pool_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->pool_zone->init = ngx_dynamic_upstream_lua_pool_init_zone;
+    mcf->pool_zone->data = mcf;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_slab_pool_t *
+ngx_dynamic_upstream_lua_pool_shpool(void)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf;
+
+    mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+              ngx_http_dynamic_upstream_lua_module);
+    if (mcf == NULL || mcf->pool_zone == NULL
+        || mcf->pool_zone->shm.addr == NULL)
+    {
+        return NULL;
+    }
+
+    return (ngx_slab_pool_t *) mcf->pool_zone->shm.addr;
+}
+
+
+/*
+ * The master reuses a process slot only after the previous process
+ * exited, refs left by a crashed worker are returned by the next one.
+ */
+
+static ngx_dynamic_upstream_lua_pool_proc_t *
+ngx_dynamic_upstream_lua_pool_proc(ngx_slab_pool_t *shpool)
+{
+    ngx_dynamic_upstream_lua_pool_t       *pool;
+    ngx_dynamic_upstream_lua_pool_proc_t  *proc;
+    ngx_atomic_uint_t                      refs;
+    ngx_uint_t                             i;
+
+    if (ngx_dynamic_upstream_lua_pool_self != NULL) {
+        return ngx_dynamic_upstream_lua_pool_self;
+    }
+
+    pool = shpool->data;
+
+    proc = pool->procs[ngx_process_slot];
+
+    if (proc == NULL) {
+        proc = ngx_slab_calloc(shpool,
+                               sizeof(ngx_dynamic_upstream_lua_pool_proc_t)
+                               + (pool->nslots - 1) * sizeof(ngx_atomic_t));
+        if (proc == NULL) {
+            return NULL;
+        }
+
+        pool->procs[ngx_process_slot] = proc;
+
+    } else if (proc->pid != ngx_pid) {
+
+        for (i = 0; i < pool->nslots; i++) {
+            refs = proc->refs[i];
+
+            if (refs == 0) {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "dynamic upstream \"%V\": %uA refs of exited "
+                          "process %P returned", &pool->slots[i].name,
+                          refs, proc->pid);
+
+            (void) ngx_atomic_fetch_add(&pool->slots[i].refs,
+                                        -(ngx_atomic_int_t) refs);
+            proc->refs[i] = 0;
+        }
+    }
+
+    proc->pid = ngx_pid;
+
+    ngx_dynamic_upstream_lua_pool_self = proc;
+
+    return proc;
+}
+
+
+static ngx_flag_t
+ngx_dynamic_upstream_lua_pool_taken(ngx_str_t *name)
+{
+    ngx_uint_t                      i;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return 0;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->host.len == name->len
+            && ngx_strncmp(uscfp[i]->host.data, name->data, name->len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_dynamic_upstream_lua_pool_local_t *
+ngx_dynamic_upstream_lua_pool_local(ngx_dynamic_upstream_lua_pool_slot_t *slot,
+    ngx_uint_t index, ngx_log_t *log)
+{
+    ngx_dynamic_upstream_lua_pool_local_t  *local;
+    ngx_http_upstream_srv_conf_t           *uscf;
+    u_char                                 *p;
+
+    local = ngx_calloc(sizeof(ngx_dynamic_upstream_lua_pool_local_t)
+                       + ngx_http_max_module * sizeof(void *)
+                       + slot->name.len, log);
+    if (local == NULL) {
+        return NULL;
+    }
+
+    local->srv_conf = (void **) (local + 1);
+
+    p = (u_char *) (local->srv_conf + ngx_http_max_module);
+    ngx_memcpy(p, slot->name.data, slot->name.len);
+
+    uscf = &local->uscf;
+
+    uscf->host.data = p;
+    uscf->host.len = slot->name.len;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    uscf->peer.init = ngx_dynamic_upstream_lua_pool_init_peer;
+    uscf->peer.data = slot->peers;
+    uscf->srv_conf = local->srv_conf;
+    uscf->shm_zone = &local->zone;
+
+    /* features of the module are not configured for the upstream */
+
+    local->srv_conf[ngx_http_upstream_module.ctx_index] = uscf;
+    local->srv_conf[ngx_http_dynamic_upstream_lua_module.ctx_index] =
+        &local->ucscf;
+
+    local->zone.shm.addr = slot->slice;
+    local->zone.shm.size = slot->size;
+    local->zone.shm.name = uscf->host;
+    local->zone.shm.exists = 1;
+    local->zone.tag = &ngx_http_dynamic_upstream_lua_module;
+
+    local->slot = slot;
+    local->index = index;
+    local->generation = slot->generation;
+    local->balancer = slot->balancer;
+
+    return local;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_pool_release(
+    ngx_dynamic_upstream_lua_pool_local_t *local)
+{
+    if (local->linked || local->refs != 0) {
+        return;
+    }
+
+    if (local->ucscf.replica != NULL) {
+        ngx_http_dynamic_upstream_lua_replica_free(local->ucscf.replica);
+    }
+
+    ngx_free(local);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_pool_link(ngx_dynamic_upstream_lua_pool_local_t *local)
+{
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* proxy_pass with variables searches the upstream by name there */
+
+    uscfp = ngx_array_push(&umcf->upstreams);
+    if (uscfp == NULL) {
+        return NGX_ERROR;
+    }
+
+    *uscfp = &local->uscf;
+
+    local->linked = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_pool_unlink(
+    ngx_dynamic_upstream_lua_pool_local_t *local)
+{
+    ngx_uint_t                      i;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i] == &local->uscf) {
+            ngx_memmove(&uscfp[i], &uscfp[i + 1],
+                        (umcf->upstreams.nelts - i - 1)
+                        * sizeof(ngx_http_upstream_srv_conf_t *));
+            umcf->upstreams.nelts--;
+            break;
+        }
+    }
+
+    local->linked = 0;
+
+    /* requests of the worker still running keep the upstream */
+
+    ngx_dynamic_upstream_lua_pool_release(local);
+}
+
+
+void
+ngx_http_dynamic_upstream_lua_pool_sync(void)
+{
+    ngx_slab_pool_t                        *shpool;
+    ngx_dynamic_upstream_lua_pool_t        *pool;
+    ngx_dynamic_upstream_lua_pool_slot_t   *slot;
+    ngx_dynamic_upstream_lua_pool_local_t  *local, **locals;
+    ngx_atomic_uint_t                       version;
+    ngx_flag_t                              synced;
+    ngx_uint_t                              i;
+
+    shpool = ngx_dynamic_upstream_lua_pool_shpool();
+    if (shpool == NULL) {
+        return;
+    }
+
+    pool = shpool->data;
+
+    if (pool->version == ngx_dynamic_upstream_lua_pool_version) {
+        return;
+    }
+
+    locals = ngx_dynamic_upstream_lua_pool_locals;
+
+    if (locals == NULL) {
+        locals = ngx_pcalloc(ngx_cycle->pool,
+            pool->nslots * sizeof(ngx_dynamic_upstream_lua_pool_local_t *));
+        if (locals == NULL) {
+            return;
+        }
+
+        ngx_dynamic_upstream_lua_pool_locals = locals;
+    }
+
+    synced = 1;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    version = pool->version;
+
+    for (i = 0; i < pool->nslots; i++) {
+
+        slot = &pool->slots[i];
+        local = locals[i];
+
+        if (local != NULL
+            && (slot->state != NGX_DYNAMIC_UPSTREAM_LUA_POOL_LIVE
+                || slot->generation != local->generation))
+        {
+            ngx_dynamic_upstream_lua_pool_unlink(local);
+            locals[i] = local = NULL;
+        }
+
+        if (local != NULL || slot->state != NGX_DYNAMIC_UPSTREAM_LUA_POOL_LIVE)
+        {
+            continue;
+        }
+
+        local = ngx_dynamic_upstream_lua_pool_local(slot, i, ngx_cycle->log);
+        if (local == NULL) {
+            synced = 0;
+            continue;
+        }
+
+        if (ngx_dynamic_upstream_lua_pool_link(local) != NGX_OK) {
+            ngx_free(local);
+            synced = 0;
+            continue;
+        }
+
+        locals[i] = local;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    /* the next call retries after a failure */
+
+    if (synced) {
+        ngx_dynamic_upstream_lua_pool_version = version;
+    }
+}
+
+
+static void
+ngx_dynamic_upstream_lua_pool_cleanup(void *data)
+{
+    ngx_dynamic_upstream_lua_pool_local_t  *local = data;
+
+    (void) ngx_atomic_fetch_add(&local->slot->refs, -1);
+    (void) ngx_atomic_fetch_add(&ngx_dynamic_upstream_lua_pool_self->refs[
+                                    local->index], -1);
+
+    local->refs--;
+
+    ngx_dynamic_upstream_lua_pool_release(local);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_pool_get_least_conn(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_http_upstream_rr_peer_data_t  *rrp = data;
+
+    time_t                         now;
+    uintptr_t                      m;
+    ngx_int_t                      rc;
+    ngx_uint_t                     i, n, p;
+    ngx_http_upstream_rr_peer_t   *peer, *best;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    peers = rrp->peers;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    best = NULL;
+    p = 0;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n] & m) {
+            continue;
+        }
+
+        if (peer->down) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        /* conns / weight compared without division */
+
+        if (best == NULL
+            || peer->conns * best->weight < best->conns * peer->weight)
+        {
+            best = peer;
+            p = i;
+        }
+    }
+
+    if (best == NULL) {
+        goto failed;
+    }
+
+    best->conns++;
+
+    rrp->current = best;
+
+    n = p / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+    rrp->tried[n] |= m;
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+
+failed:
+
+    /* backup peers are selected by the round robin */
+
+    if (peers->next) {
+
+        rrp->peers = peers->next;
+
+        n = (rrp->peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        for (i = 0; i < n; i++) {
+            rrp->tried[i] = 0;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        rc = ngx_http_upstream_get_round_robin_peer(pc, rrp);
+
+        if (rc != NGX_BUSY) {
+            return rc;
+        }
+
+        ngx_http_upstream_rr_peers_wlock(peers);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_pool_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_dynamic_upstream_lua_pool_local_t  *local;
+    ngx_dynamic_upstream_lua_pool_slot_t   *slot;
+    ngx_dynamic_upstream_lua_pool_proc_t   *proc;
+    ngx_pool_cleanup_t                     *cln;
+    ngx_atomic_uint_t                       refs;
+
+    local = (ngx_dynamic_upstream_lua_pool_local_t *) us;
+    slot = local->slot;
+
+    proc = ngx_dynamic_upstream_lua_pool_proc(
+               ngx_dynamic_upstream_lua_pool_shpool());
+    if (proc == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "dynamic upstream \"%V\": no memory for refs",
+                      &us->host);
+        return NGX_ERROR;
+    }
+
+    /* the slice is not released while the request holds the slot */
+
+    refs = ngx_atomic_fetch_add(&slot->refs, 1);
+
+    if ((refs & NGX_DYNAMIC_UPSTREAM_LUA_POOL_DEAD)
+        || slot->generation != local->generation)
+    {
+        (void) ngx_atomic_fetch_add(&slot->refs, -1);
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "dynamic upstream \"%V\" is deleted", &us->host);
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        (void) ngx_atomic_fetch_add(&slot->refs, -1);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_dynamic_upstream_lua_pool_cleanup;
+    cln->data = local;
+
+    (void) ngx_atomic_fetch_add(&proc->refs[local->index], 1);
+
+    local->refs++;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (local->balancer == NGX_DYNAMIC_UPSTREAM_LUA_POOL_LEAST_CONN) {
+        r->upstream->peer.get = ngx_dynamic_upstream_lua_pool_get_least_conn;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_http_upstream_rr_peers_t *
+ngx_dynamic_upstream_lua_pool_slice(u_char *slice, size_t size,
+    ngx_str_t *name)
+{
+    ngx_slab_pool_t               *sp;
+    ngx_http_upstream_rr_peers_t  *peers, *backup;
+    ngx_str_t                     *s;
+
+    /* the slice is the zone of the upstream, the peers are allocated there */
+
+    sp = (ngx_slab_pool_t *) slice;
+
+    ngx_memzero(sp, sizeof(ngx_slab_pool_t));
+
+    sp->end = slice + size;
+    sp->min_shift = 3;
+    sp->addr = slice;
+
+    if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+        return NULL;
+    }
+
+    ngx_slab_init(sp);
+
+    sp->log_ctx = ngx_slab_alloc(sp,
+        sizeof(" in dynamic upstream \"\"") + name->len);
+    if (sp->log_ctx == NULL) {
+        return NULL;
+    }
+
+    ngx_sprintf(sp->log_ctx, " in dynamic upstream \"%V\"%Z", name);
+
+    s = ngx_slab_alloc(sp, sizeof(ngx_str_t) + name->len);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->data = (u_char *) (s + 1);
+    s->len = name->len;
+    ngx_memcpy(s->data, name->data, name->len);
+
+    peers = ngx_slab_calloc(sp, sizeof(ngx_http_upstream_rr_peers_t));
+    if (peers == NULL) {
+        return NULL;
+    }
+
+    backup = ngx_slab_calloc(sp, sizeof(ngx_http_upstream_rr_peers_t));
+    if (backup == NULL) {
+        return NULL;
+    }
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    peers->shpool = sp;
+    backup->shpool = sp;
+#endif
+
+    peers->name = s;
+    backup->name = s;
+
+    peers->next = backup;
+
+    return peers;
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_pool_create(ngx_log_t *log, ngx_str_t *name,
+    size_t size, ngx_str_t *balancer, const char **err)
+{
+    ngx_slab_pool_t                       *shpool;
+    ngx_dynamic_upstream_lua_pool_t       *pool;
+    ngx_dynamic_upstream_lua_pool_slot_t  *slot, *found;
+    ngx_http_upstream_rr_peers_t          *peers;
+    ngx_atomic_uint_t                      refs;
+    ngx_uint_t                             i, b;
+    u_char                                *slice;
+
+    shpool = ngx_dynamic_upstream_lua_pool_shpool();
+    if (shpool == NULL) {
+        *err = "dynamic_upstream_pool is not set";
+        return NGX_ERROR;
+    }
+
+    pool = shpool->data;
+
+    b = NGX_DYNAMIC_UPSTREAM_LUA_POOL_ROUND_ROBIN;
+
+    if (balancer->len == 10
+        && ngx_strncmp(balancer->data, "least_conn", 10) == 0)
+    {
+        b = NGX_DYNAMIC_UPSTREAM_LUA_POOL_LEAST_CONN;
+
+    } else if (balancer->len != 0
+               && (balancer->len != 11
+                   || ngx_strncmp(balancer->data, "round_robin", 11) != 0))
+    {
+        *err = "unknown balancer";
+        return NGX_ERROR;
+    }
+
+    if (size == 0) {
+        size = NGX_DYNAMIC_UPSTREAM_LUA_POOL_SLICE;
+    }
+
+    if (size < 8 * ngx_pagesize) {
+        *err = "zone_slice is too small";
+        return NGX_ERROR;
+    }
+
+    /* upstreams of the configuration are found by name too */
+
+    ngx_http_dynamic_upstream_lua_pool_sync();
+
+    if (ngx_dynamic_upstream_lua_pool_taken(name)) {
+        *err = "upstream exists";
+        return NGX_DECLINED;
+    }
+
+    found = NULL;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (i = 0; i < pool->nslots; i++) {
+
+        slot = &pool->slots[i];
+
+        if (slot->state == NGX_DYNAMIC_UPSTREAM_LUA_POOL_LIVE
+            && slot->name.len == name->len
+            && ngx_strncmp(slot->name.data, name->data, name->len) == 0)
+        {
+            ngx_shmtx_unlock(&shpool->mutex);
+            *err = "upstream exists";
+            return NGX_DECLINED;
+        }
+
+        if (found == NULL
+            && slot->state == NGX_DYNAMIC_UPSTREAM_LUA_POOL_FREE)
+        {
+            found = slot;
+        }
+    }
+
+    if (found == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        *err = "no free upstream slots";
+        return NGX_ERROR;
+    }
+
+    slice = ngx_slab_alloc_locked(shpool, size);
+    if (slice == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        *err = "no memory";
+        return NGX_ERROR;
+    }
+
+    peers = ngx_dynamic_upstream_lua_pool_slice(slice, size, name);
+    if (peers == NULL) {
+        ngx_slab_free_locked(shpool, slice);
+        ngx_shmtx_unlock(&shpool->mutex);
+        *err = "zone_slice is too small";
+        return NGX_ERROR;
+    }
+
+    slot = found;
+
+    slot->name = *peers->name;
+    slot->slice = slice;
+    slot->size = size;
+    slot->peers = peers;
+    slot->balancer = b;
+    slot->deleted = 0;
+    slot->detached = NULL;
+    slot->state = NGX_DYNAMIC_UPSTREAM_LUA_POOL_LIVE;
+
+    /* workers with the previous generation back off before the slot opens */
+
+    (void) ngx_atomic_fetch_add(&slot->generation, 1);
+
+    for ( ;; ) {
+        refs = slot->refs;
+
+        if (ngx_atomic_cmp_set(&slot->refs, refs,
+                               refs & ~NGX_DYNAMIC_UPSTREAM_LUA_POOL_DEAD))
+        {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&pool->version, 1);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_http_dynamic_upstream_lua_pool_sync();
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "dynamic upstream \"%V\" created, zone slice %uz",
+                  name, size);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_pool_delete(ngx_log_t *log, ngx_str_t *name,
+    const char **err)
+{
+    ngx_slab_pool_t                       *shpool;
+    ngx_dynamic_upstream_lua_pool_t       *pool;
+    ngx_dynamic_upstream_lua_pool_slot_t  *slot;
+    ngx_uint_t                             i;
+
+    shpool = ngx_dynamic_upstream_lua_pool_shpool();
+    if (shpool == NULL) {
+        *err = "dynamic_upstream_pool is not set";
+        return NGX_ERROR;
+    }
+
+    pool = shpool->data;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (i = 0; i < pool->nslots; i++) {
+
+        slot = &pool->slots[i];
+
+        if (slot->state == NGX_DYNAMIC_UPSTREAM_LUA_POOL_LIVE
+            && slot->name.len == name->len
+            && ngx_strncmp(slot->name.data, name->data, name->len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == pool->nslots) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        *err = "upstream not found";
+        return NGX_DECLINED;
+    }
+
+    /* the peers stay until the requests release them */
+
+    slot->state = NGX_DYNAMIC_UPSTREAM_LUA_POOL_DELETED;
+    slot->deleted = ngx_time();
+
+    /*
+     * tags, staged changes and counters of the name are dropped, an
+     * upstream created with the name later starts with a new state
+     */
+
+    slot->detached = ngx_dynamic_upstream_lua_state_detach(name, 0);
+
+    (void) ngx_atomic_fetch_add(&pool->version, 1);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_http_dynamic_upstream_lua_pool_sync();
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "dynamic upstream \"%V\" deleted", name);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_pool_reclaim(ngx_slab_pool_t *shpool)
+{
+    ngx_dynamic_upstream_lua_pool_t       *pool;
+    ngx_dynamic_upstream_lua_pool_slot_t  *slot;
+    ngx_slab_pool_t                       *sp;
+    ngx_uint_t                             i;
+    time_t                                 now;
+
+    pool = shpool->data;
+
+    now = ngx_time();
+
+    for (i = 0; i < pool->nslots; i++) {
+
+        slot = &pool->slots[i];
+
+        /*
+         * lookups of workers not synced yet are done within the grace
+         * period, requests hold refs
+         */
+
+        if (slot->state != NGX_DYNAMIC_UPSTREAM_LUA_POOL_DELETED
+            || now - slot->deleted < NGX_DYNAMIC_UPSTREAM_LUA_POOL_GRACE
+            || slot->refs != 0)
+        {
+            continue;
+        }
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        if (slot->state != NGX_DYNAMIC_UPSTREAM_LUA_POOL_DELETED
+            || !ngx_atomic_cmp_set(&slot->refs, 0,
+                                   NGX_DYNAMIC_UPSTREAM_LUA_POOL_DEAD))
+        {
+            ngx_shmtx_unlock(&shpool->mutex);
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "dynamic upstream \"%V\" released", &slot->name);
+
+        sp = (ngx_slab_pool_t *) slot->slice;
+
+        ngx_shmtx_destroy(&sp->mutex);
+
+        if (slot->detached != NULL) {
+            ngx_dynamic_upstream_lua_state_free(slot->detached);
+            slot->detached = NULL;
+        }
+
+        ngx_slab_free_locked(shpool, slot->slice);
+
+        ngx_str_null(&slot->name);
+        slot->slice = NULL;
+        slot->size = 0;
+        slot->peers = NULL;
+        slot->state = NGX_DYNAMIC_UPSTREAM_LUA_POOL_FREE;
+
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+}
+
+
+static void
+ngx_dynamic_upstream_lua_pool_timer(ngx_event_t *ev)
+{
+    ngx_slab_pool_t  *shpool;
+
+    ngx_http_dynamic_upstream_lua_pool_sync();
+
+    shpool = ngx_dynamic_upstream_lua_pool_shpool();
+    if (shpool != NULL) {
+        ngx_dynamic_upstream_lua_pool_reclaim(shpool);
+    }
+
+    if (!ngx_exiting) {
+        ngx_add_timer(ev, NGX_DYNAMIC_UPSTREAM_LUA_POOL_INTERVAL);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_lua_pool_handler(ngx_http_request_t *r)
+{
+    /* proxy_pass of the request sees the upstreams of other workers */
+
+    ngx_http_dynamic_upstream_lua_pool_sync();
+
+    return NGX_DECLINED;
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_pool_init(ngx_conf_t *cf)
+{
+    ngx_http_handler_pt                        *h;
+    ngx_http_core_main_conf_t                  *cmcf;
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf;
+
+    mcf = ngx_http_conf_get_module_main_conf(cf,
+              ngx_http_dynamic_upstream_lua_module);
+
+    if (mcf->pool_zone == NULL) {
+        return NGX_OK;
+    }
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_POST_READ_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_dynamic_upstream_lua_pool_handler;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_pool_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf;
+    ngx_event_t                                *ev;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+              ngx_http_dynamic_upstream_lua_module);
+    if (mcf == NULL || mcf->pool_zone == NULL) {
+        return NGX_OK;
+    }
+
+    /* a respawned worker returns the refs left by the crashed one */
+
+    if (mcf->pool_zone->shm.addr != NULL) {
+        (void) ngx_dynamic_upstream_lua_pool_proc(
+                   (ngx_slab_pool_t *) mcf->pool_zone->shm.addr);
+    }
+
+    ngx_http_dynamic_upstream_lua_pool_sync();
+
+    ev = &ngx_dynamic_upstream_lua_pool_event;
+
+    ev->handler = ngx_dynamic_upstream_lua_pool_timer;
+    ev->log = cycle->log;
+    ev->cancelable = 1;
+
+    ngx_add_timer(ev, NGX_DYNAMIC_UPSTREAM_LUA_POOL_INTERVAL);
+
+    return NGX_OK;
+}
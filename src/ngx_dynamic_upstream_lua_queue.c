@@ -0,0 +1,880 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+extern ngx_module_t ngx_stream_dynamic_upstream_lua_module;
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_QUEUE_TIMEOUT   60000
+#define NGX_DYNAMIC_UPSTREAM_LUA_QUEUE_INTERVAL  10
+
+
+static void
+ngx_dynamic_upstream_lua_queue_poll(ngx_event_t *ev);
+
+
+/* queues of the worker with waiting requests */
+
+static ngx_queue_t  ngx_dynamic_upstream_lua_queue_busy;
+static ngx_event_t  ngx_dynamic_upstream_lua_queue_event;
+
+
+char *
+ngx_dynamic_upstream_lua_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_dynamic_upstream_lua_queue_t  **qp, *q;
+    ngx_str_t                          *value, s;
+    ngx_int_t                           n;
+    ngx_msec_t                          timeout;
+    ngx_uint_t                          i;
+
+    qp = (ngx_dynamic_upstream_lua_queue_t **) ((char *) conf + cmd->offset);
+
+    if (*qp != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        return "invalid value";
+    }
+
+    timeout = NGX_DYNAMIC_UPSTREAM_LUA_QUEUE_TIMEOUT;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+
+            timeout = ngx_parse_time(&s, 0);
+            if (timeout == (ngx_msec_t) NGX_ERROR || timeout == 0) {
+                return "invalid timeout";
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    q = ngx_pcalloc(cf->pool, sizeof(ngx_dynamic_upstream_lua_queue_t));
+    if (q == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    q->size = n;
+    q->timeout = timeout;
+
+    ngx_queue_init(&q->waiters);
+
+    if (cf->module_type == NGX_HTTP_MODULE) {
+        q->uscf = ngx_http_conf_get_module_srv_conf(cf,
+                                                    ngx_http_upstream_module);
+    } else {
+        q->suscf = ngx_stream_conf_get_module_srv_conf(cf,
+                       ngx_stream_upstream_module);
+    }
+
+    *qp = q;
+
+    /*
+     * the queue depth and counters are kept in the module zone,
+     * a stream upstream without the http block counts per worker
+     */
+
+    if (ngx_dynamic_upstream_lua_shm_add(cf) == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_dynamic_upstream_lua_queue_slot_t *
+ngx_dynamic_upstream_lua_queue_slot(
+    ngx_dynamic_upstream_lua_queue_counters_t *counters)
+{
+    ngx_slab_pool_t                        *shpool;
+    ngx_dynamic_upstream_lua_queue_slot_t  *slot;
+
+    if (counters->slots == NULL) {
+
+        shpool = ngx_dynamic_upstream_lua_shm_pool();
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        if (counters->slots == NULL) {
+            counters->slots = ngx_slab_calloc_locked(shpool,
+                NGX_MAX_PROCESSES
+                * sizeof(ngx_dynamic_upstream_lua_queue_slot_t));
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        if (counters->slots == NULL) {
+            return NULL;
+        }
+    }
+
+    slot = &counters->slots[ngx_process_slot];
+
+    /*
+     * the master reuses the slot only after the previous process exited,
+     * requests it left in the queue are no longer waiting
+     */
+
+    if (slot->pid != ngx_pid) {
+        (void) ngx_atomic_fetch_add(&counters->waiting,
+                                    -(ngx_atomic_int_t) slot->waiting);
+        (void) ngx_atomic_fetch_add(&counters->pending,
+                                    -(ngx_atomic_int_t) slot->pending);
+
+        slot->waiting = 0;
+        slot->pending = 0;
+        slot->pid = ngx_pid;
+    }
+
+    return slot;
+}
+
+
+static ngx_dynamic_upstream_lua_queue_counters_t *
+ngx_dynamic_upstream_lua_queue_counters(ngx_dynamic_upstream_lua_queue_t *q)
+{
+    ngx_dynamic_upstream_lua_state_t            *state;
+    ngx_stream_dynamic_upstream_lua_srv_conf_t  *ucscf;
+
+    if (q->counters != NULL) {
+        return q->counters;
+    }
+
+    if (q->uscf != NULL) {
+        state = ngx_http_dynamic_upstream_lua_srv_state(q->uscf);
+
+    } else {
+        ucscf = ngx_stream_conf_upstream_srv_conf(q->suscf,
+                    ngx_stream_dynamic_upstream_lua_module);
+
+        if (ucscf->state == NULL) {
+            ucscf->state = ngx_dynamic_upstream_lua_state(&q->suscf->host,
+                               NGX_DYNAMIC_UPSTREAM_LUA_STREAM);
+        }
+
+        state = ucscf->state;
+    }
+
+    /* without the module zone each worker counts its own requests */
+
+    if (state != NULL) {
+        q->slot = ngx_dynamic_upstream_lua_queue_slot(&state->queue);
+    }
+
+    q->state = state;
+
+    if (q->slot == NULL) {
+        q->slot = &q->local_slot;
+    }
+
+    q->counters = state != NULL ? &state->queue : &q->local;
+
+    return q->counters;
+}
+
+
+static ngx_uint_t
+ngx_http_dynamic_upstream_lua_queue_free(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *primary, *peers;
+    ngx_uint_t                     n = 0;
+    time_t                         now;
+
+    now = ngx_time();
+
+    primary = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    for (peers = primary; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (peer->down
+                || (peer->max_fails
+                    && peer->fails >= peer->max_fails
+                    && now - peer->checked <= peer->fail_timeout))
+            {
+                continue;
+            }
+
+            if (peer->max_conns == 0) {
+                n = NGX_MAX_INT32_VALUE;
+                goto done;
+            }
+
+            if (peer->conns < peer->max_conns) {
+                n += peer->max_conns - peer->conns;
+            }
+        }
+    }
+
+done:
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    return n;
+}
+
+
+static ngx_uint_t
+ngx_stream_dynamic_upstream_lua_queue_free(
+    ngx_stream_upstream_srv_conf_t *uscf)
+{
+    ngx_stream_upstream_rr_peer_t   *peer;
+    ngx_stream_upstream_rr_peers_t  *primary, *peers;
+    ngx_uint_t                       n = 0;
+    time_t                           now;
+
+    now = ngx_time();
+
+    primary = uscf->peer.data;
+
+    ngx_stream_upstream_rr_peers_rlock(primary);
+
+    for (peers = primary; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (peer->down
+                || (peer->max_fails
+                    && peer->fails >= peer->max_fails
+                    && now - peer->checked <= peer->fail_timeout))
+            {
+                continue;
+            }
+
+            if (peer->max_conns == 0) {
+                n = NGX_MAX_INT32_VALUE;
+                goto done;
+            }
+
+            if (peer->conns < peer->max_conns) {
+                n += peer->max_conns - peer->conns;
+            }
+        }
+    }
+
+done:
+
+    ngx_stream_upstream_rr_peers_unlock(primary);
+
+    return n;
+}
+
+
+/*
+ * peers are walked once per event loop iteration and version of the
+ * upstream, requests of the worker taking and releasing peers are
+ * counted in between
+ */
+
+static ngx_uint_t
+ngx_dynamic_upstream_lua_queue_capacity(ngx_dynamic_upstream_lua_queue_t *q)
+{
+    ngx_dynamic_upstream_lua_queue_counters_t  *counters;
+    ngx_dynamic_upstream_lua_state_t           *state;
+    ngx_atomic_uint_t                           version;
+    ngx_uint_t                                  n, pending;
+
+    counters = ngx_dynamic_upstream_lua_queue_counters(q);
+
+    state = q->state;
+
+    if (state != NULL
+        && q->cached
+        && q->counted == ngx_current_msec
+        && state->writers == 0
+        && q->version == state->version)
+    {
+        n = q->free;
+        goto cached;
+    }
+
+    version = state != NULL ? state->version : 0;
+
+    if (q->uscf != NULL) {
+        n = ngx_http_dynamic_upstream_lua_queue_free(q->uscf);
+    } else {
+        n = ngx_stream_dynamic_upstream_lua_queue_free(q->suscf);
+    }
+
+    q->version = version;
+    q->counted = ngx_current_msec;
+    q->free = n;
+    q->cached = 1;
+
+cached:
+
+    /* woken requests of all workers have not connected yet */
+
+    pending = counters->pending;
+
+    return n > pending ? n - pending : 0;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_queue_take(ngx_dynamic_upstream_lua_queue_t *q)
+{
+    if (q->free > 0 && q->free != NGX_MAX_INT32_VALUE) {
+        q->free--;
+    }
+}
+
+
+static void
+ngx_dynamic_upstream_lua_queue_leave(ngx_dynamic_upstream_lua_waiter_t *w,
+    ngx_int_t status)
+{
+    ngx_dynamic_upstream_lua_queue_t           *q = w->q;
+    ngx_dynamic_upstream_lua_queue_counters_t  *counters;
+    ngx_atomic_uint_t                           wait, max;
+
+    counters = ngx_dynamic_upstream_lua_queue_counters(q);
+
+    ngx_queue_remove(&w->queue);
+
+    if (--q->nwaiters == 0) {
+        ngx_queue_remove(&q->busy);
+    }
+
+    if (w->event.timer_set) {
+        ngx_del_timer(&w->event);
+    }
+
+    (void) ngx_atomic_fetch_add(&counters->waiting, -1);
+    q->slot->waiting--;
+
+    w->status = status;
+
+    if (status == NGX_DECLINED) {
+        (void) ngx_atomic_fetch_add(&counters->timedout, 1);
+        return;
+    }
+
+    if (status != NGX_OK) {
+        return;
+    }
+
+    wait = ngx_current_msec - w->start;
+
+    (void) ngx_atomic_fetch_add(&counters->dequeued, 1);
+    (void) ngx_atomic_fetch_add(&counters->wait_time, wait);
+
+    for ( ;; ) {
+        max = counters->wait_max;
+
+        if (wait <= max
+            || ngx_atomic_cmp_set(&counters->wait_max, max, wait))
+        {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&counters->pending, 1);
+    q->slot->pending++;
+
+    w->pending = 1;
+
+    ngx_dynamic_upstream_lua_queue_take(q);
+}
+
+
+static void
+ngx_dynamic_upstream_lua_queue_timeout(ngx_event_t *ev)
+{
+    ngx_dynamic_upstream_lua_waiter_t  *w = ev->data;
+
+    ngx_dynamic_upstream_lua_queue_leave(w, NGX_DECLINED);
+
+    w->resume(w);
+}
+
+
+static void
+ngx_dynamic_upstream_lua_queue_poll(ngx_event_t *ev)
+{
+    ngx_queue_t                        *l, *next;
+    ngx_dynamic_upstream_lua_queue_t   *q;
+    ngx_dynamic_upstream_lua_waiter_t  *w;
+    ngx_uint_t                          n;
+
+    /* peers released by other workers are seen by polling */
+
+    for (l = ngx_queue_head(&ngx_dynamic_upstream_lua_queue_busy);
+         l != ngx_queue_sentinel(&ngx_dynamic_upstream_lua_queue_busy);
+         l = next)
+    {
+        next = ngx_queue_next(l);
+
+        q = ngx_queue_data(l, ngx_dynamic_upstream_lua_queue_t, busy);
+
+        for (n = ngx_dynamic_upstream_lua_queue_capacity(q);
+             n > 0 && q->nwaiters > 0;
+             n--)
+        {
+            w = ngx_queue_data(ngx_queue_head(&q->waiters),
+                               ngx_dynamic_upstream_lua_waiter_t, queue);
+
+            ngx_dynamic_upstream_lua_queue_leave(w, NGX_OK);
+
+            w->resume(w);
+        }
+    }
+
+    if (!ngx_queue_empty(&ngx_dynamic_upstream_lua_queue_busy)) {
+        ngx_add_timer(ev, NGX_DYNAMIC_UPSTREAM_LUA_QUEUE_INTERVAL);
+    }
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_queue_enter(ngx_dynamic_upstream_lua_queue_t *q,
+    ngx_dynamic_upstream_lua_waiter_t *w, ngx_log_t *log)
+{
+    ngx_dynamic_upstream_lua_queue_counters_t  *counters;
+    ngx_event_t                                *ev;
+
+    /* requests do not overtake the waiting ones */
+
+    if (q->nwaiters == 0 && ngx_dynamic_upstream_lua_queue_capacity(q) > 0) {
+        ngx_dynamic_upstream_lua_queue_take(q);
+        return NGX_DECLINED;
+    }
+
+    counters = ngx_dynamic_upstream_lua_queue_counters(q);
+
+    if (counters->waiting >= q->size) {
+        (void) ngx_atomic_fetch_add(&counters->rejected, 1);
+        return NGX_BUSY;
+    }
+
+    (void) ngx_atomic_fetch_add(&counters->waiting, 1);
+    (void) ngx_atomic_fetch_add(&counters->queued, 1);
+    q->slot->waiting++;
+
+    ev = &ngx_dynamic_upstream_lua_queue_event;
+
+    if (ev->handler == NULL) {
+        ngx_queue_init(&ngx_dynamic_upstream_lua_queue_busy);
+
+        ev->handler = ngx_dynamic_upstream_lua_queue_poll;
+        ev->log = ngx_cycle->log;
+        ev->cancelable = 1;
+    }
+
+    if (q->nwaiters++ == 0) {
+        ngx_queue_insert_tail(&ngx_dynamic_upstream_lua_queue_busy, &q->busy);
+    }
+
+    ngx_queue_insert_tail(&q->waiters, &w->queue);
+
+    w->q = q;
+    w->start = ngx_current_msec;
+    w->status = NGX_AGAIN;
+
+    w->event.handler = ngx_dynamic_upstream_lua_queue_timeout;
+    w->event.data = w;
+    w->event.log = log;
+
+    ngx_add_timer(&w->event, q->timeout);
+
+    if (!ev->timer_set) {
+        ngx_add_timer(ev, NGX_DYNAMIC_UPSTREAM_LUA_QUEUE_INTERVAL);
+    }
+
+    return NGX_AGAIN;
+}
+
+
+void
+ngx_dynamic_upstream_lua_queue_cleanup(void *data)
+{
+    ngx_dynamic_upstream_lua_waiter_t  *w = data;
+
+    if (w->status == NGX_AGAIN) {
+        ngx_dynamic_upstream_lua_queue_leave(w, NGX_ABORT);
+    }
+
+    ngx_dynamic_upstream_lua_queue_started(w);
+}
+
+
+void
+ngx_dynamic_upstream_lua_queue_started(ngx_dynamic_upstream_lua_waiter_t *w)
+{
+    ngx_dynamic_upstream_lua_queue_t  *q = w->q;
+
+    if (w->pending) {
+        w->pending = 0;
+
+        (void) ngx_atomic_fetch_add(&q->counters->pending, -1);
+        q->slot->pending--;
+    }
+}
+
+
+static void
+ngx_dynamic_upstream_lua_queue_notify(ngx_dynamic_upstream_lua_queue_t *q)
+{
+    if (q == NULL) {
+        return;
+    }
+
+    /* the released peer is free until the next walk */
+
+    if (q->free != NGX_MAX_INT32_VALUE) {
+        q->free++;
+    }
+
+    if (q->nwaiters == 0) {
+        return;
+    }
+
+    /* waiters are woken out of the current handler */
+
+    ngx_post_event(&ngx_dynamic_upstream_lua_queue_event, &ngx_posted_events);
+}
+
+
+void
+ngx_http_dynamic_upstream_lua_queue_notify(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+
+    if (uscf->srv_conf == NULL) {
+        return;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(uscf,
+                ngx_http_dynamic_upstream_lua_module);
+
+    ngx_dynamic_upstream_lua_queue_notify(ucscf->queue);
+}
+
+
+void
+ngx_stream_dynamic_upstream_lua_queue_notify(
+    ngx_stream_upstream_srv_conf_t *uscf)
+{
+    ngx_stream_dynamic_upstream_lua_srv_conf_t  *ucscf;
+
+    if (uscf->srv_conf == NULL) {
+        return;
+    }
+
+    ucscf = ngx_stream_conf_upstream_srv_conf(uscf,
+                ngx_stream_dynamic_upstream_lua_module);
+
+    ngx_dynamic_upstream_lua_queue_notify(ucscf->queue);
+}
+
+
+static void
+ngx_dynamic_upstream_lua_queue_stat(ngx_dynamic_upstream_lua_queue_t *q,
+    ngx_dynamic_upstream_lua_queue_stat_t *stat)
+{
+    ngx_dynamic_upstream_lua_queue_counters_t  *counters;
+
+    counters = ngx_dynamic_upstream_lua_queue_counters(q);
+
+    stat->size = q->size;
+    stat->timeout = q->timeout;
+    stat->waiting = counters->waiting;
+    stat->queued = counters->queued;
+    stat->dequeued = counters->dequeued;
+    stat->rejected = counters->rejected;
+    stat->timedout = counters->timedout;
+    stat->wait_time = counters->wait_time;
+    stat->wait_max = counters->wait_max;
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_queue_stat(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_queue_stat_t *stat)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+
+    if (uscf->srv_conf == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(uscf,
+                ngx_http_dynamic_upstream_lua_module);
+
+    if (ucscf->queue == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ngx_dynamic_upstream_lua_queue_stat(ucscf->queue, stat);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_queue_stat(
+    ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_queue_stat_t *stat)
+{
+    ngx_stream_dynamic_upstream_lua_srv_conf_t  *ucscf;
+
+    if (uscf->srv_conf == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ucscf = ngx_stream_conf_upstream_srv_conf(uscf,
+                ngx_stream_dynamic_upstream_lua_module);
+
+    if (ucscf->queue == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ngx_dynamic_upstream_lua_queue_stat(ucscf->queue, stat);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_dynamic_upstream_lua_queue_resume(
+    ngx_dynamic_upstream_lua_waiter_t *w)
+{
+    ngx_http_request_t  *r = w->data;
+    ngx_connection_t    *c;
+
+    c = r->connection;
+
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    ngx_http_core_run_phases(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_lua_queue_handler(ngx_http_request_t *r)
+{
+    ngx_http_dynamic_upstream_lua_loc_conf_t  *lcf;
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_http_upstream_srv_conf_t              *uscf;
+    ngx_dynamic_upstream_lua_waiter_t         *w;
+    ngx_pool_cleanup_t                        *cln;
+    ngx_str_t                                  name;
+    ngx_int_t                                  rc;
+
+    lcf = ngx_http_get_module_loc_conf(r, ngx_http_dynamic_upstream_lua_module);
+
+    if (lcf->queue_upstream == NULL || r != r->main) {
+        return NGX_DECLINED;
+    }
+
+    w = ngx_http_get_module_ctx(r, ngx_http_dynamic_upstream_lua_module);
+
+    if (w != NULL) {
+
+        switch (w->status) {
+            case NGX_AGAIN:
+                return NGX_AGAIN;
+
+            case NGX_DECLINED:
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "dynamic queue of upstream \"%V\" timed out",
+                              &w->q->uscf->host);
+                return NGX_HTTP_BAD_GATEWAY;
+
+            default:
+                return NGX_DECLINED;
+        }
+    }
+
+    if (ngx_http_complex_value(r, lcf->queue_upstream, &name) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    uscf = lcf->queue_uscf;
+
+    if (uscf == NULL
+        || uscf->host.len != name.len
+        || ngx_strncmp(uscf->host.data, name.data, name.len) != 0)
+    {
+        uscf = ngx_http_dynamic_upstream_lua_upstream(&name);
+        if (uscf == NULL || uscf->srv_conf == NULL) {
+            return NGX_DECLINED;
+        }
+
+        ucscf = ngx_http_conf_upstream_srv_conf(uscf,
+                    ngx_http_dynamic_upstream_lua_module);
+
+        if (ucscf->queue == NULL) {
+            return NGX_DECLINED;
+        }
+
+        /* upstreams with a queue are configured and live with the cycle */
+
+        lcf->queue_uscf = uscf;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(uscf,
+                ngx_http_dynamic_upstream_lua_module);
+
+    w = ngx_pcalloc(r->pool, sizeof(ngx_dynamic_upstream_lua_waiter_t));
+    if (w == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_dynamic_upstream_lua_queue_enter(ucscf->queue, w,
+                                              r->connection->log);
+
+    if (rc == NGX_DECLINED) {
+        return NGX_DECLINED;
+    }
+
+    if (rc == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "dynamic queue of upstream \"%V\" is full",
+                      &uscf->host);
+        return NGX_HTTP_BAD_GATEWAY;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        ngx_dynamic_upstream_lua_queue_cleanup(w);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_dynamic_upstream_lua_queue_cleanup;
+    cln->data = w;
+
+    w->data = r;
+    w->resume = ngx_http_dynamic_upstream_lua_queue_resume;
+
+    ngx_http_set_ctx(r, w, ngx_http_dynamic_upstream_lua_module);
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    return NGX_AGAIN;
+}
+
+
+void
+ngx_http_dynamic_upstream_lua_queue_started(ngx_http_request_t *r)
+{
+    ngx_dynamic_upstream_lua_waiter_t  *w;
+
+    w = ngx_http_get_module_ctx(r->main,
+                                ngx_http_dynamic_upstream_lua_module);
+
+    if (w != NULL) {
+        ngx_dynamic_upstream_lua_queue_started(w);
+    }
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_queue_init(ngx_conf_t *cf)
+{
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_dynamic_upstream_lua_queue_handler;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_queue_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_upstream_main_conf_t                *umcf;
+    ngx_stream_upstream_main_conf_t              *sumcf;
+    ngx_http_upstream_srv_conf_t                **uscfp;
+    ngx_stream_upstream_srv_conf_t              **suscfp;
+    ngx_http_dynamic_upstream_lua_srv_conf_t     *ucscf;
+    ngx_stream_dynamic_upstream_lua_srv_conf_t   *sucscf;
+    ngx_uint_t                                    i;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    /* a respawned worker returns requests of the process it replaces */
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_upstream_module);
+    if (umcf != NULL) {
+
+        uscfp = umcf->upstreams.elts;
+
+        for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+            if (uscfp[i]->srv_conf == NULL) {
+                continue;
+            }
+
+            ucscf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                        ngx_http_dynamic_upstream_lua_module);
+            if (ucscf == NULL || ucscf->queue == NULL) {
+                continue;
+            }
+
+            (void) ngx_dynamic_upstream_lua_queue_counters(ucscf->queue);
+        }
+    }
+
+    sumcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                  ngx_stream_upstream_module);
+    if (sumcf != NULL) {
+
+        suscfp = sumcf->upstreams.elts;
+
+        for (i = 0; i < sumcf->upstreams.nelts; i++) {
+
+            if (suscfp[i]->srv_conf == NULL) {
+                continue;
+            }
+
+            sucscf = ngx_stream_conf_upstream_srv_conf(suscfp[i],
+                         ngx_stream_dynamic_upstream_lua_module);
+            if (sucscf == NULL || sucscf->queue == NULL) {
+                continue;
+            }
+
+            (void) ngx_dynamic_upstream_lua_queue_counters(sucscf->queue);
+        }
+    }
+
+    return NGX_OK;
+}
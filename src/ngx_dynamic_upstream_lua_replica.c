@@ -0,0 +1,1184 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+extern ngx_module_t ngx_stream_dynamic_upstream_lua_module;
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_PICK_TRIES  8
+
+
+char *
+ngx_dynamic_upstream_lua_read_replicas(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf = conf;
+
+    char  *rv;
+
+    rv = ngx_conf_set_flag_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    /* versions of the peer lists are kept in the module zone */
+
+    if (mcf->read_replicas
+        && ngx_dynamic_upstream_lua_shm_add(cf) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * versions are kept whenever the module zone exists, pick_peer and
+ * get_peer read the replica then even without dynamic_upstream_read_replicas
+ */
+
+static ngx_flag_t
+ngx_dynamic_upstream_lua_replicas_enabled(ngx_flag_t lookup)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf;
+
+    mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+              ngx_http_dynamic_upstream_lua_module);
+    if (mcf == NULL || mcf->shm_zone == NULL) {
+        return 0;
+    }
+
+    return lookup || mcf->read_replicas == 1;
+}
+
+
+void
+ngx_dynamic_upstream_lua_replica_bump(ngx_str_t *upstream, ngx_uint_t flags)
+{
+    ngx_dynamic_upstream_lua_state_t  *state;
+
+    if (!ngx_dynamic_upstream_lua_replicas_enabled(1)) {
+        return;
+    }
+
+    /* the state exists once a replica of the upstream is built */
+
+    state = ngx_dynamic_upstream_lua_state_find(upstream, flags);
+    if (state != NULL) {
+        (void) ngx_atomic_fetch_add(&state->version, 1);
+    }
+}
+
+
+/*
+ * Peers are freed by changes of the module between these calls.  Readers
+ * copy counters of the zone without the lock and drop the copy if a change
+ * was running meanwhile, so a freed peer is never trusted.
+ */
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_dynamic_upstream_lua_replica_write(ngx_str_t *upstream, ngx_uint_t flags)
+{
+    ngx_dynamic_upstream_lua_state_t  *state;
+
+    if (!ngx_dynamic_upstream_lua_replicas_enabled(1)) {
+        return NULL;
+    }
+
+    state = ngx_dynamic_upstream_lua_state_find(upstream, flags);
+    if (state != NULL) {
+        (void) ngx_atomic_fetch_add(&state->writers, 1);
+    }
+
+    return state;
+}
+
+
+void
+ngx_dynamic_upstream_lua_replica_written(
+    ngx_dynamic_upstream_lua_state_t *state)
+{
+    if (state == NULL) {
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&state->version, 1);
+    (void) ngx_atomic_fetch_add(&state->writers, -1);
+}
+
+
+/* the same fields of http and stream peers */
+
+#define ngx_dynamic_upstream_lua_hot_init(hot, peer)                          \
+    (hot)->checked = (peer)->checked;                                         \
+    (hot)->weight = (peer)->weight;                                           \
+    (hot)->conns = (peer)->conns;                                             \
+    (hot)->max_conns = (peer)->max_conns;                                     \
+    (hot)->fails = (peer)->fails;                                             \
+    (hot)->max_fails = (peer)->max_fails;                                     \
+    (hot)->fail_timeout = (peer)->fail_timeout;                               \
+    (hot)->down = (peer)->down
+
+
+/* the hash of the host and the port, IPv6 brackets are not hashed */
+
+uint32_t
+ngx_dynamic_upstream_lua_ring_base(ngx_str_t *name)
+{
+    u_char    *host, *port, c;
+    size_t     host_len, port_len, j;
+    uint32_t   hash;
+
+    host = name->data;
+    host_len = name->len;
+    port = NULL;
+    port_len = 0;
+
+    if (name->len < 5
+        || ngx_strncasecmp(name->data, (u_char *) "unix:", 5) != 0)
+    {
+        for (j = 0; j < name->len; j++) {
+            c = name->data[name->len - j - 1];
+
+            if (c == ':') {
+                host_len = name->len - j - 1;
+                port = name->data + name->len - j;
+                port_len = j;
+                break;
+            }
+
+            if (c < '0' || c > '9') {
+                break;
+            }
+        }
+    }
+
+    if (host_len >= 2 && host[0] == '[' && host[host_len - 1] == ']') {
+        host++;
+        host_len -= 2;
+    }
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, host, host_len);
+    ngx_crc32_update(&hash, (u_char *) "", 1);
+    ngx_crc32_update(&hash, port, port_len);
+    ngx_crc32_final(hash);
+
+    return hash;
+}
+
+
+/* points of a peer are mixed from one hash of its address */
+
+uint32_t
+ngx_dynamic_upstream_lua_ring_point(uint32_t base, ngx_uint_t j)
+{
+    uint32_t  h;
+
+    h = base + (uint32_t) j * 0x9e3779b9;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+
+static int ngx_libc_cdecl
+ngx_dynamic_upstream_lua_ring_cmp(const void *one, const void *two)
+{
+    ngx_dynamic_upstream_lua_ring_point_t *first =
+        (ngx_dynamic_upstream_lua_ring_point_t *) one;
+    ngx_dynamic_upstream_lua_ring_point_t *second =
+        (ngx_dynamic_upstream_lua_ring_point_t *) two;
+
+    /* the earlier peer wins a collision, as in the list walk */
+
+    if (first->hash != second->hash) {
+        return first->hash < second->hash ? -1 : 1;
+    }
+
+    if (first->index != second->index) {
+        return first->index < second->index ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_ring_build(ngx_dynamic_upstream_lua_ring_t *ring,
+    ngx_dynamic_upstream_lua_hot_t *hot, ngx_str_t *name, ngx_uint_t n)
+{
+    uint32_t                                base;
+    ngx_uint_t                              i, j, k, number;
+    ngx_dynamic_upstream_lua_ring_point_t  *points;
+
+    number = 0;
+
+    for (i = 0; i < n; i++) {
+        number += hot[i].weight * NGX_DYNAMIC_UPSTREAM_LUA_RING_POINTS;
+    }
+
+    points = NULL;
+
+    if (number != 0) {
+        points = ngx_alloc(number
+                           * sizeof(ngx_dynamic_upstream_lua_ring_point_t),
+                           ngx_cycle->log);
+        if (points == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    for (i = 0, k = 0; i < n; i++) {
+
+        base = ngx_dynamic_upstream_lua_ring_base(&name[i]);
+
+        for (j = 0;
+             j < hot[i].weight * NGX_DYNAMIC_UPSTREAM_LUA_RING_POINTS;
+             j++)
+        {
+            points[k].hash = ngx_dynamic_upstream_lua_ring_point(base, j);
+            points[k].index = (uint32_t) i;
+            k++;
+        }
+    }
+
+    if (number != 0) {
+        ngx_qsort(points, number,
+                  sizeof(ngx_dynamic_upstream_lua_ring_point_t),
+                  ngx_dynamic_upstream_lua_ring_cmp);
+    }
+
+    ring->points = points;
+    ring->number = number;
+    ring->built = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_ring_free(ngx_dynamic_upstream_lua_ring_t *ring)
+{
+    ngx_uint_t  k;
+
+    for (k = 0; k < 2; k++) {
+        if (ring[k].points != NULL) {
+            ngx_free(ring[k].points);
+        }
+    }
+}
+
+
+static void
+ngx_dynamic_upstream_lua_replica_free(void *replica,
+    ngx_dynamic_upstream_lua_ring_t *ring, ngx_pool_t *pool)
+{
+    ngx_dynamic_upstream_lua_ring_free(ring);
+
+    if (pool != NULL) {
+        ngx_destroy_pool(pool);
+    }
+
+    ngx_free(replica);
+}
+
+
+/* the first peer of a name or a server wins, as in the list walk */
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_replica_index(ngx_dynamic_upstream_lua_names_t *names,
+    ngx_str_t *key, void *peer)
+{
+    ngx_dynamic_upstream_lua_name_t  *name;
+
+    if (key->len == 0
+        || ngx_dynamic_upstream_lua_names_find(names, key) != NULL)
+    {
+        return NGX_OK;
+    }
+
+    /* the keys are in the replica and live as long as the index */
+
+    name = ngx_dynamic_upstream_lua_names_add(names, key, 0);
+    if (name == NULL) {
+        return NGX_ERROR;
+    }
+
+    name->peer = peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_http_dynamic_upstream_lua_replica_t *
+ngx_http_dynamic_upstream_lua_replica_build(
+    ngx_http_upstream_srv_conf_t *uscf, ngx_dynamic_upstream_lua_state_t *state)
+{
+    ngx_http_dynamic_upstream_lua_replica_t   *replica;
+    ngx_http_upstream_rr_peers_t              *primary, *peers;
+    ngx_http_upstream_rr_peer_t               *peer, *dst, **prev;
+    ngx_sockaddr_t                            *sockaddr;
+    ngx_atomic_uint_t                          version;
+    ngx_uint_t                                 i, k, n;
+    size_t                                     size;
+    u_char                                    *p;
+
+    primary = uscf->peer.data;
+
+    /* a write after this point is seen by the next reader */
+
+    version = state->version;
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    n = 0;
+    size = sizeof(ngx_http_dynamic_upstream_lua_replica_t);
+
+    for (peers = primary; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+            size += peer->name.len + peer->server.len;
+            n++;
+        }
+    }
+
+    size += n * (sizeof(ngx_dynamic_upstream_lua_hot_t)
+                 + sizeof(ngx_http_upstream_rr_peer_t)
+                 + sizeof(ngx_str_t)
+                 + sizeof(ngx_http_upstream_rr_peer_t *)
+                 + sizeof(ngx_sockaddr_t));
+
+    replica = ngx_alloc(size, ngx_cycle->log);
+    if (replica == NULL) {
+        ngx_http_upstream_rr_peers_unlock(primary);
+        return NULL;
+    }
+
+    replica->state = state;
+    replica->version = version;
+    replica->refreshed = ngx_current_msec;
+    replica->validated = ngx_time();
+    replica->number = 0;
+    replica->n = n;
+
+    replica->nprimary = 0;
+
+    /* the rings are built on the first pick by hash */
+
+    ngx_memzero(replica->ring, sizeof(replica->ring));
+
+    /* the names are indexed on the first lookup */
+
+    replica->pool = NULL;
+
+    replica->hot = (ngx_dynamic_upstream_lua_hot_t *) (replica + 1);
+    replica->peer = (ngx_http_upstream_rr_peer_t *) (replica->hot + n);
+    replica->name = (ngx_str_t *) (replica->peer + n);
+    replica->source = (ngx_http_upstream_rr_peer_t **) (replica->name + n);
+    sockaddr = (ngx_sockaddr_t *) (replica->source + n);
+    p = (u_char *) (sockaddr + n);
+
+    i = 0;
+
+    for (peers = primary, k = 0; peers && k < 2; peers = peers->next, k++) {
+
+        replica->peers[k] = *peers;
+        replica->peers[k].shpool = NULL;
+        replica->peers[k].next = NULL;
+
+        if (k != 0) {
+            replica->peers[0].next = &replica->peers[k];
+        }
+
+        replica->number += peers->number;
+
+        prev = &replica->peers[k].peer;
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            dst = &replica->peer[i];
+
+            *dst = *peer;
+
+            dst->sockaddr = (struct sockaddr *) &sockaddr[i];
+            ngx_memcpy(dst->sockaddr, peer->sockaddr, peer->socklen);
+
+            dst->name.data = p;
+            p = ngx_cpymem(p, peer->name.data, peer->name.len);
+
+            dst->server.data = p;
+            p = ngx_cpymem(p, peer->server.data, peer->server.len);
+
+            dst->next = NULL;
+
+            *prev = dst;
+            prev = &dst->next;
+
+            replica->name[i] = dst->name;
+            replica->source[i] = peer;
+
+            ngx_dynamic_upstream_lua_hot_init(&replica->hot[i], peer);
+
+            i++;
+        }
+
+        *prev = NULL;
+
+        if (k == 0) {
+            replica->nprimary = i;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    return replica;
+}
+
+
+/*
+ * counters are read without the lock, only scalar fields of a peer are
+ * read, a peer freed meanwhile is in the mapped zone and its values are
+ * dropped as a change of the module was running
+ */
+
+static ngx_int_t
+ngx_http_dynamic_upstream_lua_replica_read(
+    ngx_http_dynamic_upstream_lua_replica_t *replica)
+{
+    ngx_dynamic_upstream_lua_state_t  *state;
+    ngx_http_upstream_rr_peer_t       *peer, *dst;
+    ngx_uint_t                         i;
+
+    state = replica->state;
+
+    if (state->writers != 0) {
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < replica->n; i++) {
+
+        peer = replica->source[i];
+        dst = &replica->peer[i];
+
+        dst->conns = peer->conns;
+        dst->fails = peer->fails;
+        dst->accessed = peer->accessed;
+        dst->checked = peer->checked;
+        dst->current_weight = peer->current_weight;
+        dst->effective_weight = peer->effective_weight;
+    }
+
+    ngx_memory_barrier();
+
+    if (state->writers != 0 || state->version != replica->version) {
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < replica->n; i++) {
+        replica->hot[i].conns = replica->peer[i].conns;
+        replica->hot[i].fails = replica->peer[i].fails;
+        replica->hot[i].checked = replica->peer[i].checked;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * once a second the copy is checked against the peers under the read
+ * lock, peers changed by other modules are seen then; counters are
+ * copied under the read lock, the peers are walked in the
+ * order of the replica and a peer replaced since the build is detected
+ * by its address without touching the freed one
+ */
+
+static ngx_int_t
+ngx_http_dynamic_upstream_lua_replica_refresh(
+    ngx_http_dynamic_upstream_lua_replica_t *replica,
+    ngx_http_upstream_rr_peers_t *primary)
+{
+    ngx_http_upstream_rr_peers_t  *peers;
+    ngx_http_upstream_rr_peer_t   *peer, *dst;
+    ngx_uint_t                     i, k;
+
+    i = 0;
+
+    for (peers = primary, k = 0; peers && k < 2; peers = peers->next, k++) {
+        for (peer = peers->peer; peer; peer = peer->next, i++) {
+
+            if (i == replica->n || replica->source[i] != peer) {
+                return NGX_DECLINED;
+            }
+
+            dst = &replica->peer[i];
+
+            if (peer->socklen != dst->socklen
+                || ngx_memcmp(peer->sockaddr, dst->sockaddr, peer->socklen)
+                   != 0)
+            {
+                return NGX_DECLINED;
+            }
+
+            dst->conns = peer->conns;
+            dst->fails = peer->fails;
+            dst->accessed = peer->accessed;
+            dst->checked = peer->checked;
+            dst->current_weight = peer->current_weight;
+            dst->effective_weight = peer->effective_weight;
+
+            replica->hot[i].conns = dst->conns;
+            replica->hot[i].fails = dst->fails;
+            replica->hot[i].checked = dst->checked;
+        }
+    }
+
+    return i == replica->n ? NGX_OK : NGX_DECLINED;
+}
+
+
+ngx_http_dynamic_upstream_lua_replica_t *
+ngx_http_dynamic_upstream_lua_replica(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_flag_t lookup)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_http_dynamic_upstream_lua_replica_t   *replica, *fresh;
+    ngx_dynamic_upstream_lua_state_t          *state;
+    ngx_http_upstream_rr_peers_t              *primary;
+    ngx_int_t                                  rc;
+
+    if (uscf->shm_zone == NULL || uscf->srv_conf == NULL
+        || !ngx_dynamic_upstream_lua_replicas_enabled(lookup))
+    {
+        return NULL;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(uscf,
+                ngx_http_dynamic_upstream_lua_module);
+
+    replica = ucscf->replica;
+
+    if (replica != NULL) {
+        state = replica->state;
+    } else {
+        state = ngx_http_dynamic_upstream_lua_srv_state(uscf);
+        if (state == NULL) {
+            return NULL;
+        }
+    }
+
+    primary = uscf->peer.data;
+
+    if (replica != NULL && replica->version == state->version) {
+
+        /* counters are copied once per event loop iteration */
+
+        if (replica->refreshed == ngx_current_msec) {
+            return replica;
+        }
+
+        if (replica->validated == ngx_time()) {
+            rc = ngx_http_dynamic_upstream_lua_replica_read(replica);
+
+        } else {
+            ngx_http_upstream_rr_peers_rlock(primary);
+
+            rc = ngx_http_dynamic_upstream_lua_replica_refresh(replica,
+                                                               primary);
+
+            ngx_http_upstream_rr_peers_unlock(primary);
+
+            replica->validated = ngx_time();
+        }
+
+        if (rc == NGX_OK) {
+            replica->refreshed = ngx_current_msec;
+            return replica;
+        }
+    }
+
+    /* the build copies the counters as well */
+
+    fresh = ngx_http_dynamic_upstream_lua_replica_build(uscf, state);
+    if (fresh == NULL) {
+        return NULL;
+    }
+
+    if (replica != NULL) {
+        ngx_dynamic_upstream_lua_replica_free(replica, replica->ring,
+                                              replica->pool);
+    }
+
+    ucscf->replica = fresh;
+
+    return fresh;
+}
+
+
+void
+ngx_http_dynamic_upstream_lua_replica_free(
+    ngx_http_dynamic_upstream_lua_replica_t *replica)
+{
+    ngx_dynamic_upstream_lua_replica_free(replica, replica->ring,
+                                          replica->pool);
+}
+
+
+/* the names are indexed once per version of the replica */
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_replica_find(
+    ngx_http_dynamic_upstream_lua_replica_t *replica, ngx_str_t *server,
+    ngx_http_upstream_rr_peer_t **peer)
+{
+    ngx_dynamic_upstream_lua_name_t  *name;
+    ngx_http_upstream_rr_peer_t      *dst;
+    ngx_uint_t                        i;
+
+    if (replica->pool == NULL) {
+
+        replica->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE,
+                                        ngx_cycle->log);
+        if (replica->pool == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_dynamic_upstream_lua_names_init(&replica->names, replica->pool);
+
+        for (i = 0; i < replica->n; i++) {
+
+            dst = &replica->peer[i];
+
+            if (ngx_dynamic_upstream_lua_replica_index(&replica->names,
+                    &dst->server, dst) != NGX_OK
+                || ngx_dynamic_upstream_lua_replica_index(&replica->names,
+                       &dst->name, dst) != NGX_OK)
+            {
+                ngx_destroy_pool(replica->pool);
+                replica->pool = NULL;
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    name = ngx_dynamic_upstream_lua_names_find(&replica->names, server);
+    if (name == NULL) {
+        return NGX_DECLINED;
+    }
+
+    *peer = name->peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_stream_dynamic_upstream_lua_replica_t *
+ngx_stream_dynamic_upstream_lua_replica_build(
+    ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_dynamic_upstream_lua_state_t *state)
+{
+    ngx_stream_dynamic_upstream_lua_replica_t  *replica;
+    ngx_stream_upstream_rr_peers_t             *primary, *peers;
+    ngx_stream_upstream_rr_peer_t              *peer, *dst, **prev;
+    ngx_sockaddr_t                             *sockaddr;
+    ngx_atomic_uint_t                           version;
+    ngx_uint_t                                  i, k, n;
+    size_t                                      size;
+    u_char                                     *p;
+
+    primary = uscf->peer.data;
+
+    version = state->version;
+
+    ngx_stream_upstream_rr_peers_rlock(primary);
+
+    n = 0;
+    size = sizeof(ngx_stream_dynamic_upstream_lua_replica_t);
+
+    for (peers = primary; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+            size += peer->name.len + peer->server.len;
+            n++;
+        }
+    }
+
+    size += n * (sizeof(ngx_dynamic_upstream_lua_hot_t)
+                 + sizeof(ngx_stream_upstream_rr_peer_t)
+                 + sizeof(ngx_str_t)
+                 + sizeof(ngx_stream_upstream_rr_peer_t *)
+                 + sizeof(ngx_sockaddr_t));
+
+    replica = ngx_alloc(size, ngx_cycle->log);
+    if (replica == NULL) {
+        ngx_stream_upstream_rr_peers_unlock(primary);
+        return NULL;
+    }
+
+    replica->state = state;
+    replica->version = version;
+    replica->refreshed = ngx_current_msec;
+    replica->validated = ngx_time();
+    replica->number = 0;
+    replica->n = n;
+
+    replica->nprimary = 0;
+
+    /* the rings are built on the first pick by hash */
+
+    ngx_memzero(replica->ring, sizeof(replica->ring));
+
+    /* the names are indexed on the first lookup */
+
+    replica->pool = NULL;
+
+    replica->hot = (ngx_dynamic_upstream_lua_hot_t *) (replica + 1);
+    replica->peer = (ngx_stream_upstream_rr_peer_t *) (replica->hot + n);
+    replica->name = (ngx_str_t *) (replica->peer + n);
+    replica->source = (ngx_stream_upstream_rr_peer_t **) (replica->name + n);
+    sockaddr = (ngx_sockaddr_t *) (replica->source + n);
+    p = (u_char *) (sockaddr + n);
+
+    i = 0;
+
+    for (peers = primary, k = 0; peers && k < 2; peers = peers->next, k++) {
+
+        replica->peers[k] = *peers;
+        replica->peers[k].shpool = NULL;
+        replica->peers[k].next = NULL;
+
+        if (k != 0) {
+            replica->peers[0].next = &replica->peers[k];
+        }
+
+        replica->number += peers->number;
+
+        prev = &replica->peers[k].peer;
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            dst = &replica->peer[i];
+
+            *dst = *peer;
+
+            dst->sockaddr = (struct sockaddr *) &sockaddr[i];
+            ngx_memcpy(dst->sockaddr, peer->sockaddr, peer->socklen);
+
+            dst->name.data = p;
+            p = ngx_cpymem(p, peer->name.data, peer->name.len);
+
+            dst->server.data = p;
+            p = ngx_cpymem(p, peer->server.data, peer->server.len);
+
+            dst->next = NULL;
+
+            *prev = dst;
+            prev = &dst->next;
+
+            replica->name[i] = dst->name;
+            replica->source[i] = peer;
+
+            ngx_dynamic_upstream_lua_hot_init(&replica->hot[i], peer);
+
+            i++;
+        }
+
+        *prev = NULL;
+
+        if (k == 0) {
+            replica->nprimary = i;
+        }
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(primary);
+
+    return replica;
+}
+
+
+/*
+ * counters are read without the lock, only scalar fields of a peer are
+ * read, a peer freed meanwhile is in the mapped zone and its values are
+ * dropped as a change of the module was running
+ */
+
+static ngx_int_t
+ngx_stream_dynamic_upstream_lua_replica_read(
+    ngx_stream_dynamic_upstream_lua_replica_t *replica)
+{
+    ngx_dynamic_upstream_lua_state_t  *state;
+    ngx_stream_upstream_rr_peer_t     *peer, *dst;
+    ngx_uint_t                         i;
+
+    state = replica->state;
+
+    if (state->writers != 0) {
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < replica->n; i++) {
+
+        peer = replica->source[i];
+        dst = &replica->peer[i];
+
+        dst->conns = peer->conns;
+        dst->fails = peer->fails;
+        dst->accessed = peer->accessed;
+        dst->checked = peer->checked;
+        dst->current_weight = peer->current_weight;
+        dst->effective_weight = peer->effective_weight;
+    }
+
+    ngx_memory_barrier();
+
+    if (state->writers != 0 || state->version != replica->version) {
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < replica->n; i++) {
+        replica->hot[i].conns = replica->peer[i].conns;
+        replica->hot[i].fails = replica->peer[i].fails;
+        replica->hot[i].checked = replica->peer[i].checked;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * once a second the copy is checked against the peers under the read
+ * lock, peers changed by other modules are seen then; counters are
+ * copied under the read lock, the peers are walked in the
+ * order of the replica and a peer replaced since the build is detected
+ * by its address without touching the freed one
+ */
+
+static ngx_int_t
+ngx_stream_dynamic_upstream_lua_replica_refresh(
+    ngx_stream_dynamic_upstream_lua_replica_t *replica,
+    ngx_stream_upstream_rr_peers_t *primary)
+{
+    ngx_stream_upstream_rr_peers_t  *peers;
+    ngx_stream_upstream_rr_peer_t   *peer, *dst;
+    ngx_uint_t                       i, k;
+
+    i = 0;
+
+    for (peers = primary, k = 0; peers && k < 2; peers = peers->next, k++) {
+        for (peer = peers->peer; peer; peer = peer->next, i++) {
+
+            if (i == replica->n || replica->source[i] != peer) {
+                return NGX_DECLINED;
+            }
+
+            dst = &replica->peer[i];
+
+            if (peer->socklen != dst->socklen
+                || ngx_memcmp(peer->sockaddr, dst->sockaddr, peer->socklen)
+                   != 0)
+            {
+                return NGX_DECLINED;
+            }
+
+            dst->conns = peer->conns;
+            dst->fails = peer->fails;
+            dst->accessed = peer->accessed;
+            dst->checked = peer->checked;
+            dst->current_weight = peer->current_weight;
+            dst->effective_weight = peer->effective_weight;
+
+            replica->hot[i].conns = dst->conns;
+            replica->hot[i].fails = dst->fails;
+            replica->hot[i].checked = dst->checked;
+        }
+    }
+
+    return i == replica->n ? NGX_OK : NGX_DECLINED;
+}
+
+
+ngx_stream_dynamic_upstream_lua_replica_t *
+ngx_stream_dynamic_upstream_lua_replica(ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_flag_t lookup)
+{
+    ngx_stream_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_stream_dynamic_upstream_lua_replica_t   *replica, *fresh;
+    ngx_dynamic_upstream_lua_state_t            *state;
+    ngx_stream_upstream_rr_peers_t              *primary;
+    ngx_int_t                                    rc;
+
+    if (uscf->shm_zone == NULL || uscf->srv_conf == NULL
+        || !ngx_dynamic_upstream_lua_replicas_enabled(lookup))
+    {
+        return NULL;
+    }
+
+    ucscf = ngx_stream_conf_upstream_srv_conf(uscf,
+                ngx_stream_dynamic_upstream_lua_module);
+
+    replica = ucscf->replica;
+
+    if (replica != NULL) {
+        state = replica->state;
+    } else {
+        state = ngx_dynamic_upstream_lua_state(&uscf->host,
+                                               NGX_DYNAMIC_UPSTREAM_LUA_STREAM);
+        if (state == NULL) {
+            return NULL;
+        }
+    }
+
+    primary = uscf->peer.data;
+
+    if (replica != NULL && replica->version == state->version) {
+
+        /* counters are copied once per event loop iteration */
+
+        if (replica->refreshed == ngx_current_msec) {
+            return replica;
+        }
+
+        if (replica->validated == ngx_time()) {
+            rc = ngx_stream_dynamic_upstream_lua_replica_read(replica);
+
+        } else {
+            ngx_stream_upstream_rr_peers_rlock(primary);
+
+            rc = ngx_stream_dynamic_upstream_lua_replica_refresh(replica,
+                                                                 primary);
+
+            ngx_stream_upstream_rr_peers_unlock(primary);
+
+            replica->validated = ngx_time();
+        }
+
+        if (rc == NGX_OK) {
+            replica->refreshed = ngx_current_msec;
+            return replica;
+        }
+    }
+
+    /* the build copies the counters as well */
+
+    fresh = ngx_stream_dynamic_upstream_lua_replica_build(uscf, state);
+    if (fresh == NULL) {
+        return NULL;
+    }
+
+    if (replica != NULL) {
+        ngx_dynamic_upstream_lua_replica_free(replica, replica->ring,
+                                              replica->pool);
+    }
+
+    ucscf->replica = fresh;
+
+    return fresh;
+}
+
+
+/* the names are indexed once per version of the replica */
+
+ngx_int_t
+ngx_stream_dynamic_upstream_lua_replica_find(
+    ngx_stream_dynamic_upstream_lua_replica_t *replica, ngx_str_t *server,
+    ngx_stream_upstream_rr_peer_t **peer)
+{
+    ngx_dynamic_upstream_lua_name_t  *name;
+    ngx_stream_upstream_rr_peer_t    *dst;
+    ngx_uint_t                        i;
+
+    if (replica->pool == NULL) {
+
+        replica->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE,
+                                        ngx_cycle->log);
+        if (replica->pool == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_dynamic_upstream_lua_names_init(&replica->names, replica->pool);
+
+        for (i = 0; i < replica->n; i++) {
+
+            dst = &replica->peer[i];
+
+            if (ngx_dynamic_upstream_lua_replica_index(&replica->names,
+                    &dst->server, dst) != NGX_OK
+                || ngx_dynamic_upstream_lua_replica_index(&replica->names,
+                       &dst->name, dst) != NGX_OK)
+            {
+                ngx_destroy_pool(replica->pool);
+                replica->pool = NULL;
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    name = ngx_dynamic_upstream_lua_names_find(&replica->names, server);
+    if (name == NULL) {
+        return NGX_DECLINED;
+    }
+
+    *peer = name->peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_flag_t
+ngx_dynamic_upstream_lua_hot_usable(ngx_dynamic_upstream_lua_hot_t *hot,
+    time_t now, ngx_flag_t panic)
+{
+    if (hot->down && !panic) {
+        return 0;
+    }
+
+    if (hot->max_fails
+        && hot->fails >= hot->max_fails
+        && now - hot->checked <= (time_t) hot->fail_timeout)
+    {
+        return 0;
+    }
+
+    if (hot->max_conns && hot->conns >= hot->max_conns) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_hot_pick(ngx_dynamic_upstream_lua_hot_t *hot,
+    ngx_str_t *name, ngx_uint_t n, ngx_dynamic_upstream_lua_ring_t *ring,
+    ngx_uint_t policy, ngx_str_t *key, ngx_flag_t panic)
+{
+    time_t      now;
+    uint32_t    hash;
+    ngx_uint_t  i, j, k, a;
+    ngx_int_t   best = NGX_DECLINED, first = NGX_DECLINED;
+
+    now = ngx_time();
+
+    /* the same choices as the list walk of pick_peer */
+
+    switch (policy) {
+
+        case NGX_DYNAMIC_UPSTREAM_LUA_PICK_LEAST_CONN:
+
+            for (i = 0; i < n; i++) {
+                if (!ngx_dynamic_upstream_lua_hot_usable(&hot[i], now, panic)) {
+                    continue;
+                }
+
+                if (best == NGX_DECLINED
+                    || (uint64_t) hot[i].conns * hot[best].weight
+                       < (uint64_t) hot[best].conns * hot[i].weight)
+                {
+                    best = i;
+                }
+            }
+
+            return best;
+
+        case NGX_DYNAMIC_UPSTREAM_LUA_PICK_HASH:
+
+            if (!ring->built
+                && ngx_dynamic_upstream_lua_ring_build(ring, hot, name, n)
+                   != NGX_OK)
+            {
+                return NGX_DECLINED;
+            }
+
+            /* the first point clockwise of the key with a usable peer */
+
+            hash = ngx_crc32_long(key->data, key->len);
+
+            i = 0;
+            j = ring->number;
+
+            while (i < j) {
+                k = (i + j) / 2;
+
+                if (ring->points[k].hash < hash) {
+                    i = k + 1;
+
+                } else {
+                    j = k;
+                }
+            }
+
+            for (j = 0; j < ring->number; j++) {
+                k = ring->points[(i + j) % ring->number].index;
+
+                if (ngx_dynamic_upstream_lua_hot_usable(&hot[k], now, panic)) {
+                    return k;
+                }
+            }
+
+            return NGX_DECLINED;
+
+        default:
+            break;
+    }
+
+    if (n == 0) {
+        return NGX_DECLINED;
+    }
+
+    /* two random peers, unusable ones are drawn again a few times */
+
+    for (j = 0; j < NGX_DYNAMIC_UPSTREAM_LUA_PICK_TRIES; j++) {
+
+        i = ngx_random() % n;
+
+        if (!ngx_dynamic_upstream_lua_hot_usable(&hot[i], now, panic)) {
+            continue;
+        }
+
+        if (first == NGX_DECLINED) {
+            first = i;
+
+        } else if ((ngx_int_t) i != first || n == 1) {
+            best = i;
+            break;
+        }
+    }
+
+    if (first == NGX_DECLINED) {
+
+        /* most peers are not usable, the first usable one is taken */
+
+        a = ngx_random() % n;
+
+        for (j = 0; j < n; j++) {
+            i = (a + j) % n;
+
+            if (ngx_dynamic_upstream_lua_hot_usable(&hot[i], now, panic)) {
+                return i;
+            }
+        }
+
+        return NGX_DECLINED;
+    }
+
+    if (best == NGX_DECLINED) {
+        return first;
+    }
+
+    if ((uint64_t) hot[first].conns * hot[best].weight
+        < (uint64_t) hot[best].conns * hot[first].weight)
+    {
+        best = first;
+    }
+
+    return best;
+}
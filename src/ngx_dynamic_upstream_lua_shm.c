@@ -0,0 +1,471 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+
+
+static ngx_str_t shm_name = ngx_string("ngx_dynamic_upstream_lua");
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_shm_init(ngx_shm_zone_t *shm_zone, void *data);
+
+
+static void
+ngx_dynamic_upstream_lua_state_insert(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                **p;
+    ngx_dynamic_upstream_lua_state_t  *s, *t;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+        } else {
+            s = (ngx_dynamic_upstream_lua_state_t *) node;
+            t = (ngx_dynamic_upstream_lua_state_t *) temp;
+
+            p = ngx_memn2cmp(s->name.data, t->name.data, s->name.len,
+                             t->name.len) < 0 ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_shm_add(ngx_conf_t *cf)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf;
+
+    if (cf->module_type == NGX_HTTP_MODULE) {
+        mcf = ngx_http_conf_get_module_main_conf(cf,
+                  ngx_http_dynamic_upstream_lua_module);
+
+    } else {
+        /* the zone belongs to the http block parsed before stream */
+
+        mcf = ngx_http_cycle_get_module_main_conf(cf->cycle,
+                  ngx_http_dynamic_upstream_lua_module);
+        if (mcf == NULL) {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (mcf->shm_zone != NULL) {
+        return NGX_OK;
+    }
+
+    /* size is set in init main conf, or was set there already for stream */
+
+    mcf->shm_zone = ngx_shared_memory_add(cf, &shm_name,
+                        mcf->shm_size != NGX_CONF_UNSET_SIZE
+                        ? mcf->shm_size : 0,
+                        &ngx_http_dynamic_upstream_lua_module);
+    if (mcf->shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    mcf->shm_zone->init = ngx_dynamic_upstream_lua_shm_init;
+    mcf->shm_zone->data = mcf;
+
+    return NGX_OK;
+}
+
+
+char *
+ngx_dynamic_upstream_lua_shm_size(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    char  *rv;
+
+    rv = ngx_conf_set_size_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    /* explicit size enables the zone for features kept only there */
+
+    if (ngx_dynamic_upstream_lua_shm_add(cf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_shm_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t                 *shpool;
+    ngx_dynamic_upstream_lua_shm_t  *sh;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (data != NULL || shm_zone->shm.exists) {
+        /* keep the states across reloads, rebuild derived data lazily */
+        sh = shpool->data;
+        sh->generation++;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(shpool, sizeof(ngx_dynamic_upstream_lua_shm_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                    ngx_dynamic_upstream_lua_state_insert);
+
+    shpool->data = sh;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool,
+        sizeof(" in dynamic upstream zone \"\"") + shm_zone->shm.name.len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in dynamic upstream zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+ngx_slab_pool_t *
+ngx_dynamic_upstream_lua_shm_pool(void)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf;
+
+    mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+              ngx_http_dynamic_upstream_lua_module);
+    if (mcf == NULL || mcf->shm_zone == NULL) {
+        return NULL;
+    }
+
+    return (ngx_slab_pool_t *) mcf->shm_zone->shm.addr;
+}
+
+
+static ngx_dynamic_upstream_lua_state_t *
+ngx_dynamic_upstream_lua_state_lookup(ngx_dynamic_upstream_lua_shm_t *sh,
+    ngx_str_t *name, ngx_uint_t flags, uint32_t hash)
+{
+    ngx_dynamic_upstream_lua_state_t  *state;
+    ngx_rbtree_node_t                 *node, *sentinel;
+    ngx_int_t                          rc;
+
+    node = sh->rbtree.root;
+    sentinel = sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        state = (ngx_dynamic_upstream_lua_state_t *) node;
+
+        rc = ngx_memn2cmp(name->data, state->name.data, name->len,
+                          state->name.len);
+
+        if (rc == 0 && state->flags == flags) {
+            return state;
+        }
+
+        node = rc < 0 ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_dynamic_upstream_lua_state(ngx_str_t *name, ngx_uint_t flags)
+{
+    ngx_slab_pool_t                   *shpool;
+    ngx_dynamic_upstream_lua_shm_t    *sh;
+    ngx_dynamic_upstream_lua_state_t  *state;
+    uint32_t                           hash;
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+    if (shpool == NULL) {
+        return NULL;
+    }
+
+    sh = shpool->data;
+
+    flags &= NGX_DYNAMIC_UPSTREAM_LUA_STREAM;
+
+    hash = ngx_crc32_short(name->data, name->len) ^ flags;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    state = ngx_dynamic_upstream_lua_state_lookup(sh, name, flags, hash);
+    if (state != NULL) {
+        goto done;
+    }
+
+    state = ngx_slab_calloc_locked(shpool,
+        sizeof(ngx_dynamic_upstream_lua_state_t) + name->len);
+    if (state == NULL) {
+        goto done;
+    }
+
+    state->name.data = (u_char *) (state + 1);
+    state->name.len = name->len;
+    ngx_memcpy(state->name.data, name->data, name->len);
+
+    state->flags = flags;
+    state->node.key = hash;
+
+    ngx_rbtree_insert(&sh->rbtree, &state->node);
+
+done:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return state;
+}
+
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_dynamic_upstream_lua_state_find(ngx_str_t *name, ngx_uint_t flags)
+{
+    ngx_slab_pool_t                   *shpool;
+    ngx_dynamic_upstream_lua_state_t  *state;
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+    if (shpool == NULL) {
+        return NULL;
+    }
+
+    flags &= NGX_DYNAMIC_UPSTREAM_LUA_STREAM;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    state = ngx_dynamic_upstream_lua_state_lookup(shpool->data, name, flags,
+        ngx_crc32_short(name->data, name->len) ^ flags);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return state;
+}
+
+
+/* the next lookup of the name creates a new state */
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_dynamic_upstream_lua_state_detach(ngx_str_t *name, ngx_uint_t flags)
+{
+    ngx_slab_pool_t                   *shpool;
+    ngx_dynamic_upstream_lua_shm_t    *sh;
+    ngx_dynamic_upstream_lua_state_t  *state;
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+    if (shpool == NULL) {
+        return NULL;
+    }
+
+    sh = shpool->data;
+
+    flags &= NGX_DYNAMIC_UPSTREAM_LUA_STREAM;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    state = ngx_dynamic_upstream_lua_state_lookup(sh, name, flags,
+        ngx_crc32_short(name->data, name->len) ^ flags);
+
+    if (state != NULL) {
+        ngx_rbtree_delete(&sh->rbtree, &state->node);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return state;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_rbtree_free_locked(ngx_slab_pool_t *shpool,
+    ngx_rbtree_t *rbtree)
+{
+    ngx_rbtree_node_t  *node;
+
+    /* the nodes are the first fields of the allocations */
+
+    while (rbtree->root != rbtree->sentinel) {
+        node = ngx_rbtree_min(rbtree->root, rbtree->sentinel);
+        ngx_rbtree_delete(rbtree, node);
+        ngx_slab_free_locked(shpool, node);
+    }
+}
+
+
+/* the state is detached and no process holds it any more */
+
+void
+ngx_dynamic_upstream_lua_state_free(ngx_dynamic_upstream_lua_state_t *state)
+{
+    ngx_slab_pool_t                          *shpool;
+    ngx_dynamic_upstream_lua_chash_server_t  *server, *next_server;
+    ngx_dynamic_upstream_lua_ewma_peer_t     *ewma, *next_ewma;
+    ngx_dynamic_upstream_lua_outlier_peer_t  *outlier, *next_outlier;
+    ngx_uint_t                                k;
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (server = state->chash.servers; server; server = next_server) {
+        next_server = server->next;
+        ngx_slab_free_locked(shpool, server);
+    }
+
+    if (state->chash.points != NULL) {
+        ngx_slab_free_locked(shpool, state->chash.points);
+    }
+
+    for (k = 0; k < 2; k++) {
+        for (ewma = k ? state->ewma.free : state->ewma.peers;
+             ewma;
+             ewma = next_ewma)
+        {
+            next_ewma = ewma->next;
+            ngx_slab_free_locked(shpool, ewma);
+        }
+
+        for (outlier = k ? state->outlier.free : state->outlier.peers;
+             outlier;
+             outlier = next_outlier)
+        {
+            next_outlier = outlier->next;
+            ngx_slab_free_locked(shpool, outlier);
+        }
+    }
+
+    if (state->queue.slots != NULL) {
+        ngx_slab_free_locked(shpool, state->queue.slots);
+    }
+
+    /* a tagged peer is allocated with its tags */
+
+    if (state->staged.root != NULL) {
+        ngx_dynamic_upstream_lua_rbtree_free_locked(shpool, &state->staged);
+    }
+
+    if (state->tags.peers.root != NULL) {
+        ngx_dynamic_upstream_lua_rbtree_free_locked(shpool,
+                                                    &state->tags.peers);
+    }
+
+    ngx_slab_free_locked(shpool, state);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+ngx_dynamic_upstream_lua_state_t *
+ngx_http_dynamic_upstream_lua_srv_state(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+
+    if (uscf->srv_conf == NULL) {
+        return NULL;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(uscf,
+                ngx_http_dynamic_upstream_lua_module);
+
+    if (ucscf->state == NULL) {
+        ucscf->state = ngx_dynamic_upstream_lua_state(&uscf->host, 0);
+    }
+
+    return ucscf->state;
+}
+
+
+void
+ngx_dynamic_upstream_lua_zone_usage(ngx_shm_zone_t *zone,
+    ngx_dynamic_upstream_lua_zone_usage_t *usage)
+{
+    ngx_slab_pool_t  *shpool;
+    ngx_uint_t        i, n;
+    size_t            size;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+
+    usage->slab_size = 0;
+    usage->slab_used = 0;
+
+    n = ngx_pagesize_shift - shpool->min_shift;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    usage->size = zone->shm.size;
+    usage->pages = (shpool->end - shpool->start) / ngx_pagesize;
+    usage->free_pages = shpool->pfree;
+
+    /* chunks in the pages given to the small allocations */
+
+    for (i = 0; i < n; i++) {
+        size = (size_t) 1 << (i + shpool->min_shift);
+        usage->slab_size += shpool->stats[i].total * size;
+        usage->slab_used += shpool->stats[i].used * size;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    usage->used = (usage->pages - usage->free_pages) * ngx_pagesize;
+}
+
+
+static size_t
+ngx_dynamic_upstream_lua_slab_size(size_t size)
+{
+    size_t  n;
+
+    if (size > ngx_pagesize / 2) {
+        return ngx_align(size, ngx_pagesize);
+    }
+
+    for (n = 8; n < size; n <<= 1) { /* void */ }
+
+    return n;
+}
+
+
+size_t
+ngx_dynamic_upstream_lua_peer_size(size_t peer_size, ngx_str_t *server)
+{
+    /* peer, sockaddr, name and server are allocated separately */
+
+    return ngx_dynamic_upstream_lua_slab_size(peer_size)
+           + ngx_dynamic_upstream_lua_slab_size(sizeof(ngx_sockaddr_t))
+           + ngx_dynamic_upstream_lua_slab_size(NGX_SOCKADDR_STRLEN)
+           + ngx_dynamic_upstream_lua_slab_size(server->len);
+}
@@ -0,0 +1,422 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+
+
+typedef struct {
+    ngx_str_t    upstream;
+    ngx_uint_t   flags;
+    ngx_array_t  ops;
+} ngx_dynamic_upstream_lua_stage_batch_t;
+
+
+static ngx_event_t  ngx_dynamic_upstream_lua_stage_event;
+
+
+char *
+ngx_dynamic_upstream_lua_stage_interval(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf = conf;
+
+    ngx_str_t  *value;
+
+    if (mcf->stage_interval != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    mcf->stage_interval = ngx_parse_time(&value[1], 0);
+    if (mcf->stage_interval == (ngx_msec_t) NGX_ERROR
+        || mcf->stage_interval == 0)
+    {
+        return "invalid value";
+    }
+
+    if (ngx_dynamic_upstream_lua_shm_add(cf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_msec_t
+ngx_dynamic_upstream_lua_stage_enabled(void)
+{
+    ngx_http_dynamic_upstream_lua_main_conf_t  *mcf;
+
+    mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+              ngx_http_dynamic_upstream_lua_module);
+    if (mcf == NULL) {
+        return 0;
+    }
+
+    return mcf->stage_interval;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_stage_merge(ngx_dynamic_upstream_lua_stage_t *stage,
+    ngx_dynamic_upstream_op_t *op)
+{
+    /* the last write wins per field */
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT) {
+        stage->weight = op->weight;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS) {
+        stage->max_fails = op->max_fails;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS) {
+        stage->max_conns = op->max_conns;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT) {
+        stage->fail_timeout = op->fail_timeout;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP) {
+        stage->op_param &= ~NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) {
+        stage->op_param &= ~NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+    }
+
+    stage->op_param |= op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FIELDS;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_stage(ngx_str_t *upstream, ngx_uint_t flags,
+    ngx_dynamic_upstream_op_t *op)
+{
+    uint32_t                           hash;
+    ngx_slab_pool_t                   *shpool;
+    ngx_dynamic_upstream_lua_state_t  *state;
+    ngx_dynamic_upstream_lua_stage_t  *stage;
+
+    if (ngx_dynamic_upstream_lua_stage_enabled() == 0) {
+        return NGX_DECLINED;
+    }
+
+    state = ngx_dynamic_upstream_lua_state(upstream, flags);
+    if (state == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (state->staged.root == NULL) {
+        ngx_rbtree_init(&state->staged, &state->staged_sentinel,
+                        ngx_str_rbtree_insert_value);
+    }
+
+    hash = ngx_crc32_short(op->server.data, op->server.len);
+
+    stage = (ngx_dynamic_upstream_lua_stage_t *)
+                ngx_str_rbtree_lookup(&state->staged, &op->server, hash);
+    if (stage != NULL) {
+        goto found;
+    }
+
+    stage = ngx_slab_calloc_locked(shpool,
+        sizeof(ngx_dynamic_upstream_lua_stage_t) + op->server.len);
+    if (stage == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    stage->sn.str.data = (u_char *) (stage + 1);
+    stage->sn.str.len = op->server.len;
+    stage->sn.node.key = hash;
+    ngx_memcpy(stage->sn.str.data, op->server.data, op->server.len);
+
+    ngx_rbtree_insert(&state->staged, &stage->sn.node);
+
+found:
+
+    ngx_dynamic_upstream_lua_stage_merge(stage, op);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+/* the server is copied, the staged entry is freed before the commit */
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_stage_op(ngx_pool_t *pool,
+    ngx_dynamic_upstream_lua_stage_t *stage, ngx_str_t *upstream,
+    ngx_dynamic_upstream_op_t *op)
+{
+    ngx_memzero(op, sizeof(ngx_dynamic_upstream_op_t));
+
+    op->server.data = ngx_pstrdup(pool, &stage->sn.str);
+    if (op->server.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    op->server.len = stage->sn.str.len;
+
+    op->op = NGX_DYNAMIC_UPSTEAM_OP_PARAM;
+    op->status = NGX_HTTP_OK;
+    op->upstream = *upstream;
+    op->op_param = NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE | stage->op_param;
+
+    op->weight = stage->weight;
+    op->max_fails = stage->max_fails;
+    op->max_conns = stage->max_conns;
+    op->fail_timeout = stage->fail_timeout;
+
+    op->up = (stage->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP) != 0;
+    op->down = (stage->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) != 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_stage_detach(ngx_pool_t *pool,
+    ngx_slab_pool_t *shpool, ngx_dynamic_upstream_lua_state_t *state,
+    ngx_dynamic_upstream_lua_stage_batch_t *batch)
+{
+    ngx_int_t                          rc = NGX_OK;
+    ngx_rbtree_node_t                 *node;
+    ngx_dynamic_upstream_lua_stage_t  *stage;
+    ngx_dynamic_upstream_op_t         *op;
+
+    batch->flags = state->flags;
+
+    batch->upstream.data = ngx_pstrdup(pool, &state->name);
+    if (batch->upstream.data == NULL) {
+        rc = NGX_ERROR;
+    }
+
+    batch->upstream.len = state->name.len;
+
+    if (ngx_array_init(&batch->ops, pool, 4,
+                       sizeof(ngx_dynamic_upstream_op_t))
+            != NGX_OK)
+    {
+        rc = NGX_ERROR;
+    }
+
+    /* entries are freed even if the batch fails */
+
+    while (state->staged.root != state->staged.sentinel) {
+
+        node = ngx_rbtree_min(state->staged.root, state->staged.sentinel);
+        stage = (ngx_dynamic_upstream_lua_stage_t *) node;
+
+        if (rc == NGX_OK) {
+            op = ngx_array_push(&batch->ops);
+
+            if (op == NULL
+                || ngx_dynamic_upstream_lua_stage_op(pool, stage,
+                                                     &batch->upstream, op)
+                   != NGX_OK)
+            {
+                rc = NGX_ERROR;
+            }
+        }
+
+        ngx_rbtree_delete(&state->staged, node);
+        ngx_slab_free_locked(shpool, stage);
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_dynamic_upstream_lua_stage_apply(ngx_log_t *log, ngx_pool_t *pool,
+    ngx_dynamic_upstream_lua_stage_batch_t *batch)
+{
+    ngx_uint_t                       i;
+    ngx_int_t                        rc, *rcs;
+    ngx_dynamic_upstream_op_t       *op;
+    ngx_http_upstream_srv_conf_t    *uscf;
+    ngx_stream_upstream_srv_conf_t  *suscf;
+
+    uscf = NULL;
+    suscf = NULL;
+
+    if (batch->flags & NGX_DYNAMIC_UPSTREAM_LUA_STREAM) {
+        suscf = ngx_stream_dynamic_upstream_lua_upstream(&batch->upstream);
+    } else {
+        uscf = ngx_http_dynamic_upstream_lua_upstream(&batch->upstream);
+    }
+
+    if (uscf == NULL && suscf == NULL) {
+        return;
+    }
+
+    rcs = ngx_pcalloc(pool, batch->ops.nelts * sizeof(ngx_int_t));
+    if (rcs == NULL) {
+        return;
+    }
+
+    op = batch->ops.elts;
+
+    /* the whole stage of the upstream is applied in one write lock */
+
+    if (uscf != NULL) {
+        rc = ngx_http_dynamic_upstream_lua_apply_batch(log, pool, uscf, op,
+                                                       rcs, batch->ops.nelts,
+                                                       0);
+    } else {
+        rc = ngx_stream_dynamic_upstream_lua_apply_batch(log, pool, suscf, op,
+                                                         rcs,
+                                                         batch->ops.nelts, 0);
+    }
+
+    if (rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "dynamic upstream: staged updates of %V failed",
+                      &batch->upstream);
+        return;
+    }
+
+    for (i = 0; i < batch->ops.nelts; i++) {
+        if (rcs[i] != NGX_OK && rcs[i] != NGX_AGAIN) {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "dynamic upstream: staged update of %V in %V "
+                          "failed: %s", &op[i].server, &op[i].upstream,
+                          op[i].err != NULL ? op[i].err : "unknown error");
+        }
+    }
+}
+
+
+void
+ngx_dynamic_upstream_lua_stage_commit(ngx_log_t *log)
+{
+    ngx_slab_pool_t                         *shpool;
+    ngx_dynamic_upstream_lua_shm_t          *sh;
+    ngx_dynamic_upstream_lua_state_t        *state;
+    ngx_dynamic_upstream_lua_stage_batch_t  *batch;
+    ngx_rbtree_node_t                       *node;
+    ngx_array_t                              batches;
+    ngx_pool_t                              *pool;
+    ngx_uint_t                               i;
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+    if (shpool == NULL) {
+        return;
+    }
+
+    sh = shpool->data;
+
+    pool = ngx_create_pool(ngx_pagesize, log);
+    if (pool == NULL) {
+        return;
+    }
+
+    if (ngx_array_init(&batches, pool, 4,
+                       sizeof(ngx_dynamic_upstream_lua_stage_batch_t))
+            != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    /* detach staged changes, only one worker gets them */
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (sh->rbtree.root != sh->rbtree.sentinel) {
+
+        for (node = ngx_rbtree_min(sh->rbtree.root, sh->rbtree.sentinel);
+             node;
+             node = ngx_rbtree_next(&sh->rbtree, node))
+        {
+            state = (ngx_dynamic_upstream_lua_state_t *) node;
+
+            if (state->staged.root == NULL
+                || state->staged.root == state->staged.sentinel)
+            {
+                continue;
+            }
+
+            /* the rest is left for the next commit */
+
+            batch = ngx_array_push(&batches);
+            if (batch == NULL) {
+                break;
+            }
+
+            if (ngx_dynamic_upstream_lua_stage_detach(pool, shpool, state,
+                                                      batch)
+                != NGX_OK)
+            {
+                ngx_log_error(NGX_LOG_WARN, log, 0,
+                              "dynamic upstream: no memory, staged updates "
+                              "of %V are dropped", &state->name);
+                batches.nelts--;
+            }
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    batch = batches.elts;
+
+    for (i = 0; i < batches.nelts; i++) {
+        ngx_dynamic_upstream_lua_stage_apply(log, pool, &batch[i]);
+    }
+
+    ngx_destroy_pool(pool);
+}
+
+
+static void
+ngx_dynamic_upstream_lua_stage_handler(ngx_event_t *ev)
+{
+    if (ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    ngx_dynamic_upstream_lua_stage_commit(ev->log);
+
+    ngx_add_timer(ev, ngx_dynamic_upstream_lua_stage_enabled());
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_stage_init_process(ngx_cycle_t *cycle)
+{
+    ngx_msec_t  interval;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    interval = ngx_dynamic_upstream_lua_stage_enabled();
+    if (interval == 0) {
+        return NGX_OK;
+    }
+
+    ngx_dynamic_upstream_lua_stage_event.handler =
+        ngx_dynamic_upstream_lua_stage_handler;
+    ngx_dynamic_upstream_lua_stage_event.log = cycle->log;
+    ngx_dynamic_upstream_lua_stage_event.data = cycle;
+    ngx_dynamic_upstream_lua_stage_event.cancelable = 1;
+
+    ngx_add_timer(&ngx_dynamic_upstream_lua_stage_event, interval);
+
+    return NGX_OK;
+}
@@ -0,0 +1,324 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+static void
+ngx_dynamic_upstream_lua_tag_free_locked(ngx_slab_pool_t *shpool,
+    ngx_dynamic_upstream_lua_tags_t *tags,
+    ngx_dynamic_upstream_lua_tag_peer_t *peer)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < peer->ntags; i++) {
+        ngx_rbtree_delete(&tags->rbtree, &peer->tags[i].sn.node);
+    }
+
+    ngx_rbtree_delete(&tags->peers, &peer->sn.node);
+
+    ngx_slab_free_locked(shpool, peer);
+}
+
+
+static void
+ngx_dynamic_upstream_lua_tag_unlink_locked(ngx_slab_pool_t *shpool,
+    ngx_dynamic_upstream_lua_tags_t *tags, ngx_str_t *server)
+{
+    ngx_str_node_t  *sn;
+
+    sn = ngx_str_rbtree_lookup(&tags->peers, server,
+                               ngx_crc32_short(server->data, server->len));
+    if (sn == NULL) {
+        return;
+    }
+
+    ngx_dynamic_upstream_lua_tag_free_locked(shpool, tags,
+        (ngx_dynamic_upstream_lua_tag_peer_t *) sn);
+}
+
+
+static ngx_dynamic_upstream_lua_tags_t *
+ngx_dynamic_upstream_lua_tag_ready(ngx_slab_pool_t *shpool,
+    ngx_dynamic_upstream_lua_state_t *state)
+{
+    ngx_dynamic_upstream_lua_shm_t   *sh;
+    ngx_dynamic_upstream_lua_tags_t  *tags;
+    ngx_rbtree_node_t                *node;
+
+    sh = shpool->data;
+    tags = &state->tags;
+
+    if (tags->rbtree.root == NULL) {
+        ngx_rbtree_init(&tags->rbtree, &tags->sentinel,
+                        ngx_str_rbtree_insert_value);
+        ngx_rbtree_init(&tags->peers, &tags->peers_sentinel,
+                        ngx_str_rbtree_insert_value);
+        tags->generation = sh->generation;
+    }
+
+    if (tags->generation == sh->generation) {
+        return tags;
+    }
+
+    /* peers are configured again on reload, their tags are dropped */
+
+    while (tags->peers.root != tags->peers.sentinel) {
+        node = ngx_rbtree_min(tags->peers.root, tags->peers.sentinel);
+        ngx_dynamic_upstream_lua_tag_free_locked(shpool, tags,
+            (ngx_dynamic_upstream_lua_tag_peer_t *) node);
+    }
+
+    tags->generation = sh->generation;
+
+    return tags;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_tag_set(ngx_str_t *upstream, ngx_uint_t flags,
+    ngx_str_t *server, ngx_str_t *tags, ngx_uint_t n)
+{
+    ngx_slab_pool_t                      *shpool;
+    ngx_dynamic_upstream_lua_state_t     *state;
+    ngx_dynamic_upstream_lua_tags_t      *index;
+    ngx_dynamic_upstream_lua_tag_peer_t  *peer;
+    ngx_dynamic_upstream_lua_tag_t       *tag;
+    ngx_uint_t                            i;
+    size_t                                size;
+    u_char                               *p;
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+    if (shpool == NULL) {
+        return NGX_DECLINED;
+    }
+
+    state = ngx_dynamic_upstream_lua_state(upstream, flags);
+    if (state == NULL) {
+        return NGX_ERROR;
+    }
+
+    size = sizeof(ngx_dynamic_upstream_lua_tag_peer_t) + server->len
+           + n * sizeof(ngx_dynamic_upstream_lua_tag_t);
+
+    for (i = 0; i < n; i++) {
+        size += tags[i].len;
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    index = ngx_dynamic_upstream_lua_tag_ready(shpool, state);
+
+    /* tags of the peer are replaced */
+
+    ngx_dynamic_upstream_lua_tag_unlink_locked(shpool, index, server);
+
+    if (n == 0) {
+        goto done;
+    }
+
+    peer = ngx_slab_alloc_locked(shpool, size);
+    if (peer == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    peer->ntags = n;
+    peer->tags = (ngx_dynamic_upstream_lua_tag_t *) (peer + 1);
+
+    p = (u_char *) (peer->tags + n);
+
+    peer->sn.str.data = p;
+    peer->sn.str.len = server->len;
+    peer->sn.node.key = ngx_crc32_short(server->data, server->len);
+    p = ngx_cpymem(p, server->data, server->len);
+
+    ngx_rbtree_insert(&index->peers, &peer->sn.node);
+
+    for (i = 0; i < n; i++) {
+
+        tag = &peer->tags[i];
+
+        tag->peer = peer;
+        tag->sn.str.data = p;
+        tag->sn.str.len = tags[i].len;
+        tag->sn.node.key = ngx_crc32_short(tags[i].data, tags[i].len);
+        p = ngx_cpymem(p, tags[i].data, tags[i].len);
+
+        ngx_rbtree_insert(&index->rbtree, &tag->sn.node);
+    }
+
+done:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_dynamic_upstream_lua_journal_tags(upstream, flags, server, tags, n);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_dynamic_upstream_lua_tag_remove(ngx_str_t *upstream, ngx_uint_t flags,
+    ngx_str_t *server)
+{
+    ngx_slab_pool_t                   *shpool;
+    ngx_dynamic_upstream_lua_state_t  *state;
+    ngx_dynamic_upstream_lua_tags_t   *tags;
+
+    state = ngx_dynamic_upstream_lua_state_find(upstream, flags);
+    if (state == NULL || state->tags.rbtree.root == NULL) {
+        return;
+    }
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    tags = ngx_dynamic_upstream_lua_tag_ready(shpool, state);
+
+    ngx_dynamic_upstream_lua_tag_unlink_locked(shpool, tags, server);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+/* the leftmost of equal tags, the others follow it in order */
+
+static ngx_rbtree_node_t *
+ngx_dynamic_upstream_lua_tag_first(ngx_rbtree_t *rbtree, ngx_str_t *tag,
+    uint32_t hash)
+{
+    ngx_int_t           rc;
+    ngx_str_node_t     *n;
+    ngx_rbtree_node_t  *node, *sentinel, *first;
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+    first = NULL;
+
+    while (node != sentinel) {
+
+        n = (ngx_str_node_t *) node;
+
+        if (hash != node->key) {
+            node = (hash < node->key) ? node->left : node->right;
+            continue;
+        }
+
+        if (tag->len != n->str.len) {
+            node = (tag->len < n->str.len) ? node->left : node->right;
+            continue;
+        }
+
+        rc = ngx_memcmp(tag->data, n->str.data, tag->len);
+
+        if (rc == 0) {
+            first = node;
+        }
+
+        node = (rc <= 0) ? node->left : node->right;
+    }
+
+    return first;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_lua_tag_copy(ngx_pool_t *pool, ngx_str_t *dst,
+    ngx_str_t *src)
+{
+    dst->data = ngx_pstrdup(pool, src);
+    if (dst->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    dst->len = src->len;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_lua_tag_select(ngx_pool_t *pool, ngx_str_t *tag,
+    ngx_uint_t flags, ngx_array_t *tagged)
+{
+    ngx_slab_pool_t                    *shpool;
+    ngx_dynamic_upstream_lua_shm_t     *sh;
+    ngx_dynamic_upstream_lua_state_t   *state;
+    ngx_dynamic_upstream_lua_tags_t    *tags;
+    ngx_dynamic_upstream_lua_tag_t     *t;
+    ngx_dynamic_upstream_lua_tagged_t  *peer;
+    ngx_rbtree_node_t                  *node, *n;
+    ngx_int_t                           rc = NGX_OK;
+    uint32_t                            hash;
+
+    shpool = ngx_dynamic_upstream_lua_shm_pool();
+    if (shpool == NULL) {
+        return NGX_DECLINED;
+    }
+
+    sh = shpool->data;
+
+    flags &= NGX_DYNAMIC_UPSTREAM_LUA_STREAM;
+
+    hash = ngx_crc32_short(tag->data, tag->len);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (sh->rbtree.root == sh->rbtree.sentinel) {
+        goto done;
+    }
+
+    /* peers of the same upstream are adjacent in the result */
+
+    for (node = ngx_rbtree_min(sh->rbtree.root, sh->rbtree.sentinel);
+         node;
+         node = ngx_rbtree_next(&sh->rbtree, node))
+    {
+        state = (ngx_dynamic_upstream_lua_state_t *) node;
+
+        if (state->flags != flags || state->tags.rbtree.root == NULL) {
+            continue;
+        }
+
+        tags = ngx_dynamic_upstream_lua_tag_ready(shpool, state);
+
+        for (n = ngx_dynamic_upstream_lua_tag_first(&tags->rbtree, tag, hash);
+             n;
+             n = ngx_rbtree_next(&tags->rbtree, n))
+        {
+            t = (ngx_dynamic_upstream_lua_tag_t *) n;
+
+            if (n->key != hash
+                || t->sn.str.len != tag->len
+                || ngx_memcmp(t->sn.str.data, tag->data, tag->len) != 0)
+            {
+                break;
+            }
+
+            peer = ngx_array_push(tagged);
+            if (peer == NULL) {
+                rc = NGX_ERROR;
+                goto done;
+            }
+
+            if (ngx_dynamic_upstream_lua_tag_copy(pool, &peer->upstream,
+                                                  &state->name) != NGX_OK
+                || ngx_dynamic_upstream_lua_tag_copy(pool, &peer->server,
+                                                     &t->peer->sn.str)
+                   != NGX_OK)
+            {
+                rc = NGX_ERROR;
+                goto done;
+            }
+        }
+    }
+
+done:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return rc;
+}
@@ -0,0 +1,757 @@
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_lua.h"
+
+
+extern ngx_module_t ngx_http_dynamic_upstream_lua_module;
+
+
+#define NGX_DYNAMIC_UPSTREAM_LUA_WARMUP_TIMEOUT  60000
+#define NGX_DYNAMIC_UPSTREAM_LUA_WARMUP_MAX      100
+
+
+/* the peer warmed up by one call, it is brought up by the last connection */
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t  *uscf;
+    ngx_uint_t                     pending;
+    ngx_uint_t                     connected;
+    ngx_flag_t                     backup;
+    ngx_str_t                      server;
+} ngx_http_dynamic_upstream_warmup_group_t;
+
+
+/* connected connections of one peer, looked up by the balancer */
+
+typedef struct {
+    ngx_rbtree_node_t              node;
+    ngx_http_upstream_srv_conf_t  *uscf;
+    ngx_str_t                      name;
+    ngx_queue_t                    ready;
+} ngx_http_dynamic_upstream_warmup_peer_t;
+
+
+typedef struct {
+    ngx_queue_t                                queue;
+    ngx_queue_t                                link;
+    ngx_peer_connection_t                      pc;
+    ngx_http_upstream_srv_conf_t              *uscf;
+    ngx_http_dynamic_upstream_warmup_group_t  *group;
+    ngx_http_dynamic_upstream_warmup_peer_t   *peer;
+    ngx_msec_t                                 timeout;
+    ngx_flag_t                                 ready;
+    ngx_sockaddr_t                             sockaddr;
+    ngx_str_t                                  name;
+    u_char                                     addr[NGX_SOCKADDR_STRLEN];
+} ngx_http_dynamic_upstream_warmup_t;
+
+
+/* connections of the worker which are connected and not used yet */
+
+static ngx_queue_t        ngx_http_dynamic_upstream_warmup_active;
+static ngx_queue_t        ngx_http_dynamic_upstream_warmup_free;
+static ngx_rbtree_t       ngx_http_dynamic_upstream_warmup_peers;
+static ngx_rbtree_node_t  ngx_http_dynamic_upstream_warmup_sentinel;
+static ngx_flag_t         ngx_http_dynamic_upstream_warmup_initialized;
+
+
+char *
+ngx_http_dynamic_upstream_lua_warmup(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf = conf;
+
+    ngx_str_t   *value;
+    ngx_msec_t   timeout;
+
+    if (ucscf->warmup_timeout != 0) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    timeout = NGX_DYNAMIC_UPSTREAM_LUA_WARMUP_TIMEOUT;
+
+    if (cf->args->nelts == 2) {
+        timeout = ngx_parse_time(&value[1], 0);
+        if (timeout == (ngx_msec_t) NGX_ERROR || timeout == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid timeout \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ucscf->warmup_timeout = timeout;
+
+    return NGX_CONF_OK;
+}
+
+
+ngx_flag_t
+ngx_http_dynamic_upstream_lua_warmup_enabled(
+    ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+
+    if (uscf->srv_conf == NULL) {
+        return 0;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(uscf,
+                ngx_http_dynamic_upstream_lua_module);
+
+    return ucscf->warmup_timeout != 0 && ucscf->original_init_peer != NULL;
+}
+
+
+/* the keepalive module is optional and its configuration is private */
+
+void
+ngx_http_dynamic_upstream_lua_warmup_check(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_uint_t  i, *max_cached;
+
+    for (i = 0; cf->cycle->modules[i]; i++) {
+
+        if (ngx_strcmp(cf->cycle->modules[i]->name,
+                       "ngx_http_upstream_keepalive_module") != 0)
+        {
+            continue;
+        }
+
+        /* max_cached is the first field, set by the keepalive directive */
+
+        max_cached = uscf->srv_conf[cf->cycle->modules[i]->ctx_index];
+
+        if (max_cached != NULL && *max_cached != 0) {
+            return;
+        }
+
+        break;
+    }
+
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                       "dynamic_warmup without keepalive in upstream \"%V\", "
+                       "warmed up connections are used only once",
+                       &uscf->host);
+}
+
+
+/* names are resolved in background, an added name can not be held down */
+
+ngx_flag_t
+ngx_http_dynamic_upstream_lua_warmup_address(ngx_str_t *server)
+{
+    u_char  *p;
+
+    if (server->len == 0) {
+        return 0;
+    }
+
+    if (server->data[0] == '[') {
+        return 1;
+    }
+
+    p = ngx_strlchr(server->data, server->data + server->len, ':');
+    if (p == NULL) {
+        p = server->data + server->len;
+    }
+
+    return ngx_inet_addr(server->data, p - server->data) != INADDR_NONE;
+}
+
+
+/* peers of different upstreams with the same name are ordered by upstream */
+
+static ngx_int_t
+ngx_http_dynamic_upstream_warmup_cmp(ngx_http_dynamic_upstream_warmup_peer_t *p,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_str_t *name)
+{
+    ngx_int_t  rc;
+
+    rc = ngx_memn2cmp(name->data, p->name.data, name->len, p->name.len);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (uscf != p->uscf) {
+        return (uintptr_t) uscf < (uintptr_t) p->uscf ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_http_dynamic_upstream_warmup_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                        **p;
+    ngx_http_dynamic_upstream_warmup_peer_t   *wp, *wpt;
+
+    wp = (ngx_http_dynamic_upstream_warmup_peer_t *) node;
+
+    for ( ;; ) {
+
+        wpt = (ngx_http_dynamic_upstream_warmup_peer_t *) temp;
+
+        if (node->key != temp->key) {
+            p = (node->key < temp->key) ? &temp->left : &temp->right;
+
+        } else {
+            p = (ngx_http_dynamic_upstream_warmup_cmp(wpt, wp->uscf,
+                                                      &wp->name) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_http_dynamic_upstream_warmup_peer_t *
+ngx_http_dynamic_upstream_warmup_lookup(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_str_t *name, uint32_t hash)
+{
+    ngx_int_t                                 rc;
+    ngx_rbtree_node_t                        *node, *sentinel;
+    ngx_http_dynamic_upstream_warmup_peer_t  *wp;
+
+    node = ngx_http_dynamic_upstream_warmup_peers.root;
+    sentinel = ngx_http_dynamic_upstream_warmup_peers.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash != node->key) {
+            node = (hash < node->key) ? node->left : node->right;
+            continue;
+        }
+
+        wp = (ngx_http_dynamic_upstream_warmup_peer_t *) node;
+
+        rc = ngx_http_dynamic_upstream_warmup_cmp(wp, uscf, name);
+
+        if (rc == 0) {
+            return wp;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/* a connected connection is indexed by its peer until it is used */
+
+static ngx_int_t
+ngx_http_dynamic_upstream_warmup_index(ngx_http_dynamic_upstream_warmup_t *w)
+{
+    uint32_t                                  hash;
+    ngx_http_dynamic_upstream_warmup_peer_t  *wp;
+
+    hash = ngx_crc32_short(w->name.data, w->name.len);
+
+    wp = ngx_http_dynamic_upstream_warmup_lookup(w->uscf, &w->name, hash);
+
+    if (wp == NULL) {
+        wp = ngx_alloc(sizeof(ngx_http_dynamic_upstream_warmup_peer_t)
+                       + w->name.len, ngx_cycle->log);
+        if (wp == NULL) {
+            return NGX_ERROR;
+        }
+
+        wp->node.key = hash;
+        wp->uscf = w->uscf;
+        wp->name.data = (u_char *) (wp + 1);
+        wp->name.len = w->name.len;
+        ngx_memcpy(wp->name.data, w->name.data, w->name.len);
+        ngx_queue_init(&wp->ready);
+
+        ngx_rbtree_insert(&ngx_http_dynamic_upstream_warmup_peers,
+                          &wp->node);
+    }
+
+    ngx_queue_insert_tail(&wp->ready, &w->link);
+    w->peer = wp;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_dynamic_upstream_warmup_unindex(ngx_http_dynamic_upstream_warmup_t *w)
+{
+    ngx_http_dynamic_upstream_warmup_peer_t  *wp;
+
+    wp = w->peer;
+    w->peer = NULL;
+
+    if (wp == NULL) {
+        return;
+    }
+
+    ngx_queue_remove(&w->link);
+
+    if (ngx_queue_empty(&wp->ready)) {
+        ngx_rbtree_delete(&ngx_http_dynamic_upstream_warmup_peers, &wp->node);
+        ngx_free(wp);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_warmup_up(ngx_log_t *log,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_str_t *server, ngx_flag_t backup)
+{
+    ngx_dynamic_upstream_op_t  op;
+
+    ngx_memzero(&op, sizeof(ngx_dynamic_upstream_op_t));
+
+    op.op = NGX_DYNAMIC_UPSTEAM_OP_PARAM;
+    op.status = NGX_HTTP_OK;
+    op.upstream = uscf->host;
+    op.server = *server;
+    op.backup = backup;
+    op.up = 1;
+    op.op_param = NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+
+    return ngx_http_dynamic_upstream_lua_apply(log, &op, uscf);
+}
+
+
+static void
+ngx_http_dynamic_upstream_warmup_done(ngx_http_dynamic_upstream_warmup_t *w)
+{
+    ngx_http_dynamic_upstream_warmup_group_t  *group;
+
+    group = w->group;
+    w->group = NULL;
+
+    if (group == NULL) {
+        return;
+    }
+
+    group->connected += w->ready;
+
+    if (--group->pending != 0) {
+        return;
+    }
+
+    /* failed warmup does not keep the peer down, it is logged only */
+
+    ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                  "dynamic upstream: %V in %V is up, %ui connections "
+                  "warmed up", &group->server, &group->uscf->host,
+                  group->connected);
+
+    if (ngx_http_dynamic_upstream_warmup_up(ngx_cycle->log, group->uscf,
+                                            &group->server, group->backup)
+        != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "dynamic upstream: %V in %V is not brought up "
+                      "after warmup", &group->server, &group->uscf->host);
+    }
+
+    ngx_free(group);
+}
+
+
+static void
+ngx_http_dynamic_upstream_warmup_close(ngx_http_dynamic_upstream_warmup_t *w)
+{
+    ngx_http_dynamic_upstream_warmup_done(w);
+    ngx_http_dynamic_upstream_warmup_unindex(w);
+
+    if (w->pc.connection != NULL) {
+        ngx_close_connection(w->pc.connection);
+        w->pc.connection = NULL;
+    }
+
+    ngx_queue_remove(&w->queue);
+    ngx_queue_insert_tail(&ngx_http_dynamic_upstream_warmup_free, &w->queue);
+}
+
+
+static void
+ngx_http_dynamic_upstream_warmup_dummy_handler(ngx_event_t *ev)
+{
+}
+
+
+static void
+ngx_http_dynamic_upstream_warmup_read_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                    *c;
+    ngx_http_dynamic_upstream_warmup_t  *w;
+    ssize_t                              n;
+    char                                 buf[1];
+
+    c = ev->data;
+    w = c->data;
+
+    if (c->close || ev->timedout) {
+        goto close;
+    }
+
+    /* the peer closed the connection or sent unexpected data */
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    ngx_http_dynamic_upstream_warmup_close(w);
+}
+
+
+static void
+ngx_http_dynamic_upstream_warmup_connected(ngx_event_t *ev)
+{
+    ngx_connection_t                    *c;
+    ngx_http_dynamic_upstream_warmup_t  *w;
+    ngx_err_t                            err;
+    socklen_t                            len;
+
+    c = ev->data;
+    w = c->data;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_WARN, ev->log, NGX_ETIMEDOUT,
+                      "dynamic upstream: warmup of %V in %V failed",
+                      &w->name, &w->uscf->host);
+        ngx_http_dynamic_upstream_warmup_close(w);
+        return;
+    }
+
+    err = 0;
+    len = sizeof(ngx_err_t);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        ngx_log_error(NGX_LOG_WARN, ev->log, err,
+                      "dynamic upstream: warmup of %V in %V failed",
+                      &w->name, &w->uscf->host);
+        ngx_http_dynamic_upstream_warmup_close(w);
+        return;
+    }
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    c->write->handler = ngx_http_dynamic_upstream_warmup_dummy_handler;
+    c->read->handler = ngx_http_dynamic_upstream_warmup_read_handler;
+    c->idle = 1;
+
+    w->ready = 1;
+
+    ngx_http_dynamic_upstream_warmup_done(w);
+
+    ngx_add_timer(c->read, w->timeout);
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK
+        || ngx_http_dynamic_upstream_warmup_index(w) != NGX_OK)
+    {
+        ngx_http_dynamic_upstream_warmup_close(w);
+    }
+}
+
+
+static void
+ngx_http_dynamic_upstream_warmup_connect(ngx_http_dynamic_upstream_warmup_t *w,
+    ngx_log_t *log)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    w->pc.sockaddr = &w->sockaddr.sockaddr;
+    w->pc.name = &w->name;
+    w->pc.get = ngx_event_get_peer;
+    w->pc.log = ngx_cycle->log;
+    w->pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&w->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "dynamic upstream: warmup of %V in %V failed",
+                      &w->name, &w->uscf->host);
+        w->pc.connection = NULL;
+        ngx_http_dynamic_upstream_warmup_close(w);
+        return;
+    }
+
+    c = w->pc.connection;
+
+    c->data = w;
+    c->write->handler = ngx_http_dynamic_upstream_warmup_connected;
+    c->read->handler = ngx_http_dynamic_upstream_warmup_dummy_handler;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, w->timeout);
+        return;
+    }
+
+    ngx_http_dynamic_upstream_warmup_connected(c->write);
+}
+
+
+static ngx_http_dynamic_upstream_warmup_t *
+ngx_http_dynamic_upstream_warmup_alloc(void)
+{
+    ngx_queue_t                         *q;
+    ngx_http_dynamic_upstream_warmup_t  *w;
+
+    if (!ngx_queue_empty(&ngx_http_dynamic_upstream_warmup_free)) {
+        q = ngx_queue_head(&ngx_http_dynamic_upstream_warmup_free);
+        ngx_queue_remove(q);
+
+        w = ngx_queue_data(q, ngx_http_dynamic_upstream_warmup_t, queue);
+
+    } else {
+        w = ngx_palloc(ngx_cycle->pool,
+                       sizeof(ngx_http_dynamic_upstream_warmup_t));
+        if (w == NULL) {
+            return NULL;
+        }
+    }
+
+    ngx_memzero(w, sizeof(ngx_http_dynamic_upstream_warmup_t));
+
+    return w;
+}
+
+
+/*
+ * The peer is down while its connections are opened, the last connection
+ * opened or failed brings it up.  NGX_DECLINED means no such peer.
+ */
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_warmup_peer(ngx_log_t *log,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_str_t *server,
+    ngx_uint_t connections)
+{
+    ngx_http_upstream_rr_peer_t               *peer;
+    ngx_http_upstream_rr_peers_t              *primary, *peers;
+    ngx_http_dynamic_upstream_lua_srv_conf_t  *ucscf;
+    ngx_http_dynamic_upstream_warmup_t        *w;
+    ngx_http_dynamic_upstream_warmup_group_t  *group;
+    ngx_queue_t                                pending, *q;
+    ngx_uint_t                                 i;
+    ngx_flag_t                                 found = 0, backup = 0;
+
+    if (!ngx_http_dynamic_upstream_warmup_initialized) {
+        ngx_queue_init(&ngx_http_dynamic_upstream_warmup_active);
+        ngx_queue_init(&ngx_http_dynamic_upstream_warmup_free);
+        ngx_rbtree_init(&ngx_http_dynamic_upstream_warmup_peers,
+                        &ngx_http_dynamic_upstream_warmup_sentinel,
+                        ngx_http_dynamic_upstream_warmup_insert_value);
+        ngx_http_dynamic_upstream_warmup_initialized = 1;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(uscf,
+                ngx_http_dynamic_upstream_lua_module);
+
+    connections = ngx_min(connections, NGX_DYNAMIC_UPSTREAM_LUA_WARMUP_MAX);
+
+    group = ngx_alloc(sizeof(ngx_http_dynamic_upstream_warmup_group_t)
+                      + server->len, log);
+    if (group == NULL) {
+        return NGX_ERROR;
+    }
+
+    group->uscf = uscf;
+    group->pending = 0;
+    group->connected = 0;
+    group->server.data = (u_char *) (group + 1);
+    group->server.len = server->len;
+    ngx_memcpy(group->server.data, server->data, server->len);
+
+    ngx_queue_init(&pending);
+
+    primary = uscf->peer.data;
+
+    /* the server may be resolved to several peers */
+
+    ngx_http_upstream_rr_peers_rlock(primary);
+
+    for (peers = primary; peers; peers = peers->next) {
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if ((peer->server.len != server->len
+                 || ngx_strncmp(peer->server.data, server->data,
+                                server->len) != 0)
+                && (peer->name.len != server->len
+                    || ngx_strncmp(peer->name.data, server->data,
+                                   server->len) != 0))
+            {
+                continue;
+            }
+
+            found = 1;
+            backup = peers != primary;
+
+            if (peer->name.len > NGX_SOCKADDR_STRLEN) {
+                continue;
+            }
+
+            for (i = 0; i < connections; i++) {
+
+                w = ngx_http_dynamic_upstream_warmup_alloc();
+                if (w == NULL) {
+                    break;
+                }
+
+                w->uscf = uscf;
+                w->group = group;
+                w->timeout = ucscf->warmup_timeout;
+
+                ngx_memcpy(&w->sockaddr, peer->sockaddr, peer->socklen);
+                w->pc.socklen = peer->socklen;
+
+                w->name.data = w->addr;
+                w->name.len = peer->name.len;
+                ngx_memcpy(w->addr, peer->name.data, peer->name.len);
+
+                ngx_queue_insert_tail(&pending, &w->queue);
+
+                group->pending++;
+            }
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    group->backup = backup;
+
+    if (!found) {
+        ngx_free(group);
+        return NGX_DECLINED;
+    }
+
+    if (group->pending == 0) {
+        ngx_free(group);
+        return ngx_http_dynamic_upstream_warmup_up(log, uscf, server, backup);
+    }
+
+    /* the connections are moved to the free list on failure */
+
+    while (!ngx_queue_empty(&pending)) {
+        q = ngx_queue_head(&pending);
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(&ngx_http_dynamic_upstream_warmup_active, q);
+
+        w = ngx_queue_data(q, ngx_http_dynamic_upstream_warmup_t, queue);
+
+        ngx_http_dynamic_upstream_warmup_connect(w, log);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_lua_warmup_get(ngx_peer_connection_t *pc,
+    ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_queue_t                              *q;
+    ngx_connection_t                         *c;
+    ngx_http_dynamic_upstream_warmup_t       *w;
+    ngx_http_dynamic_upstream_warmup_peer_t  *wp;
+
+    if (!ngx_http_dynamic_upstream_warmup_initialized || pc->name == NULL) {
+        return NGX_DECLINED;
+    }
+
+    wp = ngx_http_dynamic_upstream_warmup_lookup(uscf, pc->name,
+             ngx_crc32_short(pc->name->data, pc->name->len));
+
+    if (wp == NULL) {
+        return NGX_DECLINED;
+    }
+
+    q = ngx_queue_head(&wp->ready);
+
+    w = ngx_queue_data(q, ngx_http_dynamic_upstream_warmup_t, link);
+
+    /* the same as the keepalive cache does for cached connection */
+
+    c = w->pc.connection;
+
+    w->pc.connection = NULL;
+    ngx_http_dynamic_upstream_warmup_close(w);
+
+    c->idle = 0;
+    c->sent = 0;
+    c->data = NULL;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+
+    if (c->pool != NULL) {
+        c->pool->log = pc->log;
+    }
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    return NGX_OK;
+}
+
+
+/*
+ * peers held down by connections of the exiting worker are brought up,
+ * other workers do not know them
+ */
+
+void
+ngx_http_dynamic_upstream_lua_warmup_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_queue_t                         *q;
+    ngx_http_dynamic_upstream_warmup_t  *w;
+
+    if (!ngx_http_dynamic_upstream_warmup_initialized) {
+        return;
+    }
+
+    while (!ngx_queue_empty(&ngx_http_dynamic_upstream_warmup_active)) {
+        q = ngx_queue_head(&ngx_http_dynamic_upstream_warmup_active);
+
+        w = ngx_queue_data(q, ngx_http_dynamic_upstream_warmup_t, queue);
+
+        ngx_http_dynamic_upstream_warmup_close(w);
+    }
+}
@@ -5,6 +5,9 @@
 #include "ngx_stream_lua_api.h"
 
 
+#include "ngx_dynamic_upstream_lua.h"
+
+
 ngx_module_t ngx_stream_dynamic_upstream_lua_module;
 
 
@@ -14,18 +17,15 @@ ngx_stream_dynamic_upstream_lua_post_conf(ngx_conf_t *cf);
 static void *
 ngx_stream_dynamic_upstream_lua_create_srv_conf(ngx_conf_t *cf);
 
+static char *
+ngx_stream_dynamic_upstream_lua_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+
 
 static ngx_int_t ngx_stream_dynamic_upstream_write_filter
     (ngx_stream_session_t *s, ngx_chain_t *in, ngx_uint_t from_upstream);
 
 
-typedef struct {
-    ngx_flag_t  disconnect_backup;
-    ngx_flag_t  disconnect_down;
-    ngx_flag_t  disconnect_on_exiting;
-} ngx_stream_dynamic_upstream_lua_srv_conf_t;
-
-
 static char *
 ngx_stream_dynamic_upstream_lua_disconnect_backup_if_primary_up(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
@@ -41,6 +41,41 @@ ngx_stream_dynamic_upstream_lua_disconnect_on_exiting(ngx_conf_t *cf,
 
 static ngx_command_t ngx_stream_dynamic_upstream_lua_commands[] = {
 
+    { ngx_string("dynamic_backup_threshold"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_dynamic_upstream_lua_threshold,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_dynamic_upstream_lua_srv_conf_t, backup_threshold),
+      NULL },
+
+    { ngx_string("dynamic_panic_threshold"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_dynamic_upstream_lua_threshold,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_dynamic_upstream_lua_srv_conf_t, panic_threshold),
+      NULL },
+
+    { ngx_string("dynamic_upstream_file"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_dynamic_upstream_lua_file,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_dynamic_upstream_lua_srv_conf_t, file),
+      NULL },
+
+    { ngx_string("dynamic_queue"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_dynamic_upstream_lua_queue,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_dynamic_upstream_lua_srv_conf_t, queue),
+      NULL },
+
+    { ngx_string("dynamic_queue_upstream"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_set_complex_value_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_dynamic_upstream_lua_srv_conf_t, queue_upstream),
+      NULL },
+
     { ngx_string("disconnect_backup_if_primary_up"),
       NGX_STREAM_UPS_CONF|NGX_CONF_NOARGS,
       ngx_stream_dynamic_upstream_lua_disconnect_backup_if_primary_up,
@@ -73,7 +108,7 @@ static ngx_stream_module_t ngx_stream_dynamic_upstream_lua_ctx = {
     NULL,                                            /* create main       */
     NULL,                                            /* init main         */
     ngx_stream_dynamic_upstream_lua_create_srv_conf, /* create server     */
-    NULL                                             /* merge server      */
+    ngx_stream_dynamic_upstream_lua_merge_srv_conf   /* merge server      */
 };
 
 
@@ -99,20 +134,24 @@ ngx_stream_next_filter;
 
 static ngx_uint_t
 ngx_stream_dynamic_upstream_alive_primary(ngx_stream_upstream_rr_peers_t *peers,
-    ngx_stream_upstream_rr_peer_t *current)
+    ngx_stream_upstream_rr_peer_t *current, ngx_uint_t threshold)
 {
     ngx_stream_upstream_rr_peer_t  *peer;
-    int                             alive = 0;
+    ngx_uint_t                      alive = 0, total = 0;
+    time_t                          now = ngx_time();
 
     for (peer = peers->peer; peer; peer = peer->next) {
 
         if (current == peer)
             return 0;
 
-        alive = alive + (peer->down == 0 ? 1 : 0);
+        alive += ngx_dynamic_upstream_lua_peer_alive(peer, now);
+        total++;
     }
 
-    return alive;
+    /* enough primary peers to carry the load without backup peers */
+
+    return !ngx_dynamic_upstream_lua_backup_needed(threshold, alive, total);
 }
 
 
@@ -150,11 +189,32 @@ ngx_have_upstream(ngx_stream_session_t *s)
 
 
 typedef struct {
-    ngx_stream_upstream_rr_peer_t *peer;
-    ngx_msec_t                     check_ms;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_msec_t                          check_ms;
+    ngx_flag_t                          looked_up;
+    ngx_dynamic_upstream_lua_waiter_t  *waiter;
 } context_t;
 
 
+static context_t *
+ngx_stream_dynamic_upstream_ctx(ngx_stream_session_t *s)
+{
+    context_t  *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_dynamic_upstream_lua_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(s->connection->pool, sizeof(context_t));
+        if (ctx == NULL)
+            return NULL;
+
+        ngx_stream_set_ctx(s, ctx, ngx_stream_dynamic_upstream_lua_module);
+    }
+
+    return ctx;
+}
+
+
 static ngx_int_t
 ngx_stream_dynamic_upstream_write_filter(ngx_stream_session_t *s,
     ngx_chain_t *in, ngx_uint_t from_upstream)
@@ -172,20 +232,14 @@ ngx_stream_dynamic_upstream_write_filter(ngx_stream_session_t *s,
 
     ngx_stream_upstream_rr_peers_rlock(peers);
 
-    ctx = ngx_stream_get_module_ctx(s, ngx_stream_dynamic_upstream_lua_module);
-
-    if (ctx == NULL) {
-        ctx = ngx_pcalloc(s->connection->pool, sizeof(context_t));
-        if (ctx == NULL)
-            goto skip;
-
-        ngx_stream_set_ctx(s, ctx, ngx_stream_dynamic_upstream_lua_module);
+    ctx = ngx_stream_dynamic_upstream_ctx(s);
+    if (ctx == NULL)
+        goto skip;
 
+    if (!ctx->looked_up) {
+        ctx->looked_up = 1;
         ctx->peer = ngx_stream_dynamic_upstream_get_peer(peers,
             s->upstream->state->peer);
-
-        if (ctx->peer == NULL)
-            goto skip;
     }
 
     if (ctx->peer == NULL)
@@ -219,7 +273,8 @@ ngx_stream_dynamic_upstream_write_filter(ngx_stream_session_t *s,
     }
 
     if (ucscf->disconnect_backup &&
-        ngx_stream_dynamic_upstream_alive_primary(peers, ctx->peer)) {
+        ngx_stream_dynamic_upstream_alive_primary(peers, ctx->peer,
+            ucscf->backup_threshold)) {
 
         ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
             "[disconnect_backup_if_primary_up] peer=%V "
@@ -243,6 +298,117 @@ skip:
 }
 
 
+static void
+ngx_stream_dynamic_upstream_queue_resume(ngx_dynamic_upstream_lua_waiter_t *w)
+{
+    ngx_stream_core_run_phases(w->data);
+}
+
+
+static ngx_int_t
+ngx_stream_dynamic_upstream_queue_handler(ngx_stream_session_t *s)
+{
+    ngx_stream_dynamic_upstream_lua_srv_conf_t  *scf, *ucscf;
+    ngx_stream_upstream_srv_conf_t              *uscf;
+    ngx_dynamic_upstream_lua_waiter_t           *w;
+    ngx_pool_cleanup_t                          *cln;
+    ngx_str_t                                    name;
+    context_t                                   *ctx;
+    ngx_int_t                                    rc;
+
+    scf = ngx_stream_get_module_srv_conf(s,
+        ngx_stream_dynamic_upstream_lua_module);
+
+    if (scf->queue_upstream == NULL)
+        return NGX_DECLINED;
+
+    ctx = ngx_stream_dynamic_upstream_ctx(s);
+    if (ctx == NULL)
+        return NGX_ERROR;
+
+    w = ctx->waiter;
+
+    if (w != NULL) {
+
+        switch (w->status) {
+            case NGX_AGAIN:
+                return NGX_AGAIN;
+
+            case NGX_DECLINED:
+                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                              "dynamic queue of upstream \"%V\" timed out",
+                              &w->q->suscf->host);
+                return NGX_STREAM_BAD_GATEWAY;
+
+            default:
+                /* proxy takes the peer in the content phase */
+                ngx_dynamic_upstream_lua_queue_started(w);
+                return NGX_DECLINED;
+        }
+    }
+
+    if (ngx_stream_complex_value(s, scf->queue_upstream, &name) != NGX_OK)
+        return NGX_ERROR;
+
+    uscf = scf->queue_uscf;
+
+    if (uscf == NULL
+        || uscf->host.len != name.len
+        || ngx_strncmp(uscf->host.data, name.data, name.len) != 0)
+    {
+        uscf = ngx_stream_dynamic_upstream_lua_upstream(&name);
+        if (uscf == NULL || uscf->srv_conf == NULL)
+            return NGX_DECLINED;
+
+        ucscf = ngx_stream_conf_upstream_srv_conf(uscf,
+            ngx_stream_dynamic_upstream_lua_module);
+
+        if (ucscf->queue == NULL)
+            return NGX_DECLINED;
+
+        /* upstreams with a queue are configured and live with the cycle */
+        scf->queue_uscf = uscf;
+    }
+
+    ucscf = ngx_stream_conf_upstream_srv_conf(uscf,
+        ngx_stream_dynamic_upstream_lua_module);
+
+    w = ngx_pcalloc(s->connection->pool,
+                    sizeof(ngx_dynamic_upstream_lua_waiter_t));
+    if (w == NULL)
+        return NGX_ERROR;
+
+    rc = ngx_dynamic_upstream_lua_queue_enter(ucscf->queue, w,
+                                              s->connection->log);
+
+    if (rc == NGX_DECLINED)
+        return NGX_DECLINED;
+
+    if (rc == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "dynamic queue of upstream \"%V\" is full",
+                      &uscf->host);
+        return NGX_STREAM_BAD_GATEWAY;
+    }
+
+    cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+    if (cln == NULL) {
+        ngx_dynamic_upstream_lua_queue_cleanup(w);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_dynamic_upstream_lua_queue_cleanup;
+    cln->data = w;
+
+    w->data = s;
+    w->resume = ngx_stream_dynamic_upstream_queue_resume;
+
+    ctx->waiter = w;
+
+    return NGX_AGAIN;
+}
+
+
 extern int
 ngx_stream_dynamic_upstream_lua_create_module(lua_State *L);
 
@@ -250,6 +416,9 @@ ngx_stream_dynamic_upstream_lua_create_module(lua_State *L);
 ngx_int_t
 ngx_stream_dynamic_upstream_lua_post_conf(ngx_conf_t *cf)
 {
+    ngx_stream_handler_pt        *h;
+    ngx_stream_core_main_conf_t  *cmcf;
+
 #ifndef NO_NGX_STREAM_LUA_MODULE
     if (ngx_stream_lua_add_package_preload(cf, "ngx.dynamic_upstream.stream",
         ngx_stream_dynamic_upstream_lua_create_module) != NGX_OK)
@@ -259,6 +428,14 @@ ngx_stream_dynamic_upstream_lua_post_conf(ngx_conf_t *cf)
     ngx_stream_next_filter = ngx_stream_top_filter;
     ngx_stream_top_filter = ngx_stream_dynamic_upstream_write_filter;
 
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_STREAM_ACCESS_PHASE].handlers);
+    if (h == NULL)
+        return NGX_ERROR;
+
+    *h = ngx_stream_dynamic_upstream_queue_handler;
+
     return NGX_OK;
 }
 
@@ -277,11 +454,33 @@ ngx_stream_dynamic_upstream_lua_create_srv_conf(ngx_conf_t *cf)
     ucscf->disconnect_backup = 0;
     ucscf->disconnect_down = 0;
     ucscf->disconnect_on_exiting = 0;
+    ucscf->backup_threshold = 0;
+    ucscf->panic_threshold = 0;
+    ngx_str_null(&ucscf->file);
+    ucscf->queue = NULL;
+    ucscf->queue_upstream = NULL;
+    ucscf->queue_uscf = NULL;
+    ucscf->state = NULL;
+    ucscf->replica = NULL;
 
     return ucscf;
 }
 
 
+static char *
+ngx_stream_dynamic_upstream_lua_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_stream_dynamic_upstream_lua_srv_conf_t  *prev = parent;
+    ngx_stream_dynamic_upstream_lua_srv_conf_t  *conf = child;
+
+    if (conf->queue_upstream == NULL)
+        conf->queue_upstream = prev->queue_upstream;
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_stream_dynamic_upstream_lua_disconnect_backup_if_primary_up(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf)
@@ -0,0 +1,97 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: api list upstreams
+--- http_config
+    upstream backends1 {
+        zone shm-backends1 128k;
+        server 127.0.0.1:6001;
+    }
+    upstream backends2 {
+        zone shm-backends2 128k;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream_api;
+    }
+    location /implicit {
+        proxy_pass http://127.0.0.1:6003;
+    }
+--- request
+    GET /dynamic?format=json
+--- response_body
+["backends1","backends2"]
+
+
+=== TEST 2: api add peer
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream_api;
+    }
+--- request
+    GET /dynamic?upstream=backends&op=add&peer=127.0.0.1:6002&weight=2&max_conns=100
+--- response_body
+server 127.0.0.1:6002 backup=0 weight=2 max_conns=100 conns=0 max_fails=1 fail_timeout=10 status=up
+server 127.0.0.1:6001 backup=0 weight=1 max_conns=0 conns=0 max_fails=1 fail_timeout=10 status=up
+
+
+=== TEST 3: api down peer
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream_api;
+    }
+--- request
+    GET /dynamic?upstream=backends&op=down&peer=127.0.0.1:6001&format=json
+--- response_body
+[{"server":"127.0.0.1:6001","name":"127.0.0.1:6001","weight":1,"max_conns":0,"conns":0,"max_fails":1,"fail_timeout":10,"backup":false,"down":true},{"server":"127.0.0.1:6002","name":"127.0.0.1:6002","weight":1,"max_conns":0,"conns":0,"max_fails":1,"fail_timeout":10,"backup":true,"down":false}]
+
+
+=== TEST 4: api remove stream peer
+--- stream_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /dynamic {
+        dynamic_upstream_api;
+    }
+--- request
+    GET /dynamic?upstream=backends&stream=1&op=remove&peer=127.0.0.1:6002
+--- response_body
+server 127.0.0.1:6001 backup=0 weight=1 max_conns=0 conns=0 max_fails=1 fail_timeout=10 status=up
+
+
+=== TEST 5: api unknown upstream
+--- config
+    location /dynamic {
+        dynamic_upstream_api;
+    }
+--- request
+    GET /dynamic?upstream=unknown&format=json
+--- error_code: 404
+--- response_body
+{"error":"upstream not found"}
@@ -0,0 +1,125 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: backup joins below threshold
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_backup_threshold 50%;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+        server 127.0.0.1:6004;
+        server 127.0.0.1:6005 backup;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function picks()
+                local seen = {}
+                for i = 1, 200 do
+                    local _, _, port = upstream.pick_peer("backends")
+                    seen[port] = true
+                end
+                ngx.say(seen[6005] == true, " ", seen[6004] == true)
+            end
+            upstream.set_peer_down("backends", "127.0.0.1:6001")
+            upstream.set_peer_down("backends", "127.0.0.1:6002")
+            picks()
+            upstream.set_peer_down("backends", "127.0.0.1:6003")
+            picks()
+            upstream.set_peer_up("backends", "127.0.0.1:6003")
+            picks()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+false true
+true true
+false true
+
+
+=== TEST 2: stream backup joins below threshold
+--- stream_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_backup_threshold 100%;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003 backup;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream.stream"
+            local _, _, port = upstream.pick_peer("backends",
+                                                  { policy = "least_conn" })
+            ngx.say(port ~= 6003)
+            upstream.set_peer_down("backends", "127.0.0.1:6001")
+            local seen = {}
+            for i = 1, 200 do
+                local _, _, port = upstream.pick_peer("backends")
+                seen[port] = true
+            end
+            ngx.say(seen[6002] == true, " ", seen[6003] == true)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+true
+true true
+
+
+=== TEST 3: failed primary counts as down
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_backup_threshold 100%;
+        server 127.0.0.1:6001 max_fails=1 fail_timeout=30s;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.1:6005 backup;
+    }
+--- config
+    location /backend {
+        return 200;
+    }
+    location /proxy {
+        proxy_pass http://backends/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function picks()
+                local seen = {}
+                for i = 1, 200 do
+                    local _, _, port = upstream.pick_peer("backends")
+                    seen[port] = true
+                end
+                ngx.say(seen[6005] == true)
+            end
+            picks()
+            for i = 1, 4 do
+                ngx.location.capture("/proxy")
+            end
+            ngx.sleep(0.01)
+            picks()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+false
+true
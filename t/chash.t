@@ -0,0 +1,289 @@
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: consistent hash keeps key on the same peer after add
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_consistent_hash $arg_key;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    server {
+        listen 6001;
+        location / { return 200 6001; }
+    }
+    server {
+        listen 6002;
+        location / { return 200 6002; }
+    }
+    server {
+        listen 6003;
+        location / { return 200 6003; }
+    }
+--- config
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local before = {}
+            for i = 1, 20 do
+                before[i] = ngx.location.capture("/proxy?key=" .. i).body
+            end
+            local ok, _, err = upstream.add_primary_peer("backends", "127.0.0.1:6003")
+            if not ok then
+                ngx.say(err)
+                ngx.exit(200)
+            end
+            local moved = 0
+            for i = 1, 20 do
+                local after = ngx.location.capture("/proxy?key=" .. i).body
+                if after ~= before[i] then
+                    if after ~= "6003" then
+                        ngx.say("key " .. i .. " moved to " .. after)
+                    end
+                    moved = moved + 1
+                end
+            end
+            ngx.say(moved < 20 and "stable" or "rehashed")
+        }
+    }
+--- request
+    GET /test
+--- response_body
+stable
+
+
+=== TEST 2: backup churn benchmark
+--- http_config
+    upstream backends {
+        zone shm-backends 256k;
+        dynamic_consistent_hash $arg_key;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+        server 127.0.0.1:6004;
+    }
+    server {
+        listen 6001;
+        location / { return 200 6001; }
+    }
+--- config
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local cycles, n = 50, 20
+            ngx.location.capture("/proxy?key=1")
+            ngx.update_time()
+            local start = ngx.now()
+            for cycle = 1, cycles do
+                for i = 1, n do
+                    upstream.add_backup_peer("backends", "127.0.1." .. i .. ":6005")
+                end
+                for i = 1, n do
+                    upstream.remove_peer("backends", "127.0.1." .. i .. ":6005")
+                end
+                ngx.location.capture("/proxy?key=" .. cycle)
+            end
+            ngx.update_time()
+            local elapsed = ngx.now() - start
+            ngx.log(ngx.NOTICE, "backup churn: ", cycles * n * 2, " ops in ", elapsed, "s")
+            ngx.say("ops=" .. cycles * n * 2)
+            ngx.say("usec_per_op=" .. math.floor(elapsed * 1000000 / (cycles * n * 2)))
+        }
+    }
+--- request
+    GET /test
+--- timeout: 60
+--- response_body_like
+ops=2000
+usec_per_op=\d+
+
+
+=== TEST 3: ring update benchmark with 10 peers
+--- http_config
+    dynamic_upstream_shm_size 8m;
+    upstream backends {
+        zone shm-backends 1m;
+        dynamic_consistent_hash $arg_key;
+        server 127.0.0.1:6001;
+    }
+    server {
+        listen 6001;
+        location / { return 200 6001; }
+    }
+--- config
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local n, cycles = 10, 20
+            for i = 2, n do
+                upstream.add_primary_peer("backends", "127.0."
+                    .. math.floor(i / 250) + 1 .. "." .. i % 250 + 1 .. ":6001")
+            end
+            ngx.location.capture("/proxy?key=0")
+            local function measure(change)
+                ngx.update_time()
+                local start = ngx.now()
+                for cycle = 1, cycles do
+                    change()
+                    ngx.location.capture("/proxy?key=" .. cycle)
+                end
+                ngx.update_time()
+                return math.floor((ngx.now() - start) * 1000000 / cycles)
+            end
+            -- points of one peer are added and removed
+            local incremental = measure(function()
+                upstream.add_primary_peer("backends", "127.0.100.1:6001")
+                upstream.remove_peer("backends", "127.0.100.1:6001")
+            end)
+            -- the ring is dropped and built again on the next request
+            local full = measure(function()
+                upstream.swap_primary_backup("backends")
+                upstream.swap_primary_backup("backends")
+            end)
+            ngx.say("peers=", n)
+            ngx.say("incremental_usec=", incremental)
+            ngx.say("full_usec=", full)
+        }
+    }
+--- request
+    GET /test
+--- timeout: 120
+--- response_body_like
+peers=10
+incremental_usec=\d+
+full_usec=\d+
+
+
+=== TEST 4: ring update benchmark with 100 peers
+--- http_config
+    dynamic_upstream_shm_size 8m;
+    upstream backends {
+        zone shm-backends 1m;
+        dynamic_consistent_hash $arg_key;
+        server 127.0.0.1:6001;
+    }
+    server {
+        listen 6001;
+        location / { return 200 6001; }
+    }
+--- config
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local n, cycles = 100, 20
+            for i = 2, n do
+                upstream.add_primary_peer("backends", "127.0."
+                    .. math.floor(i / 250) + 1 .. "." .. i % 250 + 1 .. ":6001")
+            end
+            ngx.location.capture("/proxy?key=0")
+            local function measure(change)
+                ngx.update_time()
+                local start = ngx.now()
+                for cycle = 1, cycles do
+                    change()
+                    ngx.location.capture("/proxy?key=" .. cycle)
+                end
+                ngx.update_time()
+                return math.floor((ngx.now() - start) * 1000000 / cycles)
+            end
+            -- points of one peer are added and removed
+            local incremental = measure(function()
+                upstream.add_primary_peer("backends", "127.0.100.1:6001")
+                upstream.remove_peer("backends", "127.0.100.1:6001")
+            end)
+            -- the ring is dropped and built again on the next request
+            local full = measure(function()
+                upstream.swap_primary_backup("backends")
+                upstream.swap_primary_backup("backends")
+            end)
+            ngx.say("peers=", n)
+            ngx.say("incremental_usec=", incremental)
+            ngx.say("full_usec=", full)
+        }
+    }
+--- request
+    GET /test
+--- timeout: 120
+--- response_body_like
+peers=100
+incremental_usec=\d+
+full_usec=\d+
+
+
+=== TEST 5: ring update benchmark with 1000 peers
+--- http_config
+    dynamic_upstream_shm_size 8m;
+    upstream backends {
+        zone shm-backends 1m;
+        dynamic_consistent_hash $arg_key;
+        server 127.0.0.1:6001;
+    }
+    server {
+        listen 6001;
+        location / { return 200 6001; }
+    }
+--- config
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local n, cycles = 1000, 20
+            for i = 2, n do
+                upstream.add_primary_peer("backends", "127.0."
+                    .. math.floor(i / 250) + 1 .. "." .. i % 250 + 1 .. ":6001")
+            end
+            ngx.location.capture("/proxy?key=0")
+            local function measure(change)
+                ngx.update_time()
+                local start = ngx.now()
+                for cycle = 1, cycles do
+                    change()
+                    ngx.location.capture("/proxy?key=" .. cycle)
+                end
+                ngx.update_time()
+                return math.floor((ngx.now() - start) * 1000000 / cycles)
+            end
+            -- points of one peer are added and removed
+            local incremental = measure(function()
+                upstream.add_primary_peer("backends", "127.0.100.1:6001")
+                upstream.remove_peer("backends", "127.0.100.1:6001")
+            end)
+            -- the ring is dropped and built again on the next request
+            local full = measure(function()
+                upstream.swap_primary_backup("backends")
+                upstream.swap_primary_backup("backends")
+            end)
+            ngx.say("peers=", n)
+            ngx.say("incremental_usec=", incremental)
+            ngx.say("full_usec=", full)
+        }
+    }
+--- request
+    GET /test
+--- timeout: 120
+--- response_body_like
+peers=1000
+incremental_usec=\d+
+full_usec=\d+
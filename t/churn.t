@@ -0,0 +1,89 @@
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: zone usage after add/remove churn
+--- http_config
+    upstream backends {
+        zone shm-backends 256k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local base
+            for cycle = 1, 20 do
+                for i = 1, 100 do
+                    local ok, _, err = upstream.add_primary_peer("backends", "127.0.1." .. i .. ":" .. (6000 + cycle))
+                    if not ok then
+                        ngx.say(err)
+                        ngx.exit(200)
+                    end
+                end
+                for i = 1, 100 do
+                    upstream.remove_peer("backends", "127.0.1." .. i .. ":" .. (6000 + cycle))
+                end
+                local _, usage = upstream.get_zone_usage("backends")
+                if cycle == 1 then
+                    base = usage.used
+                end
+            end
+            local _, usage = upstream.get_zone_usage("backends")
+            ngx.say("peers=" .. usage.peers)
+            ngx.say(usage.used <= base and "no growth" or "grows " .. base .. " -> " .. usage.used)
+            ngx.say("bytes_per_peer=" .. usage.bytes_per_peer .. " fragmentation=" .. usage.fragmentation)
+        }
+    }
+--- request
+    GET /test
+--- response_body_like
+peers=1
+no growth
+bytes_per_peer=\d+ fragmentation=\d+
+
+
+=== TEST 2: churn benchmark
+--- http_config
+    upstream backends {
+        zone shm-backends 256k;
+        server 127.0.0.1:6001;
+        dynamic_consistent_hash $arg_key;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local cycles, n = 50, 100
+            ngx.update_time()
+            local start = ngx.now()
+            for cycle = 1, cycles do
+                for i = 1, n do
+                    upstream.add_primary_peer("backends", "127.0.1." .. i .. ":6002")
+                end
+                for i = 1, n do
+                    upstream.remove_peer("backends", "127.0.1." .. i .. ":6002")
+                end
+            end
+            ngx.update_time()
+            local elapsed = ngx.now() - start
+            local _, usage = upstream.get_zone_usage("backends")
+            ngx.log(ngx.NOTICE, "churn: ", cycles * n * 2, " ops in ", elapsed, "s")
+            ngx.say("ops=" .. cycles * n * 2)
+            ngx.say("usec_per_op=" .. math.floor(elapsed * 1000000 / (cycles * n * 2)))
+            ngx.say("peers=" .. usage.peers)
+        }
+    }
+--- request
+    GET /test
+--- timeout: 60
+--- response_body_like
+ops=10000
+usec_per_op=\d+
+peers=1
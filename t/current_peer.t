@@ -0,0 +1,52 @@
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: current peer
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001 weight=2 max_fails=3;
+    }
+    server {
+        listen 6001;
+        location / { return 200; }
+    }
+--- config
+    location /proxy {
+        proxy_pass http://backends/;
+        header_filter_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local ok, peer, err = upstream.current_peer()
+            if not ok then
+                ngx.header["X-Peer"] = err
+                return
+            end
+            ngx.header["X-Peer"] = peer.upstream .. ";" .. peer.name .. ";" .. peer.weight .. ";" .. peer.max_fails .. ";" .. tostring(peer.down) .. ";" .. peer.status .. ";" .. type(peer.connect_time)
+        }
+    }
+--- request
+    GET /proxy
+--- response_headers
+X-Peer: backends;127.0.0.1:6001;2;3;false;200;number
+
+
+=== TEST 2: current peer without proxying
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local ok, _, err = upstream.current_peer()
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+no proxying
@@ -0,0 +1,105 @@
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: ewma statistics in get_peers
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_ewma;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    server {
+        listen 6001;
+        location / { return 200 6001; }
+    }
+    server {
+        listen 6002;
+        location / { return 200 6002; }
+    }
+--- config
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for i = 1, 10 do
+                local res = ngx.location.capture("/proxy")
+                if res.status ~= 200 then
+                    ngx.say("status " .. res.status)
+                end
+            end
+            local ok, peers, err = upstream.get_peers("backends")
+            if not ok then
+                ngx.say(err)
+                ngx.exit(200)
+            end
+            for _, peer in pairs(peers)
+            do
+                ngx.say(peer.name .. " ewma=" .. type(peer.ewma) .. " inflight=" .. peer.inflight)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+127.0.0.1:6001 ewma=number inflight=0
+127.0.0.1:6002 ewma=number inflight=0
+
+
+
+=== TEST 2: slow peer is avoided
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_ewma;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    server {
+        listen 6001;
+        location / { return 200 6001; }
+    }
+    server {
+        listen 6002;
+        location / {
+            content_by_lua_block {
+                ngx.sleep(0.05)
+                ngx.print(6002)
+            }
+        }
+    }
+--- config
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local count = { ["6001"] = 0, ["6002"] = 0 }
+            for i = 1, 30 do
+                local res = ngx.location.capture("/proxy")
+                count[res.body] = count[res.body] + 1
+            end
+            local _, peers = upstream.get_peers("backends")
+            local ewma = {}
+            for _, peer in pairs(peers)
+            do
+                ewma[peer.name] = peer.ewma
+            end
+            ngx.say(ewma["127.0.0.1:6002"] > ewma["127.0.0.1:6001"], " ",
+                    count["6001"] > count["6002"])
+        }
+    }
+--- request
+    GET /test
+--- response_body
+true true
@@ -0,0 +1,120 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: peers loaded from file
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_upstream_file $TEST_NGINX_HTML_DIR/backends.json;
+        server 127.0.0.1:6001;
+    }
+--- user_files
+>>> backends.json
+[
+  { "server": "127.0.0.1:6002", "weight": 2 },
+  { "server": "127.0.0.1:6003", "backup": true }
+]
+--- config
+    location /test {
+        content_by_lua_block {
+            ngx.sleep(0.1)
+            local upstream = require "ngx.dynamic_upstream"
+            local _, peers = upstream.get_peers("backends")
+            for _, peer in ipairs(peers) do
+                ngx.say(peer.name, " ", peer.weight, " ",
+                        peer.backup and "backup" or "primary")
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+127.0.0.1:6002 2 primary
+127.0.0.1:6003 1 backup
+
+
+=== TEST 2: changes of file applied
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_upstream_file $TEST_NGINX_HTML_DIR/backends.json;
+        server 127.0.0.1:6001;
+    }
+--- user_files
+>>> backends.json
+[ { "server": "127.0.0.1:6001" } ]
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function dump()
+                local _, peers = upstream.get_peers("backends")
+                local s = {}
+                for _, peer in ipairs(peers) do
+                    table.insert(s, peer.name .. (peer.down and "-" or "")
+                                 .. (peer.backup and "b" or ""))
+                end
+                ngx.say(table.concat(s, " "))
+            end
+            local function write(json)
+                local path = "$TEST_NGINX_HTML_DIR/backends.json"
+                local f = io.open(path .. ".tmp", "w")
+                f:write(json)
+                f:close()
+                os.rename(path .. ".tmp", path)
+                ngx.sleep(0.2)
+            end
+            ngx.sleep(0.1)
+            dump()
+            write('[{"server":"127.0.0.1:6001","down":true},'
+                  .. '{"server":"127.0.0.1:6002"}]')
+            dump()
+            write('[{"server":"127.0.0.1:6002"},'
+                  .. '{"server":"127.0.0.1:6001","backup":true}]')
+            dump()
+            write('[{"server":')
+            dump()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+127.0.0.1:6001
+127.0.0.1:6002 127.0.0.1:6001-
+127.0.0.1:6002 127.0.0.1:6001b
+127.0.0.1:6002 127.0.0.1:6001b
+
+
+=== TEST 3: stream peers loaded from file
+--- stream_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_upstream_file $TEST_NGINX_HTML_DIR/backends.json;
+        server 127.0.0.1:6001;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- user_files
+>>> backends.json
+[ { "server": "127.0.0.1:6001" }, { "server": "127.0.0.1:6002" } ]
+--- config
+    location /test {
+        content_by_lua_block {
+            ngx.sleep(0.1)
+            local upstream = require "ngx.dynamic_upstream.stream"
+            local _, peers = upstream.get_primary_peers("backends")
+            ngx.say(#peers)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+2
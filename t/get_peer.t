@@ -0,0 +1,134 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: get single peer
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 weight=2;
+        server 127.0.0.1:6003 backup;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local _, peer = upstream.get_peer("backends", "127.0.0.1:6002")
+            ngx.say(peer.name, " ", peer.weight, " ", peer.backup)
+            local _, peer = upstream.get_peer("backends", "127.0.0.1:6003")
+            ngx.say(peer.name, " ", peer.backup)
+            local ok, _, err = upstream.get_peer("backends", "127.0.0.1:6004")
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+127.0.0.1:6002 2 false
+127.0.0.1:6003 true
+peer not found
+
+
+=== TEST 2: filtered peers
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 down;
+        server 127.0.0.1:6003 backup;
+        server 127.0.0.1:6004 backup down;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function dump(filter)
+                local _, peers = upstream.get_peers("backends", filter)
+                local t = {}
+                for _, peer in ipairs(peers) do
+                    table.insert(t, peer.name)
+                end
+                ngx.say(table.concat(t, " "))
+            end
+            dump { down = true }
+            dump { down = false, backup = false }
+            dump { backup = true }
+            local _, peers = upstream.get_peers("backends", { min_conns = 1 })
+            ngx.say(#peers)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+127.0.0.1:6002 127.0.0.1:6004
+127.0.0.1:6001
+127.0.0.1:6003 127.0.0.1:6004
+0
+
+
+=== TEST 3: stream get single peer
+--- stream_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 down;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream.stream"
+            local _, peer = upstream.get_peer("backends", "127.0.0.1:6002")
+            local _, peers = upstream.get_peers("backends", { down = true })
+            ngx.say(peer.name, " ", peer.down, " ", #peers)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+127.0.0.1:6002 true 1
+
+
+=== TEST 4: get single peer from the worker copy follows changes
+--- http_config
+    dynamic_upstream_shm_size 1m;
+    upstream backends {
+        zone shm-backends 256k;
+        server 127.0.0.1:6001;
+        server localhost:6002 backup;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for i = 1, 100 do
+                upstream.add_primary_peer("backends", "127.0.1." .. i .. ":6003")
+            end
+            local _, peer = upstream.get_peer("backends", "127.0.1.50:6003")
+            ngx.say(peer.name, " ", peer.backup)
+            local _, peer = upstream.get_peer("backends", "localhost:6002")
+            ngx.say(peer.server, " ", peer.backup)
+            upstream.set_peer_down("backends", "127.0.1.50:6003")
+            local _, peer = upstream.get_peer("backends", "127.0.1.50:6003")
+            ngx.say(peer.name, " ", peer.down)
+            upstream.remove_peer("backends", "127.0.1.50:6003")
+            local ok, _, err = upstream.get_peer("backends", "127.0.1.50:6003")
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+127.0.1.50:6003 false
+localhost:6002 true
+127.0.1.50:6003 true
+peer not found
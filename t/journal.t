@@ -0,0 +1,117 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: export changes
+--- http_config
+    dynamic_upstream_journal 16;
+    upstream a {
+        zone shm-a 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            upstream.add_primary_peer("a", "127.0.0.1:6002",
+                                      { tags = { "host=h2" } })
+            upstream.add_backup_peer("a", "127.0.0.1:6003")
+            upstream.update_peer("a", "127.0.0.1:6002", { weight = 5 })
+            upstream.set_peer_down("a", "127.0.0.1:6001")
+            local _, changes = upstream.get_changes(0)
+            ngx.say(changes:match('"last":(%d+)'))
+            local _, changes = upstream.get_changes(5)
+            ngx.say(changes)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+5
+{"last":5,"changes":[]}
+
+
+=== TEST 2: apply exported changes
+--- http_config
+    dynamic_upstream_journal 16;
+    upstream a {
+        zone shm-a 128k;
+        server 127.0.0.1:6001;
+    }
+    upstream b {
+        zone shm-b 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            upstream.add_primary_peer("a", "127.0.0.1:6002",
+                                      { tags = { "host=h2" } })
+            upstream.add_backup_peer("a", "127.0.0.1:6003")
+            upstream.update_peer("a", "127.0.0.1:6002", { weight = 5 })
+            upstream.set_peer_down("a", "127.0.0.1:6001")
+            local _, changes = upstream.get_changes(0)
+            changes = changes:gsub(',"a",', ',"b",')
+            local _, n = upstream.apply_changes(changes)
+            ngx.say(n)
+            local _, peers = upstream.get_peers("b")
+            for _, peer in ipairs(peers) do
+                ngx.say(peer.name, " ", peer.weight, " ", peer.backup == true,
+                        " ", peer.down == true)
+            end
+            local _, peers = upstream.get_peers({ tag = "host=h2" })
+            ngx.say(peers.b[1].name)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+5
+127.0.0.1:6002 5 false false
+127.0.0.1:6001 1 false true
+127.0.0.1:6003 1 true false
+127.0.0.1:6002
+
+
+=== TEST 3: evicted changes
+--- http_config
+    dynamic_upstream_journal 2;
+    upstream a {
+        zone shm-a 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            upstream.add_primary_peer("a", "127.0.0.1:6002")
+            upstream.add_primary_peer("a", "127.0.0.1:6003")
+            upstream.remove_peer("a", "127.0.0.1:6002")
+            local _, _, err = upstream.get_changes(0)
+            ngx.say(err)
+            local _, changes = upstream.get_changes(1)
+            ngx.say(changes:match('"last":(%d+)'), " ",
+                    select(2, changes:gsub('"127.0.0.1:600', "")))
+            local ok, _, err = upstream.apply_changes('{"changes":[[1]]}')
+            ngx.say(ok, " ", err)
+            ok, _, err = upstream.apply_changes('{"changes":['
+                .. '[1,"add",0,"a","127.0.0.1:6009",0,0,1,1,0,10],[2]]}')
+            local _, peers = upstream.get_peers("a")
+            ngx.say(ok, " ", err, " ", #peers)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+changes are lost
+3 2
+false json: change is truncated
+false json: change is truncated 2
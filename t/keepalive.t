@@ -0,0 +1,152 @@
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: keepalive connection is reused
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT;
+        keepalive 8;
+        disconnect_if_market_down;
+    }
+--- config
+    location /backend {
+        content_by_lua_block {
+            ngx.print(ngx.var.connection)
+        }
+    }
+    location /proxy {
+        proxy_http_version 1.1;
+        proxy_set_header Connection "";
+        proxy_pass http://backends/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local first = ngx.location.capture("/proxy").body
+            local second = ngx.location.capture("/proxy").body
+            ngx.say(first == second and "reused" or "new")
+        }
+    }
+--- request
+    GET /test
+--- response_body
+reused
+
+
+=== TEST 2: keepalive connection to the peer marked down is closed
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT;
+        keepalive 8;
+        disconnect_if_market_down;
+    }
+--- config
+    location /backend {
+        content_by_lua_block {
+            ngx.print(ngx.var.connection)
+        }
+    }
+    location /proxy {
+        proxy_http_version 1.1;
+        proxy_set_header Connection "";
+        proxy_pass http://backends/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local peer = "127.0.0.1:" .. ngx.var.server_port
+            local first = ngx.location.capture("/proxy").body
+            upstream.set_peer_down("backends", peer)
+            upstream.set_peer_up("backends", peer)
+            local second = ngx.location.capture("/proxy").body
+            ngx.say(first == second and "reused" or "new")
+        }
+    }
+--- request
+    GET /test
+--- response_body
+new
+
+
+=== TEST 3: keepalive connection to the removed peer is closed
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT;
+        keepalive 8;
+        disconnect_if_market_down;
+    }
+--- config
+    location /backend {
+        content_by_lua_block {
+            ngx.print(ngx.var.connection)
+        }
+    }
+    location /proxy {
+        proxy_http_version 1.1;
+        proxy_set_header Connection "";
+        proxy_pass http://backends/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local peer = "127.0.0.1:" .. ngx.var.server_port
+            local first = ngx.location.capture("/proxy").body
+            upstream.add_primary_peer("backends", "127.0.0.1:6001")
+            upstream.remove_peer("backends", peer)
+            upstream.add_primary_peer("backends", peer)
+            upstream.remove_peer("backends", "127.0.0.1:6001")
+            local second = ngx.location.capture("/proxy").body
+            ngx.say(first == second and "reused" or "new")
+        }
+    }
+--- request
+    GET /test
+--- response_body
+new
+
+
+=== TEST 4: keepalive connection to the backup peer is closed when primary is up
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001 down;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT backup;
+        keepalive 8;
+        disconnect_backup_if_primary_up;
+    }
+--- config
+    location /backend {
+        content_by_lua_block {
+            ngx.print(ngx.var.connection)
+        }
+    }
+    location /proxy {
+        proxy_http_version 1.1;
+        proxy_set_header Connection "";
+        proxy_pass http://backends/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local first = ngx.location.capture("/proxy").body
+            local again = ngx.location.capture("/proxy").body
+            upstream.set_peer_up("backends", "127.0.0.1:6001")
+            upstream.set_peer_down("backends", "127.0.0.1:6001")
+            local second = ngx.location.capture("/proxy").body
+            ngx.say(first == again and "reused" or "new", " ",
+                    first == second and "reused" or "new")
+        }
+    }
+--- request
+    GET /test
+--- response_body
+reused new
@@ -0,0 +1,224 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: load peers from json
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local ok, report, err = upstream.load_json([[{
+              "backends" : [
+                { "server" : "127.0.0.1:6001", "down" : true },
+                { "server" : "127.0.0.1:6002", "weight" : 2, "max_fails" : 3,
+                  "fail_timeout" : 20, "max_conns" : 50 },
+                { "server" : "127.0.0.1:6003", "backup" : true }
+              ],
+              "unknown" : [
+                { "server" : "127.0.0.1:6004" }
+              ]
+            }]])
+            if not ok then
+                ngx.say(err)
+                ngx.exit(200)
+            end
+            ngx.say("backends added=" .. report.backends.added .. " updated=" .. report.backends.updated)
+            ngx.say("unknown " .. report.unknown.errors[1].error)
+            local ok, peers, err = upstream.get_peers("backends")
+            if not ok then
+                ngx.say(err)
+                ngx.exit(200)
+            end
+            local tointeger = function(b) if b then return 1 else return 0 end end
+            for _, peer in pairs(peers)
+            do
+                ngx.say(peer.name .. ";" .. peer.weight .. ";" .. peer.max_fails .. ";" .. peer.max_conns .. ";" .. peer.fail_timeout .. ";" .. tointeger(peer.down) .. ";" .. tointeger(peer.backup))
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+backends added=2 updated=1
+unknown upstream not found
+127.0.0.1:6002;2;3;50;20;0;0
+127.0.0.1:6001;1;1;0;10;1;0
+127.0.0.1:6003;1;1;0;10;0;1
+
+
+=== TEST 2: load malformed json
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local ok, _, err = upstream.load_json([[{"backends":[{"server":"127.0.0.1:6002"}]]])
+            if not ok then
+                ngx.say(err)
+            end
+            local ok, peers, err = upstream.get_peers("backends")
+            for _, peer in pairs(peers)
+            do
+                ngx.say(peer.name)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+json: ',' or '}' expected at offset 41
+127.0.0.1:6001
+
+
+=== TEST 3: load stream peers from json
+--- stream_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream.stream"
+            local ok, report, err = upstream.load_json([[{
+              "backends" : [
+                { "server" : "127.0.0.1:6002", "weight" : 3 }
+              ]
+            }]])
+            if not ok then
+                ngx.say(err)
+                ngx.exit(200)
+            end
+            ngx.say("backends added=" .. report.backends.added .. " updated=" .. report.backends.updated)
+            local ok, peers, err = upstream.get_primary_peers("backends")
+            for _, peer in pairs(peers)
+            do
+                ngx.say(peer.name .. ";" .. peer.weight)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+backends added=1 updated=0
+127.0.0.1:6002;3
+127.0.0.1:6001;1
+
+
+=== TEST 4: invalid peer rejects the whole document
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local docs = {
+              [[{"backends":[{"server":"127.0.0.1:6001","down":true},
+                             {"server":"127.0.0.1:6002","weight":0}]}]],
+              [[{"backends":[{"server":"127.0.0.1:6001","down":true},
+                             {"server":"127.0.0.1:6002","max_fails":12abc}]}]],
+              [[{"backends":[{"server":"127.0.0.1:6001","down":true},
+                             {"server":"127.0.0.1:abc"}]}]]
+            }
+            for _, doc in ipairs(docs) do
+                local ok, _, err = upstream.load_json(doc)
+                ngx.say(ok, " ", err:match("json: ([^%d]+) at"))
+            end
+            local ok, peers = upstream.get_peers("backends")
+            for _, peer in pairs(peers)
+            do
+                ngx.say(peer.name, " ", peer.down == true)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+false invalid weight
+false invalid number
+false invalid server
+127.0.0.1:6001 false
+
+
+=== TEST 5: server listed twice
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local ok, report = upstream.load_json([[{"backends":[
+              {"server":"127.0.0.1:6001","weight":3},
+              {"server":"127.0.0.1:6002"},
+              {"server":"127.0.0.1:6002","weight":2}]}]])
+            ngx.say("added=" .. report.backends.added .. " updated=" .. report.backends.updated)
+            local ok, peers = upstream.get_peers("backends")
+            for _, peer in pairs(peers)
+            do
+                ngx.say(peer.name, " ", peer.weight)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+added=1 updated=2
+127.0.0.1:6002 2
+127.0.0.1:6001 3
+
+
+=== TEST 6: stream server without port and unicode escapes
+--- stream_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream.stream"
+            local docs = {
+              [[{"backends":[{"server":"127.0.0.1"}]}]],
+              [[{"backends":[{"server":"127.0.0.1:6002\udc00"}]}]],
+              [[{"backends":[{"server":"127.0.0.1:6002\ud83d"}]}]],
+              [[{"backends":[{"server":"127.0.0.1:6002\ud83d\ude00"}]}]]
+            }
+            for _, doc in ipairs(docs) do
+                local ok, _, err = upstream.load_json(doc)
+                ngx.say(ok, " ", err:match("json: ([^%d]+) at"))
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+false no port in server
+false invalid unicode escape
+false invalid unicode escape
+false invalid server
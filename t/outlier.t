@@ -0,0 +1,138 @@
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: failing peer is ejected
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.1:1;
+        dynamic_outlier_detection consecutive=1;
+    }
+--- config
+    location /backend {
+        return 200;
+    }
+    location /proxy {
+        proxy_pass http://backends/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for _ = 1, 4 do
+                ngx.location.capture("/proxy")
+            end
+            local _, peer = upstream.get_peer("backends", "127.0.0.1:1")
+            ngx.say(peer.ejected, " ", peer.down, " ", peer.ejections)
+            local _, peer = upstream.get_peer("backends",
+                "127.0.0.1:" .. ngx.var.server_port)
+            ngx.say(peer.ejected, " ", peer.down)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+true true 1
+false nil
+
+
+=== TEST 2: ejection is capped
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:1;
+        server 127.0.0.1:2;
+        dynamic_outlier_detection consecutive=1 max_ejected=50%;
+    }
+--- config
+    location /proxy {
+        proxy_pass http://backends;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for _ = 1, 4 do
+                ngx.location.capture("/proxy")
+            end
+            local _, peers = upstream.get_peers("backends", { down = true })
+            ngx.say(#peers)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+1
+
+
+=== TEST 3: set_peer_up ends ejection
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.1:1;
+        dynamic_outlier_detection consecutive=1 ejection_time=1h;
+    }
+--- config
+    location /backend {
+        return 200;
+    }
+    location /proxy {
+        proxy_pass http://backends/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for _ = 1, 4 do
+                ngx.location.capture("/proxy")
+            end
+            upstream.set_peer_up("backends", "127.0.0.1:1")
+            local _, peer = upstream.get_peer("backends", "127.0.0.1:1")
+            ngx.say(peer.ejected, " ", peer.down)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+false nil
+
+
+=== TEST 4: ejected peer is reinstated
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.1:1;
+        dynamic_outlier_detection consecutive=1 ejection_time=100ms;
+    }
+--- config
+    location /backend {
+        return 200;
+    }
+    location /proxy {
+        proxy_pass http://backends/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for _ = 1, 4 do
+                ngx.location.capture("/proxy")
+            end
+            local _, peer = upstream.get_peer("backends", "127.0.0.1:1")
+            ngx.say(peer.ejected, " ", peer.down)
+            ngx.sleep(1.5)
+            local _, peer = upstream.get_peer("backends", "127.0.0.1:1")
+            ngx.say(peer.ejected, " ", peer.down, " ", peer.ejections)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+true true
+false nil 1
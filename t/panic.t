@@ -0,0 +1,116 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: panic mode
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_panic_threshold 50%;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+        server 127.0.0.1:6004;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function picks()
+                local seen = {}
+                for i = 1, 200 do
+                    local _, _, port = upstream.pick_peer("backends")
+                    seen[port] = true
+                end
+                local _, state = upstream.get_panic("backends")
+                ngx.say(seen[6001] == true, " ", state.panic, " ",
+                        state.alive, "/", state.primaries, " ",
+                        state.transitions, " ", state.selections)
+            end
+            upstream.set_peer_down("backends", "127.0.0.1:6001")
+            upstream.set_peer_down("backends", "127.0.0.1:6002")
+            picks()
+            upstream.set_peer_down("backends", "127.0.0.1:6003")
+            picks()
+            upstream.set_peer_up("backends", "127.0.0.1:6003")
+            picks()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+false false 2/4 0 0
+true true 1/4 1 200
+false false 2/4 1 200
+
+
+=== TEST 2: stream panic mode
+--- stream_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_panic_threshold 100%;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream.stream"
+            upstream.set_peer_down("backends", "127.0.0.1:6001")
+            local _, state = upstream.get_panic("backends")
+            ngx.say(state.panic, " ", state.alive, " ", state.transitions)
+            local _, _, err = upstream.get_panic("unknown")
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+true 1 1
+upstream not found
+
+
+=== TEST 3: failed peers without changes
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_panic_threshold 100%;
+        server 127.0.0.1:6001 max_fails=1 fail_timeout=30s;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT;
+    }
+--- config
+    location /backend {
+        return 200;
+    }
+    location /proxy {
+        proxy_pass http://backends/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function say()
+                local _, state = upstream.get_panic("backends")
+                ngx.say(state.panic, " ", state.alive, "/", state.primaries,
+                        " ", state.transitions)
+            end
+            say()
+            for i = 1, 4 do
+                ngx.location.capture("/proxy")
+            end
+            say()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+false 2/2 0
+true 1/2 1
@@ -0,0 +1,62 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: get peers json
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local ok, json, err = upstream.get_peers_json("backends")
+            ngx.say(json)
+            local ok, json, err = upstream.get_peers_json("backends", { primary = false })
+            ngx.say(json)
+            local ok, json, err = upstream.get_peers_json("unknown")
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+[{"server":"127.0.0.1:6001","name":"127.0.0.1:6001","weight":1,"max_conns":0,"conns":0,"max_fails":1,"fail_timeout":10,"backup":false,"down":false},{"server":"127.0.0.1:6002","name":"127.0.0.1:6002","weight":1,"max_conns":0,"conns":0,"max_fails":1,"fail_timeout":10,"backup":true,"down":false}]
+[{"server":"127.0.0.1:6002","name":"127.0.0.1:6002","weight":1,"max_conns":0,"conns":0,"max_fails":1,"fail_timeout":10,"backup":true,"down":false}]
+upstream not found
+
+
+=== TEST 2: get all stream peers json
+--- stream_config
+    upstream backends1 {
+        zone shm-backends1 128k;
+        server 127.0.0.1:6001;
+    }
+    upstream backends2 {
+        zone shm-backends2 128k;
+        server 127.0.0.1:6002 down;
+    }
+--- stream_server_config
+    proxy_pass backends1;
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream.stream"
+            local ok, json, err = upstream.get_all_peers_json()
+            ngx.say(json)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+{"backends1":[{"server":"127.0.0.1:6001","name":"127.0.0.1:6001","weight":1,"max_conns":0,"conns":0,"max_fails":1,"fail_timeout":10,"backup":false,"down":false}],"backends2":[{"server":"127.0.0.1:6002","name":"127.0.0.1:6002","weight":1,"max_conns":0,"conns":0,"max_fails":1,"fail_timeout":10,"backup":false,"down":true}]}
@@ -0,0 +1,287 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: pick peer skips down and max_conns
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001 down;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003 backup;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for _, policy in ipairs({ "p2c", "least_conn", "hash" }) do
+                local ok, host, port, err = upstream.pick_peer("backends", { policy = policy, key = "k" })
+                if not ok then
+                    ngx.say(err)
+                else
+                    ngx.say(policy .. " " .. host .. " " .. port)
+                end
+            end
+            upstream.set_peer_down("backends", "127.0.0.1:6002")
+            local ok, host, port = upstream.pick_peer("backends")
+            ngx.say("backup " .. host .. " " .. port)
+            upstream.set_peer_down("backends", "127.0.0.1:6003")
+            local ok, _, _, err = upstream.pick_peer("backends")
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+p2c 127.0.0.1 6002
+least_conn 127.0.0.1 6002
+hash 127.0.0.1 6002
+backup 127.0.0.1 6003
+no live peers
+
+
+=== TEST 2: pick peer hash is stable
+--- stream_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream.stream"
+            local _, _, first = upstream.pick_peer("backends", { policy = "hash", key = "abc" })
+            for i = 1, 10 do
+                local _, _, port = upstream.pick_peer("backends", { policy = "hash", key = "abc" })
+                if port ~= first then
+                    ngx.say("unstable")
+                end
+            end
+            local ok, _, _, err = upstream.pick_peer("backends", { policy = "hash" })
+            ngx.say(err)
+            local ok, _, _, err = upstream.pick_peer("backends", { policy = "random" })
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+key is required for hash policy
+unknown policy
+
+
+=== TEST 3: pick benchmark scanning the zone
+--- http_config
+    upstream backends {
+        zone shm-backends 256k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for i = 1, 200 do
+                upstream.add_primary_peer("backends", "127.0.1." .. i .. ":6002")
+            end
+            local n = 20000
+            for _, policy in ipairs({ "p2c", "least_conn", "hash" }) do
+                ngx.update_time()
+                local start = ngx.now()
+                for i = 1, n do
+                    upstream.pick_peer("backends",
+                                       { policy = policy, key = "k" .. i })
+                end
+                ngx.update_time()
+                ngx.say(policy, " usec_per_pick=",
+                        math.floor((ngx.now() - start) * 1000000 / n))
+            end
+        }
+    }
+--- request
+    GET /test
+--- timeout: 60
+--- response_body_like
+p2c usec_per_pick=\d+
+least_conn usec_per_pick=\d+
+hash usec_per_pick=\d+
+
+
+=== TEST 4: pick benchmark on the worker copy rebuilt by changes
+--- http_config
+    dynamic_upstream_shm_size 1m;
+    upstream backends {
+        zone shm-backends 256k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for i = 1, 200 do
+                upstream.add_primary_peer("backends", "127.0.1." .. i .. ":6002")
+            end
+            local n = 20000
+            for _, policy in ipairs({ "p2c", "least_conn", "hash" }) do
+                ngx.update_time()
+                local start = ngx.now()
+                for i = 1, n do
+                    -- the copy and its ring are rebuilt once per 1000 picks
+                    if i % 1000 == 0 then
+                        upstream.set_peer_down("backends", "127.0.1.1:6002")
+                        upstream.set_peer_up("backends", "127.0.1.1:6002")
+                    end
+                    upstream.pick_peer("backends",
+                                       { policy = policy, key = "k" .. i })
+                end
+                ngx.update_time()
+                ngx.say(policy, " usec_per_pick=",
+                        math.floor((ngx.now() - start) * 1000000 / n))
+            end
+        }
+    }
+--- request
+    GET /test
+--- timeout: 60
+--- response_body_like
+p2c usec_per_pick=\d+
+least_conn usec_per_pick=\d+
+hash usec_per_pick=\d+
+
+
+=== TEST 5: pick peer hash scanning the zone moves only keys of the down peer
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function pick_all()
+                local ports = {}
+                for i = 1, 100 do
+                    local _, _, port = upstream.pick_peer("backends",
+                        { policy = "hash", key = "k" .. i })
+                    ports[i] = port
+                end
+                return ports
+            end
+            local before = pick_all()
+            local counts = {}
+            for _, port in ipairs(before) do
+                counts[port] = (counts[port] or 0) + 1
+            end
+            ngx.say("6001=", counts[6001], " 6002=", counts[6002],
+                    " 6003=", counts[6003])
+            upstream.set_peer_down("backends", "127.0.0.1:6002")
+            local after = pick_all()
+            local moved = 0
+            for i = 1, 100 do
+                if before[i] ~= 6002 and before[i] ~= after[i] then
+                    moved = moved + 1
+                end
+            end
+            ngx.say("moved=", moved)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+6001=39 6002=32 6003=29
+moved=0
+
+
+=== TEST 6: pick peer hash on the worker copy moves keys only to an added peer
+--- http_config
+    dynamic_upstream_shm_size 1m;
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function pick_all()
+                local ports = {}
+                for i = 1, 100 do
+                    local _, _, port = upstream.pick_peer("backends",
+                        { policy = "hash", key = "k" .. i })
+                    ports[i] = port
+                end
+                return ports
+            end
+            local before = pick_all()
+            local counts = {}
+            for _, port in ipairs(before) do
+                counts[port] = (counts[port] or 0) + 1
+            end
+            -- the same mapping as the scan of the zone
+            ngx.say("6001=", counts[6001], " 6002=", counts[6002],
+                    " 6003=", counts[6003])
+            upstream.add_primary_peer("backends", "127.0.0.1:6004")
+            local after = pick_all()
+            local added, elsewhere = 0, 0
+            for i = 1, 100 do
+                if after[i] == 6004 then
+                    added = added + 1
+                elseif before[i] ~= after[i] then
+                    elsewhere = elsewhere + 1
+                end
+            end
+            ngx.say("added=", added > 0, " elsewhere=", elsewhere)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+6001=39 6002=32 6003=29
+added=true elsewhere=0
+
+
+=== TEST 7: pick peer p2c on the worker copy finds the last up peer
+--- http_config
+    dynamic_upstream_shm_size 1m;
+    upstream backends {
+        zone shm-backends 256k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for i = 1, 50 do
+                upstream.add_primary_peer("backends", "127.0.1." .. i .. ":6002")
+                upstream.set_peer_down("backends", "127.0.1." .. i .. ":6002")
+            end
+            local hits = 0
+            for i = 1, 1000 do
+                local _, _, port = upstream.pick_peer("backends",
+                                                      { policy = "p2c" })
+                if port == 6001 then
+                    hits = hits + 1
+                end
+            end
+            ngx.say("hits=", hits)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+hits=1000
@@ -0,0 +1,128 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: create and delete upstream
+--- http_config
+    dynamic_upstream_pool 1m upstreams=4;
+--- config
+    location /backend {
+        return 200 "ok\n";
+    }
+    location /proxy {
+        set $backend "dyn";
+        proxy_pass http://$backend/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function get()
+                local sock = ngx.socket.tcp()
+                assert(sock:connect("127.0.0.1", ngx.var.server_port))
+                sock:send("GET /proxy HTTP/1.0\r\nHost: localhost\r\n\r\n")
+                local line = sock:receive("*l")
+                sock:close()
+                return line:match("HTTP/1.%d (%d+)")
+            end
+            local function listed()
+                local _, upstreams = upstream.get_upstreams()
+                for _, name in ipairs(upstreams) do
+                    if name == "dyn" then
+                        return true
+                    end
+                end
+                return false
+            end
+            ngx.say(upstream.create_upstream("dyn", { zone_slice = "64k" }))
+            ngx.say(upstream.add_primary_peer("dyn",
+                    "127.0.0.1:" .. ngx.var.server_port))
+            ngx.say(listed(), " ", get())
+            ngx.say(upstream.delete_upstream("dyn"))
+            ngx.say(listed(), " ", get())
+        }
+    }
+--- request
+    GET /test
+--- response_body
+truenilnil
+truenilnil
+true 200
+truenilnil
+false 502
+
+
+=== TEST 2: errors
+--- http_config
+    dynamic_upstream_pool 1m upstreams=1;
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function say(ok, _, err)
+                ngx.say(ok, " ", err)
+            end
+            say(upstream.create_upstream("backends"))
+            say(upstream.create_upstream("dyn", { balancer = "random" }))
+            say(upstream.create_upstream("dyn", { balancer = "least_conn" }))
+            say(upstream.create_upstream("dyn"))
+            say(upstream.create_upstream("other"))
+            say(upstream.delete_upstream("backends"))
+            say(upstream.delete_upstream("dyn"))
+            say(upstream.delete_upstream("dyn"))
+        }
+    }
+--- request
+    GET /test
+--- response_body
+false upstream exists
+false unknown balancer
+true nil
+false upstream exists
+false no free upstream slots
+false upstream not found
+true nil
+false upstream not found
+
+
+=== TEST 3: tags of a deleted upstream are dropped
+--- http_config
+    dynamic_upstream_pool 1m upstreams=4;
+    dynamic_upstream_shm_size 1m;
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function tagged()
+                local _, upstreams = upstream.get_peers({ tag = "host=a" })
+                local n = 0
+                for _, peers in pairs(upstreams) do
+                    n = n + #peers
+                end
+                return n
+            end
+            upstream.create_upstream("dyn", { zone_slice = "64k" })
+            upstream.add_primary_peer("dyn", "127.0.0.1:6001",
+                                      { tags = { "host=a" } })
+            ngx.say("before=", tagged())
+            upstream.delete_upstream("dyn")
+            upstream.create_upstream("dyn", { zone_slice = "64k" })
+            upstream.add_primary_peer("dyn", "127.0.0.1:6001")
+            ngx.say("after=", tagged())
+        }
+    }
+--- request
+    GET /test
+--- response_body
+before=1
+after=0
@@ -0,0 +1,250 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: get_queue
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_queue 10 timeout=5s;
+        server 127.0.0.1:6001 max_conns=1;
+    }
+    upstream other {
+        zone shm-other 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local _, state = upstream.get_queue("backends")
+            ngx.say(state.size, " ", state.timeout, " ", state.waiting)
+            local ok, _, err = upstream.get_queue("other")
+            ngx.say(ok, " ", err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+10 5000 0
+false dynamic_queue is not set
+
+
+=== TEST 2: requests wait for a free peer
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_queue 10 timeout=5s;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT max_conns=1;
+    }
+--- config
+    location /backend {
+        content_by_lua_block {
+            ngx.sleep(0.3)
+            ngx.say("ok")
+        }
+    }
+    location /proxy {
+        dynamic_queue_upstream backends;
+        proxy_pass http://backends/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function get()
+                local sock = ngx.socket.tcp()
+                assert(sock:connect("127.0.0.1", ngx.var.server_port))
+                sock:send("GET /proxy HTTP/1.0\r\nHost: localhost\r\n\r\n")
+                local line = sock:receive("*l")
+                sock:close()
+                return line:match("HTTP/1.%d (%d+)")
+            end
+            local threads = {}
+            for i = 1, 3 do
+                table.insert(threads, ngx.thread.spawn(get))
+                ngx.sleep(0.05)
+            end
+            local statuses = {}
+            for _, thread in ipairs(threads) do
+                local _, status = ngx.thread.wait(thread)
+                table.insert(statuses, status)
+            end
+            local _, state = upstream.get_queue("backends")
+            ngx.say(table.concat(statuses, " "))
+            ngx.say(state.waiting, " ", state.queued, " ", state.dequeued,
+                    " ", state.rejected, " ", state.timedout)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+200 200 200
+0 2 2 0 0
+
+
+=== TEST 3: queue is full
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_queue 1 timeout=5s;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT max_conns=1;
+    }
+--- config
+    location /backend {
+        content_by_lua_block {
+            ngx.sleep(0.3)
+            ngx.say("ok")
+        }
+    }
+    location /proxy {
+        dynamic_queue_upstream backends;
+        proxy_pass http://backends/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function get()
+                local sock = ngx.socket.tcp()
+                assert(sock:connect("127.0.0.1", ngx.var.server_port))
+                sock:send("GET /proxy HTTP/1.0\r\nHost: localhost\r\n\r\n")
+                local line = sock:receive("*l")
+                sock:close()
+                return line:match("HTTP/1.%d (%d+)")
+            end
+            local threads = {}
+            for i = 1, 3 do
+                table.insert(threads, ngx.thread.spawn(get))
+                ngx.sleep(0.05)
+            end
+            local statuses = {}
+            for _, thread in ipairs(threads) do
+                local _, status = ngx.thread.wait(thread)
+                table.insert(statuses, status)
+            end
+            local _, state = upstream.get_queue("backends")
+            ngx.say(table.concat(statuses, " "))
+            ngx.say(state.waiting, " ", state.queued, " ", state.dequeued,
+                    " ", state.rejected, " ", state.timedout)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+200 200 502
+0 1 1 1 0
+
+
+=== TEST 4: waiting timed out
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        dynamic_queue 10 timeout=100ms;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT max_conns=1;
+    }
+--- config
+    location /backend {
+        content_by_lua_block {
+            ngx.sleep(0.3)
+            ngx.say("ok")
+        }
+    }
+    location /proxy {
+        dynamic_queue_upstream backends;
+        proxy_pass http://backends/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function get()
+                local sock = ngx.socket.tcp()
+                assert(sock:connect("127.0.0.1", ngx.var.server_port))
+                sock:send("GET /proxy HTTP/1.0\r\nHost: localhost\r\n\r\n")
+                local line = sock:receive("*l")
+                sock:close()
+                return line:match("HTTP/1.%d (%d+)")
+            end
+            local threads = {}
+            for i = 1, 3 do
+                table.insert(threads, ngx.thread.spawn(get))
+                ngx.sleep(0.05)
+            end
+            local statuses = {}
+            for _, thread in ipairs(threads) do
+                local _, status = ngx.thread.wait(thread)
+                table.insert(statuses, status)
+            end
+            local _, state = upstream.get_queue("backends")
+            ngx.say(table.concat(statuses, " "))
+            ngx.say(state.waiting, " ", state.queued, " ", state.dequeued,
+                    " ", state.rejected, " ", state.timedout)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+200 502 502
+0 2 0 0 2
+
+
+=== TEST 5: upstream named by a variable
+--- http_config
+    upstream one {
+        zone shm-one 128k;
+        dynamic_queue 10 timeout=5s;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT max_conns=1;
+    }
+    upstream two {
+        zone shm-two 128k;
+        dynamic_queue 10 timeout=5s;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT max_conns=1;
+    }
+--- config
+    location /backend {
+        content_by_lua_block {
+            ngx.sleep(0.2)
+            ngx.say("ok")
+        }
+    }
+    location /proxy {
+        dynamic_queue_upstream $arg_u;
+        proxy_pass http://$arg_u/backend;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function get(u)
+                local sock = ngx.socket.tcp()
+                assert(sock:connect("127.0.0.1", ngx.var.server_port))
+                sock:send("GET /proxy?u=" .. u
+                          .. " HTTP/1.0\r\nHost: localhost\r\n\r\n")
+                local line = sock:receive("*l")
+                sock:close()
+                return line:match("HTTP/1.%d (%d+)")
+            end
+            local threads = {}
+            for _, u in ipairs({ "one", "two", "one", "two" }) do
+                table.insert(threads, ngx.thread.spawn(get, u))
+                ngx.sleep(0.05)
+            end
+            for _, thread in ipairs(threads) do
+                ngx.thread.wait(thread)
+            end
+            for _, u in ipairs({ "one", "two" }) do
+                local _, state = upstream.get_queue(u)
+                ngx.say(u, " ", state.waiting, " ", state.queued, " ",
+                        state.dequeued)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+one 0 1 1
+two 0 1 1
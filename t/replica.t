@@ -0,0 +1,220 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: replica follows changes
+--- http_config
+    dynamic_upstream_read_replicas on;
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function dump()
+                local _, peers = upstream.get_peers("backends")
+                local s = {}
+                for _, peer in ipairs(peers) do
+                    table.insert(s, peer.name .. (peer.down and "-" or "")
+                                 .. (peer.backup and "b" or ""))
+                end
+                ngx.say(table.concat(s, " "))
+            end
+            dump()
+            upstream.add_primary_peer("backends", "127.0.0.1:6003")
+            dump()
+            upstream.set_peer_down("backends", "127.0.0.1:6001")
+            dump()
+            upstream.remove_peer("backends", "127.0.0.1:6003")
+            local _, host, port = upstream.pick_peer("backends")
+            ngx.say(host, ":", port)
+            upstream.swap_primary_backup("backends")
+            dump()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+127.0.0.1:6001 127.0.0.1:6002b
+127.0.0.1:6003 127.0.0.1:6001 127.0.0.1:6002b
+127.0.0.1:6003 127.0.0.1:6001- 127.0.0.1:6002b
+127.0.0.1:6002
+127.0.0.1:6002 127.0.0.1:6001-b
+
+
+=== TEST 2: stream replica
+--- http_config
+    dynamic_upstream_read_replicas on;
+--- stream_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream.stream"
+            local _, peers = upstream.get_primary_peers("backends")
+            ngx.say(#peers)
+            upstream.add_primary_peer("backends", "127.0.0.1:6002")
+            upstream.update_peer("backends", "127.0.0.1:6002", { weight = 3 })
+            local _, peers = upstream.get_primary_peers("backends")
+            ngx.say(#peers, " ", peers[1].name, " ", peers[1].weight)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+1
+2 127.0.0.1:6002 3
+
+
+=== TEST 3: pick from replica arrays
+--- http_config
+    dynamic_upstream_read_replicas on;
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001 weight=2;
+        server 127.0.0.1:6002 down;
+        server 127.0.0.1:6003 backup;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local _, host, port = upstream.pick_peer("backends",
+                                                     { policy = "least_conn" })
+            ngx.say(host, ":", port)
+            local _, a = upstream.pick_peer("backends",
+                                            { policy = "hash", key = "k" })
+            local _, b = upstream.pick_peer("backends",
+                                            { policy = "hash", key = "k" })
+            ngx.say(a == b)
+            upstream.set_peer_down("backends", "127.0.0.1:6001")
+            local _, host, port = upstream.pick_peer("backends")
+            ngx.say(host, ":", port)
+            upstream.set_peer_down("backends", "127.0.0.1:6003")
+            local _, _, _, err = upstream.pick_peer("backends")
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+127.0.0.1:6001
+true
+127.0.0.1:6003
+no live peers
+
+
+=== TEST 4: replica benchmark
+--- http_config
+    dynamic_upstream_read_replicas on;
+    upstream backends {
+        zone shm-backends 256k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for i = 1, 200 do
+                upstream.add_primary_peer("backends", "127.0.1." .. i .. ":6002")
+            end
+            local n = 20000
+            ngx.update_time()
+            local start = ngx.now()
+            for i = 1, n do
+                upstream.pick_peer("backends", { policy = "least_conn" })
+            end
+            ngx.update_time()
+            local picks = ngx.now() - start
+            start = ngx.now()
+            for i = 1, n / 100 do
+                upstream.get_peers("backends")
+            end
+            ngx.update_time()
+            local lists = ngx.now() - start
+            ngx.say("usec_per_pick=" .. math.floor(picks * 1000000 / n))
+            ngx.say("usec_per_get_peers=" .. math.floor(lists * 100000000 / n))
+        }
+    }
+--- request
+    GET /test
+--- timeout: 60
+--- response_body_like
+usec_per_pick=\d+
+usec_per_get_peers=\d+
+
+
+=== TEST 5: replica benchmark with a writer
+--- http_config
+    dynamic_upstream_read_replicas on;
+    upstream backends {
+        zone shm-backends 256k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for i = 1, 200 do
+                upstream.add_primary_peer("backends", "127.0.1." .. i .. ":6002")
+            end
+            local done = false
+            local writes = 0
+            local function writer()
+                local down = false
+                while not done do
+                    writes = writes + 1
+                    upstream.update_peer("backends", "127.0.1.1:6002",
+                                         { weight = writes % 10 + 1 })
+                    down = not down
+                    if down then
+                        upstream.set_peer_down("backends", "127.0.1.2:6002")
+                    else
+                        upstream.set_peer_up("backends", "127.0.1.2:6002")
+                    end
+                    ngx.sleep(0.001)
+                end
+            end
+            ngx.timer.at(0, writer)
+            local n = 20000
+            local picked = 0
+            ngx.update_time()
+            local start = ngx.now()
+            for i = 1, n do
+                if upstream.pick_peer("backends", { policy = "p2c" }) then
+                    picked = picked + 1
+                end
+                if i % 100 == 0 then
+                    ngx.sleep(0)
+                end
+            end
+            ngx.update_time()
+            local elapsed = ngx.now() - start
+            done = true
+            ngx.say("usec_per_pick=" .. math.floor(elapsed * 1000000 / n))
+            ngx.say("writes=" .. (writes > 0 and "yes" or "no"))
+            ngx.say("picked=" .. picked)
+        }
+    }
+--- request
+    GET /test
+--- timeout: 60
+--- response_body_like
+usec_per_pick=\d+
+writes=yes
+picked=20000
@@ -0,0 +1,112 @@
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: staged updates are coalesced and committed
+--- http_config
+    dynamic_upstream_stage_interval 100ms;
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function dump()
+                local _, peers = upstream.get_primary_peers("backends")
+                for _, peer in ipairs(peers) do
+                    ngx.say(peer.name, " weight=", peer.weight, " down=", peer.down and 1 or 0)
+                end
+            end
+            local ok, _, err = upstream.stage("backends", {
+                { server = "127.0.0.1:6001", down = 1 },
+                { server = "127.0.0.1:6002", weight = 2 }
+            })
+            if not ok then
+                ngx.say(err)
+                ngx.exit(200)
+            end
+            upstream.stage("backends", {
+                { server = "127.0.0.1:6001", down = 0 },
+                { server = "127.0.0.1:6002", weight = 3 }
+            })
+            upstream.stage("backends", {
+                { server = "127.0.0.1:6001", down = 1 }
+            })
+            dump()
+            ngx.sleep(0.3)
+            dump()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+127.0.0.1:6001 weight=1 down=0
+127.0.0.1:6002 weight=1 down=0
+127.0.0.1:6001 weight=1 down=1
+127.0.0.1:6002 weight=3 down=0
+
+
+=== TEST 2: commit staged updates immediately
+--- http_config
+    dynamic_upstream_stage_interval 1h;
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            upstream.stage("backends", {
+                { server = "127.0.0.1:6001", max_fails = 7 }
+            })
+            upstream.commit_staged()
+            local _, peers = upstream.get_primary_peers("backends")
+            ngx.say(peers[1].max_fails)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+7
+
+
+=== TEST 3: unknown server does not stop the stage
+--- http_config
+    dynamic_upstream_stage_interval 1h;
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            upstream.stage("backends", {
+                { server = "127.0.0.1:6001", max_fails = 3 },
+                { server = "127.0.0.1:6009", weight = 2 },
+                { server = "127.0.0.1:6002", down = 1 }
+            })
+            upstream.commit_staged()
+            local _, peers = upstream.get_primary_peers("backends")
+            for _, peer in ipairs(peers) do
+                ngx.say(peer.name, " max_fails=", peer.max_fails,
+                        " down=", peer.down and 1 or 0)
+            end
+        }
+    }
+--- request
+    GET /test
+--- response_body
+127.0.0.1:6001 max_fails=3 down=0
+127.0.0.1:6002 max_fails=1 down=1
@@ -0,0 +1,69 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: swap primary and backup peers
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003 backup;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function dump()
+                local _, primary = upstream.get_primary_peers("backends")
+                local _, backup = upstream.get_backup_peers("backends")
+                local t = {}
+                for _, peer in ipairs(primary) do
+                    table.insert(t, peer.name)
+                end
+                table.insert(t, "|")
+                for _, peer in ipairs(backup) do
+                    table.insert(t, peer.name)
+                end
+                ngx.say(table.concat(t, " "))
+            end
+            upstream.swap_primary_backup("backends")
+            dump()
+            upstream.swap_primary_backup("backends")
+            dump()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+127.0.0.1:6003 | 127.0.0.1:6001 127.0.0.1:6002
+127.0.0.1:6001 127.0.0.1:6002 | 127.0.0.1:6003
+
+
+=== TEST 2: swap without backup peers
+--- stream_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream.stream"
+            local ok, _, err = upstream.swap_primary_backup("backends")
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+no backup peers
@@ -0,0 +1,163 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: drain host in several upstreams
+--- http_config
+    dynamic_upstream_shm_size 1m;
+    upstream a {
+        zone shm-a 128k;
+        server 127.0.0.1:6001;
+    }
+    upstream b {
+        zone shm-b 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            upstream.add_primary_peer("a", "127.0.0.1:6002",
+                                      { tags = { "host=h2" } })
+            upstream.add_primary_peer("b", "127.0.0.1:6002",
+                                      { tags = { "host=h2", "zone=z1" } })
+            upstream.add_primary_peer("b", "127.0.0.1:6003",
+                                      { tags = { "host=h3" } })
+            local _, n = upstream.set_down({ tag = "host=h2" })
+            ngx.say(n)
+            local _, peers = upstream.get_peers({ tag = "host=h2" })
+            for _, u in ipairs { "a", "b" } do
+                for _, peer in ipairs(peers[u]) do
+                    ngx.say(u, " ", peer.name, " ", tostring(peer.down))
+                end
+            end
+            local _, n = upstream.set_up({ tag = "host=h2" })
+            ngx.say(n)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+2
+a 127.0.0.1:6002 true
+b 127.0.0.1:6002 true
+2
+
+
+=== TEST 2: update and remove drop tags
+--- http_config
+    dynamic_upstream_shm_size 1m;
+    upstream a {
+        zone shm-a 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            upstream.add_primary_peer("a", "127.0.0.1:6002",
+                                      { tags = { "v=1" } })
+            upstream.add_primary_peer("a", "127.0.0.1:6003",
+                                      { tags = { "v=1" } })
+            upstream.update_peer("a", "127.0.0.1:6002", { tags = { "v=2" } })
+            upstream.remove_peer("a", "127.0.0.1:6003")
+            local _, peers = upstream.get_peers({ tag = "v=1" })
+            ngx.say(peers.a == nil)
+            local _, peers = upstream.get_peers({ tag = "v=2" })
+            ngx.say(#peers.a, " ", peers.a[1].name)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+true
+1 127.0.0.1:6002
+
+
+=== TEST 3: stream tags
+--- http_config
+    dynamic_upstream_shm_size 1m;
+--- stream_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream.stream"
+            upstream.add_backup_peer("backends", "127.0.0.1:6002",
+                                     { tags = { "host=h2" } })
+            local _, n = upstream.set_down({ tag = "host=h2" })
+            local _, peers = upstream.get_peers({ tag = "host=h2" })
+            local peer = peers.backends[1]
+            ngx.say(n, " ", peer.name, " ", peer.backup, " ", peer.down)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+1 127.0.0.1:6002 true true
+
+
+=== TEST 4: tags without zone
+--- http_config
+    upstream a {
+        zone shm-a 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local ok, _, err = upstream.add_primary_peer("a", "127.0.0.1:6002",
+                                                         { tags = { "x" } })
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+tags require dynamic_upstream_shm_size
+
+
+=== TEST 5: tag shared by many peers
+--- http_config
+    dynamic_upstream_shm_size 1m;
+    upstream a {
+        zone shm-a 256k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for i = 2, 41 do
+                upstream.add_primary_peer("a", "127.0.0.1:" .. 6000 + i,
+                    { tags = { i % 2 == 0 and "zone=z1" or "zone=z2",
+                               "port=" .. 6000 + i } })
+            end
+            for i = 2, 11 do
+                upstream.remove_peer("a", "127.0.0.1:" .. 6000 + i)
+            end
+            local _, n = upstream.set_down({ tag = "zone=z1" })
+            local _, z2 = upstream.get_peers({ tag = "zone=z2" })
+            local _, p = upstream.get_peers({ tag = "port=6020" })
+            local _, gone = upstream.get_peers({ tag = "port=6003" })
+            ngx.say(n, " ", #z2.a, " ", p.a[1].name, " ", p.a[1].down,
+                    " ", gone.a == nil)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+15 15 127.0.0.1:6020 true true
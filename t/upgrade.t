@@ -0,0 +1,144 @@
+use Test::Nginx::Socket;
+
+master_on();
+workers(1);
+repeat_each(1);
+
+plan tests => repeat_each() * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: upgraded connection to the peer marked down is closed
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT;
+        disconnect_if_market_down;
+    }
+--- config
+    location /backend {
+        content_by_lua_block {
+            ngx.status = 101
+            ngx.header["Upgrade"] = "websocket"
+            ngx.send_headers()
+            ngx.flush(true)
+            ngx.sleep(5)
+        }
+    }
+    location /ws {
+        access_by_lua_block {
+            local peer = "127.0.0.1:" .. ngx.var.server_port
+            ngx.timer.at(0.2, function()
+                local upstream = require "ngx.dynamic_upstream"
+                upstream.set_peer_down("backends", peer)
+            end)
+        }
+        proxy_http_version 1.1;
+        proxy_set_header Upgrade $http_upgrade;
+        proxy_set_header Connection "upgrade";
+        proxy_pass http://backends/backend;
+    }
+--- raw_request eval
+"GET /ws HTTP/1.1\r
+Host: localhost\r
+Connection: Upgrade\r
+Upgrade: websocket\r
+\r
+"
+--- ignore_response
+--- timeout: 4
+--- wait: 2
+--- error_log
+[disconnect_if_market_down] peer=127.0.0.1:
+
+
+=== TEST 2: upgraded connection to the backup peer is closed when primary is up
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT down;
+        server 127.0.0.1:6001 backup;
+        disconnect_backup_if_primary_up;
+    }
+    server {
+        listen 6001;
+        location /backend {
+            content_by_lua_block {
+                ngx.status = 101
+                ngx.header["Upgrade"] = "websocket"
+                ngx.send_headers()
+                ngx.flush(true)
+                ngx.sleep(5)
+            }
+        }
+    }
+--- config
+    location /ws {
+        access_by_lua_block {
+            local peer = "127.0.0.1:" .. ngx.var.server_port
+            ngx.timer.at(0.2, function()
+                local upstream = require "ngx.dynamic_upstream"
+                upstream.set_peer_up("backends", peer)
+            end)
+        }
+        proxy_http_version 1.1;
+        proxy_set_header Upgrade $http_upgrade;
+        proxy_set_header Connection "upgrade";
+        proxy_pass http://backends/backend;
+    }
+--- raw_request eval
+"GET /ws HTTP/1.1\r
+Host: localhost\r
+Connection: Upgrade\r
+Upgrade: websocket\r
+\r
+"
+--- ignore_response
+--- timeout: 4
+--- wait: 2
+--- error_log
+[disconnect_backup_if_primary_up] peer=127.0.0.1:6001
+
+
+=== TEST 3: upgraded connection is closed by the exiting worker
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT;
+        disconnect_on_exiting;
+    }
+--- config
+    location /backend {
+        content_by_lua_block {
+            ngx.status = 101
+            ngx.header["Upgrade"] = "websocket"
+            ngx.send_headers()
+            ngx.flush(true)
+            ngx.sleep(5)
+        }
+    }
+    location /ws {
+        access_by_lua_block {
+            ngx.timer.at(0.2, function()
+                os.execute("kill -QUIT " .. ngx.worker.pid())
+            end)
+        }
+        proxy_http_version 1.1;
+        proxy_set_header Upgrade $http_upgrade;
+        proxy_set_header Connection "upgrade";
+        proxy_pass http://backends/backend;
+    }
+--- raw_request eval
+"GET /ws HTTP/1.1\r
+Host: localhost\r
+Connection: Upgrade\r
+Upgrade: websocket\r
+\r
+"
+--- ignore_response
+--- timeout: 4
+--- wait: 2
+--- error_log
+[disconnect_on_exiting] peer=127.0.0.1:
@@ -0,0 +1,175 @@
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: peer is brought up after warmup
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        keepalive 8;
+        dynamic_warmup 10s;
+    }
+    server {
+        listen 6001;
+        location / { return 200 $connection; }
+    }
+--- config
+    location /proxy {
+        proxy_http_version 1.1;
+        proxy_set_header Connection "";
+        proxy_pass http://backends/;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function down()
+                local _, peers = upstream.get_peers("backends")
+                return peers[1].down == true
+            end
+            upstream.set_peer_down("backends", "127.0.0.1:6001")
+            local ok, _, err = upstream.set_peer_up("backends",
+                "127.0.0.1:6001", { warmup = { connections = 2 } })
+            if not ok then
+                ngx.say(err)
+                ngx.exit(200)
+            end
+            ngx.say(down())
+            ngx.sleep(0.1)
+            ngx.say(down())
+            -- connections accepted later get greater numbers
+            local sock = ngx.socket.tcp()
+            assert(sock:connect("127.0.0.1", 6001))
+            sock:send("GET / HTTP/1.0\r\nHost: localhost\r\n\r\n")
+            local fresh = tonumber(sock:receive("*a"):match("(%d+)$"))
+            sock:close()
+            local r1, r2 = ngx.location.capture_multi {
+                { "/proxy" }, { "/proxy" }
+            }
+            local c1, c2 = tonumber(r1.body), tonumber(r2.body)
+            ngx.say(c1 < fresh, " ", c2 < fresh, " ", c1 ~= c2)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+true
+false
+true true true
+
+
+=== TEST 2: warmup is not enabled
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local ok, _, err = upstream.add_primary_peer("backends",
+                "127.0.0.1:6002", { warmup = { connections = 2 } })
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+warmup is not enabled, use dynamic_warmup
+
+
+=== TEST 3: added peer is down until warmup fails
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        keepalive 8;
+        dynamic_warmup 10s;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local function down()
+                local _, peers = upstream.get_peers("backends")
+                for _, peer in ipairs(peers) do
+                    if peer.name == "127.0.0.1:6002" then
+                        return peer.down == true
+                    end
+                end
+            end
+            upstream.add_primary_peer("backends", "127.0.0.1:6002",
+                                      { warmup = { connections = 1 } })
+            ngx.say(down())
+            ngx.sleep(0.1)
+            ngx.say(down())
+        }
+    }
+--- request
+    GET /test
+--- response_body
+true
+false
+
+
+=== TEST 4: warmed up connections are used by their upstream only
+--- http_config
+    upstream a {
+        zone shm-a 128k;
+        server 127.0.0.1:6001;
+        keepalive 8;
+        dynamic_warmup 10s;
+    }
+    upstream b {
+        zone shm-b 128k;
+        server 127.0.0.1:6001;
+        keepalive 8;
+        dynamic_warmup 10s;
+    }
+    server {
+        listen 6001;
+        location / { return 200 $connection; }
+    }
+--- config
+    location ~ ^/proxy/(\w+)$ {
+        proxy_http_version 1.1;
+        proxy_set_header Connection "";
+        proxy_pass http://$1/;
+    }
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            for _, u in ipairs({ "a", "b" }) do
+                upstream.set_peer_down(u, "127.0.0.1:6001")
+                upstream.set_peer_up(u, "127.0.0.1:6001",
+                                     { warmup = { connections = 1 } })
+            end
+            ngx.sleep(0.1)
+            local sock = ngx.socket.tcp()
+            assert(sock:connect("127.0.0.1", 6001))
+            sock:send("GET / HTTP/1.0\r\nHost: localhost\r\n\r\n")
+            local fresh = tonumber(sock:receive("*a"):match("(%d+)$"))
+            sock:close()
+            local r1, r2, r3 = ngx.location.capture_multi {
+                { "/proxy/a" }, { "/proxy/a" }, { "/proxy/b" }
+            }
+            local warm = 0
+            for _, r in ipairs({ r1, r2 }) do
+                if tonumber(r.body) < fresh then
+                    warm = warm + 1
+                end
+            end
+            ngx.say("a=", warm, " b=", tonumber(r3.body) < fresh)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+a=1 b=true
@@ -0,0 +1,96 @@
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+repeat_each(1);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: zone usage
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local ok, usage, err = upstream.get_zone_usage("backends")
+            if not ok then
+                ngx.say(err)
+                ngx.exit(200)
+            end
+            ngx.say("peers=" .. usage.peers)
+            ngx.say(usage.size == 131072 and "size ok" or usage.size)
+            ngx.say(usage.used > 0 and usage.free_pages < usage.pages and "used ok" or usage.used)
+            ngx.say(usage.bytes_per_peer == math.floor(usage.used / 2) and "bytes ok" or usage.bytes_per_peer)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+peers=2
+size ok
+used ok
+bytes ok
+
+
+=== TEST 2: load json with zone check
+--- stream_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream.stream"
+            local peers = {}
+            for i = 1, 2000 do
+                table.insert(peers, '{"server":"127.0.' .. math.floor(i / 200) .. '.' .. (i % 200 + 1) .. ':6002"}')
+            end
+            local ok, _, err = upstream.load_json('{"backends":[' .. table.concat(peers, ",") .. ']}', { check_zone = true })
+            ngx.say(err)
+            local ok, usage = upstream.get_zone_usage("backends")
+            ngx.say("peers=" .. usage.peers)
+            local ok, report = upstream.load_json('{"backends":[{"server":"127.0.0.1:6002"}]}', { check_zone = true })
+            ngx.say("added=" .. report.backends.added)
+        }
+    }
+--- request
+    GET /test
+--- response_body_like
+zone of upstream "backends" is too small: \d+ bytes required, \d+ free
+peers=1
+added=1
+
+
+=== TEST 3: zone check of peers without server
+--- http_config
+    upstream backends {
+        zone shm-backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /test {
+        content_by_lua_block {
+            local upstream = require "ngx.dynamic_upstream"
+            local ok, _, err = upstream.load_json([[{"backends":[
+              {"server":"127.0.0.1:6002"},{"weight":2}]}]], { check_zone = true })
+            ngx.say(ok, " ", err)
+            local ok, usage = upstream.get_zone_usage("backends")
+            ngx.say("peers=" .. usage.peers)
+        }
+    }
+--- request
+    GET /test
+--- response_body_like
+false json: peer without server at offset \d+
+peers=1